@@ -32,10 +32,11 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
-#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
 
 
 #include <errno.h>
@@ -105,6 +106,8 @@ static int evbuffer_ptr_subtract(struct evbuffer *buf, struct evbuffer_ptr *pos,
     size_t howfar);
 static int evbuffer_file_segment_materialize(struct evbuffer_file_segment *seg);
 static inline void evbuffer_chain_incref(struct evbuffer_chain *chain);
+static void evbuffer_spill_check(struct evbuffer *buf);
+static void evbuffer_spill_decref(struct evbuffer_spill *spill);
 
 static struct evbuffer_chain *
 evbuffer_chain_new(size_t size)
@@ -145,6 +148,35 @@ evbuffer_chain_new(size_t size)
 	return (chain);
 }
 
+/* Like evbuffer_chain_new(), but hands out buf's spare chain instead of
+ * allocating when size fits in it and nothing is using it.  The spare
+ * chain is allocated the first time a small chain is needed, and kept
+ * until the buffer is freed or trimmed while empty. */
+static struct evbuffer_chain *
+evbuffer_chain_new_for(struct evbuffer *buf, size_t size)
+{
+	struct evbuffer_chain *chain = buf->spare_chain;
+
+	if (size > EVBUFFER_SPARE_SIZE)
+		return evbuffer_chain_new(size);
+	if (chain == NULL) {
+		chain = mm_malloc(EVBUFFER_CHAIN_SIZE + EVBUFFER_SPARE_SIZE);
+		if (chain == NULL)
+			return (NULL);
+		buf->spare_chain = chain;
+	} else if (chain->refcnt != 0) {
+		return evbuffer_chain_new(size);
+	}
+
+	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+	chain->buffer_len = EVBUFFER_SPARE_SIZE;
+	chain->buffer = EVBUFFER_CHAIN_EXTRA(unsigned char, chain);
+	chain->flags = EVBUFFER_SPARE;
+	chain->refcnt = 1;
+
+	return (chain);
+}
+
 static inline void
 evbuffer_chain_free(struct evbuffer_chain *chain)
 {
@@ -197,10 +229,40 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 		evbuffer_chain_free(info->parent);
 		evbuffer_decref_and_unlock_(info->source);
 	}
+	if (chain->flags & EVBUFFER_RING) {
+		struct evbuffer_chain_ring *info =
+		    EVBUFFER_CHAIN_EXTRA(
+			    struct evbuffer_chain_ring,
+			    chain);
+		if (munmap(info->mapping, info->capacity * 2) == -1)
+			event_warn("%s: munmap failed", __func__);
+	}
+
+	/* the spare chain is free again now that its refcnt is 0; its
+	 * evbuffer releases the memory */
+	if (chain->flags & EVBUFFER_SPARE)
+		return;
 
 	mm_free(chain);
 }
 
+/* Restore the invariants of a ring chain after its misalign or off has
+ * changed: misalign stays inside the first mapping, and buffer_len is set
+ * so that CHAIN_SPACE_LEN() is the free space left in the ring. */
+static inline void
+evbuffer_chain_ring_fixup(struct evbuffer_chain *chain)
+{
+	struct evbuffer_chain_ring *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_ring, chain);
+	const size_t capacity = info->capacity;
+
+	if (chain->off == 0)
+		chain->misalign = 0;
+	else if ((size_t)chain->misalign >= capacity)
+		chain->misalign -= capacity;
+	chain->buffer_len = (size_t)chain->misalign + capacity;
+}
+
 static void
 evbuffer_free_all_chains(struct evbuffer_chain *chain)
 {
@@ -251,6 +313,16 @@ evbuffer_free_trailing_empty_chains(struct evbuffer *buf)
 	return ch;
 }
 
+/* Chains whose bytes are not heap memory allocated for the buffer holding
+ * them, and which memory accounting leaves out: file data, whether mapped,
+ * read for sendfile or spilled, and memory that belongs to someone else. */
+#define EVBUFFER_FOREIGN_FLAGS						\
+	(EVBUFFER_FILESEGMENT|EVBUFFER_SENDFILE|EVBUFFER_REFERENCE|	\
+	    EVBUFFER_MULTICAST)
+/* How many of the bytes in chain count towards its buffer's foreign_len. */
+#define CHAIN_FOREIGN_LEN(ch)						\
+	(((ch)->flags & EVBUFFER_FOREIGN_FLAGS) ? (ch)->off : 0)
+
 /* Add a single chain 'chain' to the end of 'buf', freeing trailing empty
  * chains as necessary.  Requires lock.  Does not schedule callbacks.
  */
@@ -273,18 +345,55 @@ evbuffer_chain_insert(struct evbuffer *buf,
 		buf->last = chain;
 	}
 	buf->total_len += chain->off;
+	buf->foreign_len += CHAIN_FOREIGN_LEN(chain);
 }
 
 static inline struct evbuffer_chain *
 evbuffer_chain_insert_new(struct evbuffer *buf, size_t datlen)
 {
 	struct evbuffer_chain *chain;
-	if ((chain = evbuffer_chain_new(datlen)) == NULL)
+	if ((chain = evbuffer_chain_new_for(buf, datlen)) == NULL)
 		return NULL;
 	evbuffer_chain_insert(buf, chain);
 	return chain;
 }
 
+/* Replace buf's spare chain, if it holds any of buf's data, with a copy on
+ * the heap, so that all of buf's chains can be handed to another buffer.
+ * Requires lock. */
+static int
+evbuffer_chain_unspare(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain = buf->spare_chain;
+	struct evbuffer_chain **chp, *tmp;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+
+	if (chain == NULL || chain->refcnt == 0 || CHAIN_PINNED(chain))
+		return 0;
+
+	for (chp = &buf->first; *chp && *chp != chain; chp = &(*chp)->next)
+		;
+	if (*chp == NULL) {
+		/* still referenced by a multicast chain, but not ours */
+		return 0;
+	}
+
+	if ((tmp = evbuffer_chain_new(chain->off)) == NULL)
+		return -1;
+	memcpy(tmp->buffer, chain->buffer + chain->misalign, chain->off);
+	tmp->off = chain->off;
+	tmp->next = chain->next;
+	*chp = tmp;
+	if (buf->last == chain)
+		buf->last = tmp;
+	if (buf->last_with_datap == &chain->next)
+		buf->last_with_datap = &tmp->next;
+
+	evbuffer_chain_free(chain);
+	return 0;
+}
+
 void
 evbuffer_chain_pin_(struct evbuffer_chain *chain, unsigned flag)
 {
@@ -393,11 +502,218 @@ evbuffer_enable_locking(struct evbuffer *buf, void *lock)
 #endif
 }
 
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+/** Protects evbuffer_mem_total. */
+static void *evbuffer_mem_total_lock_ = NULL;
+#endif
+/* Bytes held by all accounted evbuffers in the process. */
+static size_t evbuffer_mem_total = 0;
+
+static int
+evbuffer_mem_level(const struct event_base *base, size_t usage)
+{
+	if (base->evbuffer_mem_hard && usage >= base->evbuffer_mem_hard)
+		return EVBUFFER_MEM_HARD;
+	if (base->evbuffer_mem_soft && usage >= base->evbuffer_mem_soft)
+		return EVBUFFER_MEM_SOFT;
+	return EVBUFFER_MEM_OK;
+}
+
+/* Requires that we hold the evbuffer_mem_lock of base. */
+static void
+evbuffer_mem_check_level(struct event_base *base)
+{
+	int level = evbuffer_mem_level(base, base->evbuffer_mem);
+
+	if (level != base->evbuffer_mem_level || base->evbuffer_mem_pending) {
+		base->evbuffer_mem_level = level;
+		event_deferred_cb_schedule_(base, &base->evbuffer_mem_deferred);
+	}
+}
+
+/* How many of buf's bytes are heap memory that it allocated. */
+static inline size_t
+evbuffer_mem_len(const struct evbuffer *buf)
+{
+	EVUTIL_ASSERT(buf->foreign_len <= buf->total_len);
+	return buf->total_len - buf->foreign_len;
+}
+
+/* Count buf as holding len bytes of memory. */
+static void
+evbuffer_mem_account_len(struct evbuffer *buf, size_t len)
+{
+	struct event_base *base = buf->mem_base;
+	size_t delta;
+
+	if (len == buf->mem_accounted)
+		return;
+
+	/* Wraps around for a shrinking buffer; the additions below wrap
+	 * back. */
+	delta = len - buf->mem_accounted;
+	buf->mem_accounted = len;
+
+	EVLOCK_LOCK(evbuffer_mem_total_lock_, 0);
+	evbuffer_mem_total += delta;
+	EVLOCK_UNLOCK(evbuffer_mem_total_lock_, 0);
+
+	EVLOCK_LOCK(base->evbuffer_mem_lock, 0);
+	base->evbuffer_mem += delta;
+	if (base->evbuffer_mem_soft || base->evbuffer_mem_hard)
+		evbuffer_mem_check_level(base);
+	EVLOCK_UNLOCK(base->evbuffer_mem_lock, 0);
+}
+
+/* Bring the accounting for buf up to date with its contents. */
+static void
+evbuffer_mem_account(struct evbuffer *buf)
+{
+	if (buf->mem_base)
+		evbuffer_mem_account_len(buf, evbuffer_mem_len(buf));
+}
+
+static void
+evbuffer_mem_detach(struct evbuffer *buf)
+{
+	struct event_base *base = buf->mem_base;
+
+	if (!base)
+		return;
+
+	/* Account for the buffer as if it were empty. */
+	evbuffer_mem_account_len(buf, 0);
+
+	EVLOCK_LOCK(base->evbuffer_mem_lock, 0);
+	LIST_REMOVE(buf, mem_next);
+	--base->n_evbuffers;
+	EVLOCK_UNLOCK(base->evbuffer_mem_lock, 0);
+	buf->mem_base = NULL;
+}
+
+static void
+evbuffer_mem_attach(struct evbuffer *buf, struct event_base *base)
+{
+	EVLOCK_LOCK(base->evbuffer_mem_lock, 0);
+	LIST_INSERT_HEAD(&base->evbuffers, buf, mem_next);
+	++base->n_evbuffers;
+	EVLOCK_UNLOCK(base->evbuffer_mem_lock, 0);
+	buf->mem_base = base;
+	buf->mem_accounted = 0;
+	evbuffer_mem_account(buf);
+}
+
+/* Runs from the event loop when the memory level of base has changed:
+ * suspends or resumes reading on heavy bufferevents if we were asked to,
+ * then tells the user. */
+static void
+evbuffer_mem_deferred_cb(struct event_callback *evcb, void *arg)
+{
+	struct event_base *base = arg;
+	struct evbuffer *buf;
+	event_base_memory_cb cb;
+	void *cbarg;
+	size_t usage;
+	int level;
+
+	EVLOCK_LOCK(base->evbuffer_mem_lock, 0);
+	level = base->evbuffer_mem_level;
+	usage = base->evbuffer_mem;
+	cb = base->evbuffer_mem_cb;
+	cbarg = base->evbuffer_mem_cb_arg;
+	base->evbuffer_mem_pending = 0;
+
+	if ((base->evbuffer_mem_flags & EVBUFFER_MEM_SUSPEND_READS) &&
+	    level != EVBUFFER_MEM_SOFT) {
+		LIST_FOREACH(buf, &base->evbuffers, mem_next) {
+			struct bufferevent *bev = buf->parent;
+			size_t held;
+			if (!bev || buf != bev->input)
+				continue;
+			/* As with rate-limiting groups, we only try-lock here:
+			 * our lock nests inside the bufferevent locks. */
+			if (!EVLOCK_TRY_LOCK_(buf->lock)) {
+				base->evbuffer_mem_pending = 1;
+				continue;
+			}
+			if (level == EVBUFFER_MEM_HARD) {
+				held = bev->input->mem_accounted +
+				    bev->output->mem_accounted;
+				/* Suspend anyone holding at least the average
+				 * for a bufferevent (two evbuffers). */
+				if (held * base->n_evbuffers >= 2 * usage)
+					bufferevent_suspend_read_(bev,
+					    BEV_SUSPEND_MEM);
+			} else {
+				bufferevent_unsuspend_read_(bev,
+				    BEV_SUSPEND_MEM);
+			}
+			EVLOCK_UNLOCK(buf->lock, 0);
+		}
+	}
+	EVLOCK_UNLOCK(base->evbuffer_mem_lock, 0);
+
+	if (cb)
+		cb(base, usage, level, cbarg);
+}
+
+int
+event_base_set_memory_limits(struct event_base *base, size_t soft_limit,
+    size_t hard_limit, int flags, event_base_memory_cb cb, void *arg)
+{
+	int npriorities;
+
+	if ((hard_limit && soft_limit > hard_limit) ||
+	    (flags & ~EVBUFFER_MEM_SUSPEND_READS))
+		return -1;
+
+	npriorities = event_base_get_npriorities(base);
+
+	EVLOCK_LOCK(base->evbuffer_mem_lock, 0);
+	if (!base->evbuffer_mem_deferred.evcb_cb_union.evcb_selfcb)
+		event_deferred_cb_init_(&base->evbuffer_mem_deferred,
+		    npriorities / 2, evbuffer_mem_deferred_cb, base);
+	base->evbuffer_mem_soft = soft_limit;
+	base->evbuffer_mem_hard = hard_limit;
+	base->evbuffer_mem_flags = flags;
+	base->evbuffer_mem_cb = cb;
+	base->evbuffer_mem_cb_arg = arg;
+	evbuffer_mem_check_level(base);
+	EVLOCK_UNLOCK(base->evbuffer_mem_lock, 0);
+
+	return 0;
+}
+
+size_t
+event_base_memory_usage(struct event_base *base)
+{
+	size_t usage;
+
+	EVLOCK_LOCK(base->evbuffer_mem_lock, 0);
+	usage = base->evbuffer_mem;
+	EVLOCK_UNLOCK(base->evbuffer_mem_lock, 0);
+	return usage;
+}
+
+size_t
+evbuffer_get_total_memory_usage(void)
+{
+	size_t usage;
+
+	EVLOCK_LOCK(evbuffer_mem_total_lock_, 0);
+	usage = evbuffer_mem_total;
+	EVLOCK_UNLOCK(evbuffer_mem_total_lock_, 0);
+	return usage;
+}
+
 void
 evbuffer_set_parent_(struct evbuffer *buf, struct bufferevent *bev)
 {
 	EVBUFFER_LOCK(buf);
 	buf->parent = bev;
+	evbuffer_mem_detach(buf);
+	if (bev)
+		evbuffer_mem_attach(buf, bev->ev_base);
 	EVBUFFER_UNLOCK(buf);
 }
 
@@ -462,6 +778,10 @@ evbuffer_run_callbacks(struct evbuffer *buffer, int running_deferred)
 void
 evbuffer_invoke_callbacks_(struct evbuffer *buffer)
 {
+	if (buffer->spill)
+		evbuffer_spill_check(buffer);
+	evbuffer_mem_account(buffer);
+
 	if (LIST_EMPTY(&buffer->callbacks)) {
 		buffer->n_add_for_cb = buffer->n_del_for_cb = 0;
 		return;
@@ -519,10 +839,15 @@ evbuffer_decref_and_unlock_(struct evbuffer *buffer)
 		return;
 	}
 
+	evbuffer_mem_detach(buffer);
 	for (chain = buffer->first; chain != NULL; chain = next) {
 		next = chain->next;
 		evbuffer_chain_free(chain);
 	}
+	if (buffer->spare_chain)
+		mm_free(buffer->spare_chain);
+	if (buffer->spill)
+		evbuffer_spill_decref(buffer->spill);
 	evbuffer_remove_all_callbacks(buffer);
 	if (buffer->deferred_cbs)
 		event_deferred_cb_cancel_(buffer->cb_queue, &buffer->deferred);
@@ -540,6 +865,60 @@ evbuffer_free(struct evbuffer *buffer)
 	evbuffer_decref_and_unlock_(buffer);
 }
 
+int
+evbuffer_reset_(struct evbuffer *buf, evbuffer_cb_func keep)
+{
+	struct evbuffer_cb_entry *cbent, *next;
+	int result = -1;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->refcnt != 1)
+		goto done;
+
+	evbuffer_mem_detach(buf);
+	buf->parent = NULL;
+
+	evbuffer_free_all_chains(buf->first);
+	buf->first = buf->last = NULL;
+	buf->last_with_datap = &buf->first;
+	buf->total_len = 0;
+	buf->foreign_len = 0;
+
+	if (buf->deferred_cbs)
+		event_deferred_cb_cancel_(buf->cb_queue, &buf->deferred);
+	buf->deferred_cbs = 0;
+	buf->cb_queue = NULL;
+
+	for (cbent = LIST_FIRST(&buf->callbacks); cbent; cbent = next) {
+		next = LIST_NEXT(cbent, next);
+		if (keep && cbent->cb.cb_func == keep) {
+			cbent->flags = EVBUFFER_CB_ENABLED;
+			continue;
+		}
+		LIST_REMOVE(cbent, next);
+		mm_free(cbent);
+	}
+
+	buf->n_add_for_cb = buf->n_del_for_cb = 0;
+	buf->freeze_start = buf->freeze_end = 0;
+	buf->ring = 0;
+	buf->flags = 0;
+	buf->n_compactions = buf->n_bytes_compacted = 0;
+	buf->read_hint = 0;
+	if (buf->spill) {
+		evbuffer_spill_decref(buf->spill);
+		buf->spill = NULL;
+	}
+	buf->spill_checked_len = 0;
+	buf->read_mem_cb = NULL;
+	buf->read_mem_cleanup = NULL;
+	buf->read_mem_arg = NULL;
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
 void
 evbuffer_lock(struct evbuffer *buf)
 {
@@ -580,6 +959,20 @@ evbuffer_get_contiguous_space(const struct evbuffer *buf)
 	return result;
 }
 
+void
+evbuffer_get_stats(const struct evbuffer *buf, struct evbuffer_stats *stats)
+{
+	struct evbuffer_chain *chain;
+
+	memset(stats, 0, sizeof(*stats));
+	EVBUFFER_LOCK(buf);
+	for (chain = buf->first; chain; chain = chain->next)
+		++stats->n_chains;
+	stats->n_compactions = buf->n_compactions;
+	stats->n_bytes_compacted = buf->n_bytes_compacted;
+	EVBUFFER_UNLOCK(buf);
+}
+
 size_t
 evbuffer_add_iovec(struct evbuffer * buf, struct iovec * vec, int n_vec) {
 	int n;
@@ -753,6 +1146,7 @@ ZERO_CHAIN(struct evbuffer *dst)
 	dst->last = NULL;
 	dst->last_with_datap = &(dst)->first;
 	dst->total_len = 0;
+	dst->foreign_len = 0;
 }
 
 /* Prepares the contents of src to be moved to another buffer by removing
@@ -818,6 +1212,7 @@ RESTORE_PINNED(struct evbuffer *src, struct evbuffer_chain *pinned,
 	src->last = last;
 	src->last_with_datap = &src->first;
 	src->total_len = 0;
+	src->foreign_len = 0;
 }
 
 static inline void
@@ -832,6 +1227,7 @@ COPY_CHAIN(struct evbuffer *dst, struct evbuffer *src)
 		dst->last_with_datap = src->last_with_datap;
 	dst->last = src->last;
 	dst->total_len = src->total_len;
+	dst->foreign_len = src->foreign_len;
 }
 
 static void
@@ -851,6 +1247,61 @@ APPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
 		dst->last_with_datap = src->last_with_datap;
 	dst->last = src->last;
 	dst->total_len += src->total_len;
+	dst->foreign_len += src->foreign_len;
+}
+
+/* Return a new chain holding the datlen bytes at data, which are not ours:
+ * cleanupfn gets them back when the chain is freed.  Nothing but the chain
+ * header is allocated. */
+static struct evbuffer_chain *
+evbuffer_chain_new_reference(const void *data, size_t datlen,
+    evbuffer_ref_cleanup_cb cleanupfn, void *extra)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_reference *info;
+
+	chain = mm_malloc(EVBUFFER_CHAIN_SIZE +
+	    sizeof(struct evbuffer_chain_reference));
+	if (!chain)
+		return NULL;
+	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+	chain->flags = EVBUFFER_REFERENCE | EVBUFFER_IMMUTABLE;
+	chain->buffer = (unsigned char *)data;
+	chain->buffer_len = datlen;
+	chain->off = datlen;
+	chain->refcnt = 1;
+
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_reference, chain);
+	info->cleanupfn = cleanupfn;
+	info->extra = extra;
+	return chain;
+}
+
+/* Return a new chain referring to the data of chain 'parent' in 'source'.
+ * Nothing but the chain header is allocated.  The caller must already have
+ * taken a reference to both source and parent for the new chain. */
+static struct evbuffer_chain *
+evbuffer_chain_new_multicast(struct evbuffer *source,
+    struct evbuffer_chain *parent)
+{
+	struct evbuffer_chain *tmp;
+	struct evbuffer_multicast_parent *extra;
+
+	tmp = mm_malloc(EVBUFFER_CHAIN_SIZE +
+	    sizeof(struct evbuffer_multicast_parent));
+	if (!tmp)
+		return NULL;
+	memset(tmp, 0, EVBUFFER_CHAIN_SIZE);
+	extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent, tmp);
+	extra->source = source;
+	extra->parent = parent;
+	tmp->buffer_len = parent->buffer_len;
+	tmp->misalign = parent->misalign;
+	tmp->off = parent->off;
+	tmp->flags = EVBUFFER_MULTICAST|EVBUFFER_IMMUTABLE;
+	tmp->buffer = parent->buffer;
+	tmp->refcnt = 1;
+	return tmp;
 }
 
 static inline void
@@ -858,7 +1309,6 @@ APPEND_CHAIN_MULTICAST(struct evbuffer *dst, struct evbuffer *src)
 {
 	struct evbuffer_chain *tmp;
 	struct evbuffer_chain *chain = src->first;
-	struct evbuffer_multicast_parent *extra;
 
 	ASSERT_EVBUFFER_LOCKED(dst);
 	ASSERT_EVBUFFER_LOCKED(src);
@@ -869,26 +1319,18 @@ APPEND_CHAIN_MULTICAST(struct evbuffer *dst, struct evbuffer *src)
 			continue;
 		}
 
-		tmp = evbuffer_chain_new(sizeof(struct evbuffer_multicast_parent));
+		tmp = evbuffer_chain_new_multicast(src, chain);
 		if (!tmp) {
 			event_warn("%s: out of memory", __func__);
 			return;
 		}
-		extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_multicast_parent, tmp);
 		/* reference evbuffer containing source chain so it
 		 * doesn't get released while the chain is still
 		 * being referenced to */
 		evbuffer_incref_(src);
-		extra->source = src;
 		/* reference source chain which now becomes immutable */
 		evbuffer_chain_incref(chain);
-		extra->parent = chain;
 		chain->flags |= EVBUFFER_IMMUTABLE;
-		tmp->buffer_len = chain->buffer_len;
-		tmp->misalign = chain->misalign;
-		tmp->off = chain->off;
-		tmp->flags |= EVBUFFER_MULTICAST|EVBUFFER_IMMUTABLE;
-		tmp->buffer = chain->buffer;
 		evbuffer_chain_insert(dst, tmp);
 	}
 }
@@ -901,6 +1343,7 @@ PREPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
 	src->last->next = dst->first;
 	dst->first = src->first;
 	dst->total_len += src->total_len;
+	dst->foreign_len += src->foreign_len;
 	if (*dst->last_with_datap == NULL) {
 		if (src->last_with_datap == &(src)->first)
 			dst->last_with_datap = &dst->first;
@@ -911,6 +1354,35 @@ PREPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
 	}
 }
 
+/* Helper: move the first datlen bytes of src to the end of dst when one of
+ * them is a ring.  Chains can't change hands with a ring, so we copy
+ * instead.  Requires both locks; runs callbacks on both buffers. */
+static int
+evbuffer_ring_move(struct evbuffer *dst, struct evbuffer *src, size_t datlen)
+{
+	struct evbuffer_chain *chain;
+
+	if (dst->ring) {
+		chain = dst->first;
+		if (CHAIN_SPACE_LEN(chain) < datlen)
+			return -1;
+		if (evbuffer_copyout(src, CHAIN_SPACE_PTR(chain), datlen) < 0)
+			return -1;
+		chain->off += datlen;
+		dst->total_len += datlen;
+		dst->n_add_for_cb += datlen;
+		evbuffer_invoke_callbacks_(dst);
+	} else {
+		/* The contents of a ring are always contiguous. */
+		chain = src->first;
+		if (evbuffer_add(dst, chain->buffer + chain->misalign,
+			datlen) < 0)
+			return -1;
+	}
+
+	return evbuffer_drain(src, datlen);
+}
+
 int
 evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 {
@@ -930,7 +1402,13 @@ evbuffer_add_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 		goto done;
 	}
 
-	if (PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
+	if (outbuf->ring || inbuf->ring) {
+		result = evbuffer_ring_move(outbuf, inbuf, in_total_len);
+		goto done;
+	}
+
+	if (evbuffer_chain_unspare(inbuf) < 0 ||
+	    PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
 		result = -1;
 		goto done;
 	}
@@ -972,7 +1450,8 @@ evbuffer_add_buffer_reference(struct evbuffer *outbuf, struct evbuffer *inbuf)
 	if (in_total_len == 0)
 		goto done;
 
-	if (outbuf->freeze_end || outbuf == inbuf) {
+	if (outbuf->freeze_end || outbuf == inbuf ||
+	    outbuf->ring || inbuf->ring) {
 		result = -1;
 		goto done;
 	}
@@ -1000,6 +1479,113 @@ done:
 	return result;
 }
 
+int
+evbuffer_broadcast(struct evbuffer *src, struct evbuffer **dsts, int n_dsts)
+{
+	struct evbuffer *snap = NULL;
+	struct evbuffer_chain *chain, *tmp;
+	size_t len;
+	int i, n_chains = 0, n_added = 0, need_pullup = 0;
+
+	if (n_dsts < 0)
+		return -1;
+
+	/* Take the data out of src, so that src can go on being used, and
+	 * nothing can change the data while anyone refers to it. */
+	if (!(snap = evbuffer_new()))
+		return -1;
+	evbuffer_enable_locking(snap, NULL);
+	if (evbuffer_add_buffer(snap, src) < 0)
+		goto err;
+	if (!(len = snap->total_len))
+		goto done;
+
+	for (chain = snap->first; chain; chain = chain->next) {
+		if (chain->flags & EVBUFFER_SENDFILE)
+			goto err;
+		if (chain->flags & (EVBUFFER_FILESEGMENT|EVBUFFER_MULTICAST))
+			need_pullup = 1;
+	}
+	if (need_pullup && !evbuffer_pullup(snap, -1))
+		goto err;
+
+	/* Take every reference we might need at once, so that we lock the
+	 * snapshot once rather than once per destination. */
+	EVBUFFER_LOCK(snap);
+	for (chain = snap->first; chain; chain = chain->next) {
+		if (!chain->off)
+			continue;
+		chain->flags |= EVBUFFER_IMMUTABLE;
+		chain->refcnt += n_dsts;
+		++n_chains;
+	}
+	snap->refcnt += n_chains * n_dsts;
+	EVBUFFER_UNLOCK(snap);
+
+	for (i = 0; i < n_dsts; ++i) {
+		struct evbuffer *dst = dsts[i];
+		struct evbuffer_chain *first = NULL, **last = &first;
+		int n = 0;
+
+		/* Allocate every chain header before touching dst, so that
+		 * running out of memory leaves it unchanged. */
+		for (chain = snap->first; chain; chain = chain->next) {
+			if (!chain->off)
+				continue;
+			if (!(tmp = evbuffer_chain_new_multicast(snap, chain)))
+				break;
+			*last = tmp;
+			last = &tmp->next;
+			++n;
+		}
+		if (n < n_chains) {
+			event_warn("%s: out of memory", __func__);
+			for (; first; first = tmp) {
+				tmp = first->next;
+				mm_free(first);
+			}
+			continue;
+		}
+
+		EVBUFFER_LOCK(dst);
+		if (dst->freeze_end || dst->ring || dst == src) {
+			EVBUFFER_UNLOCK(dst);
+			for (; first; first = tmp) {
+				tmp = first->next;
+				mm_free(first);
+			}
+			continue;
+		}
+		for (; first; first = tmp) {
+			tmp = first->next;
+			first->next = NULL;
+			evbuffer_chain_insert(dst, first);
+		}
+		dst->n_add_for_cb += len;
+		evbuffer_invoke_callbacks_(dst);
+		EVBUFFER_UNLOCK(dst);
+		++n_added;
+	}
+
+	/* Give back the references that no destination used. */
+	EVBUFFER_LOCK(snap);
+	for (chain = snap->first; chain; chain = chain->next) {
+		if (chain->off)
+			chain->refcnt -= n_dsts - n_added;
+	}
+	snap->refcnt -= n_chains * (n_dsts - n_added);
+	EVBUFFER_UNLOCK(snap);
+
+done:
+	evbuffer_free(snap);
+	return n_added;
+err:
+	/* Put the data back where we found it. */
+	evbuffer_prepend_buffer(src, snap);
+	evbuffer_free(snap);
+	return -1;
+}
+
 int
 evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 {
@@ -1015,12 +1601,14 @@ evbuffer_prepend_buffer(struct evbuffer *outbuf, struct evbuffer *inbuf)
 	if (!in_total_len || inbuf == outbuf)
 		goto done;
 
-	if (outbuf->freeze_start || inbuf->freeze_start) {
+	if (outbuf->freeze_start || inbuf->freeze_start ||
+	    outbuf->ring || inbuf->ring) {
 		result = -1;
 		goto done;
 	}
 
-	if (PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
+	if (evbuffer_chain_unspare(inbuf) < 0 ||
+	    PRESERVE_PINNED(inbuf, &pinned, &last) < 0) {
 		result = -1;
 		goto done;
 	}
@@ -1064,7 +1652,16 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 		goto done;
 	}
 
-	if (len >= old_len && !HAS_PINNED_R(buf)) {
+	if (buf->ring) {
+		/* A ring keeps its only chain no matter how much we drain. */
+		if (len >= old_len)
+			len = old_len;
+		chain = buf->first;
+		chain->misalign += len;
+		chain->off -= len;
+		buf->total_len -= len;
+		evbuffer_chain_ring_fixup(chain);
+	} else if (len >= old_len && !HAS_PINNED_R(buf)) {
 		len = old_len;
 		for (chain = buf->first; chain != NULL; chain = next) {
 			next = chain->next;
@@ -1089,6 +1686,7 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 			}
 			if (&chain->next == buf->last_with_datap)
 				buf->last_with_datap = &buf->first;
+			buf->foreign_len -= CHAIN_FOREIGN_LEN(chain);
 
 			if (CHAIN_PINNED_R(chain)) {
 				EVUTIL_ASSERT(remaining == 0);
@@ -1101,6 +1699,8 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 
 		buf->first = chain;
 		EVUTIL_ASSERT(remaining <= chain->off);
+		if (chain->flags & EVBUFFER_FOREIGN_FLAGS)
+			buf->foreign_len -= remaining;
 		chain->misalign += remaining;
 		chain->off -= remaining;
 	}
@@ -1213,7 +1813,7 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 
 	/*XXX can fail badly on sendfile case. */
 	struct evbuffer_chain *chain, *previous;
-	size_t nread = 0;
+	size_t nread = 0, foreign = 0;
 	int result;
 
 	EVBUFFER_LOCK2(src, dst);
@@ -1238,6 +1838,18 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 		goto done;
 	}
 
+	if (dst->ring || src->ring) {
+		result = evbuffer_ring_move(dst, src, datlen) < 0 ?
+		    -1 : (int)datlen;
+		goto done;
+	}
+
+	if (evbuffer_chain_unspare(src) < 0) {
+		result = -1;
+		goto done;
+	}
+	chain = previous = src->first;
+
 	/* removes chains if possible */
 	while (chain->off <= datlen) {
 		/* We can't remove the last with data from src unless we
@@ -1246,6 +1858,7 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 		EVUTIL_ASSERT(chain != *src->last_with_datap);
 		nread += chain->off;
 		datlen -= chain->off;
+		foreign += CHAIN_FOREIGN_LEN(chain);
 		previous = chain;
 		if (src->last_with_datap == &chain->next)
 			src->last_with_datap = &src->first;
@@ -1269,11 +1882,14 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 
 		dst->total_len += nread;
 		dst->n_add_for_cb += nread;
+		dst->foreign_len += foreign;
 	}
 
 	/* we know that there is more data in the src buffer than
 	 * we want to read, so we manually drain the chain */
 	evbuffer_add(dst, chain->buffer + chain->misalign, datlen);
+	if (chain->flags & EVBUFFER_FOREIGN_FLAGS)
+		foreign += datlen;
 	chain->misalign += datlen;
 	chain->off -= datlen;
 	nread += datlen;
@@ -1282,6 +1898,7 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 	 * here too.  But evbuffer_add above already took care of that.
 	 */
 	src->total_len -= nread;
+	src->foreign_len -= foreign;
 	src->n_del_for_cb += nread;
 
 	if (nread) {
@@ -1344,6 +1961,8 @@ evbuffer_pullup(struct evbuffer *buf, ssize_t size)
 		tmp = chain;
 		tmp->off = size;
 		size -= old_off;
+		if (tmp->flags & EVBUFFER_FOREIGN_FLAGS)
+			buf->foreign_len += size;
 		chain = chain->next;
 	} else if (chain->buffer_len - chain->misalign >= (size_t)size) {
 		/* already have enough space in the first chain */
@@ -1352,6 +1971,8 @@ evbuffer_pullup(struct evbuffer *buf, ssize_t size)
 		tmp = chain;
 		tmp->off = size;
 		size -= old_off;
+		if (tmp->flags & EVBUFFER_FOREIGN_FLAGS)
+			buf->foreign_len += size;
 		chain = chain->next;
 	} else {
 		if ((tmp = evbuffer_chain_new(size)) == NULL) {
@@ -1379,12 +2000,15 @@ evbuffer_pullup(struct evbuffer *buf, ssize_t size)
 			removed_last_with_data = 1;
 		if (&chain->next == buf->last_with_datap)
 			removed_last_with_datap = 1;
+		buf->foreign_len -= CHAIN_FOREIGN_LEN(chain);
 
 		evbuffer_chain_free(chain);
 	}
 
 	if (chain != NULL) {
 		memcpy(buffer, chain->buffer + chain->misalign, size);
+		if (chain->flags & EVBUFFER_FOREIGN_FLAGS)
+			buf->foreign_len -= size;
 		chain->misalign += size;
 		chain->off -= size;
 	} else {
@@ -1671,7 +2295,7 @@ done:
 	return result;
 }
 
-#define EVBUFFER_CHAIN_MAX_AUTO_SIZE 4096
+#define EVBUFFER_CHAIN_MAX_AUTO_SIZE 16384
 
 /* Adds data to an event buffer */
 
@@ -1702,7 +2326,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 	/* If there are no chains allocated for this buffer, allocate one
 	 * big enough to hold all the data. */
 	if (chain == NULL) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new_for(buf, datlen);
 		if (!chain)
 			goto done;
 		evbuffer_chain_insert(buf, chain);
@@ -1722,7 +2346,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 			buf->total_len += datlen;
 			buf->n_add_for_cb += datlen;
 			goto out;
-		} else if (!CHAIN_PINNED(chain) &&
+		} else if (!CHAIN_PINNED(chain) && !buf->ring &&
 		    evbuffer_chain_should_realign(chain, datlen)) {
 			/* we can fit the data into the misalignment */
 			evbuffer_chain_align(chain);
@@ -1738,6 +2362,10 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 		remain = 0;
 	}
 
+	/* a ring never grows past its capacity */
+	if (buf->ring)
+		goto done;
+
 	/* we need to add another chain */
 	to_alloc = chain->buffer_len;
 	if (to_alloc <= EVBUFFER_CHAIN_MAX_AUTO_SIZE/2)
@@ -1793,8 +2421,26 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 
 	chain = buf->first;
 
+	if (buf->ring) {
+		/* Step back from the start of the ring, wrapping into the
+		 * second mapping if needed. */
+		struct evbuffer_chain_ring *info =
+		    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_ring, chain);
+		if (CHAIN_SPACE_LEN(chain) < datlen)
+			goto done;
+		if ((size_t)chain->misalign < datlen)
+			chain->misalign += info->capacity;
+		chain->misalign -= datlen;
+		memcpy(chain->buffer + chain->misalign, data, datlen);
+		chain->off += datlen;
+		evbuffer_chain_ring_fixup(chain);
+		buf->total_len += datlen;
+		buf->n_add_for_cb += datlen;
+		goto out;
+	}
+
 	if (chain == NULL) {
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new_for(buf, datlen);
 		if (!chain)
 			goto done;
 		evbuffer_chain_insert(buf, chain);
@@ -1891,6 +2537,12 @@ evbuffer_expand_singlechain(struct evbuffer *buf, size_t datlen)
 	struct evbuffer_chain *result = NULL;
 	ASSERT_EVBUFFER_LOCKED(buf);
 
+	if (buf->ring) {
+		/* A ring has exactly one chain, and it never grows. */
+		chain = buf->first;
+		return CHAIN_SPACE_LEN(chain) >= datlen ? chain : NULL;
+	}
+
 	chainp = buf->last_with_datap;
 
 	/* XXX If *chainp is no longer writeable, but has enough space in its
@@ -2006,10 +2658,13 @@ evbuffer_expand_fast_(struct evbuffer *buf, size_t datlen, int n)
 	ASSERT_EVBUFFER_LOCKED(buf);
 	EVUTIL_ASSERT(n >= 2);
 
+	if (buf->ring)
+		return CHAIN_SPACE_LEN(chain) >= datlen ? 0 : -1;
+
 	if (chain == NULL || (chain->flags & EVBUFFER_IMMUTABLE)) {
 		/* There is no last chunk, or we can't touch the last chunk.
 		 * Just add a new chunk. */
-		chain = evbuffer_chain_new(datlen);
+		chain = evbuffer_chain_new_for(buf, datlen);
 		if (chain == NULL)
 			return (-1);
 
@@ -2117,10 +2772,58 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 	return chain ? 0 : -1;
 }
 
-/*
- * Reads data from a file descriptor into a buffer.
- */
-
+void
+evbuffer_trim_(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain, *tmp;
+	size_t allocated = 0;
+
+	EVBUFFER_LOCK(buf);
+
+	if (buf->total_len == 0 && buf->spare_chain &&
+	    buf->spare_chain->refcnt == 0) {
+		/* An idle buffer gives its spare chain back too. */
+		mm_free(buf->spare_chain);
+		buf->spare_chain = NULL;
+	}
+	if (buf->total_len == 0 || buf->ring)
+		goto done;
+
+	for (chain = buf->first; chain; chain = chain->next) {
+		/* Only plain memory chains can be replaced by a copy. */
+		if (chain->flags & (EVBUFFER_IMMUTABLE|EVBUFFER_MEM_PINNED_ANY|
+			EVBUFFER_MULTICAST|EVBUFFER_DANGLING))
+			goto done;
+		allocated += chain->buffer_len;
+	}
+
+	/* Not worth a copy unless we would free at least half of what we
+	 * are holding. */
+	if (allocated + EVBUFFER_CHAIN_SIZE <= MIN_BUFFER_SIZE ||
+	    allocated < 2 * buf->total_len)
+		goto done;
+
+	if ((tmp = evbuffer_chain_new_for(buf, buf->total_len)) == NULL)
+		goto done;
+	for (chain = buf->first; chain; chain = chain->next) {
+		memcpy(tmp->buffer + tmp->off, chain->buffer + chain->misalign,
+		    chain->off);
+		tmp->off += chain->off;
+	}
+	EVUTIL_ASSERT(tmp->off == buf->total_len);
+
+	evbuffer_free_all_chains(buf->first);
+	buf->first = buf->last = tmp;
+	buf->last_with_datap = &buf->first;
+
+done:
+	EVBUFFER_UNLOCK(buf);
+}
+
+/*
+ * Reads data from a file descriptor into a buffer.
+ */
+
 #define USE_IOVEC_IMPL
 /* number of iovec we use for writev, fragmentation is going to determine
  * how much we end up writing */
@@ -2142,7 +2845,11 @@ evbuffer_expand(struct evbuffer *buf, size_t datlen)
 
 #define NUM_READ_IOVEC 4
 
+/* How much evbuffer_read() asks for before it knows anything about the
+ * traffic, and the bounds it adapts that amount within. */
 #define EVBUFFER_MAX_READ	4096
+#define EVBUFFER_MIN_READ_HINT	256
+#define EVBUFFER_MAX_READ_HINT	(16 * EVBUFFER_MAX_READ)
 
 /** Helper function to figure out which space to use for reading data into
     an evbuffer.  Internal use only.
@@ -2195,17 +2902,125 @@ evbuffer_read_setup_vecs_(struct evbuffer *buf, ssize_t howmuch,
 	return i;
 }
 
+static inline size_t
+evbuffer_get_read_hint(const struct evbuffer *buf)
+{
+	return buf->read_hint ? buf->read_hint : EVBUFFER_MAX_READ;
+}
+
+/* Adjust our guess for the size of the next read, given that we asked for
+ * 'asked' bytes and read() returned 'got'.  A read that fills the whole
+ * guess doubles it; one that returns data, but much less than we asked
+ * for, halves it.  EAGAIN, EOF and errors say nothing about how much the
+ * next burst will bring, so they leave it alone. */
+static void
+evbuffer_update_read_hint(struct evbuffer *buf, size_t asked, int got)
+{
+	size_t hint = evbuffer_get_read_hint(buf);
+
+	if (got > 0 && (size_t)got == hint) {
+		hint *= 2;
+		if (hint > EVBUFFER_MAX_READ_HINT)
+			hint = EVBUFFER_MAX_READ_HINT;
+	} else if (got > 0 &&
+	    (size_t)got < asked && (size_t)got < hint / 4) {
+		hint /= 2;
+		if (hint < EVBUFFER_MIN_READ_HINT)
+			hint = EVBUFFER_MIN_READ_HINT;
+	}
+	buf->read_hint = hint;
+}
+
+/* Read from fd into the n_vec regions of memory in vec, which we have been
+ * lent, and append whatever arrives as reference chains over them.  Every
+ * region goes back through cleanupfn exactly once: at once if we read
+ * nothing into it, otherwise when its chain is freed.  Requires lock. */
 static int
-get_n_bytes_readable_on_socket(int fd)
+evbuffer_read_into_(struct evbuffer *buf, int fd, const struct iovec *vec,
+    int n_vec, evbuffer_ref_cleanup_cb cleanupfn, void *extra)
 {
-#if defined(FIONREAD)
-	int n = EVBUFFER_MAX_READ;
-	if (ioctl(fd, FIONREAD, &n) < 0)
-		return -1;
+	struct evbuffer_chain *first = NULL, **last = &first, *chain;
+	size_t remaining;
+	int i, n = -1;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+
+	if (buf->freeze_end || buf->ring) {
+		errno = EINVAL;
+		goto done;
+	}
+
+	/* Get every chain we might need now: once the data is read, we
+	 * can't fail to keep it. */
+	for (i = 0; i < n_vec; ++i) {
+		chain = evbuffer_chain_new_reference(vec[i].iov_base,
+		    vec[i].iov_len, cleanupfn, extra);
+		if (!chain)
+			goto done;
+		chain->off = 0;
+		*last = chain;
+		last = &chain->next;
+	}
+
+	n = readv(fd, vec, n_vec);
+
+done:
+	remaining = n > 0 ? n : 0;
+	for (i = 0; i < n_vec; ++i) {
+		if ((chain = first) != NULL) {
+			first = chain->next;
+			chain->next = NULL;
+		}
+		if (chain && remaining) {
+			chain->off = vec[i].iov_len < remaining ?
+			    vec[i].iov_len : remaining;
+			remaining -= chain->off;
+			evbuffer_chain_insert(buf, chain);
+			continue;
+		}
+		if (chain)
+			mm_free(chain);
+		if (cleanupfn)
+			cleanupfn(vec[i].iov_base, vec[i].iov_len, extra);
+	}
+
+	if (n > 0) {
+		buf->n_add_for_cb += n;
+		evbuffer_invoke_callbacks_(buf);
+	}
 	return n;
-#else
-	return EVBUFFER_MAX_READ;
-#endif
+}
+
+int
+evbuffer_read_into(struct evbuffer *buf, int fd, const struct iovec *vec,
+    int n_vec, evbuffer_ref_cleanup_cb cleanupfn, void *extra)
+{
+	int n;
+
+	EVBUFFER_LOCK(buf);
+	n = evbuffer_read_into_(buf, fd, vec, n_vec, cleanupfn, extra);
+	EVBUFFER_UNLOCK(buf);
+	return n;
+}
+
+int
+evbuffer_set_read_mem(struct evbuffer *buf, evbuffer_read_mem_cb getfn,
+    evbuffer_ref_cleanup_cb cleanupfn, void *arg)
+{
+	int r = -1;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->ring && getfn) {
+		errno = EINVAL;
+		goto done;
+	}
+	buf->read_mem_cb = getfn;
+	buf->read_mem_cleanup = getfn ? cleanupfn : NULL;
+	buf->read_mem_arg = getfn ? arg : NULL;
+	r = 0;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return r;
 }
 
 /* TODO(niels): should this function return ssize_t and take ssize_t
@@ -2226,11 +3041,68 @@ evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 		goto done;
 	}
 
-	n = get_n_bytes_readable_on_socket(fd);
-	if (n <= 0 || n > EVBUFFER_MAX_READ)
-		n = EVBUFFER_MAX_READ;
-	if (howmuch < 0 || howmuch > n)
-		howmuch = n;
+	if (buf->ring) {
+		/* The free space in a ring is always contiguous, so we can
+		 * read straight into it without asking how much is
+		 * waiting. */
+		struct evbuffer_chain *chain = buf->first;
+		size_t space = CHAIN_SPACE_LEN(chain);
+		if (space == 0) {
+			errno = ENOBUFS;
+			result = -1;
+			goto done;
+		}
+		if (space > INT_MAX)
+			space = INT_MAX;
+		if (howmuch < 0 || (size_t)howmuch > space)
+			howmuch = (int)space;
+		n = read(fd, CHAIN_SPACE_PTR(chain), howmuch);
+		if (n <= 0) {
+			result = n;
+			goto done;
+		}
+		chain->off += n;
+		goto added;
+	}
+
+	/* Rather than ask the kernel how much is waiting, guess from how
+	 * much the last reads returned. */
+	if (howmuch < 0 || (size_t)howmuch > evbuffer_get_read_hint(buf))
+		howmuch = (int)evbuffer_get_read_hint(buf);
+
+	if (buf->read_mem_cb) {
+		IOV_TYPE vecs[NUM_READ_IOVEC];
+		nvecs = buf->read_mem_cb(buf, howmuch, vecs, NUM_READ_IOVEC,
+		    buf->read_mem_arg);
+		if (nvecs < 0 || nvecs > NUM_READ_IOVEC) {
+			result = -1;
+			goto done;
+		}
+		if (nvecs > 0) {
+			result = evbuffer_read_into_(buf, fd, vecs, nvecs,
+			    buf->read_mem_cleanup, buf->read_mem_arg);
+			evbuffer_update_read_hint(buf, howmuch, result);
+			goto done;
+		}
+	}
+
+	if (howmuch < MIN_BUFFER_SIZE &&
+	    (buf->last == NULL || CHAIN_SPACE_LEN(buf->last) == 0 ||
+		(buf->last->flags & EVBUFFER_IMMUTABLE))) {
+		/* We expect a small read and have no room for it.  Read onto
+		 * the stack first, so that an EAGAIN or EOF costs us no
+		 * allocation, and so that we only allocate as much as we
+		 * actually got. */
+		char tmp[MIN_BUFFER_SIZE];
+		n = read(fd, tmp, howmuch);
+		evbuffer_update_read_hint(buf, howmuch, n);
+		if (n <= 0) {
+			result = n;
+			goto done;
+		}
+		result = evbuffer_add(buf, tmp, n) == -1 ? -1 : n;
+		goto done;
+	}
 
 	/* Since we can use iovecs, we're willing to use the last
 	 * NUM_READ_IOVEC chains. */
@@ -2245,6 +3117,7 @@ evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 		n = readv(fd, vecs, nvecs);
 	}
 
+	evbuffer_update_read_hint(buf, howmuch, n);
 
 
 	if (n == -1) {
@@ -2276,6 +3149,7 @@ evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 		chainp = &(*chainp)->next;
 	}
 
+added:
 	buf->total_len += n;
 	buf->n_add_for_cb += n;
 
@@ -2287,21 +3161,106 @@ done:
 	return result;
 }
 
+/* Chains holding less than this are worth copying together when a write
+ * would otherwise run out of iovecs; compaction never builds a chain
+ * bigger than EVBUFFER_COMPACT_MAX. */
+#define EVBUFFER_COMPACT_SMALL	2048
+#define EVBUFFER_COMPACT_MAX	(16 * EVBUFFER_COMPACT_SMALL)
+
+/* True iff we can copy the data out of chain and free it. */
+#define CHAIN_COMPACTABLE(ch)						\
+	((ch)->off > 0 && (ch)->off < EVBUFFER_COMPACT_SMALL &&		\
+	    (ch)->buffer != NULL &&					\
+	    !((ch)->flags & (EVBUFFER_SENDFILE|EVBUFFER_MEM_PINNED_ANY)))
+
+/* If writing 'howmuch' bytes from buffer would take more than
+ * NUM_WRITE_IOVEC chains, copy runs of small adjacent chains at its front
+ * into bigger ones, so that a single writev() gets further. */
+static void
+evbuffer_compact_for_write(struct evbuffer *buffer, size_t howmuch)
+{
+	struct evbuffer_chain **chp, *chain, *end, *next, *tmp;
+	size_t so_far = 0, run_len;
+	int n = 0;
+
+	ASSERT_EVBUFFER_LOCKED(buffer);
+
+	for (chain = buffer->first; chain && so_far < howmuch;
+	     chain = chain->next) {
+		if (chain->flags & EVBUFFER_SENDFILE)
+			break;
+		so_far += chain->off;
+		++n;
+	}
+	if (n <= NUM_WRITE_IOVEC)
+		return;
+
+	so_far = 0;
+	chp = &buffer->first;
+	while (*chp && so_far < howmuch) {
+		if ((*chp)->flags & EVBUFFER_SENDFILE)
+			break;
+
+		/* Find the run of small chains that starts here. */
+		run_len = 0;
+		n = 0;
+		for (end = *chp; end && CHAIN_COMPACTABLE(end) &&
+			 run_len + end->off <= EVBUFFER_COMPACT_MAX;
+		     end = end->next) {
+			run_len += end->off;
+			++n;
+		}
+		if (n < 2) {
+			so_far += (*chp)->off;
+			chp = &(*chp)->next;
+			continue;
+		}
+
+		if ((tmp = evbuffer_chain_new(run_len)) == NULL)
+			break;
+		for (chain = *chp; chain != end; chain = next) {
+			next = chain->next;
+			memcpy(tmp->buffer + tmp->off,
+			    chain->buffer + chain->misalign, chain->off);
+			tmp->off += chain->off;
+			buffer->foreign_len -= CHAIN_FOREIGN_LEN(chain);
+			evbuffer_chain_free(chain);
+		}
+		tmp->next = end;
+		*chp = tmp;
+
+		++buffer->n_compactions;
+		buffer->n_bytes_compacted += run_len;
+		so_far += run_len;
+		chp = &tmp->next;
+	}
+
+	/* We may have replaced the last chain, or the last one with data. */
+	buffer->last_with_datap = &buffer->first;
+	for (chp = &buffer->first; *chp; chp = &(*chp)->next) {
+		if ((*chp)->off)
+			buffer->last_with_datap = chp;
+		buffer->last = *chp;
+	}
+}
+
 static inline int
 evbuffer_write_iovec(struct evbuffer *buffer, int fd,
-    ssize_t howmuch)
+    ssize_t howmuch, int more)
 {
 	IOV_TYPE iov[NUM_WRITE_IOVEC];
-	struct evbuffer_chain *chain = buffer->first;
+	struct evbuffer_chain *chain;
+	struct msghdr msg;
 	int n, i = 0;
 
 	if (howmuch < 0)
 		return -1;
 
 	ASSERT_EVBUFFER_LOCKED(buffer);
-	/* XXX make this top out at some maximal data length?  if the
-	 * buffer has (say) 1MB in it, split over 128 chains, there's
-	 * no way it all gets written in one go. */
+	/* If the data is spread over more chains than we have iovecs,
+	 * coalesce the small ones so that we write as much as we can. */
+	evbuffer_compact_for_write(buffer, howmuch);
+	chain = buffer->first;
 	while (chain != NULL && i < NUM_WRITE_IOVEC && howmuch) {
 #ifdef USE_SENDFILE
 		/* we cannot write the file info via writev */
@@ -2316,6 +3275,7 @@ evbuffer_write_iovec(struct evbuffer *buffer, int fd,
 		} else {
 			/* XXXcould be problematic when windows supports mmap*/
 			iov[i++].IOV_LEN_FIELD = (IOV_LEN_TYPE)howmuch;
+			howmuch = 0;
 			break;
 		}
 		chain = chain->next;
@@ -2323,6 +3283,20 @@ evbuffer_write_iovec(struct evbuffer *buffer, int fd,
 	if (! i)
 		return 0;
 
+	/* If we ran out of iovecs, or stopped at a sendfile chain, more data
+	 * goes out right behind this write: if the caller allows it, tell the
+	 * kernel not to push out a short segment in the meantime.  We do not
+	 * do this when 'howmuch' stopped us, since that can be a rate
+	 * limit. */
+	if (more && chain != NULL && howmuch > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+		n = sendmsg(fd, &msg, MSG_MORE);
+		if (n >= 0 || errno != ENOTSOCK)
+			return (n);
+	}
+
 	n = writev(fd, iov, i);
 	return (n);
 }
@@ -2385,8 +3359,8 @@ evbuffer_write_sendfile(struct evbuffer *buffer, int dest_fd,
 #endif
 
 int
-evbuffer_write_atmost(struct evbuffer *buffer, int fd,
-    ssize_t howmuch)
+evbuffer_write_atmost_(struct evbuffer *buffer, int fd,
+    ssize_t howmuch, int more)
 {
 	int n = -1;
 
@@ -2406,7 +3380,7 @@ evbuffer_write_atmost(struct evbuffer *buffer, int fd,
 			n = evbuffer_write_sendfile(buffer, fd, howmuch);
 		else {
 #endif
-		n = evbuffer_write_iovec(buffer, fd, howmuch);
+		n = evbuffer_write_iovec(buffer, fd, howmuch, more);
 #ifdef USE_SENDFILE
 		}
 #endif
@@ -2420,6 +3394,13 @@ done:
 	return (n);
 }
 
+int
+evbuffer_write_atmost(struct evbuffer *buffer, int fd,
+    ssize_t howmuch)
+{
+	return evbuffer_write_atmost_(buffer, fd, howmuch, 0);
+}
+
 int
 evbuffer_write(struct evbuffer *buffer, int fd)
 {
@@ -2691,6 +3672,182 @@ evbuffer_peek(struct evbuffer *buffer, ssize_t len,
 	return idx;
 }
 
+/* CRC-32C (Castagnoli), reflected, as used by iSCSI, SCTP and ext4. */
+static const uint32_t evbuffer_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+	0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+	0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+	0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+	0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+	0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+	0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+	0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+	0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+	0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+	0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+	0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+	0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+	0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+	0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+	0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+	0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+	0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+	0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+	0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+	0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+	0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint32_t
+evbuffer_crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = evbuffer_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define EVBUFFER_CRC32C_HW
+/* The SSE4.2 crc32 instruction computes the same CRC, 8 bytes at a time. */
+__attribute__((target("sse4.2")))
+static uint32_t
+evbuffer_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); --len)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	for (; len; --len)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+	return (uint32_t)c;
+}
+#define EVBUFFER_CRC32C_HW_OK() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define EVBUFFER_CRC32C_HW
+#include <arm_acle.h>
+static uint32_t
+evbuffer_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	for (; len && ((uintptr_t)p & 7); --len)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for (; len; --len)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#define EVBUFFER_CRC32C_HW_OK() 1
+#endif
+
+int
+evbuffer_crc32c(struct evbuffer *buf, const struct evbuffer_ptr *start,
+    ssize_t len, uint32_t *crc)
+{
+	struct evbuffer_chain *chain;
+	size_t pos_in_chain, n, left;
+	uint32_t c = ~*crc;
+	int result = -1;
+#ifdef EVBUFFER_CRC32C_HW
+	int hw = EVBUFFER_CRC32C_HW_OK();
+#endif
+
+	EVBUFFER_LOCK(buf);
+
+	if (start) {
+		if (start->pos < 0 || (size_t)start->pos > buf->total_len)
+			goto done;
+		chain = start->internal_.chain;
+		pos_in_chain = start->internal_.pos_in_chain;
+		left = buf->total_len - start->pos;
+	} else {
+		chain = buf->first;
+		pos_in_chain = 0;
+		left = buf->total_len;
+	}
+	if (len >= 0) {
+		if ((size_t)len > left)
+			goto done;
+		left = len;
+	}
+
+	for (; left && chain; chain = chain->next, pos_in_chain = 0) {
+		const unsigned char *p;
+
+		if (!chain->off)
+			continue;
+		/* Data we'd send with sendfile() isn't in memory. */
+		if (!chain->buffer)
+			goto done;
+		p = chain->buffer + chain->misalign + pos_in_chain;
+		n = chain->off - pos_in_chain;
+		if (n > left)
+			n = left;
+#ifdef EVBUFFER_CRC32C_HW
+		if (hw)
+			c = evbuffer_crc32c_hw(c, p, n);
+		else
+#endif
+			c = evbuffer_crc32c_sw(c, p, n);
+		left -= n;
+	}
+
+	*crc = ~c;
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
 
 int
 evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
@@ -2769,23 +3926,14 @@ evbuffer_add_reference(struct evbuffer *outbuf,
     evbuffer_ref_cleanup_cb cleanupfn, void *extra)
 {
 	struct evbuffer_chain *chain;
-	struct evbuffer_chain_reference *info;
 	int result = -1;
 
-	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_reference));
+	chain = evbuffer_chain_new_reference(data, datlen, cleanupfn, extra);
 	if (!chain)
 		return (-1);
-	chain->flags |= EVBUFFER_REFERENCE | EVBUFFER_IMMUTABLE;
-	chain->buffer = (unsigned char *)data;
-	chain->buffer_len = datlen;
-	chain->off = datlen;
-
-	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_reference, chain);
-	info->cleanupfn = cleanupfn;
-	info->extra = extra;
 
 	EVBUFFER_LOCK(outbuf);
-	if (outbuf->freeze_end) {
+	if (outbuf->freeze_end || outbuf->ring) {
 		/* don't call chain_free; we do not want to actually invoke
 		 * the cleanup function */
 		mm_free(chain);
@@ -2999,12 +4147,50 @@ evbuffer_file_segment_free(struct evbuffer_file_segment *seg)
 	mm_free(seg);
 }
 
+/* Helper: return a new chain holding length bytes of seg starting at
+ * offset, and take a reference to seg for it.  Unless can_use_sendfile is
+ * set, seg must already be materialized. */
+static struct evbuffer_chain *
+evbuffer_file_segment_chain_new(struct evbuffer_file_segment *seg,
+    off_t offset, off_t length, int can_use_sendfile)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_file_segment *extra;
+
+	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_file_segment));
+	if (!chain)
+		return NULL;
+	extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
+
+	chain->flags |= EVBUFFER_IMMUTABLE|EVBUFFER_FILESEGMENT;
+	if (can_use_sendfile && seg->can_sendfile) {
+		chain->flags |= EVBUFFER_SENDFILE;
+		chain->misalign = seg->file_offset + offset;
+		chain->off = length;
+		chain->buffer_len = chain->misalign + length;
+	} else if (seg->is_mapping) {
+		chain->buffer = (unsigned char*)(seg->contents + offset);
+		chain->buffer_len = length;
+		chain->off = length;
+	} else {
+		chain->buffer = (unsigned char*)(seg->contents + offset);
+		chain->buffer_len = length;
+		chain->off = length;
+	}
+
+	EVLOCK_LOCK(seg->lock, 0);
+	++seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+	extra->segment = seg;
+
+	return chain;
+}
+
 int
 evbuffer_add_file_segment(struct evbuffer *buf,
     struct evbuffer_file_segment *seg, off_t offset, off_t length)
 {
 	struct evbuffer_chain *chain;
-	struct evbuffer_chain_file_segment *extra;
 	int can_use_sendfile = 0;
 
 	EVBUFFER_LOCK(buf);
@@ -3022,7 +4208,7 @@ evbuffer_add_file_segment(struct evbuffer *buf,
 	}
 	EVLOCK_UNLOCK(seg->lock, 0);
 
-	if (buf->freeze_end)
+	if (buf->freeze_end || buf->ring)
 		goto err;
 
 	if (length < 0) {
@@ -3035,31 +4221,10 @@ evbuffer_add_file_segment(struct evbuffer *buf,
 	if (offset+length > seg->length)
 		goto err;
 
-	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_file_segment));
+	chain = evbuffer_file_segment_chain_new(seg, offset, length,
+	    can_use_sendfile);
 	if (!chain)
 		goto err;
-	extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
-
-	chain->flags |= EVBUFFER_IMMUTABLE|EVBUFFER_FILESEGMENT;
-	if (can_use_sendfile && seg->can_sendfile) {
-		chain->flags |= EVBUFFER_SENDFILE;
-		chain->misalign = seg->file_offset + offset;
-		chain->off = length;
-		chain->buffer_len = chain->misalign + length;
-	} else if (seg->is_mapping) {
-		chain->buffer = (unsigned char*)(seg->contents + offset);
-		chain->buffer_len = length;
-		chain->off = length;
-	} else {
-		chain->buffer = (unsigned char*)(seg->contents + offset);
-		chain->buffer_len = length;
-		chain->off = length;
-	}
-
-	EVLOCK_LOCK(seg->lock, 0);
-	++seg->refcnt;
-	EVLOCK_UNLOCK(seg->lock, 0);
-	extra->segment = seg;
 	buf->n_add_for_cb += length;
 	evbuffer_chain_insert(buf, chain);
 
@@ -3090,6 +4255,673 @@ evbuffer_add_file(struct evbuffer *buf, int fd, off_t offset, off_t length)
 	return r;
 }
 
+/* The process-wide file segment cache; see
+ * evbuffer_file_segment_cache_enable(). */
+
+/** Events on a cached file that make us drop its segments. */
+#define EVBUFFER_FS_CACHE_WATCH_MASK					\
+	(IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_MOVE_SELF|IN_DELETE_SELF)
+
+struct evbuffer_fs_cache_entry {
+	/** Links in the hash chain, and in the LRU list (most recently used
+	 * first). */
+	LIST_ENTRY(evbuffer_fs_cache_entry) hash_next;
+	TAILQ_ENTRY(evbuffer_fs_cache_entry) lru_next;
+
+	/** The lookup key, as passed to evbuffer_file_segment_cache_get(). */
+	char *path;
+	off_t offset;
+	off_t length;
+	unsigned flags;
+	unsigned hash;
+
+	/** What the file looked like when we opened it. */
+	struct stat st;
+
+	/** Our inotify watch on the file, or -1 if we are not watching. */
+	int wd;
+
+	/** The cache's own reference to the segment. */
+	struct evbuffer_file_segment *seg;
+};
+
+LIST_HEAD(evbuffer_fs_cache_bucket, evbuffer_fs_cache_entry);
+TAILQ_HEAD(evbuffer_fs_cache_lru, evbuffer_fs_cache_entry);
+
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+/** Protects everything below. */
+static void *evbuffer_fs_cache_lock_ = NULL;
+#endif
+static struct evbuffer_fs_cache_bucket *fs_cache_buckets = NULL;
+static unsigned fs_cache_mask = 0;
+static size_t fs_cache_n = 0;
+static size_t fs_cache_max = 0;
+static struct evbuffer_fs_cache_lru fs_cache_lru =
+    TAILQ_HEAD_INITIALIZER(fs_cache_lru);
+static int fs_cache_inotify_fd = -1;
+static struct event *fs_cache_inotify_ev = NULL;
+
+#define FS_CACHE_LOCK() EVLOCK_LOCK(evbuffer_fs_cache_lock_, 0)
+#define FS_CACHE_UNLOCK() EVLOCK_UNLOCK(evbuffer_fs_cache_lock_, 0)
+
+static unsigned
+evbuffer_fs_cache_hash(const char *path, off_t offset, off_t length)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	for (; *path; ++path)
+		h = (h ^ (unsigned char)*path) * 16777619u;
+	h = (h ^ (unsigned)offset) * 16777619u;
+	h = (h ^ (unsigned)length) * 16777619u;
+	return h;
+}
+
+/* Remove ent from the cache and free it.  Requires the cache lock. */
+static void
+evbuffer_fs_cache_remove(struct evbuffer_fs_cache_entry *ent)
+{
+	struct evbuffer_fs_cache_entry *other;
+
+	LIST_REMOVE(ent, hash_next);
+	TAILQ_REMOVE(&fs_cache_lru, ent, lru_next);
+	--fs_cache_n;
+
+	if (ent->wd >= 0 && fs_cache_inotify_fd >= 0) {
+		/* Watches are per inode, so other entries may share it. */
+		TAILQ_FOREACH(other, &fs_cache_lru, lru_next) {
+			if (other->wd == ent->wd)
+				break;
+		}
+		if (!other)
+			inotify_rm_watch(fs_cache_inotify_fd, ent->wd);
+	}
+
+	evbuffer_file_segment_free(ent->seg);
+	mm_free(ent->path);
+	mm_free(ent);
+}
+
+/* Remove every entry watched by wd, or every entry if wd is -1.  Requires
+ * the cache lock. */
+static void
+evbuffer_fs_cache_drop(int wd)
+{
+	struct evbuffer_fs_cache_entry *ent, *next;
+
+	for (ent = TAILQ_FIRST(&fs_cache_lru); ent; ent = next) {
+		next = TAILQ_NEXT(ent, lru_next);
+		if (wd == -1 || ent->wd == wd)
+			evbuffer_fs_cache_remove(ent);
+	}
+}
+
+static void
+evbuffer_fs_cache_inotify_cb(int fd, short what, void *arg)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	FS_CACHE_LOCK();
+	while ((n = read(fd, u.buf, sizeof(u.buf))) > 0) {
+		for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			/* On overflow we no longer know what changed. */
+			evbuffer_fs_cache_drop(
+			    (ev->mask & IN_Q_OVERFLOW) ? -1 : ev->wd);
+		}
+	}
+	FS_CACHE_UNLOCK();
+}
+
+/* Open path and make a segment for it, filling in st. */
+static struct evbuffer_file_segment *
+evbuffer_fs_cache_open(const char *path, off_t offset, off_t length,
+    unsigned flags, struct stat *st)
+{
+	struct evbuffer_file_segment *seg;
+	int fd, saved_errno;
+
+	/* O_NONBLOCK, so that a FIFO in the way can't stall us. */
+	if ((fd = evutil_open_closeonexec_(path, O_RDONLY|O_NONBLOCK, 0)) < 0)
+		return NULL;
+	if (fstat(fd, st) < 0)
+		goto err;
+	if (!S_ISREG(st->st_mode)) {
+		errno = S_ISDIR(st->st_mode) ? EISDIR : EINVAL;
+		goto err;
+	}
+	if (length < 0) {
+		if (offset > st->st_size)
+			goto err;
+		length = st->st_size - offset;
+	}
+	seg = evbuffer_file_segment_new(fd, offset, length,
+	    flags | EVBUF_FS_CLOSE_ON_FREE);
+	if (!seg)
+		goto err;
+	return seg;
+err:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return NULL;
+}
+
+struct evbuffer_file_segment *
+evbuffer_file_segment_cache_get(const char *path, off_t offset,
+    off_t length, unsigned flags)
+{
+	struct stat st;
+
+	return evbuffer_file_segment_cache_get_(path, offset, length, flags,
+	    &st);
+}
+
+struct evbuffer_file_segment *
+evbuffer_file_segment_cache_get_(const char *path, off_t offset,
+    off_t length, unsigned flags, struct stat *stp)
+{
+	struct evbuffer_fs_cache_entry *ent;
+	struct evbuffer_file_segment *seg = NULL;
+	struct stat st;
+	unsigned hash;
+
+	/* Cached segments are shared, so they need their locks. */
+	flags &= ~EVBUF_FS_DISABLE_LOCKING;
+
+	FS_CACHE_LOCK();
+	if (!fs_cache_max) {
+		FS_CACHE_UNLOCK();
+		return evbuffer_fs_cache_open(path, offset, length, flags, stp);
+	}
+
+	hash = evbuffer_fs_cache_hash(path, offset, length);
+	LIST_FOREACH(ent, &fs_cache_buckets[hash & fs_cache_mask],
+	    hash_next) {
+		if (ent->hash == hash && ent->offset == offset &&
+		    ent->length == length && ent->flags == flags &&
+		    !strcmp(ent->path, path))
+			break;
+	}
+
+	if (ent && ent->wd < 0) {
+		/* Nothing tells us when the file changes; check. */
+		if (stat(path, &st) < 0 ||
+		    st.st_dev != ent->st.st_dev ||
+		    st.st_ino != ent->st.st_ino ||
+		    st.st_size != ent->st.st_size ||
+		    st.st_mtim.tv_sec != ent->st.st_mtim.tv_sec ||
+		    st.st_mtim.tv_nsec != ent->st.st_mtim.tv_nsec) {
+			evbuffer_fs_cache_remove(ent);
+			ent = NULL;
+		}
+	}
+
+	if (ent) {
+		TAILQ_REMOVE(&fs_cache_lru, ent, lru_next);
+		TAILQ_INSERT_HEAD(&fs_cache_lru, ent, lru_next);
+		seg = ent->seg;
+		*stp = ent->st;
+		EVLOCK_LOCK(seg->lock, 0);
+		++seg->refcnt;
+		EVLOCK_UNLOCK(seg->lock, 0);
+		goto done;
+	}
+
+	if (!(seg = evbuffer_fs_cache_open(path, offset, length, flags, &st)))
+		goto done;
+	*stp = st;
+
+	/* If we can't remember it, the caller still gets a segment. */
+	if (!(ent = mm_calloc(1, sizeof(*ent))))
+		goto done;
+	if (!(ent->path = mm_strdup(path))) {
+		mm_free(ent);
+		goto done;
+	}
+	ent->offset = offset;
+	ent->length = length;
+	ent->flags = flags;
+	ent->hash = hash;
+	ent->st = st;
+	ent->wd = -1;
+	if (fs_cache_inotify_fd >= 0) {
+		ent->wd = inotify_add_watch(fs_cache_inotify_fd, path,
+		    EVBUFFER_FS_CACHE_WATCH_MASK);
+		if (ent->wd < 0)
+			event_warn("%s: inotify_add_watch(%s)", __func__, path);
+	}
+
+	EVLOCK_LOCK(seg->lock, 0);
+	++seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+	ent->seg = seg;
+	LIST_INSERT_HEAD(&fs_cache_buckets[hash & fs_cache_mask], ent,
+	    hash_next);
+	TAILQ_INSERT_HEAD(&fs_cache_lru, ent, lru_next);
+	++fs_cache_n;
+
+	while (fs_cache_n > fs_cache_max)
+		evbuffer_fs_cache_remove(
+		    TAILQ_LAST(&fs_cache_lru, evbuffer_fs_cache_lru));
+
+done:
+	FS_CACHE_UNLOCK();
+	return seg;
+}
+
+int
+evbuffer_file_segment_cache_enable(struct event_base *base,
+    size_t max_entries)
+{
+	struct evbuffer_fs_cache_bucket *buckets = NULL;
+	struct event *old_ev, *ev = NULL;
+	int old_fd, fd = -1;
+	size_t i, n_buckets = 64;
+
+	if (max_entries) {
+		while (n_buckets < max_entries && n_buckets < (1u << 30))
+			n_buckets <<= 1;
+		if (!(buckets = mm_calloc(n_buckets, sizeof(*buckets))))
+			return -1;
+		for (i = 0; i < n_buckets; ++i)
+			LIST_INIT(&buckets[i]);
+	}
+	if (max_entries && base) {
+		fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+		if (fd < 0 ||
+		    !(ev = event_new(base, fd, EV_READ|EV_PERSIST,
+			evbuffer_fs_cache_inotify_cb, NULL)) ||
+		    event_add(ev, NULL) < 0) {
+			if (ev)
+				event_free(ev);
+			if (fd >= 0)
+				close(fd);
+			mm_free(buckets);
+			return -1;
+		}
+	}
+
+	FS_CACHE_LOCK();
+	evbuffer_fs_cache_drop(-1);
+	if (fs_cache_buckets)
+		mm_free(fs_cache_buckets);
+	fs_cache_buckets = buckets;
+	fs_cache_mask = (unsigned)(n_buckets - 1);
+	fs_cache_max = max_entries;
+	old_ev = fs_cache_inotify_ev;
+	old_fd = fs_cache_inotify_fd;
+	fs_cache_inotify_ev = ev;
+	fs_cache_inotify_fd = fd;
+	FS_CACHE_UNLOCK();
+
+	/* Not under the cache lock: event_free() waits for the callback,
+	 * which takes it. */
+	if (old_ev)
+		event_free(old_ev);
+	if (old_fd >= 0)
+		close(old_fd);
+	return 0;
+}
+
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+int
+evbuffer_global_setup_locks_(const int enable_locks)
+{
+	EVTHREAD_SETUP_GLOBAL_LOCK(evbuffer_fs_cache_lock_, 0);
+	EVTHREAD_SETUP_GLOBAL_LOCK(evbuffer_mem_total_lock_, 0);
+	return 0;
+}
+#endif
+
+void
+evbuffer_free_globals_(void)
+{
+	evbuffer_file_segment_cache_enable(NULL, 0);
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+	if (evbuffer_fs_cache_lock_ != NULL) {
+		EVTHREAD_FREE_LOCK(evbuffer_fs_cache_lock_, 0);
+		evbuffer_fs_cache_lock_ = NULL;
+	}
+	if (evbuffer_mem_total_lock_ != NULL) {
+		EVTHREAD_FREE_LOCK(evbuffer_mem_total_lock_, 0);
+		evbuffer_mem_total_lock_ = NULL;
+	}
+#endif
+}
+
+/* Spilled data is written out in runs of at least this many bytes, so
+ * that a buffer that keeps growing does not become a long list of tiny
+ * file segments. */
+#define EVBUFFER_SPILL_BATCH	(256*1024)
+
+/** The temporary file behind a spilling evbuffer.  Held by the evbuffer,
+ * and by every file segment made from it. */
+struct evbuffer_spill {
+	/** Protects refcnt, since segments can be freed from any thread. */
+	void *lock;
+	/** Number of references. */
+	int refcnt;
+	/** The unlinked file, or -1 if we have not created it yet. */
+	int fd;
+	/** Where the next spilled byte goes in the file. */
+	off_t end;
+	/** How much of the buffer to keep in memory. */
+	size_t threshold;
+	/** Directory to create the file in, or NULL. */
+	char *dir;
+};
+
+/* True iff chain is plain memory whose contents we may copy to the spill
+ * file and then free. */
+#define CHAIN_SPILLABLE(ch)						\
+	((ch)->buffer != NULL &&					\
+	    !((ch)->flags & (EVBUFFER_FILESEGMENT|EVBUFFER_SENDFILE|	\
+		EVBUFFER_MULTICAST|EVBUFFER_RING|EVBUFFER_MEM_PINNED_ANY)))
+
+static void
+evbuffer_spill_decref(struct evbuffer_spill *spill)
+{
+	int refcnt;
+
+	EVLOCK_LOCK(spill->lock, 0);
+	refcnt = --spill->refcnt;
+	EVLOCK_UNLOCK(spill->lock, 0);
+	if (refcnt > 0)
+		return;
+	if (spill->fd >= 0)
+		close(spill->fd);
+	if (spill->dir)
+		mm_free(spill->dir);
+	EVTHREAD_FREE_LOCK(spill->lock, 0);
+	mm_free(spill);
+}
+
+/* Cleanup callback for the file segments we spill into: give the disk
+ * space back, and drop the segment's reference to the file.
+ *
+ * A segment that was never materialized may have been sent with
+ * sendfile(), and the kernel can still be holding on to its pages, so we
+ * must not touch its part of the file. */
+static void
+evbuffer_spill_segment_cleanup(struct evbuffer_file_segment const *seg,
+    int flags, void *arg)
+{
+	struct evbuffer_spill *spill = arg;
+
+	(void)flags;
+	if (seg->contents &&
+	    fallocate(spill->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		seg->file_offset, seg->length) < 0 &&
+	    errno != EOPNOTSUPP)
+		event_warn("%s: fallocate", __func__);
+	evbuffer_spill_decref(spill);
+}
+
+/* Create the unlinked file for spill.  Return 0 on success, -1 on
+ * failure. */
+static int
+evbuffer_spill_open(struct evbuffer_spill *spill)
+{
+	const char *dir = spill->dir;
+	char path[PATH_MAX];
+	int fd;
+
+	if (!dir && !(dir = getenv("TMPDIR")))
+		dir = "/tmp";
+
+	fd = evutil_open_closeonexec_(dir, O_TMPFILE|O_RDWR, 0600);
+	if (fd < 0) {
+		/* The filesystem may not support O_TMPFILE. */
+		if (evutil_snprintf(path, sizeof(path),
+			"%s/evbuffer-spill-XXXXXX", dir) >= (int)sizeof(path))
+			return -1;
+		if ((fd = mkostemp(path, O_CLOEXEC)) < 0) {
+			event_warn("%s: can't create a file in %s",
+			    __func__, dir);
+			return -1;
+		}
+		unlink(path);
+	}
+	spill->fd = fd;
+	return 0;
+}
+
+/* Write the data of chain and the chains after it to the end of the spill
+ * file.  Return 0 on success, -1 on failure. */
+static int
+evbuffer_spill_write(struct evbuffer_spill *spill,
+    struct evbuffer_chain *chain)
+{
+	off_t pos = spill->end;
+	size_t done;
+	ssize_t n;
+
+	for (; chain; chain = chain->next) {
+		for (done = 0; done < chain->off; done += n) {
+			n = pwrite(spill->fd,
+			    chain->buffer + chain->misalign + done,
+			    chain->off - done, pos + done);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n <= 0) {
+				event_warn("%s: pwrite", __func__);
+				return -1;
+			}
+		}
+		pos += chain->off;
+	}
+	return 0;
+}
+
+/* If buf has grown by a batch since we last looked, move the run of plain
+ * memory chains at its end that lie beyond the spill threshold into the
+ * spill file, replacing them with a single file-segment chain.  The
+ * contents and length of buf do not change.  Requires lock.
+ *
+ * This runs from evbuffer_invoke_callbacks_(), so the pwrite() and the
+ * mmap() of the new segment (unless it will go out with sendfile()) both
+ * happen synchronously, usually on the event loop thread. */
+static void
+evbuffer_spill_check(struct evbuffer *buf)
+{
+	struct evbuffer_spill *spill = buf->spill;
+	struct evbuffer_chain **chp, **runp = NULL, *chain, *next;
+	struct evbuffer_file_segment *seg;
+	size_t pos = 0, len = 0;
+	int can_use_sendfile, refcnt;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+
+	if (buf->total_len < buf->spill_checked_len)
+		buf->spill_checked_len = buf->total_len;
+	if (!spill->threshold || buf->total_len <= spill->threshold ||
+	    buf->total_len - buf->spill_checked_len < EVBUFFER_SPILL_BATCH)
+		return;
+	buf->spill_checked_len = buf->total_len;
+
+	for (chp = &buf->first; *chp; chp = &(*chp)->next) {
+		chain = *chp;
+		if (!chain->off)
+			continue;
+		if (pos >= spill->threshold && CHAIN_SPILLABLE(chain)) {
+			if (!runp) {
+				runp = chp;
+				len = 0;
+			}
+			len += chain->off;
+		} else {
+			runp = NULL;
+		}
+		pos += chain->off;
+	}
+	if (!runp || len < EVBUFFER_SPILL_BATCH)
+		return;
+
+	/* Nothing refers to the file but us: start a new one, and let the
+	 * old one go.  (Rewriting it in place could change data that a
+	 * sendfile() has not finished sending.) */
+	EVLOCK_LOCK(spill->lock, 0);
+	refcnt = spill->refcnt;
+	EVLOCK_UNLOCK(spill->lock, 0);
+	if (refcnt == 1 && spill->end) {
+		close(spill->fd);
+		spill->fd = -1;
+		spill->end = 0;
+	}
+	if (spill->fd < 0 && evbuffer_spill_open(spill) < 0)
+		return;
+
+	if (evbuffer_spill_write(spill, *runp) < 0)
+		return;
+	seg = evbuffer_file_segment_new(spill->fd, spill->end, len, 0);
+	if (!seg)
+		return;
+	can_use_sendfile = (buf->flags & EVBUFFER_FLAG_DRAINS_TO_FD) != 0;
+	if (!can_use_sendfile && evbuffer_file_segment_materialize(seg) < 0)
+		goto done;
+	chain = evbuffer_file_segment_chain_new(seg, 0, len, can_use_sendfile);
+	if (!chain)
+		goto done;
+
+	spill->end += len;
+	EVLOCK_LOCK(spill->lock, 0);
+	++spill->refcnt;
+	EVLOCK_UNLOCK(spill->lock, 0);
+	evbuffer_file_segment_add_cleanup_cb(seg,
+	    evbuffer_spill_segment_cleanup, spill);
+
+	for (next = *runp; next; ) {
+		struct evbuffer_chain *victim = next;
+		next = next->next;
+		buf->foreign_len -= CHAIN_FOREIGN_LEN(victim);
+		evbuffer_chain_free(victim);
+	}
+	*runp = chain;
+	buf->last = chain;
+	buf->last_with_datap = runp;
+	buf->foreign_len += len;
+done:
+	/* Drop our own reference; the chain holds the segment if we made
+	 * one. */
+	evbuffer_file_segment_free(seg);
+}
+
+int
+evbuffer_set_spill(struct evbuffer *buf, size_t threshold, const char *dir)
+{
+	struct evbuffer_spill *spill;
+	int result = -1;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->ring)
+		goto done;
+
+	if (!threshold) {
+		if (buf->spill) {
+			evbuffer_spill_decref(buf->spill);
+			buf->spill = NULL;
+		}
+		result = 0;
+		goto done;
+	}
+
+	if (!buf->spill) {
+		if (!(spill = mm_calloc(1, sizeof(*spill))))
+			goto done;
+		if (dir && !(spill->dir = mm_strdup(dir))) {
+			mm_free(spill);
+			goto done;
+		}
+		spill->refcnt = 1;
+		spill->fd = -1;
+		EVTHREAD_ALLOC_LOCK(spill->lock, 0);
+		buf->spill = spill;
+	}
+	buf->spill->threshold = threshold;
+	buf->spill_checked_len = 0;
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+int
+evbuffer_enable_ring(struct evbuffer *buf, size_t capacity)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_ring *info;
+	char *mapping = MAP_FAILED;
+	long page_size;
+	int fd = -1;
+	int result = -1;
+
+	EVBUFFER_LOCK(buf);
+
+	if (buf->ring || buf->total_len || capacity == 0)
+		goto done;
+
+	/* Each half of the mapping has to start on a page boundary. */
+	page_size = get_page_size();
+	if (page_size <= 0 ||
+	    capacity > EVBUFFER_CHAIN_MAX / 2 - (size_t)page_size)
+		goto done;
+	capacity = (capacity + page_size - 1) & ~((size_t)page_size - 1);
+
+	if ((fd = memfd_create("evbuffer-ring", MFD_CLOEXEC)) < 0) {
+		event_warn("%s: memfd_create failed", __func__);
+		goto done;
+	}
+	if (ftruncate(fd, capacity) < 0)
+		goto done;
+
+	/* Reserve room for both halves, then map the file over each. */
+	mapping = mmap(NULL, capacity * 2, PROT_NONE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		goto done;
+	if (mmap(mapping, capacity, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(mapping + capacity, capacity, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+		event_warn("%s: mmap failed", __func__);
+		goto done;
+	}
+
+	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_ring));
+	if (!chain)
+		goto done;
+	chain->flags |= EVBUFFER_RING;
+	chain->buffer = (unsigned char *)mapping;
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_ring, chain);
+	info->mapping = mapping;
+	info->capacity = capacity;
+	evbuffer_chain_ring_fixup(chain);
+	mapping = MAP_FAILED; /* now owned by the chain */
+
+	/* Throw away any empty chains we had before. */
+	evbuffer_free_all_chains(buf->first);
+	ZERO_CHAIN(buf);
+	evbuffer_chain_insert(buf, chain);
+	buf->ring = 1;
+	result = 0;
+
+done:
+	if (mapping != MAP_FAILED)
+		munmap(mapping, capacity * 2);
+	if (fd >= 0)
+		close(fd);
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
 int
 evbuffer_setcb(struct evbuffer *buffer, evbuffer_cb cb, void *cbarg)
 {
@@ -64,6 +64,9 @@ extern "C" {
 /* On a base bufferevent, for reading: used when a filter has choked this
  * (underlying) bufferevent because it has stopped reading from it. */
 #define BEV_SUSPEND_FILT_READ 0x10
+/* On a bufferevent, for reading: the event_base is over its hard limit on
+ * buffered memory, and this bufferevent holds more than its share. */
+#define BEV_SUSPEND_MEM 0x20
 
 typedef uint16_t bufferevent_suspend_flags;
 
@@ -163,6 +166,10 @@ struct bufferevent_private {
 	/** Flag: set if a connect failed prematurely; this is a hack for
 	 * getting around the bufferevent abstraction. */
 	unsigned connection_refused : 1;
+	/** Flag: set if the last write on this socket bufferevent left
+	 * nothing behind, so the socket is probably still writable.  Used by
+	 * BEV_OPT_WRITE_THROUGH. */
+	unsigned write_ready : 1;
 	/** Set to the events pending if we have deferred callbacks and
 	 * an events callback is pending. */
 	short eventcb_pending;
@@ -187,6 +194,10 @@ struct bufferevent_private {
 	/** Used to implement deferred callbacks */
 	struct event_callback deferred;
 
+	/** Used to implement BEV_OPT_COALESCE_WRITES: runs at the end of the
+	 * loop iteration in which data was added to the output buffer. */
+	struct event_callback write_flush;
+
 	/** The options this bufferevent was constructed with */
 	enum bufferevent_options options;
 
@@ -221,6 +232,14 @@ struct bufferevent_private {
 	} conn_address;
 
 	struct evdns_getaddrinfo_request *dns_request;
+
+	/** Next bufferevent in the base's pool, if this one is pooled; see
+	 * bufferevent_socket_set_pool_size(). */
+	struct bufferevent_private *pool_next;
+
+	/** If set, input is split into frames; see bufferevent_set_framing().
+	 */
+	struct bufferevent_framing *framing;
 };
 
 /** Possible operations for a control callback. */
@@ -417,6 +436,24 @@ int bufferevent_generic_adj_existing_timeouts_(struct bufferevent *bev);
 EVENT2_EXPORT_SYMBOL
 enum bufferevent_options bufferevent_get_options_(struct bufferevent *bev);
 
+/** Internal: for a socket bufferevent with BEV_OPT_WRITE_THROUGH and an
+ * empty output buffer, try to write data straight to the socket.  If buf is
+ * set, write from buf (draining what was written); otherwise write up to
+ * size bytes from data.  Returns the number of bytes written, or 0 if the
+ * caller should just queue everything.  Must hold the bufev lock. */
+ssize_t bufferevent_socket_write_through_(struct bufferevent *bev,
+    const void *data, size_t size, struct evbuffer *buf);
+
+/** Internal: called while finalizing a socket bufferevent.  If the base
+ * pools bufferevents, reset bev's evbuffers for reuse and return 0; the
+ * caller must then hand bev to bufferevent_socket_pool_put_() instead of
+ * freeing it and its evbuffers.  Returns -1 otherwise.  Must hold the
+ * bufev lock. */
+int bufferevent_socket_pool_prepare_(struct bufferevent *bev);
+/** Internal: add bev, prepared by bufferevent_socket_pool_prepare_() and
+ * no longer locked, to its base's pool, or free it if the pool is full. */
+void bufferevent_socket_pool_put_(struct bufferevent *bev);
+
 EVENT2_EXPORT_SYMBOL
 const struct sockaddr*
 bufferevent_socket_get_conn_address_(struct bufferevent *bev);
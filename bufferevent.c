@@ -140,6 +140,183 @@ bufferevent_inbuf_wm_cb(struct evbuffer *buf,
 		bufferevent_wm_unsuspend_read(bufev);
 }
 
+/* The longest length prefix we support: a 64-bit varint. */
+#define BEV_FRAME_MAX_HEADER 10
+/* How many iovecs of a frame we can describe without allocating. */
+#define BEV_FRAME_N_IOVEC 8
+
+/** State for a bufferevent with framing; see bufferevent_set_framing(). */
+struct bufferevent_framing {
+	enum bufferevent_frame_header header;
+	size_t max_frame;
+	bufferevent_frame_cb cb;
+	void *cbarg;
+	/** The read watermarks to put back when framing is turned off. */
+	struct event_watermark saved_wm;
+};
+
+/* Parse the length prefix at the start of buf.  Return 1 and set *hlen and
+ * *len if it is all there, 0 and set *hlen to the number of bytes we need
+ * if it is not, and -1 if it is malformed. */
+static int
+bufferevent_frame_parse(struct evbuffer *buf,
+    enum bufferevent_frame_header header, size_t *hlen, uint64_t *len)
+{
+	unsigned char h[BEV_FRAME_MAX_HEADER];
+	size_t have = evbuffer_get_length(buf);
+	size_t need;
+	int i;
+
+	switch (header) {
+	case BEV_FRAME_U8:
+		need = 1;
+		break;
+	case BEV_FRAME_BE16:
+	case BEV_FRAME_LE16:
+		need = 2;
+		break;
+	case BEV_FRAME_BE32:
+	case BEV_FRAME_LE32:
+		need = 4;
+		break;
+	case BEV_FRAME_VARINT:
+	default:
+		need = have < BEV_FRAME_MAX_HEADER ? have : BEV_FRAME_MAX_HEADER;
+		evbuffer_copyout(buf, h, need);
+		*len = 0;
+		for (i = 0; i < (int)need; ++i) {
+			if (i == BEV_FRAME_MAX_HEADER - 1 && h[i] > 1)
+				return -1;
+			*len |= (uint64_t)(h[i] & 0x7f) << (7 * i);
+			if (!(h[i] & 0x80)) {
+				*hlen = i + 1;
+				return 1;
+			}
+		}
+		if (need == BEV_FRAME_MAX_HEADER)
+			return -1;
+		*hlen = need + 1;
+		return 0;
+	}
+
+	*hlen = need;
+	if (have < need)
+		return 0;
+	evbuffer_copyout(buf, h, need);
+	switch (header) {
+	case BEV_FRAME_U8:
+		*len = h[0];
+		break;
+	case BEV_FRAME_BE16:
+		*len = ((uint64_t)h[0] << 8) | h[1];
+		break;
+	case BEV_FRAME_LE16:
+		*len = ((uint64_t)h[1] << 8) | h[0];
+		break;
+	case BEV_FRAME_BE32:
+		*len = ((uint64_t)h[0] << 24) | ((uint64_t)h[1] << 16) |
+		    ((uint64_t)h[2] << 8) | h[3];
+		break;
+	default:
+		*len = ((uint64_t)h[3] << 24) | ((uint64_t)h[2] << 16) |
+		    ((uint64_t)h[1] << 8) | h[0];
+		break;
+	}
+	return 1;
+}
+
+static void bufferevent_set_read_wm(struct bufferevent *bufev,
+    size_t lowmark, size_t highmark);
+
+/* Don't run the read callback until 'need' bytes have arrived.  The high
+ * watermark is the user's, raised to 'need' only while the frame we are
+ * waiting for would not fit under it. */
+static void
+bufferevent_frame_set_wm(struct bufferevent *bufev, size_t need)
+{
+	struct bufferevent_framing *f = BEV_UPCAST(bufev)->framing;
+	size_t high = f->saved_wm.high;
+
+	if (high && high < need)
+		high = need;
+	if (high != bufev->wm_read.high)
+		bufferevent_set_read_wm(bufev, need, high);
+	else
+		bufev->wm_read.low = need;
+}
+
+/* Run the frame callback for every complete frame in the input, then make
+ * the read low watermark what the next frame needs.  If 'unlock' is set,
+ * the callback runs without the lock held.  Requires that we hold the lock
+ * and a reference. */
+static void
+bufferevent_frame_dispatch(struct bufferevent *bufev, int unlock)
+{
+	struct bufferevent_private *p = BEV_UPCAST(bufev);
+	struct bufferevent_framing *f;
+	struct iovec vecs[BEV_FRAME_N_IOVEC], *vec;
+	struct evbuffer_ptr pos;
+	uint64_t len, left;
+	size_t hlen;
+	int i, n, r;
+
+	while ((f = p->framing)) {
+		bufferevent_frame_cb cb = f->cb;
+		void *cbarg = f->cbarg;
+		uint64_t max = f->max_frame ? f->max_frame : EV_SSIZE_MAX;
+
+		r = bufferevent_frame_parse(bufev->input, f->header, &hlen,
+		    &len);
+		if (r < 0 || (r > 0 && len > max)) {
+			bufferevent_disable(bufev, EV_READ);
+			errno = EMSGSIZE;
+			bufferevent_run_eventcb_(bufev,
+			    BEV_EVENT_READING|BEV_EVENT_ERROR, 0);
+			return;
+		}
+		if (r == 0) {
+			bufferevent_frame_set_wm(bufev, hlen);
+			return;
+		}
+		if (evbuffer_get_length(bufev->input) < hlen + len) {
+			bufferevent_frame_set_wm(bufev, hlen + len);
+			return;
+		}
+
+		evbuffer_ptr_set(bufev->input, &pos, hlen, EVBUFFER_PTR_SET);
+		vec = vecs;
+		n = 0;
+		if (len) {
+			n = evbuffer_peek(bufev->input, len, &pos, vecs,
+			    BEV_FRAME_N_IOVEC);
+			if (n > BEV_FRAME_N_IOVEC) {
+				if (!(vec = mm_calloc(n, sizeof(*vec)))) {
+					event_warn("%s: out of memory",
+					    __func__);
+					return;
+				}
+				evbuffer_peek(bufev->input, len, &pos, vec, n);
+			}
+			/* The last extent can run past the frame. */
+			for (i = 0, left = len; i < n; ++i) {
+				if (vec[i].iov_len > left)
+					vec[i].iov_len = left;
+				left -= vec[i].iov_len;
+			}
+		}
+		if (unlock) {
+			BEV_UNLOCK(bufev);
+			cb(bufev, &pos, len, vec, n, cbarg);
+			BEV_LOCK(bufev);
+		} else {
+			cb(bufev, &pos, len, vec, n, cbarg);
+		}
+		if (vec != vecs)
+			mm_free(vec);
+		evbuffer_drain(bufev->input, hlen + len);
+	}
+}
+
 static void
 bufferevent_run_deferred_callbacks_locked(struct event_callback *cb, void *arg)
 {
@@ -154,7 +331,11 @@ bufferevent_run_deferred_callbacks_locked(struct event_callback *cb, void *arg)
 		bufev_private->eventcb_pending &= ~BEV_EVENT_CONNECTED;
 		bufev->errorcb(bufev, BEV_EVENT_CONNECTED, bufev->cbarg);
 	}
-	if (bufev_private->readcb_pending && bufev->readcb) {
+	if (bufev_private->readcb_pending && bufev_private->framing) {
+		bufev_private->readcb_pending = 0;
+		bufferevent_frame_dispatch(bufev, 0);
+		bufferevent_inbuf_wm_check(bufev);
+	} else if (bufev_private->readcb_pending && bufev->readcb) {
 		bufev_private->readcb_pending = 0;
 		bufev->readcb(bufev, bufev->cbarg);
 		bufferevent_inbuf_wm_check(bufev);
@@ -193,7 +374,11 @@ bufferevent_run_deferred_callbacks_unlocked(struct event_callback *cb, void *arg
 		bufev_private->eventcb_pending &= ~BEV_EVENT_CONNECTED;
 		UNLOCKED(errorcb(bufev, BEV_EVENT_CONNECTED, cbarg));
 	}
-	if (bufev_private->readcb_pending && bufev->readcb) {
+	if (bufev_private->readcb_pending && bufev_private->framing) {
+		bufev_private->readcb_pending = 0;
+		bufferevent_frame_dispatch(bufev, 1);
+		bufferevent_inbuf_wm_check(bufev);
+	} else if (bufev_private->readcb_pending && bufev->readcb) {
 		bufferevent_data_cb readcb = bufev->readcb;
 		void *cbarg = bufev->cbarg;
 		bufev_private->readcb_pending = 0;
@@ -234,11 +419,14 @@ bufferevent_run_readcb_(struct bufferevent *bufev, int options)
 {
 	/* Requires that we hold the lock and a reference */
 	struct bufferevent_private *p = BEV_UPCAST(bufev);
-	if (bufev->readcb == NULL)
+	if (bufev->readcb == NULL && p->framing == NULL)
 		return;
 	if ((p->options|options) & BEV_OPT_DEFER_CALLBACKS) {
 		p->readcb_pending = 1;
 		SCHEDULE_DEFERRED(p);
+	} else if (p->framing) {
+		bufferevent_frame_dispatch(bufev, 0);
+		bufferevent_inbuf_wm_check(bufev);
 	} else {
 		bufev->readcb(bufev, bufev->cbarg);
 		bufferevent_inbuf_wm_check(bufev);
@@ -281,8 +469,12 @@ bufferevent_run_eventcb_(struct bufferevent *bufev, short what, int options)
 	if (bufev->errorcb == NULL)
 		return;
 	if ((p->options|options) & BEV_OPT_DEFER_CALLBACKS) {
+		/* An error that is still waiting to be reported keeps its
+		 * errno (EMSGSIZE for a bad frame, say); a later event such as
+		 * EOF must not replace it before the callback runs. */
+		if (!(p->eventcb_pending & BEV_EVENT_ERROR))
+			p->errno_pending = errno;
 		p->eventcb_pending |= what;
-		p->errno_pending = errno;
 		SCHEDULE_DEFERRED(p);
 	} else {
 		bufev->errorcb(bufev, what, bufev->cbarg);
@@ -443,19 +635,44 @@ bufferevent_get_priority(const struct bufferevent *bufev)
 int
 bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
 {
-	if (evbuffer_add(bufev->output, data, size) == -1)
-		return (-1);
+	ssize_t n = 0;
+	int r = 0;
 
-	return 0;
+	BEV_LOCK(bufev);
+	if (BEV_UPCAST(bufev)->options & BEV_OPT_WRITE_THROUGH)
+		n = bufferevent_socket_write_through_(bufev, data, size, NULL);
+	if ((size_t)n < size &&
+	    evbuffer_add(bufev->output, (const char *)data + n, size - n) == -1)
+		r = -1;
+	if (n > 0)
+		bufferevent_trigger_nolock_(bufev, EV_WRITE,
+		    BEV_OPT_DEFER_CALLBACKS);
+	BEV_UNLOCK(bufev);
+
+	return r;
 }
 
 int
 bufferevent_write_buffer(struct bufferevent *bufev, struct evbuffer *buf)
 {
+	ssize_t n = 0;
+	int r = 0;
+
+	/* Take both locks in the usual order before the bufferevent lock,
+	 * since we may write from buf while holding it. */
+	EVBUFFER_LOCK2(bufev->output, buf);
+	BEV_LOCK(bufev);
+	if (BEV_UPCAST(bufev)->options & BEV_OPT_WRITE_THROUGH)
+		n = bufferevent_socket_write_through_(bufev, NULL, 0, buf);
 	if (evbuffer_add_buffer(bufev->output, buf) == -1)
-		return (-1);
+		r = -1;
+	if (n > 0)
+		bufferevent_trigger_nolock_(bufev, EV_WRITE,
+		    BEV_OPT_DEFER_CALLBACKS);
+	BEV_UNLOCK(bufev);
+	EVBUFFER_UNLOCK2(bufev->output, buf);
 
-	return 0;
+	return r;
 }
 
 size_t
@@ -582,48 +799,69 @@ bufferevent_disable(struct bufferevent *bufev, short event)
  * Sets the water marks
  */
 
+/* Set the read watermarks, and start or stop suspending reads to match.
+ * Requires lock. */
+static void
+bufferevent_set_read_wm(struct bufferevent *bufev, size_t lowmark,
+    size_t highmark)
+{
+	struct bufferevent_private *bufev_private = BEV_UPCAST(bufev);
+
+	bufev->wm_read.low = lowmark;
+	bufev->wm_read.high = highmark;
+
+	if (highmark) {
+		/* There is now a new high-water mark for read.
+		   enable the callback if needed, and see if we should
+		   suspend/bufferevent_wm_unsuspend. */
+
+		if (bufev_private->read_watermarks_cb == NULL) {
+			bufev_private->read_watermarks_cb =
+			    evbuffer_add_cb(bufev->input,
+					    bufferevent_inbuf_wm_cb,
+					    bufev);
+		}
+		evbuffer_cb_set_flags(bufev->input,
+			      bufev_private->read_watermarks_cb,
+			      EVBUFFER_CB_ENABLED|EVBUFFER_CB_NODEFER);
+
+		if (evbuffer_get_length(bufev->input) >= highmark)
+			bufferevent_wm_suspend_read(bufev);
+		else if (evbuffer_get_length(bufev->input) < highmark)
+			bufferevent_wm_unsuspend_read(bufev);
+	} else {
+		/* There is now no high-water mark for read. */
+		if (bufev_private->read_watermarks_cb)
+			evbuffer_cb_clear_flags(bufev->input,
+			    bufev_private->read_watermarks_cb,
+			    EVBUFFER_CB_ENABLED);
+		bufferevent_wm_unsuspend_read(bufev);
+	}
+}
+
 void
 bufferevent_setwatermark(struct bufferevent *bufev, short events,
     size_t lowmark, size_t highmark)
 {
-	struct bufferevent_private *bufev_private = BEV_UPCAST(bufev);
+	struct bufferevent_framing *f;
 
 	BEV_LOCK(bufev);
+	f = BEV_UPCAST(bufev)->framing;
 	if (events & EV_WRITE) {
 		bufev->wm_write.low = lowmark;
 		bufev->wm_write.high = highmark;
 	}
 
 	if (events & EV_READ) {
-		bufev->wm_read.low = lowmark;
-		bufev->wm_read.high = highmark;
-
-		if (highmark) {
-			/* There is now a new high-water mark for read.
-			   enable the callback if needed, and see if we should
-			   suspend/bufferevent_wm_unsuspend. */
-
-			if (bufev_private->read_watermarks_cb == NULL) {
-				bufev_private->read_watermarks_cb =
-				    evbuffer_add_cb(bufev->input,
-						    bufferevent_inbuf_wm_cb,
-						    bufev);
-			}
-			evbuffer_cb_set_flags(bufev->input,
-				      bufev_private->read_watermarks_cb,
-				      EVBUFFER_CB_ENABLED|EVBUFFER_CB_NODEFER);
-
-			if (evbuffer_get_length(bufev->input) >= highmark)
-				bufferevent_wm_suspend_read(bufev);
-			else if (evbuffer_get_length(bufev->input) < highmark)
-				bufferevent_wm_unsuspend_read(bufev);
+		if (f) {
+			/* Framing owns the low watermark; remember what the
+			 * user wants for when it is turned off, and apply
+			 * their high watermark now. */
+			f->saved_wm.low = lowmark;
+			f->saved_wm.high = highmark;
+			bufferevent_frame_set_wm(bufev, bufev->wm_read.low);
 		} else {
-			/* There is now no high-water mark for read. */
-			if (bufev_private->read_watermarks_cb)
-				evbuffer_cb_clear_flags(bufev->input,
-				    bufev_private->read_watermarks_cb,
-				    EVBUFFER_CB_ENABLED);
-			bufferevent_wm_unsuspend_read(bufev);
+			bufferevent_set_read_wm(bufev, lowmark, highmark);
 		}
 	}
 	BEV_UNLOCK(bufev);
@@ -655,6 +893,129 @@ bufferevent_getwatermark(struct bufferevent *bufev, short events,
 	return -1;
 }
 
+int
+bufferevent_set_framing(struct bufferevent *bufev,
+    enum bufferevent_frame_header header, size_t max_frame,
+    bufferevent_frame_cb cb, void *cbarg)
+{
+	struct bufferevent_private *p = BEV_UPCAST(bufev);
+	struct bufferevent_framing *f;
+	int r = -1;
+
+	BEV_LOCK(bufev);
+	if (!cb) {
+		if ((f = p->framing)) {
+			p->framing = NULL;
+			bufferevent_set_read_wm(bufev,
+			    f->saved_wm.low, f->saved_wm.high);
+			mm_free(f);
+		}
+		r = 0;
+		goto done;
+	}
+	if (header > BEV_FRAME_VARINT)
+		goto done;
+	if (!(f = p->framing)) {
+		if (!(f = mm_calloc(1, sizeof(*f))))
+			goto done;
+		f->saved_wm = bufev->wm_read;
+		p->framing = f;
+	}
+	f->header = header;
+	f->max_frame = max_frame;
+	f->cb = cb;
+	f->cbarg = cbarg;
+
+	/* Deal with anything that has already arrived, and set the
+	 * watermark for the first frame. */
+	bufev->wm_read.low = 0;
+	bufferevent_trigger_nolock_(bufev, EV_READ, BEV_OPT_DEFER_CALLBACKS);
+	r = 0;
+done:
+	BEV_UNLOCK(bufev);
+	return r;
+}
+
+int
+bufferevent_write_frame(struct bufferevent *bufev,
+    const void *data, size_t size)
+{
+	struct bufferevent_private *p = BEV_UPCAST(bufev);
+	unsigned char h[BEV_FRAME_MAX_HEADER];
+	struct iovec vec[2];
+	uint64_t left = size;
+	size_t hlen = 0, off = 0;
+	int i, n, r = -1;
+
+	BEV_LOCK(bufev);
+	if (!p->framing)
+		goto done;
+	switch (p->framing->header) {
+	case BEV_FRAME_U8:
+		if (size > 0xff)
+			goto done;
+		h[hlen++] = (unsigned char)size;
+		break;
+	case BEV_FRAME_BE16:
+	case BEV_FRAME_LE16:
+		if (size > 0xffff)
+			goto done;
+		hlen = 2;
+		break;
+	case BEV_FRAME_BE32:
+	case BEV_FRAME_LE32:
+		if ((uint64_t)size > 0xffffffffu)
+			goto done;
+		hlen = 4;
+		break;
+	case BEV_FRAME_VARINT:
+	default:
+		do {
+			h[hlen] = left & 0x7f;
+			if (left >>= 7)
+				h[hlen] |= 0x80;
+			++hlen;
+		} while (left);
+		break;
+	}
+	if (p->framing->header == BEV_FRAME_BE16 ||
+	    p->framing->header == BEV_FRAME_BE32) {
+		for (i = 0; i < (int)hlen; ++i)
+			h[i] = (size >> (8 * (hlen - 1 - i))) & 0xff;
+	} else if (p->framing->header == BEV_FRAME_LE16 ||
+	    p->framing->header == BEV_FRAME_LE32) {
+		for (i = 0; i < (int)hlen; ++i)
+			h[i] = (size >> (8 * i)) & 0xff;
+	}
+
+	/* Add the prefix and the payload in one go, so that nobody sees a
+	 * frame with only its prefix. */
+	n = evbuffer_reserve_space(bufev->output, hlen + size, vec, 2);
+	if (n < 0)
+		goto done;
+	for (i = 0; i < n && off < hlen + size; ++i) {
+		char *out = vec[i].iov_base;
+		size_t room = vec[i].iov_len, k;
+
+		if (room > hlen + size - off)
+			room = hlen + size - off;
+		vec[i].iov_len = room;
+		if (off < hlen) {
+			k = room < hlen - off ? room : hlen - off;
+			memcpy(out, h + off, k);
+			out += k;
+			off += k;
+			room -= k;
+		}
+		memcpy(out, (const char *)data + (off - hlen), room);
+		off += room;
+	}
+	r = evbuffer_commit_space(bufev->output, vec, i);
+done:
+	BEV_UNLOCK(bufev);
+	return r;
+}
+
 int
 bufferevent_flush(struct bufferevent *bufev,
     short iotype,
@@ -723,6 +1084,7 @@ bufferevent_finalize_cb_(struct event_callback *evcb, void *arg_)
 	struct bufferevent *bufev = arg_;
 	struct bufferevent *underlying;
 	struct bufferevent_private *bufev_private = BEV_UPCAST(bufev);
+	int pooled;
 
 	BEV_LOCK(bufev);
 	underlying = bufferevent_get_underlying(bufev);
@@ -731,12 +1093,18 @@ bufferevent_finalize_cb_(struct event_callback *evcb, void *arg_)
 	if (bufev->be_ops->destruct)
 		bufev->be_ops->destruct(bufev);
 
+	/* Socket bufferevents may be kept, buffers and all, for reuse. */
+	pooled = BEV_IS_SOCKET(bufev) &&
+	    bufferevent_socket_pool_prepare_(bufev) == 0;
+
 	/* XXX what happens if refcnt for these buffers is > 1?
 	 * The buffers can share a lock with this bufferevent object,
 	 * but the lock might be destroyed below. */
 	/* evbuffer will free the callbacks */
-	evbuffer_free(bufev->input);
-	evbuffer_free(bufev->output);
+	if (!pooled) {
+		evbuffer_free(bufev->input);
+		evbuffer_free(bufev->output);
+	}
 
 	if (bufev_private->rate_limiting) {
 		if (bufev_private->rate_limiting->group)
@@ -745,6 +1113,11 @@ bufferevent_finalize_cb_(struct event_callback *evcb, void *arg_)
 		bufev_private->rate_limiting = NULL;
 	}
 
+	if (bufev_private->framing) {
+		mm_free(bufev_private->framing);
+		bufev_private->framing = NULL;
+	}
+
 
 	BEV_UNLOCK(bufev);
 
@@ -753,7 +1126,10 @@ bufferevent_finalize_cb_(struct event_callback *evcb, void *arg_)
 		    EVTHREAD_LOCKTYPE_RECURSIVE);
 
 	/* Free the actual allocated memory. */
-	mm_free(((char*)bufev) - bufev->be_ops->mem_offset);
+	if (pooled)
+		bufferevent_socket_pool_put_(bufev);
+	else
+		mm_free(((char*)bufev) - bufev->be_ops->mem_offset);
 
 	/* Release the reference to underlying now that we no longer need the
 	 * reference to it.  We wait this long mainly in case our lock is
@@ -886,6 +1262,11 @@ bufferevent_cancel_all_(struct bufferevent *bev)
 	BEV_LOCK(bev);
 	if (bev->be_ops->ctrl)
 		bev->be_ops->ctrl(bev, BEV_CTRL_CANCEL_ALL, &d);
+	/* The callbacks are gone, so a deferred run would do nothing; drop
+	 * it and the reference it holds, or freeing the base before the
+	 * loop runs again would leak us. */
+	if (event_deferred_cb_cancel_(bev->ev_base, &BEV_UPCAST(bev)->deferred))
+		bufferevent_decref_(bev);
 	BEV_UNLOCK(bev);
 }
 
@@ -46,12 +46,15 @@
 #include "event2/util.h"
 #include "event2/bufferevent.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
+#include "event-internal.h"
 #include "util-internal.h"
 
 /* prototypes */
@@ -118,12 +121,47 @@ bufferevent_socket_outbuf_cb(struct evbuffer *buf,
 	    !bufev_p->write_suspended) {
 		/* Somebody added data to the buffer, and we would like to
 		 * write, and we were not writing.  So, start writing. */
-		if (bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write) == -1) {
+		if (bufev_p->options & BEV_OPT_COALESCE_WRITES) {
+			/* ... once this loop iteration is done, so that
+			 * everything added until then goes out together. */
+			if (event_callback_run_at_loop_end_(bufev->ev_base,
+				&bufev_p->write_flush))
+				bufferevent_incref_(bufev);
+		} else if (bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write) == -1) {
 		    /* Should we log this? */
 		}
 	}
 }
 
+/* Largest read we do through the scratch area for BEV_OPT_FRUGAL; the same
+ * as the default limit on a single read. */
+#define FRUGAL_READ_MAX 16384
+
+/* Read into base's scratch area, then copy what we got into buf.  Behaves
+ * like evbuffer_read().  Only the loop thread runs read callbacks, so the
+ * one area serves every bufferevent on the base. */
+static int
+bufferevent_socket_read_frugal(struct event_base *base, struct evbuffer *buf,
+    int fd, ssize_t howmuch)
+{
+	char *scratch = base->bev_read_scratch;
+	ssize_t n;
+
+	if (scratch == NULL) {
+		if ((scratch = mm_malloc(FRUGAL_READ_MAX)) == NULL)
+			return -1;
+		base->bev_read_scratch = scratch;
+	}
+	if (howmuch < 0 || howmuch > FRUGAL_READ_MAX)
+		howmuch = FRUGAL_READ_MAX;
+	n = read(fd, scratch, howmuch);
+	if (n <= 0)
+		return (int)n;
+	if (evbuffer_add(buf, scratch, n) == -1)
+		return -1;
+	return (int)n;
+}
+
 static void
 bufferevent_readcb(int fd, short event, void *arg)
 {
@@ -166,7 +204,12 @@ bufferevent_readcb(int fd, short event, void *arg)
 		goto done;
 
 	evbuffer_unfreeze(input, 0);
-	res = evbuffer_read(input, fd, (int)howmuch); /* XXXX evbuffer_read would do better to take and return ssize_t */
+	if ((bufev_p->options & BEV_OPT_FRUGAL) &&
+	    evbuffer_get_length(input) == 0 && input->read_mem_cb == NULL)
+		res = bufferevent_socket_read_frugal(bufev->ev_base, input,
+		    fd, howmuch);
+	else
+		res = evbuffer_read(input, fd, (int)howmuch); /* XXXX evbuffer_read would do better to take and return ssize_t */
 	evbuffer_freeze(input, 0);
 
 	if (res == -1) {
@@ -192,6 +235,12 @@ bufferevent_readcb(int fd, short event, void *arg)
 	/* Invoke the user callback - must always be called last */
 	bufferevent_trigger_nolock_(bufev, EV_READ, 0);
 
+	/* If the callback ran and left some data behind, keep it in no
+	 * more memory than it needs. */
+	if ((bufev_p->options & (BEV_OPT_FRUGAL|BEV_OPT_DEFER_CALLBACKS)) ==
+	    BEV_OPT_FRUGAL)
+		evbuffer_trim_(input);
+
 	goto done;
 
  reschedule:
@@ -262,7 +311,8 @@ bufferevent_writecb(int fd, short event, void *arg)
 
 	if (evbuffer_get_length(bufev->output)) {
 		evbuffer_unfreeze(bufev->output, 1);
-		res = evbuffer_write_atmost(bufev->output, fd, atmost);
+		res = evbuffer_write_atmost_(bufev->output, fd, atmost,
+		    bufev_p->options & BEV_OPT_COALESCE_WRITES);
 		evbuffer_freeze(bufev->output, 1);
 		if (res == -1) {
 			int err = errno;
@@ -284,6 +334,11 @@ bufferevent_writecb(int fd, short event, void *arg)
 
 	if (evbuffer_get_length(bufev->output) == 0) {
 		event_del(&bufev->ev_write);
+		bufev_p->write_ready = 1;
+	} else {
+		bufev_p->write_ready = 0;
+		if (bufev_p->options & BEV_OPT_FRUGAL)
+			evbuffer_trim_(bufev->output);
 	}
 
 	/*
@@ -297,6 +352,7 @@ bufferevent_writecb(int fd, short event, void *arg)
 	goto done;
 
  reschedule:
+	bufev_p->write_ready = 0;
 	if (evbuffer_get_length(bufev->output) == 0) {
 		event_del(&bufev->ev_write);
 	}
@@ -310,6 +366,211 @@ bufferevent_writecb(int fd, short event, void *arg)
 	bufferevent_decref_and_unlock_(bufev);
 }
 
+/* Called at the end of a loop iteration for BEV_OPT_COALESCE_WRITES.  If the
+ * socket was writable last time, write right away, and only wait for EV_WRITE
+ * if data is left over. */
+static void
+bufferevent_socket_write_flush_cb(struct event_callback *cb, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_private *bufev_p = BEV_UPCAST(bufev);
+
+	BEV_LOCK(bufev);
+	if (!evbuffer_get_length(bufev->output) ||
+	    !(bufev->enabled & EV_WRITE) ||
+	    bufev_p->write_suspended ||
+	    event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		goto done;
+
+	if (bufev_p->write_ready && !bufev_p->connecting)
+		bufferevent_writecb(event_get_fd(&bufev->ev_write), EV_WRITE,
+		    bufev);
+
+	if (evbuffer_get_length(bufev->output) &&
+	    (bufev->enabled & EV_WRITE) &&
+	    !bufev_p->write_suspended &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
+		if (bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write) == -1) {
+		    /* Should we log this? */
+		}
+	}
+
+done:
+	bufferevent_decref_and_unlock_(bufev);
+}
+
+ssize_t
+bufferevent_socket_write_through_(struct bufferevent *bufev,
+    const void *data, size_t size, struct evbuffer *buf)
+{
+	struct bufferevent_private *bufev_p = BEV_UPCAST(bufev);
+	ssize_t atmost, res;
+	int fd;
+
+	if (!BEV_IS_SOCKET(bufev) ||
+	    !(bufev_p->options & BEV_OPT_WRITE_THROUGH) ||
+	    !bufev_p->write_ready ||
+	    bufev_p->connecting ||
+	    bufev_p->write_suspended ||
+	    !(bufev->enabled & EV_WRITE) ||
+	    evbuffer_get_length(bufev->output))
+		return 0;
+
+	fd = event_get_fd(&bufev->ev_write);
+	if (fd < 0)
+		return 0;
+
+	atmost = bufferevent_get_write_max_(bufev_p);
+	if (atmost <= 0)
+		return 0;
+
+	if (buf) {
+		res = evbuffer_write_atmost(buf, fd, atmost);
+	} else {
+		if (size > (size_t)atmost)
+			size = atmost;
+		res = write(fd, data, size);
+	}
+
+	/* Errors, EOF and EAGAIN are all left to the event loop: whatever
+	 * we could not write gets queued, and bufferevent_writecb will see
+	 * and report the condition when it tries again. */
+	if (res <= 0) {
+		bufev_p->write_ready = 0;
+		return 0;
+	}
+
+	bufferevent_decrement_write_buckets_(bufev_p, res);
+	if (buf ? evbuffer_get_length(buf) != 0 : (size_t)res < size)
+		bufev_p->write_ready = 0;
+
+	/* We made progress, so restart the write timeout, as running
+	 * bufferevent_writecb from the persistent write event would. */
+	if (event_pending(&bufev->ev_write, EV_WRITE, NULL))
+		bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write);
+
+	return res;
+}
+
+/* Take a bufferevent from base's pool, if there is one, and clear
+ * everything in it except its evbuffers. */
+static struct bufferevent_private *
+bufferevent_socket_pool_get(struct event_base *base)
+{
+	struct bufferevent_private *bufev_p;
+	struct evbuffer *input, *output;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if ((bufev_p = base->bev_pool) != NULL) {
+		base->bev_pool = bufev_p->pool_next;
+		--base->n_bev_pool;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	if (bufev_p) {
+		input = bufev_p->bev.input;
+		output = bufev_p->bev.output;
+		memset(bufev_p, 0, sizeof(*bufev_p));
+		bufev_p->bev.input = input;
+		bufev_p->bev.output = output;
+	}
+	return bufev_p;
+}
+
+static void
+bufferevent_socket_pool_free(struct bufferevent_private *bufev_p)
+{
+	evbuffer_free(bufev_p->bev.input);
+	evbuffer_free(bufev_p->bev.output);
+	mm_free(bufev_p);
+}
+
+int
+bufferevent_socket_pool_prepare_(struct bufferevent *bev)
+{
+	struct event_base *base = bev->ev_base;
+	int max;
+
+	EVUTIL_ASSERT(BEV_IS_SOCKET(bev));
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	max = base->bev_pool_max;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	if (!max)
+		return -1;
+	if (evbuffer_reset_(bev->input, NULL) < 0 ||
+	    evbuffer_reset_(bev->output, bufferevent_socket_outbuf_cb) < 0)
+		return -1;
+	return 0;
+}
+
+void
+bufferevent_socket_pool_put_(struct bufferevent *bev)
+{
+	struct bufferevent_private *bufev_p = BEV_UPCAST(bev);
+	struct event_base *base = bev->ev_base;
+
+	/* The lock the evbuffers shared with bev is gone. */
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+	bev->input->lock = NULL;
+	bev->output->lock = NULL;
+#endif
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (base->n_bev_pool < base->bev_pool_max) {
+		bufev_p->pool_next = base->bev_pool;
+		base->bev_pool = bufev_p;
+		++base->n_bev_pool;
+		bufev_p = NULL;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	if (bufev_p)
+		bufferevent_socket_pool_free(bufev_p);
+}
+
+int
+bufferevent_socket_set_pool_size(struct event_base *base, int n_max)
+{
+	struct bufferevent_private *victims = NULL, *bufev_p;
+
+	if (n_max < 0)
+		return -1;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	base->bev_pool_max = n_max;
+	while (base->n_bev_pool > n_max) {
+		bufev_p = base->bev_pool;
+		base->bev_pool = bufev_p->pool_next;
+		--base->n_bev_pool;
+		bufev_p->pool_next = victims;
+		victims = bufev_p;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	while ((bufev_p = victims) != NULL) {
+		victims = bufev_p->pool_next;
+		bufferevent_socket_pool_free(bufev_p);
+	}
+	return 0;
+}
+
+void
+bufferevent_socket_pool_clear_(struct event_base *base)
+{
+	bufferevent_socket_set_pool_size(base, 0);
+}
+
+void
+bufferevent_socket_free_scratch_(struct event_base *base)
+{
+	if (base->bev_read_scratch) {
+		mm_free(base->bev_read_scratch);
+		base->bev_read_scratch = NULL;
+	}
+}
+
 struct bufferevent *
 bufferevent_socket_new(struct event_base *base, int fd,
     int options)
@@ -317,7 +578,8 @@ bufferevent_socket_new(struct event_base *base, int fd,
 	struct bufferevent_private *bufev_p;
 	struct bufferevent *bufev;
 
-	if ((bufev_p = mm_calloc(1, sizeof(struct bufferevent_private)))== NULL)
+	if ((bufev_p = bufferevent_socket_pool_get(base)) == NULL &&
+	    (bufev_p = mm_calloc(1, sizeof(struct bufferevent_private)))== NULL)
 		return NULL;
 
 	if (bufferevent_init_common_(bufev_p, base, &bufferevent_ops_socket,
@@ -333,11 +595,19 @@ bufferevent_socket_new(struct event_base *base, int fd,
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
 	    EV_WRITE|EV_PERSIST|EV_FINALIZE, bufferevent_writecb, bufev);
 
-	evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb, bufev);
+	/* A pooled output buffer still has this callback. */
+	if (LIST_EMPTY(&bufev->output->callbacks))
+		evbuffer_add_cb(bufev->output, bufferevent_socket_outbuf_cb,
+		    bufev);
+	if (options & BEV_OPT_COALESCE_WRITES)
+		event_deferred_cb_init_(&bufev_p->write_flush, 0,
+		    bufferevent_socket_write_flush_cb, bufev);
 
 	evbuffer_freeze(bufev->input, 0);
 	evbuffer_freeze(bufev->output, 1);
 
+	bufev_p->write_ready = fd >= 0;
+
 	return bufev;
 }
 
@@ -579,6 +849,7 @@ be_socket_setfd(struct bufferevent *bufev, int fd)
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
 	    EV_WRITE|EV_PERSIST|EV_FINALIZE, bufferevent_writecb, bufev);
 
+	bufev_p->write_ready = fd >= 0;
 	if (fd >= 0)
 		bufferevent_enable(bufev, bufev->enabled);
 
@@ -644,8 +915,16 @@ be_socket_ctrl(struct bufferevent *bev, enum bufferevent_ctrl_op op,
 	case BEV_CTRL_GET_FD:
 		data->fd = event_get_fd(&bev->ev_read);
 		return 0;
-	case BEV_CTRL_GET_UNDERLYING:
 	case BEV_CTRL_CANCEL_ALL:
+		/* A flush queued for the end of the loop holds a reference;
+		 * drop both, or nothing ever releases it if the base goes
+		 * away before the loop runs again. */
+		if ((BEV_UPCAST(bev)->options & BEV_OPT_COALESCE_WRITES) &&
+		    event_callback_cancel_loop_end_(bev->ev_base,
+			&BEV_UPCAST(bev)->write_flush))
+			bufferevent_decref_(bev);
+		return 0;
+	case BEV_CTRL_GET_UNDERLYING:
 	default:
 		return -1;
 	}
@@ -54,9 +54,11 @@ void event_deferred_cb_init_(struct event_callback *, uint8_t, deferred_cb_fn, v
 void event_deferred_cb_set_priority_(struct event_callback *, uint8_t);
 /**
    Cancel a struct event_callback if it is currently scheduled in an event_base.
+
+   @return 1 if the callback was scheduled and will no longer run, 0 otherwise.
  */
 EVENT2_EXPORT_SYMBOL
-void event_deferred_cb_cancel_(struct event_base *, struct event_callback *);
+int event_deferred_cb_cancel_(struct event_base *, struct event_callback *);
 /**
    Activate a struct event_callback if it is not currently scheduled in an event_base.
 
@@ -50,6 +50,13 @@ extern "C" {
  * less space, though. */
 #define MIN_BUFFER_SIZE	1024
 
+/* Capacity of the spare chain an evbuffer allocates the first time it
+ * needs a chain this small, and then keeps and reuses for every short
+ * message instead of allocating a new chain each time. */
+#ifndef EVBUFFER_SPARE_SIZE
+#define EVBUFFER_SPARE_SIZE	256
+#endif
+
 /** A single evbuffer callback for an evbuffer. This function will be invoked
  * when bytes are added to or removed from the evbuffer. */
 struct evbuffer_cb_entry {
@@ -93,6 +100,10 @@ struct evbuffer {
 
 	/** Total amount of bytes stored in all chains.*/
 	size_t total_len;
+	/** How many of those bytes are in chains whose memory the buffer did
+	 * not allocate (file segments, references, multicast), which memory
+	 * accounting leaves out. */
+	size_t foreign_len;
 
 	/** Number of bytes we have added to the buffer since we last tried to
 	 * invoke callbacks. */
@@ -120,9 +131,39 @@ struct evbuffer {
 	 * overflows when we have mutually recursive callbacks, and for
 	 * serializing callbacks in a single thread. */
 	unsigned deferred_cbs : 1;
+	/** True iff this evbuffer is backed by a single mirror-mapped ring
+	 * chain; see evbuffer_enable_ring(). */
+	unsigned ring : 1;
 	/** Zero or more EVBUFFER_FLAG_* bits */
 	uint32_t flags;
 
+	/** A spare chain of EVBUFFER_SPARE_SIZE bytes that is reused for
+	 * short messages, or NULL if none has been needed since the buffer
+	 * was created or last trimmed while empty. */
+	struct evbuffer_chain *spare_chain;
+
+	/** How many times, and how many bytes, we have coalesced small
+	 * chains before a write; see evbuffer_get_stats(). */
+	size_t n_compactions;
+	size_t n_bytes_compacted;
+
+	/** How many bytes evbuffer_read() expects the next read to return,
+	 * learned from the reads so far.  0 if we have not read yet. */
+	size_t read_hint;
+
+	/** The file data beyond the spill threshold goes to, or NULL if this
+	 * buffer does not spill; see evbuffer_set_spill(). */
+	struct evbuffer_spill *spill;
+	/** total_len when we last looked for data to spill. */
+	size_t spill_checked_len;
+
+	/** If set, evbuffer_read() asks this function for memory to read
+	 * into; see evbuffer_set_read_mem(). */
+	evbuffer_read_mem_cb read_mem_cb;
+	/** Gets back the memory read_mem_cb lent us. */
+	evbuffer_ref_cleanup_cb read_mem_cleanup;
+	void *read_mem_arg;
+
 	/** Used to implement deferred callbacks. */
 	struct event_base *cb_queue;
 
@@ -142,6 +183,14 @@ struct evbuffer {
 	/** The parent bufferevent object this evbuffer belongs to.
 	 * NULL if the evbuffer stands alone. */
 	struct bufferevent *parent;
+
+	/** The event_base whose memory accounting covers this buffer, or NULL.
+	 * Set along with parent. */
+	struct event_base *mem_base;
+	/** How much of total_len we have already counted in mem_base. */
+	size_t mem_accounted;
+	/** Links this buffer into mem_base's list of evbuffers. */
+	LIST_ENTRY(evbuffer) mem_next;
 };
 
 typedef off_t ev_misalign_t;
@@ -180,6 +229,11 @@ struct evbuffer_chain {
 #define EVBUFFER_DANGLING	0x0040
 	/** a chain that is a referenced copy of another chain */
 #define EVBUFFER_MULTICAST	0x0080
+	/** a chain whose memory is a ring mapped twice back-to-back */
+#define EVBUFFER_RING		0x0100
+	/** the spare chain of its evbuffer; see evbuffer.spare_chain.
+	 * It is free whenever its refcnt is 0. */
+#define EVBUFFER_SPARE		0x0200
 
 	/** number of references to this chain */
 	int refcnt;
@@ -246,6 +300,20 @@ struct evbuffer_multicast_parent {
 	struct evbuffer_chain *parent;
 };
 
+/** The mapping behind a ring chain.  Lives at the end of an evbuffer_chain
+ * with the EVBUFFER_RING flag set.
+ *
+ * The ring's memory is mapped twice in a row, so the 'capacity' bytes
+ * starting at any offset below 'capacity' are contiguous.  We keep the
+ * chain's misalign below 'capacity', and its buffer_len equal to misalign
+ * plus capacity, so that CHAIN_SPACE_LEN() is the free space in the ring. */
+struct evbuffer_chain_ring {
+	/** Start of the double mapping; 2*capacity bytes long. */
+	void *mapping;
+	/** Size of the ring. */
+	size_t capacity;
+};
+
 #define EVBUFFER_CHAIN_SIZE sizeof(struct evbuffer_chain)
 /** Return a pointer to extra data allocated along with an evbuffer. */
 #define EVBUFFER_CHAIN_EXTRA(t, c) (t *)((struct evbuffer_chain *)(c) + 1)
@@ -288,6 +356,24 @@ void evbuffer_decref_and_unlock_(struct evbuffer *buffer);
  * is contiguous.  Instead, it may be split across two or more chunks. */
 int evbuffer_expand_fast_(struct evbuffer *, size_t, int);
 
+/** If buf holds only a little data in chains with a lot of free space, move
+ * the data into a single chain just big enough for it, and free the rest.
+ * The contents and length of buf do not change, so no callbacks run. */
+void evbuffer_trim_(struct evbuffer *buf);
+
+/** As evbuffer_write_atmost(), but if more is set, and the write stops short
+ * of howmuch at a sendfile chain or for want of iovecs, send it with
+ * MSG_MORE so that the kernel waits for the rest before pushing a short
+ * segment. */
+int evbuffer_write_atmost_(struct evbuffer *buffer, int fd,
+    ssize_t howmuch, int more);
+
+/** Return buf to the state evbuffer_new() left it in, so that it can be
+ * used again: free its data, detach it from its bufferevent, and remove its
+ * callbacks, except for those that call 'keep', which are re-enabled.
+ * Fails, returning -1, if anything else holds a reference to buf. */
+int evbuffer_reset_(struct evbuffer *buf, evbuffer_cb_func keep);
+
 /** Helper: prepares for a readv/WSARecv call by expanding the buffer to
  * hold enough memory to read 'howmuch' bytes in possibly noncontiguous memory.
  * Sets up the one or two iovecs in 'vecs' to point to the free memory and its
@@ -311,6 +397,13 @@ void evbuffer_set_parent_(struct evbuffer *buf, struct bufferevent *bev);
 
 void evbuffer_invoke_callbacks_(struct evbuffer *buf);
 
+struct stat;
+/** As evbuffer_file_segment_cache_get(), but also fills in *st with what
+ * the file looked like when it was opened. */
+struct evbuffer_file_segment *evbuffer_file_segment_cache_get_(
+    const char *path, off_t offset, off_t length, unsigned flags,
+    struct stat *st);
+
 
 int evbuffer_get_callbacks_(struct evbuffer *buffer,
     struct event_callback **cbs,
@@ -240,6 +240,9 @@ struct event_base {
 	/** A list of event_callbacks that should become active the next time
 	 * we process events, but not this time. */
 	struct evcallback_list active_later_queue;
+	/** A list of event_callbacks to run once we are done processing the
+	 * active queues in the current loop iteration. */
+	struct evcallback_list loop_end_queue;
 
 	/* common timeout logic */
 
@@ -314,6 +317,38 @@ struct event_base {
 	/** List of event_onces that have not yet fired. */
 	LIST_HEAD(once_event_list, event_once) once_events;
 
+	/* evbuffer memory accounting; see event_base_set_memory_limits(). */
+	/** Bytes held in the evbuffers on the evbuffers list.  This and
+	 * everything else here is protected by evbuffer_mem_lock, which nests
+	 * inside evbuffer locks and outside th_base_lock. */
+	size_t evbuffer_mem;
+	/** The evbuffers of this base's bufferevents. */
+	LIST_HEAD(evbuffer_list, evbuffer) evbuffers;
+	int n_evbuffers;
+	void *evbuffer_mem_lock;
+	size_t evbuffer_mem_soft;
+	size_t evbuffer_mem_hard;
+	int evbuffer_mem_flags;
+	/** The EVBUFFER_MEM_* level we last reported. */
+	int evbuffer_mem_level;
+	/** Set if we could not lock some bufferevent to resume reading on it,
+	 * and need to try again. */
+	unsigned evbuffer_mem_pending : 1;
+	void (*evbuffer_mem_cb)(struct event_base *, size_t, int, void *);
+	void *evbuffer_mem_cb_arg;
+	/** Runs evbuffer_mem_cb, and suspends or resumes reading, when the
+	 * level changes. */
+	struct event_callback evbuffer_mem_deferred;
+
+	/** Freed socket bufferevents kept for reuse, linked by pool_next; see
+	 * bufferevent_socket_set_pool_size().  Protected by th_base_lock. */
+	struct bufferevent_private *bev_pool;
+	int n_bev_pool;
+	int bev_pool_max;
+
+	/** Where BEV_OPT_FRUGAL socket bufferevents read before copying into
+	 * their input buffers; allocated on first use. */
+	char *bev_read_scratch;
 };
 
 struct event_config_entry {
@@ -411,9 +446,35 @@ int event_callback_activate_later_nolock_(struct event_base *base,
     struct event_callback *evcb);
 int event_callback_cancel_nolock_(struct event_base *base,
     struct event_callback *evcb, int even_if_finalizing);
+
+/** Flag for an event_callback that is in its base's loop_end_queue.  Only
+ * ever set on callbacks with EV_CLOSURE_CB_SELF, never on a struct event. */
+#define EVLIST_LOOP_END_ 0x100
+
+/** Schedule evcb (which must use EV_CLOSURE_CB_SELF) to run once the event
+ * loop has finished processing active callbacks in its current iteration,
+ * before it polls for new events.  A callback scheduled this way must not
+ * be activated by other means until it has run or been cancelled with
+ * event_callback_cancel_().  Returns 1 if evcb was not already scheduled,
+ * 0 otherwise. */
+EVENT2_EXPORT_SYMBOL
+int event_callback_run_at_loop_end_(struct event_base *base,
+    struct event_callback *evcb);
+/** Take evcb off its base's loop_end_queue.  Returns 1 if it was scheduled
+ * there, so that the caller can release whatever it held for the run, and
+ * 0 otherwise. */
+int event_callback_cancel_loop_end_(struct event_base *base,
+    struct event_callback *evcb);
 void event_callback_init_(struct event_base *base,
     struct event_callback *cb);
 
+/** Free every bufferevent in base's pool; defined in bufferevent_sock.c. */
+void bufferevent_socket_pool_clear_(struct event_base *base);
+/** Free the scratch area for frugal reads; defined in bufferevent_sock.c. */
+void bufferevent_socket_free_scratch_(struct event_base *base);
+/** Empty the file segment cache and free its lock; defined in buffer.c. */
+void evbuffer_free_globals_(void);
+
 /* FIXME document. */
 EVENT2_EXPORT_SYMBOL
 void event_base_add_virtual_(struct event_base *base);
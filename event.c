@@ -331,6 +331,8 @@ event_base_new_with_config(const struct event_config *cfg)
 	base->th_notify_fd[1] = -1;
 
 	TAILQ_INIT(&base->active_later_queue);
+	TAILQ_INIT(&base->loop_end_queue);
+	LIST_INIT(&base->evbuffers);
 
 	evmap_io_initmap_(&base->io);
 	evmap_signal_initmap_(&base->sigmap);
@@ -401,6 +403,7 @@ event_base_new_with_config(const struct event_config *cfg)
 	    (!cfg || !(cfg->flags & EVENT_BASE_FLAG_NOLOCK))) {
 		int r;
 		EVTHREAD_ALLOC_LOCK(base->th_base_lock, 0);
+		EVTHREAD_ALLOC_LOCK(base->evbuffer_mem_lock, 0);
 		EVTHREAD_ALLOC_COND(base->current_event_cond);
 		r = evthread_make_base_notifiable(base);
 		if (r<0) {
@@ -472,6 +475,9 @@ static int event_base_free_queues_(struct event_base *base, int run_finalizers)
 		while ((evcb = TAILQ_FIRST(&base->active_later_queue))) {
 			deleted += event_base_cancel_single_callback_(base, evcb, run_finalizers);
 		}
+		while ((evcb = TAILQ_FIRST(&base->loop_end_queue))) {
+			deleted += event_base_cancel_single_callback_(base, evcb, run_finalizers);
+		}
 	}
 
 	return deleted;
@@ -560,6 +566,10 @@ event_base_free_(struct event_base *base, int run_finalizers)
 		mm_free(eonce);
 	}
 
+	/* The finalizers above may have pooled some bufferevents. */
+	bufferevent_socket_pool_clear_(base);
+	bufferevent_socket_free_scratch_(base);
+
 	if (base->evsel != NULL && base->evsel->dealloc != NULL)
 		base->evsel->dealloc(base);
 
@@ -576,6 +586,7 @@ event_base_free_(struct event_base *base, int run_finalizers)
 	event_changelist_freemem_(&base->changelist);
 
 	EVTHREAD_FREE_LOCK(base->th_base_lock, 0);
+	EVTHREAD_FREE_LOCK(base->evbuffer_mem_lock, 0);
 	EVTHREAD_FREE_COND(base->current_event_cond);
 
 	/* If we're freeing current_base, there won't be a current_base. */
@@ -1428,6 +1439,35 @@ done:
 	return c;
 }
 
+/*
+ * Run the callbacks that asked to be called once the active queues have
+ * been processed.  Callbacks scheduled while we are doing this wait for
+ * the next iteration.
+ */
+static void
+event_process_loop_end(struct event_base *base)
+{
+	/* Caller must hold th_base_lock */
+	struct event_callback *evcb;
+	int n = 0;
+
+	TAILQ_FOREACH(evcb, &base->loop_end_queue, evcb_active_next)
+		++n;
+
+	while (n-- > 0 && (evcb = TAILQ_FIRST(&base->loop_end_queue))) {
+		void (*evcb_selfcb)(struct event_callback *, void *) =
+		    evcb->evcb_cb_union.evcb_selfcb;
+
+		EVUTIL_ASSERT(evcb->evcb_closure == EV_CLOSURE_CB_SELF);
+		TAILQ_REMOVE(&base->loop_end_queue, evcb, evcb_active_next);
+		evcb->evcb_flags &= ~EVLIST_LOOP_END_;
+
+		EVBASE_RELEASE_LOCK(base, th_base_lock);
+		evcb_selfcb(evcb, evcb->evcb_arg);
+		EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	}
+}
+
 /*
  * Wait continuously for events.  We exit only if no events are left.
  */
@@ -1594,7 +1634,9 @@ event_base_loop(struct event_base *base, int flags)
 		}
 
 		tv_p = &tv;
-		if (!N_ACTIVE_CALLBACKS(base) && !(flags & EVLOOP_NONBLOCK)) {
+		if (!N_ACTIVE_CALLBACKS(base) &&
+		    TAILQ_EMPTY(&base->loop_end_queue) &&
+		    !(flags & EVLOOP_NONBLOCK)) {
 			timeout_next(base, &tv_p);
 		} else {
 			/*
@@ -1606,7 +1648,8 @@ event_base_loop(struct event_base *base, int flags)
 
 		/* If we have no events, we just exit */
 		if (0==(flags&EVLOOP_NO_EXIT_ON_EMPTY) &&
-		    !event_haveevents(base) && !N_ACTIVE_CALLBACKS(base)) {
+		    !event_haveevents(base) && !N_ACTIVE_CALLBACKS(base) &&
+		    TAILQ_EMPTY(&base->loop_end_queue)) {
 			event_debug(("%s: no events registered.", __func__));
 			retval = 1;
 			goto done;
@@ -1637,6 +1680,8 @@ event_base_loop(struct event_base *base, int flags)
 				done = 1;
 		} else if (flags & EVLOOP_NONBLOCK)
 			done = 1;
+
+		event_process_loop_end(base);
 	}
 	event_debug(("%s: asked to terminate loop.", __func__));
 
@@ -2652,6 +2697,43 @@ event_callback_activate_later_nolock_(struct event_base *base,
 	return 1;
 }
 
+int
+event_callback_run_at_loop_end_(struct event_base *base,
+    struct event_callback *evcb)
+{
+	int r = 0;
+
+	EVUTIL_ASSERT(evcb->evcb_closure == EV_CLOSURE_CB_SELF);
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (!(evcb->evcb_flags &
+		(EVLIST_ACTIVE|EVLIST_ACTIVE_LATER|EVLIST_LOOP_END_))) {
+		evcb->evcb_flags |= EVLIST_LOOP_END_;
+		TAILQ_INSERT_TAIL(&base->loop_end_queue, evcb,
+		    evcb_active_next);
+		if (EVBASE_NEED_NOTIFY(base))
+			evthread_notify_base(base);
+		r = 1;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return r;
+}
+
+int
+event_callback_cancel_loop_end_(struct event_base *base,
+    struct event_callback *evcb)
+{
+	int r = 0;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (evcb->evcb_flags & EVLIST_LOOP_END_) {
+		TAILQ_REMOVE(&base->loop_end_queue, evcb, evcb_active_next);
+		evcb->evcb_flags &= ~EVLIST_LOOP_END_;
+		r = 1;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return r;
+}
+
 void
 event_callback_init_(struct event_base *base,
     struct event_callback *cb)
@@ -2682,6 +2764,12 @@ event_callback_cancel_nolock_(struct event_base *base,
 		return event_del_nolock_(event_callback_to_event(evcb),
 		    even_if_finalizing ? EVENT_DEL_EVEN_IF_FINALIZING : EVENT_DEL_AUTOBLOCK);
 
+	if (evcb->evcb_flags & EVLIST_LOOP_END_) {
+		TAILQ_REMOVE(&base->loop_end_queue, evcb, evcb_active_next);
+		evcb->evcb_flags &= ~EVLIST_LOOP_END_;
+		return 0;
+	}
+
 	switch ((evcb->evcb_flags & (EVLIST_ACTIVE|EVLIST_ACTIVE_LATER))) {
 	default:
 	case EVLIST_ACTIVE|EVLIST_ACTIVE_LATER:
@@ -2717,12 +2805,18 @@ event_deferred_cb_set_priority_(struct event_callback *cb, uint8_t priority)
 	cb->evcb_pri = priority;
 }
 
-void
+int
 event_deferred_cb_cancel_(struct event_base *base, struct event_callback *cb)
 {
+	int r;
 	if (!base)
 		base = current_base;
-	event_callback_cancel_(base, cb);
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	r = (cb->evcb_flags & (EVLIST_ACTIVE|EVLIST_ACTIVE_LATER)) &&
+	    !(cb->evcb_flags & EVLIST_FINALIZING);
+	event_callback_cancel_nolock_(base, cb, 0);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return r;
 }
 
 #define MAX_DEFERREDS_QUEUED 32
@@ -3440,6 +3534,7 @@ event_free_globals(void)
 	event_free_debug_globals();
 	event_free_evsig_globals();
 	event_free_evutil_globals();
+	evbuffer_free_globals_();
 }
 
 void
@@ -3459,6 +3554,8 @@ event_global_setup_locks_(const int enable_locks)
 		return -1;
 	if (evutil_secure_rng_global_setup_locks_(enable_locks) < 0)
 		return -1;
+	if (evbuffer_global_setup_locks_(enable_locks) < 0)
+		return -1;
 	return 0;
 }
 #endif
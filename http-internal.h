@@ -76,6 +76,14 @@ struct evhttp_connection {
 /* Installed when attempt to read HTTP error after write failed, see
  * EVHTTP_CON_READ_ON_WRITE_ERROR */
 #define EVHTTP_CON_READING_ERROR	(EVHTTP_CON_AUTOFREE << 1)
+/* set when no more requests are to be read from an incoming connection */
+#define EVHTTP_CON_READ_STOPPED	(EVHTTP_CON_AUTOFREE << 2)
+/* set while an incoming connection may still open with the HTTP/2 client
+ * connection preface, see EVHTTP_SERVER_H2C */
+#define EVHTTP_CON_H2C_PREFACE	(EVHTTP_CON_AUTOFREE << 3)
+/* set while an incoming connection reads a pipelined request with replies
+ * still owed ahead of it, and so has no read timeout */
+#define EVHTTP_CON_READ_UNTIMED	(EVHTTP_CON_AUTOFREE << 4)
 
 	struct timeval timeout;		/* timeout for events */
 	int retry_cnt;			/* retry count */
@@ -90,6 +98,15 @@ struct evhttp_connection {
 	struct evhttp *http_server;
 
 	TAILQ_HEAD(evcon_requestq, evhttp_request) requests;
+	/* a finished incoming request, kept to serve the next one */
+	struct evhttp_request *spare_req;
+
+	/* how many requests may be sent before their responses arrive, and
+	 * how many at the front of requests have been sent; for incoming
+	 * connections, how many requests may be read before the first of
+	 * them has been answered */
+	int pipeline_max;
+	int n_inflight;
 
 	void (*cb)(struct evhttp_connection *, void *);
 	void *cb_arg;
@@ -99,6 +116,9 @@ struct evhttp_connection {
 
 	struct event_callback read_more_deferred_cb;
 
+	/* set once an incoming connection has switched to HTTP/2 */
+	struct evhttp_h2 *h2;
+
 	struct event_base *base;
 	struct evdns_base *dns_base;
 	int ai_family;
@@ -109,11 +129,18 @@ struct evhttp_cb {
 	TAILQ_ENTRY(evhttp_cb) next;
 
 	char *what;
+	/* set if 'what' is a pattern from evhttp_set_route() rather than a
+	 * literal path */
+	unsigned is_route : 1;
 
 	void (*cb)(struct evhttp_request *req, void *);
 	void *cbarg;
+	/* if set, frees cbarg along with the callback */
+	void (*cbarg_free)(void *);
 };
 
+struct evhttp_route_node;
+
 /* both the http server as well as the rpc system need to queue connections */
 TAILQ_HEAD(evconq, evhttp_connection);
 
@@ -139,6 +166,8 @@ struct evhttp {
 	TAILQ_HEAD(boundq, evhttp_bound_socket) sockets;
 
 	TAILQ_HEAD(httpcbq, evhttp_cb) callbacks;
+	/* the callbacks, indexed by path segment for dispatch */
+	struct evhttp_route_node *routes;
 
 	/* All live connections on this host. */
 	struct evconq connections;
@@ -154,8 +183,15 @@ struct evhttp {
 
 	size_t default_max_headers_size;
 	uint64_t default_max_body_size;
+	int default_pipeline_max;
 	int flags;
 	const char *default_content_type;
+	/* serialised headers added to every response, if any */
+	struct evhttp_static_headers *static_headers;
+
+	/* the Date header value for the second in date_sec */
+	time_t date_sec;
+	char date[32];
 
 	/* Bitmask of all HTTP methods that we accept and pass to user
 	 * callbacks. */
@@ -203,4 +239,40 @@ EVENT2_EXPORT_SYMBOL
 int evhttp_decode_uri_internal(const char *uri, size_t length,
     char *ret, int decode_plus);
 
+/* the header tokenizer's byte-range scanners; ranges always point to
+ * EVHTTP_SCAN_RANGES_MAX bytes, of which ranges_len are used */
+#define EVHTTP_SCAN_RANGES_MAX 16
+#define EVHTTP_SCAN_IMPL_SW	0
+#define EVHTTP_SCAN_IMPL_SSE42	1
+#define EVHTTP_SCAN_IMPL_AVX2	2
+/* scans with one particular scanner, for the tests: stores the offset of
+ * the first byte in ranges (or len) in *off, or returns -1 if this build
+ * or CPU lacks that scanner */
+EVENT2_EXPORT_SYMBOL
+int evhttp_scan_impl_(int impl, const char *p, size_t len,
+    const char *ranges, int ranges_len, size_t *off);
+
+/* shared between the HTTP/1.x and the HTTP/2 server code */
+struct evhttp_request *evhttp_request_new_incoming_(
+    struct evhttp_connection *);
+enum evhttp_cmd_type evhttp_parse_method_(const char *, size_t);
+void evhttp_maybe_add_date_header_(struct evhttp *, struct evkeyvalq *);
+int evhttp_response_needs_body_(struct evhttp_request *);
+const struct evkeyvalq *evhttp_static_headers_(struct evhttp *);
+
+/* HTTP/2 over cleartext TCP, see http2.c */
+
+/* checks whether buf starts with the HTTP/2 client connection preface */
+enum message_read_status evhttp_h2_preface_(struct evbuffer *);
+/* returns 1 if req asks to be upgraded to HTTP/2 */
+int evhttp_h2_wants_upgrade_(struct evhttp_request *);
+/* switches evcon to HTTP/2, answering the upgrade request if any;
+ * returns -1 and leaves evcon alone if that fails */
+int evhttp_h2_start_(struct evhttp_connection *,
+    struct evhttp_request *);
+void evhttp_h2_free_(struct evhttp_connection *);
+/* queues response headers (first call) and body for the stream of req */
+void evhttp_h2_send_(struct evhttp_request *, struct evbuffer *, int,
+    void (*)(struct evhttp_connection *, void *), void *);
+
 #endif /* HTTP_INTERNAL_H_INCLUDED_ */
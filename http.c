@@ -43,6 +43,7 @@
 #include <sys/queue.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -55,6 +56,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #undef timeout_pending
 #undef timeout_initialized
@@ -63,6 +65,7 @@
 #include "event2/http.h"
 #include "event2/event.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent.h"
 #include "event2/http_struct.h"
 #include "event2/http_compat.h"
@@ -73,6 +76,7 @@
 #include "http-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
 
 #define REQ_VERSION_BEFORE(req, major_v, minor_v)			\
 	((req)->major < (major_v) ||					\
@@ -99,6 +103,10 @@ static void evhttp_connection_start_detectclose(
 static void evhttp_connection_stop_detectclose(
 	struct evhttp_connection *evcon);
 static void evhttp_request_dispatch(struct evhttp_connection* evcon);
+static void evhttp_pipeline_next(struct evhttp_connection *evcon);
+static void evhttp_connection_untime_read(struct evhttp_connection *evcon,
+    int untimed);
+static void evhttp_send_done(struct evhttp_connection *evcon, void *arg);
 static void evhttp_read_firstline(struct evhttp_connection *evcon,
 				  struct evhttp_request *req);
 static void evhttp_read_header(struct evhttp_connection *evcon,
@@ -243,8 +251,8 @@ evhttp_method(enum evhttp_cmd_type type)
  * @return 1 if the response MUST have a body; 0 if the response MUST NOT have
  *     a body.
  */
-static int
-evhttp_response_needs_body(struct evhttp_request *req)
+int
+evhttp_response_needs_body_(struct evhttp_request *req)
 {
 	return (req->response_code != HTTP_NOCONTENT &&
 		req->response_code != HTTP_NOTMODIFIED &&
@@ -253,6 +261,21 @@ evhttp_response_needs_body(struct evhttp_request *req)
 		req->type != EVHTTP_REQ_HEAD);
 }
 
+/** Helper: returns true iff evcon is reading a request or response. */
+static int
+evhttp_connection_is_reading(struct evhttp_connection *evcon)
+{
+	switch (evcon->state) {
+	case EVCON_READING_FIRSTLINE:
+	case EVCON_READING_HEADERS:
+	case EVCON_READING_BODY:
+	case EVCON_READING_TRAILER:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
 /** Helper: called after we've added some data to an evcon's bufferevent's
  * output buffer.  Sets the evconn's writing-is-done callback, and puts
  * the bufferevent into writing mode.
@@ -267,11 +290,12 @@ evhttp_write_buffer(struct evhttp_connection *evcon,
 	evcon->cb = cb;
 	evcon->cb_arg = arg;
 
-	/* Disable the read callback: we don't actually care about data;
-	 * we only care about close detection. (We don't disable reading --
-	 * EV_READ, since we *do* want to learn about any close events.) */
+	/* Disable the read callback unless a pipelined request is being
+	 * read: otherwise we don't actually care about data; we only care
+	 * about close detection. (We don't disable reading -- EV_READ,
+	 * since we *do* want to learn about any close events.) */
 	bufferevent_setcb(evcon->bufev,
-	    NULL, /*read*/
+	    evhttp_connection_is_reading(evcon) ? evhttp_read_cb : NULL,
 	    evhttp_write_cb,
 	    evhttp_error_cb,
 	    evcon);
@@ -302,6 +326,80 @@ evhttp_send_continue(struct evhttp_connection *evcon,
 	    evcon);
 }
 
+/* A response to a pipelined request, written before the responses to the
+ * requests ahead of it have been sent. */
+struct evhttp_held_response {
+	struct evbuffer *buf;
+	/* set once the whole response is in buf */
+	unsigned done : 1;
+	/* to run once buf has been written, as for evhttp_write_buffer() */
+	void (*cb)(struct evhttp_connection *, void *);
+	void *cb_arg;
+};
+
+/* Helper: if the response to req has to wait for earlier ones, give it
+ * somewhere to be held.  Returns -1 if memory ran out. */
+static int
+evhttp_response_hold(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	struct evhttp_held_response *held;
+
+	if (req->held != NULL || TAILQ_FIRST(&evcon->requests) == req)
+		return (0);
+
+	if ((held = mm_calloc(1, sizeof(*held))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if ((held->buf = evbuffer_new()) == NULL) {
+		mm_free(held);
+		return (-1);
+	}
+	req->held = held;
+	return (0);
+}
+
+static void
+evhttp_held_response_free(struct evhttp_held_response *held)
+{
+	evbuffer_free(held->buf);
+	mm_free(held);
+}
+
+/* Helper: the buffer to write the response to req into. */
+static struct evbuffer *
+evhttp_response_output(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	if (req->held != NULL)
+		return (req->held->buf);
+	return (bufferevent_get_output(evcon->bufev));
+}
+
+/* req has come to the front of evcon's requests: send what has been held
+ * of its response, and finish it if it is complete. */
+static void
+evhttp_send_held(struct evhttp_connection *evcon, struct evhttp_request *req)
+{
+	struct evhttp_held_response *held = req->held;
+	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
+	void (*cb)(struct evhttp_connection *, void *) = held->cb;
+	void *cb_arg = held->cb_arg;
+	int done = held->done;
+
+	req->held = NULL;
+	evbuffer_add_buffer(output, held->buf);
+	evhttp_held_response_free(held);
+
+	if (!done)
+		evhttp_write_buffer(evcon, cb, cb_arg);
+	else if (evbuffer_get_length(output) == 0)
+		evhttp_send_done(evcon, NULL);
+	else
+		evhttp_write_buffer(evcon, evhttp_send_done, NULL);
+}
+
 /** Helper: returns true iff evconn is in any connected state. */
 static int
 evhttp_connected(struct evhttp_connection *evcon)
@@ -387,16 +485,102 @@ evhttp_is_connection_keepalive(struct evkeyvalq* headers)
 	    && evutil_ascii_strncasecmp(connection, "keep-alive", 10) == 0);
 }
 
-/* Add a correct "Date" header to headers, unless it already has one. */
+/* Add a correct "Date" header to headers, unless it already has one.  The
+ * string is formatted at most once a second, from the loop's cached time. */
+void
+evhttp_maybe_add_date_header_(struct evhttp *http, struct evkeyvalq *headers)
+{
+	struct timeval tv;
+	struct tm tm;
+	time_t now;
+
+	if (evhttp_find_header(headers, "Date") != NULL)
+		return;
+
+	if (event_base_gettimeofday_cached(http->base, &tv) < 0)
+		return;
+	now = tv.tv_sec;
+	if (now != http->date_sec || http->date[0] == '\0') {
+		http->date_sec = now;
+		http->date[0] = '\0';
+		if (gmtime_r(&now, &tm) == NULL)
+			return;
+		evutil_date_rfc1123(http->date, sizeof(http->date), &tm);
+	}
+	evhttp_add_header(headers, "Date", http->date);
+}
+
+/* A server's static headers, serialised once.  Each response holds a
+ * reference while the block sits in its output buffer. */
+struct evhttp_static_headers {
+	int refcnt;
+	unsigned has_content_type:1;
+	/* the same headers, to find those a response overrides */
+	struct evkeyvalq headers;
+	size_t len;
+	char data[1];
+};
+
 static void
-evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+evhttp_static_headers_decref(struct evhttp_static_headers *sh)
 {
-	if (evhttp_find_header(headers, "Date") == NULL) {
-		char date[50];
-		if (sizeof(date) - evutil_date_rfc1123(date, sizeof(date), NULL) > 0) {
-			evhttp_add_header(headers, "Date", date);
-		}
+	if (--sh->refcnt > 0)
+		return;
+	evhttp_clear_headers(&sh->headers);
+	mm_free(sh);
+}
+
+static void
+evhttp_static_headers_cleanup(const void *data, size_t len, void *arg)
+{
+	evhttp_static_headers_decref(arg);
+}
+
+/* Returns the static headers of http, or NULL if it has none. */
+const struct evkeyvalq *
+evhttp_static_headers_(struct evhttp *http)
+{
+	if (http->static_headers == NULL)
+		return (NULL);
+	return (&http->static_headers->headers);
+}
+
+/* Append headers as "Key: Value" lines with one reservation, leaving out
+ * any that are also in skip. */
+static void
+evhttp_write_headers_(struct evbuffer *buf, const struct evkeyvalq *headers,
+    const struct evkeyvalq *skip)
+{
+	const struct evkeyval *header;
+	struct iovec v;
+	size_t len = 0, n;
+	char *p;
+
+	TAILQ_FOREACH(header, headers, next) {
+		if (skip && evhttp_find_header(skip, header->key))
+			continue;
+		len += strlen(header->key) + strlen(header->value) + 4;
+	}
+	if (len == 0 || evbuffer_reserve_space(buf, len, &v, 1) < 1)
+		return;
+
+	p = v.iov_base;
+	TAILQ_FOREACH(header, headers, next) {
+		if (skip && evhttp_find_header(skip, header->key))
+			continue;
+		n = strlen(header->key);
+		memcpy(p, header->key, n);
+		p += n;
+		*p++ = ':';
+		*p++ = ' ';
+		n = strlen(header->value);
+		memcpy(p, header->value, n);
+		p += n;
+		*p++ = '\r';
+		*p++ = '\n';
 	}
+	v.iov_len = len;
+	evbuffer_commit_space(buf, &v, 1);
 }
 
 /* Add a "Content-Length" header with value 'content_length' to headers,
@@ -423,14 +607,15 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
 	int is_keepalive = evhttp_is_connection_keepalive(req->input_headers);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
+	evbuffer_add_printf(evhttp_response_output(evcon, req),
 	    "HTTP/%d.%d %d %s\r\n",
 	    req->major, req->minor, req->response_code,
 	    req->response_code_line);
 
 	if (req->major == 1) {
 		if (req->minor >= 1)
-			evhttp_maybe_add_date_header(req->output_headers);
+			evhttp_maybe_add_date_header_(evcon->http_server,
+			    req->output_headers);
 
 		/*
 		 * if the protocol is 1.0; and the connection was keep-alive
@@ -441,7 +626,7 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 			    "Connection", "keep-alive");
 
 		if ((req->minor >= 1 || is_keepalive) &&
-		    evhttp_response_needs_body(req)) {
+		    evhttp_response_needs_body_(req)) {
 			/*
 			 * we need to add the content length if the
 			 * user did not give it, this is required for
@@ -454,9 +639,12 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 	}
 
 	/* Potentially add headers for unidentified content. */
-	if (evhttp_response_needs_body(req)) {
+	if (evhttp_response_needs_body_(req)) {
+		struct evhttp_static_headers *sh =
+		    evcon->http_server->static_headers;
 		if (evhttp_find_header(req->output_headers,
 			"Content-Type") == NULL
+		    && !(sh && sh->has_content_type)
 		    && evcon->http_server->default_content_type) {
 			evhttp_add_header(req->output_headers,
 			    "Content-Type",
@@ -497,7 +685,8 @@ static void
 evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
 	struct evkeyval *header;
-	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
+	struct evbuffer *output = evhttp_response_output(evcon, req);
+	struct evhttp_static_headers *sh = NULL;
 
 	/*
 	 * Depending if this is a HTTP request or response, we might need to
@@ -507,11 +696,28 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 		evhttp_make_header_request(evcon, req);
 	} else {
 		evhttp_make_header_response(evcon, req);
+		if (evcon->http_server != NULL)
+			sh = evcon->http_server->static_headers;
 	}
 
-	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(output, "%s: %s\r\n",
-		    header->key, header->value);
+	evhttp_write_headers_(output, req->output_headers, NULL);
+	if (sh != NULL) {
+		/* Send the prebuilt block unless the response overrides
+		 * some of it; then send only what it doesn't override. */
+		TAILQ_FOREACH(header, &sh->headers, next) {
+			if (evhttp_find_header(req->output_headers,
+				header->key))
+				break;
+		}
+		if (header == NULL) {
+			++sh->refcnt;
+			if (evbuffer_add_reference(output, sh->data, sh->len,
+				evhttp_static_headers_cleanup, sh) < 0)
+				--sh->refcnt;
+		} else {
+			evhttp_write_headers_(output, &sh->headers,
+			    req->output_headers);
+		}
 	}
 	evbuffer_add(output, "\r\n", 2);
 
@@ -519,9 +725,13 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 		evbuffer_get_length(req->output_buffer)) {
 		/*
 		 * For a request, we add the POST data, for a reply, this
-		 * is the regular data.
+		 * is the regular data.  A pipelined request keeps its body
+		 * in case it has to be sent again.
 		 */
-		evbuffer_add_buffer(output, req->output_buffer);
+		if (req->kind != EVHTTP_REQUEST || evcon->pipeline_max < 2 ||
+		    evbuffer_add_buffer_reference(output,
+			req->output_buffer) < 0)
+			evbuffer_add_buffer(output, req->output_buffer);
 	}
 }
 
@@ -544,6 +754,43 @@ evhttp_connection_set_max_body_size(struct evhttp_connection* evcon,
 		evcon->max_body_size = new_max_body_size;
 }
 
+/* Helper: remove from evcon the requests the user is still working on, so
+ * that they are not freed with it; their replies are then discarded. */
+static void
+evhttp_connection_detach_pending(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req, *next;
+
+	for (req = TAILQ_FIRST(&evcon->requests); req; req = next) {
+		next = TAILQ_NEXT(req, next);
+		if (!req->userdone) {
+			TAILQ_REMOVE(&evcon->requests, req, next);
+			/* indicate that this request no longer has a
+			 * connection object
+			 */
+			req->evcon = NULL;
+		}
+	}
+}
+
+/* Helper: drop the incoming connection evcon, sparing the requests the
+ * user is still working on. */
+static void
+evhttp_connection_drop(struct evhttp_connection *evcon)
+{
+	evhttp_connection_detach_pending(evcon);
+	evhttp_connection_free(evcon);
+}
+
+/* Helper: read no more requests from the incoming connection evcon; the
+ * response to the last one read is left to close it. */
+static void
+evhttp_connection_stop_reading(struct evhttp_connection *evcon)
+{
+	evcon->flags |= EVHTTP_CON_READ_STOPPED;
+	evcon->state = EVCON_WRITING;
+}
+
 static int
 evhttp_connection_incoming_fail(struct evhttp_request *req,
     enum evhttp_request_error error)
@@ -567,14 +814,7 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 		 * the request is still being used for sending, we
 		 * need to disassociated it from the connection here.
 		 */
-		if (!req->userdone) {
-			/* remove it so that it will not be freed */
-			TAILQ_REMOVE(&req->evcon->requests, req, next);
-			/* indicate that this request no longer has a
-			 * connection object
-			 */
-			req->evcon = NULL;
-		}
+		evhttp_connection_detach_pending(req->evcon);
 		return (-1);
 	case EVREQ_HTTP_INVALID_HEADER:
 	case EVREQ_HTTP_BUFFER_ERROR:
@@ -617,6 +857,18 @@ evhttp_request_free_(struct evhttp_connection *evcon, struct evhttp_request *req
 	evhttp_request_free_auto(req);
 }
 
+/* Helper: the request whose input is being read.  Responses arrive in the
+ * order the requests were sent, so on an outgoing connection it is the
+ * first; on an incoming connection, requests read ahead are queued behind
+ * those waiting for replies, so it is the last. */
+static struct evhttp_request *
+evhttp_connection_reading_request(struct evhttp_connection *evcon)
+{
+	if (evcon->flags & EVHTTP_CON_INCOMING)
+		return (TAILQ_LAST(&evcon->requests, evcon_requestq));
+	return (TAILQ_FIRST(&evcon->requests));
+}
+
 /* Called when evcon has experienced a (non-recoverable? -NM) error, as
  * given in error. If it's an outgoing connection, reset the connection,
  * retry any pending requests, and inform the user.  If it's incoming,
@@ -626,14 +878,19 @@ evhttp_connection_fail_(struct evhttp_connection *evcon,
     enum evhttp_request_error error)
 {
 	const int errsave = errno;
-	struct evhttp_request* req = TAILQ_FIRST(&evcon->requests);
+	struct evhttp_request* req = evhttp_connection_reading_request(evcon);
 	void (*cb)(struct evhttp_request *, void *);
 	void *cb_arg;
 	void (*error_cb)(enum evhttp_request_error, void *);
 	void *error_cb_arg;
 	EVUTIL_ASSERT(req != NULL);
 
-	bufferevent_disable(evcon->bufev, EV_READ|EV_WRITE);
+	/* responses to earlier pipelined requests may still be going out */
+	if ((evcon->flags & EVHTTP_CON_INCOMING) &&
+	    evbuffer_get_length(bufferevent_get_output(evcon->bufev)))
+		bufferevent_disable(evcon->bufev, EV_READ);
+	else
+		bufferevent_disable(evcon->bufev, EV_READ|EV_WRITE);
 
 	if (evcon->flags & EVHTTP_CON_INCOMING) {
 		/*
@@ -644,6 +901,7 @@ evhttp_connection_fail_(struct evhttp_connection *evcon,
 		 * For HTTP problems, we might have to send back a
 		 * reply before the connection can be freed.
 		 */
+		evhttp_connection_stop_reading(evcon);
 		if (evhttp_connection_incoming_fail(req, error) == -1)
 			evhttp_connection_free(evcon);
 		return;
@@ -704,6 +962,41 @@ evhttp_write_cb(struct bufferevent *bufev, void *arg)
 		(*evcon->cb)(evcon, evcon->cb_arg);
 }
 
+/* Helper: start reading another pipelined request from the incoming
+ * connection evcon, if it may have one more outstanding. */
+static void
+evhttp_pipeline_read_next(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req;
+	int n = 0;
+
+	if (evcon->pipeline_max < 2 ||
+	    (evcon->flags & EVHTTP_CON_READ_STOPPED) ||
+	    evhttp_connection_is_reading(evcon))
+		return;
+
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		++n;
+	}
+	if (n >= evcon->pipeline_max)
+		return;
+
+	/* nothing is read behind a request that ends the connection or
+	 * turns it into a tunnel */
+	req = TAILQ_LAST(&evcon->requests, evcon_requestq);
+	if (req != NULL && (req->type == EVHTTP_REQ_CONNECT ||
+		(REQ_VERSION_BEFORE(req, 1, 1) &&
+		    !evhttp_is_connection_keepalive(req->input_headers)) ||
+		evhttp_is_request_connection_close(req))) {
+		evcon->flags |= EVHTTP_CON_READ_STOPPED;
+		return;
+	}
+
+	/* if this fails, it is tried again once the next reply is out */
+	evhttp_connection_untime_read(evcon, 1);
+	evhttp_associate_new_request_with_connection(evcon);
+}
+
 /**
  * Advance the connection state.
  * - If this is an outgoing connection, we've just processed the response;
@@ -714,7 +1007,7 @@ evhttp_write_cb(struct bufferevent *bufev, void *arg)
 static void
 evhttp_connection_done(struct evhttp_connection *evcon)
 {
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	struct evhttp_request *req = evhttp_connection_reading_request(evcon);
 	int con_outgoing = evcon->flags & EVHTTP_CON_OUTGOING;
 	int free_evcon = 0;
 
@@ -723,6 +1016,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		int need_close = evhttp_is_request_connection_close(req);
 		TAILQ_REMOVE(&evcon->requests, req, next);
 		req->evcon = NULL;
+		if (evcon->n_inflight > 0)
+			--evcon->n_inflight;
 
 		evcon->state = EVCON_IDLE;
 
@@ -737,6 +1032,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 			 */
 			if (!evhttp_connected(evcon))
 				evhttp_connection_connect_(evcon);
+			else if (evcon->n_inflight > 0)
+				evhttp_pipeline_next(evcon);
 			else
 				evhttp_request_dispatch(evcon);
 		} else if (!need_close) {
@@ -758,6 +1055,13 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		 * connection so that we can reply to it.
 		 */
 		evcon->state = EVCON_WRITING;
+		if ((evcon->http_server->flags & EVHTTP_SERVER_H2C) &&
+		    TAILQ_FIRST(&evcon->requests) == req &&
+		    TAILQ_NEXT(req, next) == NULL &&
+		    evhttp_h2_wants_upgrade_(req) &&
+		    evhttp_h2_start_(evcon, req) == 0)
+			return;
+		evhttp_pipeline_read_next(evcon);
 	}
 
 	/* notify the user of the request */
@@ -1023,7 +1327,7 @@ static void
 evhttp_read_cb(struct bufferevent *bufev, void *arg)
 {
 	struct evhttp_connection *evcon = arg;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	struct evhttp_request *req = evhttp_connection_reading_request(evcon);
 
 	/* Cancel if it's pending. */
 	event_deferred_cb_cancel_(get_deferred_queue(evcon),
@@ -1114,6 +1418,10 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 	while ((req = TAILQ_FIRST(&evcon->requests)) != NULL) {
 		evhttp_request_free_(evcon, req);
 	}
+	if (evcon->h2 != NULL)
+		evhttp_h2_free_(evcon);
+	if (evcon->spare_req != NULL)
+		evhttp_request_free(evcon->spare_req);
 
 	if (evcon->http_server != NULL) {
 		struct evhttp *http = evcon->http_server;
@@ -1176,6 +1484,55 @@ evhttp_connection_set_local_port(struct evhttp_connection *evcon,
 	evcon->bind_port = port;
 }
 
+/* Only requests that can safely be repeated are sent ahead of earlier
+ * responses (RFC 7230, 6.3.2), so that those left unanswered when the
+ * connection fails can be sent again. */
+static int
+evhttp_request_is_pipelinable(struct evhttp_request *req)
+{
+	switch (req->type) {
+	case EVHTTP_REQ_GET:
+	case EVHTTP_REQ_HEAD:
+	case EVHTTP_REQ_PUT:
+	case EVHTTP_REQ_DELETE:
+	case EVHTTP_REQ_OPTIONS:
+	case EVHTTP_REQ_TRACE:
+		break;
+	default:
+		return (0);
+	}
+	return (evhttp_find_header(req->output_headers, "Expect") == NULL);
+}
+
+/* Send queued requests behind those in flight, up to the pipeline depth. */
+static void
+evhttp_pipeline_fill(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req;
+	int i = 0, sent = 0;
+
+	if (evcon->pipeline_max < 2 || evcon->n_inflight < 1)
+		return;
+
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		if (!evhttp_request_is_pipelinable(req))
+			break;
+		if (i++ < evcon->n_inflight)
+			continue;
+		if (evcon->n_inflight >= evcon->pipeline_max)
+			break;
+		evhttp_make_header(evcon, req);
+		++evcon->n_inflight;
+		sent = 1;
+	}
+
+	if (sent && evcon->state != EVCON_WRITING) {
+		/* We are reading already; nothing to do once it's out. */
+		evcon->cb = NULL;
+		bufferevent_enable(evcon->bufev, EV_WRITE);
+	}
+}
+
 static void
 evhttp_request_dispatch(struct evhttp_connection* evcon)
 {
@@ -1197,10 +1554,49 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 
 	/* Create the header from the store arguments */
 	evhttp_make_header(evcon, req);
+	evcon->n_inflight = 1;
+	evhttp_pipeline_fill(evcon);
 
 	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
 }
 
+/* Stands in for a request that was canceled after being sent, to take its
+ * response. */
+static void
+evhttp_pipeline_discard_cb(struct evhttp_request *req, void *arg)
+{
+}
+
+/* The response to the request now at the front was sent for ahead of
+ * time; start reading it, and send more behind it. */
+static void
+evhttp_pipeline_next(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+
+	req->kind = EVHTTP_RESPONSE;
+	evhttp_start_read_(evcon);
+
+	evcon->cb = NULL;
+	evhttp_pipeline_fill(evcon);
+	if (evbuffer_get_length(bufferevent_get_output(evcon->bufev)))
+		bufferevent_enable(evcon->bufev, EV_WRITE);
+}
+
+/* Forget the requests standing in for canceled ones; they were only
+ * waiting for responses that will not come now. */
+static void
+evhttp_pipeline_drop_discarded(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req, *next;
+
+	for (req = TAILQ_FIRST(&evcon->requests); req; req = next) {
+		next = TAILQ_NEXT(req, next);
+		if (req->cb == evhttp_pipeline_discard_cb)
+			evhttp_request_free_(evcon, req);
+	}
+}
+
 /* Reset our connection state: disables reading/writing, closes our fd (if
 * any), clears out buffers, and puts us in state DISCONNECTED. */
 void
@@ -1249,6 +1645,10 @@ evhttp_connection_reset_(struct evhttp_connection *evcon)
 
 	evcon->flags &= ~EVHTTP_CON_READING_ERROR;
 
+	/* requests sent ahead will go again on the next connection */
+	evcon->n_inflight = 0;
+	evhttp_pipeline_drop_discarded(evcon);
+
 	evcon->state = EVCON_DISCONNECTED;
 }
 
@@ -1356,7 +1756,7 @@ static void
 evhttp_error_cb(struct bufferevent *bufev, short what, void *arg)
 {
 	struct evhttp_connection *evcon = arg;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	struct evhttp_request *req = evhttp_connection_reading_request(evcon);
 
 	if (evcon->fd == -1)
 		evcon->fd = bufferevent_getfd(bufev);
@@ -1587,43 +1987,13 @@ evhttp_parse_response_line(struct evhttp_request *req, char *line)
 	return (0);
 }
 
-/* Parse the first line of a HTTP request */
-
-static int
-evhttp_parse_request_line(struct evhttp_request *req, char *line, size_t len)
+/* Returns the type of the method named by the method_len bytes at method,
+ * or EVHTTP_REQ_UNKNOWN_. */
+enum evhttp_cmd_type
+evhttp_parse_method_(const char *method, size_t method_len)
 {
-	char *eos = line + len;
-	char *method;
-	char *uri;
-	char *version;
-	const char *hostname;
-	const char *scheme;
-	size_t method_len;
-	enum evhttp_cmd_type type;
-
-	while (eos > line && *(eos-1) == ' ') {
-		*(eos-1) = '\0';
-		--eos;
-		--len;
-	}
-	if (len < strlen("GET / HTTP/1.0"))
-		return -1;
-
-	/* Parse the request line */
-	method = strsep(&line, " ");
-	if (!line)
-		return -1;
-	uri = line;
-	version = strrchr(uri, ' ');
-	if (!version || uri == version)
-		return -1;
-	*version = '\0';
-	version++;
-
-	method_len = (uri - method) - 1;
-	type       = EVHTTP_REQ_UNKNOWN_;
+	enum evhttp_cmd_type type = EVHTTP_REQ_UNKNOWN_;
 
-	/* First line */
 	switch (method_len) {
 	    case 3:
 		/* The length of the method string is 3, meaning it can only be one of two methods: GET or PUT */
@@ -1728,25 +2098,64 @@ evhttp_parse_request_line(struct evhttp_request *req, char *line, size_t len)
 		break;
 	} /* switch */
 
-	if ((int)type == EVHTTP_REQ_UNKNOWN_) {
-	        event_debug(("%s: bad method %s on request %p from %s",
-			__func__, method, req, req->remote_host));
-                /* No error yet; we'll give a better error later when
-                 * we see that req->type is unsupported. */
-	}
-	    
-	req->type = type;
+	return (type);
+}
 
-	if (evhttp_parse_http_version(version, req) < 0)
-		return -1;
+/* Parse the first line of a HTTP request */
 
-	if ((req->uri = mm_strdup(uri)) == NULL) {
-		event_debug(("%s: mm_strdup", __func__));
-		return -1;
-	}
+static int
+evhttp_parse_request_line(struct evhttp_request *req, char *line, size_t len)
+{
+	char *eos = line + len;
+	char *method;
+	char *uri;
+	char *version;
+	const char *hostname;
+	const char *scheme;
+	size_t method_len;
+	enum evhttp_cmd_type type;
 
-	if (type == EVHTTP_REQ_CONNECT) {
-		if ((req->uri_elems = evhttp_uri_parse_authority(req->uri)) == NULL) {
+	while (eos > line && *(eos-1) == ' ') {
+		*(eos-1) = '\0';
+		--eos;
+		--len;
+	}
+	if (len < strlen("GET / HTTP/1.0"))
+		return -1;
+
+	/* Parse the request line */
+	method = strsep(&line, " ");
+	if (!line)
+		return -1;
+	uri = line;
+	version = strrchr(uri, ' ');
+	if (!version || uri == version)
+		return -1;
+	*version = '\0';
+	version++;
+
+	method_len = (uri - method) - 1;
+	type = evhttp_parse_method_(method, method_len);
+
+	if ((int)type == EVHTTP_REQ_UNKNOWN_) {
+	        event_debug(("%s: bad method %s on request %p from %s",
+			__func__, method, req, req->remote_host));
+                /* No error yet; we'll give a better error later when
+                 * we see that req->type is unsupported. */
+	}
+	    
+	req->type = type;
+
+	if (evhttp_parse_http_version(version, req) < 0)
+		return -1;
+
+	if ((req->uri = mm_strdup(uri)) == NULL) {
+		event_debug(("%s: mm_strdup", __func__));
+		return -1;
+	}
+
+	if (type == EVHTTP_REQ_CONNECT) {
+		if ((req->uri_elems = evhttp_uri_parse_authority(req->uri)) == NULL) {
 			return -1;
 		}
 	} else {
@@ -1770,19 +2179,193 @@ evhttp_parse_request_line(struct evhttp_request *req, char *line, size_t len)
 	return 0;
 }
 
-const char *
-evhttp_find_header(const struct evkeyvalq *headers, const char *key)
+/*
+ * Header nodes made here are one block: the evkeyval, a tag byte, then the
+ * key and the value, both NUL-terminated.  The tag says whether the block
+ * came from a request's arena, and which common header the key is, if any,
+ * so that lookups of common headers compare one byte rather than strings.
+ * Nodes made by the user are still freed field by field.
+ */
+#define EVHTTP_HDR_ARENA	0x80
+#define EVHTTP_HDR_ID_MASK	0x7f
+
+/* Header names we intern; their index is their id.  0 is "none". */
+static const struct {
+	const char *name;
+	size_t len;
+} evhttp_common_headers[] = {
+#define H(s) { s, sizeof(s) - 1 }
+	{ NULL, 0 },
+	H("Host"), H("Date"), H("Connection"), H("Content-Length"),
+	H("Content-Type"), H("Transfer-Encoding"), H("Proxy-Connection"),
+	H("Expect"), H("Accept"), H("Accept-Encoding"), H("Accept-Language"),
+	H("User-Agent"), H("Cookie"), H("Set-Cookie"), H("Cache-Control"),
+	H("Keep-Alive"), H("Server"), H("Location"), H("Upgrade"),
+	H("Content-Encoding"), H("Last-Modified"), H("ETag"), H("Range"),
+	H("If-None-Match"), H("If-Modified-Since"), H("Authorization"),
+	H("Referer"), H("Origin"),
+#undef H
+};
+
+/* Arena blocks are at least this big. */
+#define EVHTTP_ARENA_BLOCK	2048
+
+struct evhttp_header_arena {
+	struct evhttp_header_arena *next;
+	size_t used;
+	size_t size;
+	/* Keep mem aligned for an evkeyval. */
+	union {
+		void *p;
+		char mem[1];
+	} u;
+};
+
+static int
+evhttp_header_id(const char *key, size_t len)
+{
+	int i;
+
+	for (i = 1; i < (int)(sizeof(evhttp_common_headers) /
+	    sizeof(evhttp_common_headers[0])); ++i) {
+		if (evhttp_common_headers[i].len == len &&
+		    !evutil_ascii_strncasecmp(evhttp_common_headers[i].name, key, len))
+			return i;
+	}
+	return 0;
+}
+
+/* Return the tag byte of a node made by evhttp_header_new(), or NULL if
+ * the node was made some other way.  This relies on the user leaving the
+ * key of our nodes alone, as <event2/http.h> asks. */
+static unsigned char *
+evhttp_header_tag(const struct evkeyval *header)
+{
+	unsigned char *tag = (unsigned char *)(header + 1);
+	if (header->key != (char *)tag + 1)
+		return NULL;
+	return tag;
+}
+
+/* True iff header's value still lives in the node's own block. */
+static int
+evhttp_header_value_is_inline(const struct evkeyval *header)
+{
+	return evhttp_header_tag(header) &&
+	    header->value == header->key + strlen(header->key) + 1;
+}
+
+static void *
+evhttp_arena_alloc(struct evhttp_header_arena **arenap, size_t size)
+{
+	struct evhttp_header_arena *arena = *arenap;
+	void *p;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (arena == NULL || arena->size - arena->used < size) {
+		size_t block = size > EVHTTP_ARENA_BLOCK ?
+		    size : EVHTTP_ARENA_BLOCK;
+		arena = mm_malloc(offsetof(struct evhttp_header_arena, u) +
+		    block);
+		if (arena == NULL)
+			return NULL;
+		arena->next = *arenap;
+		arena->used = 0;
+		arena->size = block;
+		*arenap = arena;
+	}
+	p = arena->u.mem + arena->used;
+	arena->used += size;
+	return p;
+}
+
+static void
+evhttp_arena_free(struct evhttp_header_arena *arena)
+{
+	struct evhttp_header_arena *next;
+
+	for (; arena; arena = next) {
+		next = arena->next;
+		mm_free(arena);
+	}
+}
+
+/* Make a header node in one block, from *arenap if it is not NULL. */
+static struct evkeyval *
+evhttp_header_new(struct evhttp_header_arena **arenap,
+    const char *key, size_t keylen, const char *value, size_t valuelen)
 {
+	size_t size = sizeof(struct evkeyval) + 1 + keylen + 1 + valuelen + 1;
 	struct evkeyval *header;
+	unsigned char *p;
+
+	if (arenap)
+		header = evhttp_arena_alloc(arenap, size);
+	else
+		header = mm_malloc(size);
+	if (header == NULL)
+		return NULL;
+
+	p = (unsigned char *)(header + 1);
+	*p = evhttp_header_id(key, keylen) | (arenap ? EVHTTP_HDR_ARENA : 0);
+	header->key = (char *)++p;
+	memcpy(p, key, keylen);
+	p[keylen] = '\0';
+	header->value = (char *)(p += keylen + 1);
+	memcpy(p, value, valuelen);
+	p[valuelen] = '\0';
+	return header;
+}
+
+static void
+evhttp_header_free(struct evkeyval *header)
+{
+	unsigned char *tag = evhttp_header_tag(header);
+
+	if (tag == NULL) {
+		mm_free(header->key);
+		mm_free(header->value);
+		mm_free(header);
+		return;
+	}
+	if (!evhttp_header_value_is_inline(header))
+		mm_free(header->value);
+	if (!(*tag & EVHTTP_HDR_ARENA))
+		mm_free(header);
+}
+
+/* Find the first header called key in headers. */
+static struct evkeyval *
+evhttp_header_find(const struct evkeyvalq *headers, const char *key)
+{
+	struct evkeyval *header;
+	unsigned char *tag;
+	int id = evhttp_header_id(key, strlen(key));
 
 	TAILQ_FOREACH(header, headers, next) {
+		if ((tag = evhttp_header_tag(header)) != NULL) {
+			/* Interned names match only by id, and others
+			 * never match an interned name. */
+			if ((*tag & EVHTTP_HDR_ID_MASK) != id)
+				continue;
+			if (id)
+				return header;
+		}
 		if (evutil_ascii_strcasecmp(header->key, key) == 0)
-			return (header->value);
+			return header;
 	}
 
 	return (NULL);
 }
 
+const char *
+evhttp_find_header(const struct evkeyvalq *headers, const char *key)
+{
+	struct evkeyval *header = evhttp_header_find(headers, key);
+
+	return header ? header->value : NULL;
+}
+
 void
 evhttp_clear_headers(struct evkeyvalq *headers)
 {
@@ -1792,9 +2375,7 @@ evhttp_clear_headers(struct evkeyvalq *headers)
 	    header != NULL;
 	    header = TAILQ_FIRST(headers)) {
 		TAILQ_REMOVE(headers, header, next);
-		mm_free(header->key);
-		mm_free(header->value);
-		mm_free(header);
+		evhttp_header_free(header);
 	}
 }
 
@@ -1808,38 +2389,172 @@ evhttp_remove_header(struct evkeyvalq *headers, const char *key)
 {
 	struct evkeyval *header;
 
-	TAILQ_FOREACH(header, headers, next) {
-		if (evutil_ascii_strcasecmp(header->key, key) == 0)
-			break;
-	}
-
-	if (header == NULL)
+	if ((header = evhttp_header_find(headers, key)) == NULL)
 		return (-1);
 
 	/* Free and remove the header that we found */
 	TAILQ_REMOVE(headers, header, next);
-	mm_free(header->key);
-	mm_free(header->value);
-	mm_free(header);
+	evhttp_header_free(header);
 
 	return (0);
 }
 
+/*
+ * Header tokenizing comes down to finding the first byte that belongs to
+ * a small set -- ':' and the characters a field may not contain.  The sets
+ * are given as up to eight inclusive [lo, hi] byte ranges, in the layout
+ * pcmpestri takes, so it can be scanned for 16 or 32 bytes at a time.
+ */
+
+/* ends a header name: ':' or a control byte the name may not contain */
+static const char evhttp_scan_key[EVHTTP_SCAN_RANGES_MAX] =
+	"\0\x1f\x7f\x7f::";
+#define EVHTTP_SCAN_KEY_LEN 6
+/* interrupts a header value: NUL truncates it, CR or LF must fold */
+static const char evhttp_scan_value[EVHTTP_SCAN_RANGES_MAX] =
+	"\0\0\n\n\r\r";
+#define EVHTTP_SCAN_VALUE_LEN 6
+static const char evhttp_scan_crlf[EVHTTP_SCAN_RANGES_MAX] =
+	"\n\n\r\r";
+#define EVHTTP_SCAN_CRLF_LEN 4
+
+static size_t
+evhttp_scan_sw(const char *p, size_t len, const char *ranges, int ranges_len)
+{
+	size_t i;
+	int r;
+
+	for (i = 0; i < len; ++i) {
+		unsigned char c = p[i];
+		for (r = 0; r < ranges_len; r += 2) {
+			if (c >= (unsigned char)ranges[r] &&
+			    c <= (unsigned char)ranges[r + 1])
+				return i;
+		}
+	}
+	return len;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define EVHTTP_SCAN_SIMD
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static size_t
+evhttp_scan_sse42(const char *p, size_t len, const char *ranges, int ranges_len)
+{
+	__m128i set = _mm_loadu_si128((const __m128i *)ranges);
+	size_t i;
+	int idx;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + i));
+		idx = _mm_cmpestri(set, ranges_len, b, 16,
+		    _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+		if (idx != 16)
+			return i + idx;
+	}
+	return i + evhttp_scan_sw(p + i, len - i, ranges, ranges_len);
+}
+
+/* AVX2 has no range compare: c is in [lo, hi] iff (c - lo) <= (hi - lo)
+ * unsigned, which min_epu8 tests. */
+__attribute__((target("avx2")))
+static size_t
+evhttp_scan_avx2(const char *p, size_t len, const char *ranges, int ranges_len)
+{
+	__m256i lo[EVHTTP_SCAN_RANGES_MAX / 2], span[EVHTTP_SCAN_RANGES_MAX / 2];
+	int r, n = ranges_len / 2;
+	size_t i;
+
+	for (r = 0; r < n; ++r) {
+		lo[r] = _mm256_set1_epi8(ranges[2 * r]);
+		span[r] = _mm256_set1_epi8(
+		    (char)(ranges[2 * r + 1] - ranges[2 * r]));
+	}
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i hit = _mm256_setzero_si256();
+		unsigned mask;
+
+		for (r = 0; r < n; ++r) {
+			__m256i t = _mm256_sub_epi8(b, lo[r]);
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(
+				_mm256_min_epu8(t, span[r]), t));
+		}
+		mask = (unsigned)_mm256_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + evhttp_scan_sw(p + i, len - i, ranges, ranges_len);
+}
+#endif
+
+/* Returns the offset of the first byte of p[0..len) in ranges, or len. */
+static size_t
+evhttp_scan(const char *p, size_t len, const char *ranges, int ranges_len)
+{
+#ifdef EVHTTP_SCAN_SIMD
+	if (len >= 32 && __builtin_cpu_supports("avx2"))
+		return evhttp_scan_avx2(p, len, ranges, ranges_len);
+	if (len >= 16 && __builtin_cpu_supports("sse4.2"))
+		return evhttp_scan_sse42(p, len, ranges, ranges_len);
+#endif
+	return evhttp_scan_sw(p, len, ranges, ranges_len);
+}
+
+int
+evhttp_scan_impl_(int impl, const char *p, size_t len,
+    const char *ranges, int ranges_len, size_t *off)
+{
+	switch (impl) {
+	case EVHTTP_SCAN_IMPL_SW:
+		*off = evhttp_scan_sw(p, len, ranges, ranges_len);
+		return (0);
+#ifdef EVHTTP_SCAN_SIMD
+	case EVHTTP_SCAN_IMPL_SSE42:
+		if (!__builtin_cpu_supports("sse4.2"))
+			break;
+		*off = evhttp_scan_sse42(p, len, ranges, ranges_len);
+		return (0);
+	case EVHTTP_SCAN_IMPL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			break;
+		*off = evhttp_scan_avx2(p, len, ranges, ranges_len);
+		return (0);
+#endif
+	default:
+		break;
+	}
+	return (-1);
+}
+
 static int
-evhttp_header_is_valid_value(const char *value)
+evhttp_header_value_is_valid_(const char *value, size_t len)
 {
-	const char *p = value;
+	const char *p = value, *end = value + len;
 
-	while ((p = strpbrk(p, "\r\n")) != NULL) {
+	while (p < end) {
+		p += evhttp_scan(p, end - p,
+		    evhttp_scan_crlf, EVHTTP_SCAN_CRLF_LEN);
+		if (p == end)
+			break;
 		/* we really expect only one new line */
-		p += strspn(p, "\r\n");
+		while (p < end && (*p == '\r' || *p == '\n'))
+			++p;
 		/* we expect a space or tab for continuation */
-		if (*p != ' ' && *p != '\t')
+		if (p == end || (*p != ' ' && *p != '\t'))
 			return (0);
 	}
 	return (1);
 }
 
+static int
+evhttp_header_is_valid_value(const char *value)
+{
+	return evhttp_header_value_is_valid_(value, strlen(value));
+}
+
 int
 evhttp_add_header(struct evkeyvalq *headers,
     const char *key, const char *value)
@@ -1864,20 +2579,10 @@ static int
 evhttp_add_header_internal(struct evkeyvalq *headers,
     const char *key, const char *value)
 {
-	struct evkeyval *header = mm_calloc(1, sizeof(struct evkeyval));
+	struct evkeyval *header = evhttp_header_new(NULL, key, strlen(key),
+	    value, strlen(value));
 	if (header == NULL) {
-		event_warn("%s: calloc", __func__);
-		return (-1);
-	}
-	if ((header->key = mm_strdup(key)) == NULL) {
-		mm_free(header);
-		event_warn("%s: strdup", __func__);
-		return (-1);
-	}
-	if ((header->value = mm_strdup(value)) == NULL) {
-		mm_free(header->key);
-		mm_free(header);
-		event_warn("%s: strdup", __func__);
+		event_warn("%s: malloc", __func__);
 		return (-1);
 	}
 
@@ -1896,16 +2601,42 @@ evhttp_add_header_internal(struct evkeyvalq *headers,
  *   ALL_DATA_READ       when all headers have been read.
  */
 
+/* Request and status lines up to this long are parsed from a copy on the
+ * stack; longer ones get a heap copy. */
+#define EVHTTP_FIRSTLINE_STACK 512
+
+/*
+ * Locates the next complete line at the front of buffer and returns a
+ * pointer to it in place, or NULL if no full line has arrived yet.  The
+ * line is only pulled up into one chain if it spans several; usually it
+ * is already contiguous and nothing is copied.  The returned memory must
+ * not be modified, and is valid until the caller drains *len + *eol_len
+ * bytes from the buffer.
+ */
+static const char *
+evhttp_peekln(struct evbuffer *buffer, size_t *len, size_t *eol_len)
+{
+	struct evbuffer_ptr eol;
+
+	eol = evbuffer_search_eol(buffer, NULL, eol_len, EVBUFFER_EOL_CRLF);
+	if (eol.pos < 0)
+		return (NULL);
+
+	*len = eol.pos;
+	return (const char *)evbuffer_pullup(buffer, eol.pos + *eol_len);
+}
+
 enum message_read_status
 evhttp_parse_firstline_(struct evhttp_request *req, struct evbuffer *buffer)
 {
+	char stackline[EVHTTP_FIRSTLINE_STACK];
+	const char *peeked;
 	char *line;
 	enum message_read_status status = ALL_DATA_READ;
 
-	size_t len;
-	/* XXX try */
-	line = evbuffer_readln(buffer, &len, EVBUFFER_EOL_CRLF);
-	if (line == NULL) {
+	size_t len, eol_len;
+	peeked = evhttp_peekln(buffer, &len, &eol_len);
+	if (peeked == NULL) {
 		if (req->evcon != NULL &&
 		    evbuffer_get_length(buffer) > req->evcon->max_headers_size)
 			return (DATA_TOO_LONG);
@@ -1913,10 +2644,19 @@ evhttp_parse_firstline_(struct evhttp_request *req, struct evbuffer *buffer)
 			return (MORE_DATA_EXPECTED);
 	}
 
-	if (req->evcon != NULL && len > req->evcon->max_headers_size) {
-		mm_free(line);
+	if (req->evcon != NULL && len > req->evcon->max_headers_size)
 		return (DATA_TOO_LONG);
+
+	/* the line parsers tokenize in place, so give them a private copy */
+	if (len < sizeof(stackline)) {
+		line = stackline;
+	} else if ((line = mm_malloc(len + 1)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (DATA_CORRUPTED);
 	}
+	memcpy(line, peeked, len);
+	line[len] = '\0';
+	evbuffer_drain(buffer, len + eol_len);
 
 	req->headers_size = len;
 
@@ -1933,88 +2673,124 @@ evhttp_parse_firstline_(struct evhttp_request *req, struct evbuffer *buffer)
 		status = DATA_CORRUPTED;
 	}
 
-	mm_free(line);
+	if (line != stackline)
+		mm_free(line);
 	return (status);
 }
 
 static int
-evhttp_append_to_last_header(struct evkeyvalq *headers, char *line)
+evhttp_append_to_last_header(struct evkeyvalq *headers,
+    const char *line, size_t line_len)
 {
 	struct evkeyval *header = TAILQ_LAST(headers, evkeyvalq);
+	const char *nul;
 	char *newval;
-	size_t old_len, line_len;
+	size_t old_len;
 
 	if (header == NULL)
 		return (-1);
 
 	old_len = strlen(header->value);
 
+	/* Anything past an embedded NUL was never part of the value. */
+	if ((nul = memchr(line, '\0', line_len)) != NULL)
+		line_len = nul - line;
+
 	/* Strip space from start and end of line. */
-	while (*line == ' ' || *line == '\t')
+	while (line_len && (*line == ' ' || *line == '\t')) {
 		++line;
-	evutil_rtrim_lws_(line);
-
-	line_len = strlen(line);
+		--line_len;
+	}
+	while (line_len &&
+	    (line[line_len - 1] == ' ' || line[line_len - 1] == '\t'))
+		--line_len;
 
-	newval = mm_realloc(header->value, old_len + line_len + 2);
+	if (evhttp_header_value_is_inline(header)) {
+		/* the value has outgrown its node */
+		newval = mm_malloc(old_len + line_len + 2);
+		if (newval != NULL)
+			memcpy(newval, header->value, old_len);
+	} else {
+		newval = mm_realloc(header->value, old_len + line_len + 2);
+	}
 	if (newval == NULL)
 		return (-1);
 
 	newval[old_len] = ' ';
-	memcpy(newval + old_len + 1, line, line_len + 1);
+	memcpy(newval + old_len + 1, line, line_len);
+	newval[old_len + 1 + line_len] = '\0';
 	header->value = newval;
 
 	return (0);
 }
 
+/*
+ * Header lines are tokenized where they sit in the input buffer: key and
+ * value are located by pointer and length, and the only copy made is the
+ * one into the header node itself.
+ */
 enum message_read_status
 evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 {
-	enum message_read_status errcode = DATA_CORRUPTED;
-	char *line;
 	enum message_read_status status = MORE_DATA_EXPECTED;
 
 	struct evkeyvalq* headers = req->input_headers;
-	size_t len;
-	while ((line = evbuffer_readln(buffer, &len, EVBUFFER_EOL_CRLF))
-	       != NULL) {
-		char *skey, *svalue;
+	struct evkeyval *header;
+	const char *line;
+	size_t len, eol_len;
+	while ((line = evhttp_peekln(buffer, &len, &eol_len)) != NULL) {
+		const char *skey, *svalue, *stop, *nul, *end = line + len;
+		size_t klen, vlen;
 
 		req->headers_size += len;
 
 		if (req->evcon != NULL &&
-		    req->headers_size > req->evcon->max_headers_size) {
-			errcode = DATA_TOO_LONG;
-			goto error;
-		}
+		    req->headers_size > req->evcon->max_headers_size)
+			return (DATA_TOO_LONG);
 
-		if (*line == '\0') { /* Last header - Done */
+		if (len == 0) { /* Last header - Done */
 			status = ALL_DATA_READ;
-			mm_free(line);
+			evbuffer_drain(buffer, eol_len);
 			break;
 		}
 
 		/* Check if this is a continuation line */
 		if (*line == ' ' || *line == '\t') {
-			if (evhttp_append_to_last_header(headers, line) == -1)
-				goto error;
-			mm_free(line);
+			if (evhttp_append_to_last_header(headers, line, len) == -1)
+				return (DATA_CORRUPTED);
+			evbuffer_drain(buffer, len + eol_len);
 			continue;
 		}
 
 		/* Processing of header lines */
-		svalue = line;
-		skey = strsep(&svalue, ":");
-		if (svalue == NULL)
-			goto error;
-
-		svalue += strspn(svalue, " ");
-		evutil_rtrim_lws_(svalue);
-
-		if (evhttp_add_header(headers, skey, svalue) == -1)
-			goto error;
-
-		mm_free(line);
+		skey = line;
+		klen = evhttp_scan(line, len, evhttp_scan_key, EVHTTP_SCAN_KEY_LEN);
+		if (klen == len || line[klen] != ':')
+			return (DATA_CORRUPTED);
+
+		svalue = line + klen + 1;
+		stop = svalue + evhttp_scan(svalue, end - svalue,
+		    evhttp_scan_value, EVHTTP_SCAN_VALUE_LEN);
+		if (stop == end || *stop == '\0')
+			end = stop;
+		else if ((nul = memchr(stop, '\0', end - stop)) != NULL)
+			end = nul;
+		while (svalue < end && *svalue == ' ')
+			++svalue;
+		while (end > svalue && (end[-1] == ' ' || end[-1] == '\t'))
+			--end;
+		vlen = end - svalue;
+
+		/* Only a value holding CR or LF needs a closer look. */
+		if (stop < end && !evhttp_header_value_is_valid_(stop, end - stop))
+			return (DATA_CORRUPTED);
+		header = evhttp_header_new(&req->header_arena,
+		    skey, klen, svalue, vlen);
+		if (header == NULL)
+			return (DATA_CORRUPTED);
+		TAILQ_INSERT_TAIL(headers, header, next);
+
+		evbuffer_drain(buffer, len + eol_len);
 	}
 
 	if (status == MORE_DATA_EXPECTED) {
@@ -2024,10 +2800,6 @@ evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 	}
 
 	return (status);
-
- error:
-	mm_free(line);
-	return (errcode);
 }
 
 static int
@@ -2132,10 +2904,14 @@ evhttp_get_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 						return;
 					}
 				}
-				if (!evbuffer_get_length(bufferevent_get_input(evcon->bufev)))
+				/* a pipelined request is not asked for its
+				 * body; its client sends it after a while */
+				if (TAILQ_FIRST(&evcon->requests) == req &&
+				    !evbuffer_get_length(bufferevent_get_input(evcon->bufev)))
 					evhttp_send_continue(evcon, req);
 			break;
 		case OTHER:
+			evhttp_connection_stop_reading(evcon);
 			evhttp_send_error(req, HTTP_EXPECTATIONFAILED, NULL);
 			return;
 		case NO: break;
@@ -2151,6 +2927,15 @@ evhttp_read_firstline(struct evhttp_connection *evcon,
 {
 	enum message_read_status res;
 
+	if (evcon->flags & EVHTTP_CON_H2C_PREFACE) {
+		res = evhttp_h2_preface_(bufferevent_get_input(evcon->bufev));
+		if (res == MORE_DATA_EXPECTED)
+			return;
+		evcon->flags &= ~EVHTTP_CON_H2C_PREFACE;
+		if (res == ALL_DATA_READ && evhttp_h2_start_(evcon, NULL) == 0)
+			return;
+	}
+
 	res = evhttp_parse_firstline_(req, bufferevent_get_input(evcon->bufev));
 	if (res == DATA_CORRUPTED || res == DATA_TOO_LONG) {
 		/* Error while reading, terminate */
@@ -2211,7 +2996,7 @@ evhttp_read_header(struct evhttp_connection *evcon,
 			evhttp_start_write_(evcon);
 			return;
 		}
-		if (!evhttp_response_needs_body(req)) {
+		if (!evhttp_response_needs_body_(req)) {
 			event_debug(("%s: skipping body for code %d\n",
 					__func__, req->response_code));
 			evhttp_connection_done(evcon);
@@ -2379,19 +3164,46 @@ evhttp_connection_set_timeout(struct evhttp_connection *evcon,
 	}
 }
 
+/* Give evcon's bufferevent the connection's timeouts, leaving out the read
+ * timeout while EVHTTP_CON_READ_UNTIMED is set. */
+static void
+evhttp_connection_apply_timeouts(struct evhttp_connection *evcon)
+{
+	struct timeval read_tv = { HTTP_READ_TIMEOUT, 0 };
+	struct timeval write_tv = { HTTP_WRITE_TIMEOUT, 0 };
+
+	if (timerisset(&evcon->timeout))
+		read_tv = write_tv = evcon->timeout;
+	bufferevent_set_timeouts(evcon->bufev,
+	    (evcon->flags & EVHTTP_CON_READ_UNTIMED) ? NULL : &read_tv,
+	    &write_tv);
+}
+
 void
 evhttp_connection_set_timeout_tv(struct evhttp_connection *evcon,
     const struct timeval* tv)
 {
-	if (tv) {
+	if (tv)
 		evcon->timeout = *tv;
-		bufferevent_set_timeouts(evcon->bufev, &evcon->timeout, &evcon->timeout);
-	} else {
-		const struct timeval read_tv = { HTTP_READ_TIMEOUT, 0 };
-		const struct timeval write_tv = { HTTP_WRITE_TIMEOUT, 0 };
+	else
 		timerclear(&evcon->timeout);
-		bufferevent_set_timeouts(evcon->bufev, &read_tv, &write_tv);
-	}
+	evhttp_connection_apply_timeouts(evcon);
+}
+
+/* Turn evcon's read timeout off while it reads a pipelined request ahead
+ * of the replies it still owes, and back on once they are sent.  A client
+ * that is waiting for a slow reply has no reason to send anything, so the
+ * timeout would only drop the connection under the handler. */
+static void
+evhttp_connection_untime_read(struct evhttp_connection *evcon, int untimed)
+{
+	if (!untimed == !(evcon->flags & EVHTTP_CON_READ_UNTIMED))
+		return;
+	if (untimed)
+		evcon->flags |= EVHTTP_CON_READ_UNTIMED;
+	else
+		evcon->flags &= ~EVHTTP_CON_READ_UNTIMED;
+	evhttp_connection_apply_timeouts(evcon);
 }
 
 void
@@ -2413,6 +3225,13 @@ evhttp_connection_set_retries(struct evhttp_connection *evcon,
 	evcon->retry_max = retry_max;
 }
 
+void
+evhttp_connection_set_max_pipeline(struct evhttp_connection *evcon,
+    int depth)
+{
+	evcon->pipeline_max = depth;
+}
+
 void
 evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*cb)(struct evhttp_connection *, void *), void *cbarg)
@@ -2571,10 +3390,28 @@ evhttp_make_request(struct evhttp_connection *evcon,
 	 */
 	if (TAILQ_FIRST(&evcon->requests) == req)
 		evhttp_request_dispatch(evcon);
+	else
+		evhttp_pipeline_fill(evcon);
 
 	return (0);
 }
 
+static int
+evhttp_request_is_inflight(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	struct evhttp_request *r;
+	int i = 0;
+
+	TAILQ_FOREACH(r, &evcon->requests, next) {
+		if (i++ >= evcon->n_inflight)
+			break;
+		if (r == req)
+			return (1);
+	}
+	return (0);
+}
+
 void
 evhttp_cancel_request(struct evhttp_request *req)
 {
@@ -2590,6 +3427,24 @@ evhttp_cancel_request(struct evhttp_request *req)
 
 			/* connection fail freed the request */
 			return;
+		} else if (evhttp_request_is_inflight(evcon, req)) {
+			/* it was sent ahead, so its response is still
+			 * coming; leave something in its place to take it
+			 */
+			struct evhttp_request *stub = evhttp_request_new(
+			    evhttp_pipeline_discard_cb, NULL);
+			if (stub == NULL) {
+				TAILQ_REMOVE(&evcon->requests, req, next);
+				evhttp_connection_fail_(evcon,
+				    EVREQ_HTTP_BUFFER_ERROR);
+			} else {
+				stub->evcon = evcon;
+				stub->kind = EVHTTP_REQUEST;
+				stub->type = req->type;
+				TAILQ_INSERT_AFTER(&evcon->requests,
+				    req, stub, next);
+				TAILQ_REMOVE(&evcon->requests, req, next);
+			}
 		} else {
 			/* otherwise, we can just remove it from the
 			 * queue
@@ -2609,7 +3464,9 @@ evhttp_cancel_request(struct evhttp_request *req)
 void
 evhttp_start_read_(struct evhttp_connection *evcon)
 {
-	bufferevent_disable(evcon->bufev, EV_WRITE);
+	/* keep writing any pipelined output */
+	if (evbuffer_get_length(bufferevent_get_output(evcon->bufev)) == 0)
+		bufferevent_disable(evcon->bufev, EV_WRITE);
 	bufferevent_enable(evcon->bufev, EV_READ);
 
 	evcon->state = EVCON_READING_FIRSTLINE;
@@ -2638,6 +3495,69 @@ evhttp_start_write_(struct evhttp_connection *evcon)
 	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
 }
 
+/*
+ * Returns a finished incoming request to the state evhttp_request_new()
+ * left it in, keeping its header lists, buffers, first arena block and
+ * remote_host, and parks it on evcon to carry the connection's next
+ * request.  Fails if the user owns req, it is still in use upstack, or
+ * something else holds a reference to one of its buffers.
+ */
+static int
+evhttp_request_recycle_(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	struct evhttp_request saved;
+	struct evhttp_header_arena *arena;
+
+	if (evcon->spare_req != NULL ||
+	    (req->flags & (EVHTTP_USER_OWNED|EVHTTP_REQ_DEFER_FREE)))
+		return (-1);
+	if (evbuffer_reset_(req->input_buffer, NULL) < 0 ||
+	    evbuffer_reset_(req->output_buffer, NULL) < 0)
+		return (-1);
+
+	if (req->uri != NULL)
+		mm_free(req->uri);
+	if (req->uri_elems != NULL)
+		evhttp_uri_free(req->uri_elems);
+	if (req->response_code_line != NULL)
+		mm_free(req->response_code_line);
+	if (req->host_cache != NULL)
+		mm_free(req->host_cache);
+	if (req->route_params != NULL)
+		mm_free(req->route_params);
+	if (req->held != NULL)
+		evhttp_held_response_free(req->held);
+
+	evhttp_clear_headers(req->input_headers);
+	evhttp_clear_headers(req->output_headers);
+
+	/* keep one ordinary arena block for the next request's headers */
+	arena = req->header_arena;
+	if (arena != NULL && arena->size != EVHTTP_ARENA_BLOCK) {
+		evhttp_arena_free(arena);
+		arena = NULL;
+	}
+	if (arena != NULL) {
+		evhttp_arena_free(arena->next);
+		arena->next = NULL;
+		arena->used = 0;
+	}
+
+	saved = *req;
+	memset(req, 0, sizeof(*req));
+	req->kind = EVHTTP_RESPONSE;
+	req->input_headers = saved.input_headers;
+	req->output_headers = saved.output_headers;
+	req->input_buffer = saved.input_buffer;
+	req->output_buffer = saved.output_buffer;
+	req->header_arena = arena;
+	req->remote_host = saved.remote_host;
+
+	evcon->spare_req = req;
+	return (0);
+}
+
 static void
 evhttp_send_done(struct evhttp_connection *evcon, void *arg)
 {
@@ -2655,17 +3575,35 @@ evhttp_send_done(struct evhttp_connection *evcon, void *arg)
 	    evhttp_is_request_connection_close(req);
 
 	EVUTIL_ASSERT(req->flags & EVHTTP_REQ_OWN_CONNECTION);
-	evhttp_request_free(req);
+	if (need_close || evhttp_request_recycle_(evcon, req) < 0)
+		evhttp_request_free(req);
 
 	if (need_close) {
-		evhttp_connection_free(evcon);
+		evhttp_connection_drop(evcon);
 		return;
 	}
 
-	/* we have a persistent connection; try to accept another request. */
-	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
-		evhttp_connection_free(evcon);
+	if ((req = TAILQ_FIRST(&evcon->requests)) == NULL) {
+		/* we have a persistent connection; try to accept another
+		 * request. */
+		evhttp_connection_untime_read(evcon, 0);
+		if (evhttp_associate_new_request_with_connection(evcon) == -1) {
+			evhttp_connection_free(evcon);
+		}
+		return;
 	}
+
+	/* no more replies are owed ahead of the request being read */
+	if (TAILQ_NEXT(req, next) == NULL &&
+	    evhttp_connection_is_reading(evcon))
+		evhttp_connection_untime_read(evcon, 0);
+
+	/* pipelined requests are outstanding: there may be room to read
+	 * another, and the reply to the next may be waiting */
+	evcon->cb = NULL;
+	evhttp_pipeline_read_next(evcon);
+	if (req->held != NULL)
+		evhttp_send_held(evcon, req);
 }
 
 /*
@@ -2714,8 +3652,6 @@ evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
 		return;
 	}
 
-	EVUTIL_ASSERT(TAILQ_FIRST(&evcon->requests) == req);
-
 	/* we expect no more calls form the user on this request */
 	req->userdone = 1;
 
@@ -2723,9 +3659,25 @@ evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
 	if (databuf != NULL)
 		evbuffer_add_buffer(req->output_buffer, databuf);
 
+	if (evcon->h2 != NULL) {
+		evhttp_h2_send_(req, req->output_buffer, 1, NULL, NULL);
+		return;
+	}
+
+	if (evhttp_response_hold(evcon, req) == -1) {
+		evhttp_connection_drop(evcon);
+		return;
+	}
+
 	/* Adds headers to the response */
 	evhttp_make_header(evcon, req);
 
+	/* a pipelined reply waits for those ahead of it */
+	if (req->held != NULL) {
+		req->held->done = 1;
+		return;
+	}
+
 	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
 }
 
@@ -2747,9 +3699,19 @@ evhttp_send_reply_start(struct evhttp_request *req, int code,
 	if (req->evcon == NULL)
 		return;
 
+	if (req->evcon->h2 != NULL) {
+		evhttp_h2_send_(req, NULL, 0, NULL, NULL);
+		return;
+	}
+
+	if (evhttp_response_hold(req->evcon, req) == -1) {
+		evhttp_connection_drop(req->evcon);
+		return;
+	}
+
 	if (evhttp_find_header(req->output_headers, "Content-Length") == NULL &&
 	    REQ_VERSION_ATLEAST(req, 1, 1) &&
-	    evhttp_response_needs_body(req)) {
+	    evhttp_response_needs_body_(req)) {
 		/*
 		 * prefer HTTP/1.1 chunked encoding to closing the connection;
 		 * note RFC 2616 section 4.4 forbids it with Content-Length:
@@ -2762,7 +3724,8 @@ evhttp_send_reply_start(struct evhttp_request *req, int code,
 		req->chunked = 0;
 	}
 	evhttp_make_header(req->evcon, req);
-	evhttp_write_buffer(req->evcon, NULL, NULL);
+	if (req->held == NULL)
+		evhttp_write_buffer(req->evcon, NULL, NULL);
 }
 
 void
@@ -2775,11 +3738,15 @@ evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *dat
 	if (evcon == NULL)
 		return;
 
-	output = bufferevent_get_output(evcon->bufev);
-
 	if (evbuffer_get_length(databuf) == 0)
 		return;
-	if (!evhttp_response_needs_body(req))
+	if (evcon->h2 != NULL) {
+		evhttp_h2_send_(req, databuf, 0, cb, arg);
+		return;
+	}
+
+	output = evhttp_response_output(evcon, req);
+	if (!evhttp_response_needs_body_(req))
 		return;
 	if (req->chunked) {
 		evbuffer_add_printf(output, "%x\r\n",
@@ -2789,6 +3756,11 @@ evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *dat
 	if (req->chunked) {
 		evbuffer_add(output, "\r\n", 2);
 	}
+	if (req->held != NULL) {
+		req->held->cb = cb;
+		req->held->cb_arg = arg;
+		return;
+	}
 	evhttp_write_buffer(evcon, cb, arg);
 }
 
@@ -2808,12 +3780,23 @@ evhttp_send_reply_end(struct evhttp_request *req)
 		return;
 	}
 
-	output = bufferevent_get_output(evcon->bufev);
-
 	/* we expect no more calls form the user on this request */
 	req->userdone = 1;
 
-	if (req->chunked) {
+	if (evcon->h2 != NULL) {
+		evhttp_h2_send_(req, NULL, 1, NULL, NULL);
+		return;
+	}
+
+	output = evhttp_response_output(evcon, req);
+
+	if (req->held != NULL) {
+		if (req->chunked) {
+			evbuffer_add(output, "0\r\n\r\n", 5);
+			req->chunked = 0;
+		}
+		req->held->done = 1;
+	} else if (req->chunked) {
 		evbuffer_add(output, "0\r\n\r\n", 5);
 		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
 		req->chunked = 0;
@@ -3147,93 +4130,385 @@ evhttp_parse_query_impl(const char *str, struct evkeyvalq *headers,
 		query_part = str;
 	}
 
-	/* No arguments - we are done */
-	if (!query_part || !strlen(query_part)) {
-		result = 0;
-		goto done;
-	}
+	/* No arguments - we are done */
+	if (!query_part || !strlen(query_part)) {
+		result = 0;
+		goto done;
+	}
+
+	if ((line = mm_strdup(query_part)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		goto error;
+	}
+
+	p = argument = line;
+	while (p != NULL && *p != '\0') {
+		char *key, *value, *decoded_value;
+		int err;
+		argument = strsep(&p, "&");
+
+		value = argument;
+		key = strsep(&value, "=");
+		if (value == NULL || *key == '\0') {
+			goto error;
+		}
+
+		if ((decoded_value = mm_malloc(strlen(value) + 1)) == NULL) {
+			event_warn("%s: mm_malloc", __func__);
+			goto error;
+		}
+		evhttp_decode_uri_internal(value, strlen(value),
+		    decoded_value, 1 /*always_decode_plus*/);
+		event_debug(("Query Param: %s -> %s\n", key, decoded_value));
+		err = evhttp_add_header_internal(headers, key, decoded_value);
+		mm_free(decoded_value);
+		if (err)
+			goto error;
+	}
+
+	result = 0;
+	goto done;
+error:
+	evhttp_clear_headers(headers);
+done:
+	if (line)
+		mm_free(line);
+	if (uri)
+		evhttp_uri_free(uri);
+	return result;
+}
+
+int
+evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
+{
+	return evhttp_parse_query_impl(uri, headers, 1);
+}
+int
+evhttp_parse_query_str(const char *uri, struct evkeyvalq *headers)
+{
+	return evhttp_parse_query_impl(uri, headers, 0);
+}
+
+/* The most parameters, counting the remainder matched by '*', that one route
+ * can capture. */
+#define EVHTTP_ROUTE_MAX_PARAMS 8
+/* Paths up to this long are decoded for dispatch without allocating. */
+#define EVHTTP_ROUTE_PATH_MAX 512
+
+/* A node in the routing trie.  Each node stands for one '/'-separated
+ * segment of a path; the root stands for none. */
+struct evhttp_route_node {
+	/* the segment for a static child; not NUL-terminated */
+	char *seg;
+	size_t seglen;
+
+	/* static children, sorted by evhttp_route_cmp() */
+	struct evhttp_route_node **children;
+	int n_children;
+	int n_alloc;
+
+	/* the child for a ':name' segment, and that name */
+	struct evhttp_route_node *param;
+	char *param_name;
+
+	/* the callback for paths that end here */
+	struct evhttp_cb *cb;
+	/* the callback for paths that go on past here, from a pattern
+	 * ending in '*' */
+	struct evhttp_cb *prefix_cb;
+};
+
+/* Parameters captured by a route, as kept on a request. */
+struct evhttp_route_params {
+	int n;
+	const char *names[EVHTTP_ROUTE_MAX_PARAMS];
+	const char *values[EVHTTP_ROUTE_MAX_PARAMS];
+	/* the names and values, NUL-terminated */
+	char buf[1];
+};
+
+/* Parameters captured while matching, as offsets into the decoded path. */
+struct evhttp_route_match {
+	const char *path;
+	int n;
+	const char *names[EVHTTP_ROUTE_MAX_PARAMS];
+	size_t off[EVHTTP_ROUTE_MAX_PARAMS];
+	size_t len[EVHTTP_ROUTE_MAX_PARAMS];
+};
+
+static int
+evhttp_route_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+	if (r)
+		return r;
+	return alen < blen ? -1 : alen > blen;
+}
+
+/* Return the index of node's static child for seg, or if there is none,
+ * -1 - the index at which it would go. */
+static int
+evhttp_route_find(const struct evhttp_route_node *node,
+    const char *seg, size_t len)
+{
+	int lo = 0, hi = node->n_children - 1, mid, r;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		r = evhttp_route_cmp(seg, len,
+		    node->children[mid]->seg, node->children[mid]->seglen);
+		if (r == 0)
+			return mid;
+		if (r < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return -1 - lo;
+}
+
+static void
+evhttp_route_free(struct evhttp_route_node *node)
+{
+	int i;
+
+	if (node == NULL)
+		return;
+	for (i = 0; i < node->n_children; ++i)
+		evhttp_route_free(node->children[i]);
+	evhttp_route_free(node->param);
+	mm_free(node->children);
+	mm_free(node->seg);
+	mm_free(node->param_name);
+	mm_free(node);
+}
+
+/* Add cb to the trie at *rootp.  Returns 0 on success, -1 if the path or
+ * pattern is taken, conflicts with another or has too many parameters, and
+ * -2 on failure.  On error, the trie may be left with nodes for the part
+ * of the pattern seen so far. */
+static int
+evhttp_route_insert(struct evhttp_route_node **rootp, struct evhttp_cb *cb)
+{
+	struct evhttp_route_node *node, *child;
+	const char *p = cb->what, *slash;
+	size_t len;
+	int i, n_params = 0;
+
+	if (*rootp == NULL && (*rootp = mm_calloc(1, sizeof(**rootp))) == NULL)
+		return (-2);
+	node = *rootp;
+
+	for (;;) {
+		slash = strchr(p, '/');
+		len = slash ? (size_t)(slash - p) : strlen(p);
+
+		if (cb->is_route && !slash && len == 1 && *p == '*') {
+			if (node->prefix_cb)
+				return (-1);
+			node->prefix_cb = cb;
+			return (0);
+		}
+
+		if (cb->is_route && len > 1 && *p == ':') {
+			if (++n_params >= EVHTTP_ROUTE_MAX_PARAMS)
+				return (-1);
+			if (node->param == NULL) {
+				child = mm_calloc(1, sizeof(*child));
+				if (child == NULL)
+					return (-2);
+				child->param_name = mm_malloc(len);
+				if (child->param_name == NULL) {
+					mm_free(child);
+					return (-2);
+				}
+				memcpy(child->param_name, p + 1, len - 1);
+				child->param_name[len - 1] = '\0';
+				node->param = child;
+			} else if (strlen(node->param->param_name) != len - 1 ||
+			    memcmp(node->param->param_name, p + 1, len - 1)) {
+				/* the same position can't have two names */
+				return (-1);
+			}
+			node = node->param;
+		} else if ((i = evhttp_route_find(node, p, len)) >= 0) {
+			node = node->children[i];
+		} else {
+			i = -1 - i;
+			if (node->n_children == node->n_alloc) {
+				int n_alloc = node->n_alloc ? node->n_alloc * 2 : 4;
+				struct evhttp_route_node **tmp = mm_realloc(
+				    node->children, n_alloc * sizeof(*tmp));
+				if (tmp == NULL)
+					return (-2);
+				node->children = tmp;
+				node->n_alloc = n_alloc;
+			}
+			if ((child = mm_calloc(1, sizeof(*child))) == NULL)
+				return (-2);
+			if ((child->seg = mm_malloc(len + 1)) == NULL) {
+				mm_free(child);
+				return (-2);
+			}
+			memcpy(child->seg, p, len);
+			child->seg[len] = '\0';
+			child->seglen = len;
+			memmove(node->children + i + 1, node->children + i,
+			    (node->n_children - i) * sizeof(*node->children));
+			node->children[i] = child;
+			++node->n_children;
+			node = child;
+		}
+
+		if (!slash)
+			break;
+		p = slash + 1;
+	}
+
+	if (node->cb)
+		return (-1);
+	node->cb = cb;
+	return (0);
+}
+
+static void
+evhttp_cb_free(struct evhttp_cb *http_cb)
+{
+	if (http_cb->cbarg_free != NULL)
+		http_cb->cbarg_free(http_cb->cbarg);
+	mm_free(http_cb->what);
+	mm_free(http_cb);
+}
+
+/* Throw away the trie and build it again from the list of callbacks. */
+static void
+evhttp_route_rebuild(struct evhttp *http)
+{
+	struct evhttp_cb *cb;
 
-	if ((line = mm_strdup(query_part)) == NULL) {
-		event_warn("%s: strdup", __func__);
-		goto error;
+	evhttp_route_free(http->routes);
+	http->routes = NULL;
+	TAILQ_FOREACH(cb, &http->callbacks, next) {
+		if (evhttp_route_insert(&http->routes, cb) == -2)
+			event_warn("%s: could not add %s", __func__, cb->what);
 	}
+}
 
-	p = argument = line;
-	while (p != NULL && *p != '\0') {
-		char *key, *value, *decoded_value;
-		int err;
-		argument = strsep(&p, "&");
+/* Find the callback for the path segments from p to end, below node.  p is
+ * NULL if there are no segments left.  Static segments win over
+ * parameters, which win over a '*'. */
+static struct evhttp_cb *
+evhttp_route_match(const struct evhttp_route_node *node,
+    const char *p, const char *end, struct evhttp_route_match *m)
+{
+	const char *slash, *next;
+	struct evhttp_cb *cb;
+	size_t len;
+	int i;
 
-		value = argument;
-		key = strsep(&value, "=");
-		if (value == NULL || *key == '\0') {
-			goto error;
-		}
+	if (p == NULL)
+		return node->cb;
 
-		if ((decoded_value = mm_malloc(strlen(value) + 1)) == NULL) {
-			event_warn("%s: mm_malloc", __func__);
-			goto error;
-		}
-		evhttp_decode_uri_internal(value, strlen(value),
-		    decoded_value, 1 /*always_decode_plus*/);
-		event_debug(("Query Param: %s -> %s\n", key, decoded_value));
-		err = evhttp_add_header_internal(headers, key, decoded_value);
-		mm_free(decoded_value);
-		if (err)
-			goto error;
+	slash = memchr(p, '/', end - p);
+	len = (slash ? slash : end) - p;
+	next = slash ? slash + 1 : NULL;
+
+	if ((i = evhttp_route_find(node, p, len)) >= 0 &&
+	    (cb = evhttp_route_match(node->children[i], next, end, m)))
+		return cb;
+
+	if (node->param && len && m->n < EVHTTP_ROUTE_MAX_PARAMS) {
+		m->names[m->n] = node->param->param_name;
+		m->off[m->n] = p - m->path;
+		m->len[m->n] = len;
+		++m->n;
+		if ((cb = evhttp_route_match(node->param, next, end, m)))
+			return cb;
+		--m->n;
 	}
 
-	result = 0;
-	goto done;
-error:
-	evhttp_clear_headers(headers);
-done:
-	if (line)
-		mm_free(line);
-	if (uri)
-		evhttp_uri_free(uri);
-	return result;
-}
+	if (node->prefix_cb && m->n < EVHTTP_ROUTE_MAX_PARAMS) {
+		m->names[m->n] = "*";
+		m->off[m->n] = p - m->path;
+		m->len[m->n] = end - p;
+		++m->n;
+		return node->prefix_cb;
+	}
 
-int
-evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
-{
-	return evhttp_parse_query_impl(uri, headers, 1);
+	return NULL;
 }
-int
-evhttp_parse_query_str(const char *uri, struct evkeyvalq *headers)
+
+/* Keep the parameters in m on req, copied out of the decoded path. */
+static int
+evhttp_route_set_params(struct evhttp_request *req,
+    const struct evhttp_route_match *m)
 {
-	return evhttp_parse_query_impl(uri, headers, 0);
+	struct evhttp_route_params *params;
+	size_t size = 0;
+	char *p;
+	int i;
+
+	/* The names are copied too, since the route can go away first. */
+	for (i = 0; i < m->n; ++i)
+		size += strlen(m->names[i]) + 1 + m->len[i] + 1;
+	params = mm_malloc(sizeof(*params) + size);
+	if (params == NULL)
+		return (-1);
+	params->n = m->n;
+	for (i = 0, p = params->buf; i < m->n; ++i) {
+		size_t namelen = strlen(m->names[i]) + 1;
+		params->names[i] = p;
+		memcpy(p, m->names[i], namelen);
+		p += namelen;
+		params->values[i] = p;
+		memcpy(p, m->path + m->off[i], m->len[i]);
+		p += m->len[i];
+		*p++ = '\0';
+	}
+
+	if (req->route_params)
+		mm_free(req->route_params);
+	req->route_params = params;
+	return (0);
 }
 
 static struct evhttp_cb *
-evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
+evhttp_dispatch_callback(struct evhttp *http, struct evhttp_request *req)
 {
+	struct evhttp_route_match m;
 	struct evhttp_cb *cb;
+	char buf[EVHTTP_ROUTE_PATH_MAX];
 	size_t offset = 0;
 	char *translated;
 	const char *path;
 
+	if (http->routes == NULL)
+		return (NULL);
+
 	/* Test for different URLs */
 	path = evhttp_uri_get_path(req->uri_elems);
 	offset = strlen(path);
-	if ((translated = mm_malloc(offset + 1)) == NULL)
+	if (offset < sizeof(buf))
+		translated = buf;
+	else if ((translated = mm_malloc(offset + 1)) == NULL)
 		return (NULL);
 	evhttp_decode_uri_internal(path, offset, translated,
 	    0 /* decode_plus */);
 
-	TAILQ_FOREACH(cb, callbacks, next) {
-		if (!strcmp(cb->what, translated)) {
-			mm_free(translated);
-			return (cb);
-		}
+	m.path = translated;
+	m.n = 0;
+	cb = evhttp_route_match(http->routes, translated,
+	    translated + strlen(translated), &m);
+	if (cb && m.n && evhttp_route_set_params(req, &m) < 0) {
+		event_warn("%s: malloc", __func__);
+		cb = NULL;
 	}
 
-	mm_free(translated);
-	return (NULL);
+	if (translated != buf)
+		mm_free(translated);
+	return (cb);
 }
 
-
 static int
 prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
 {
@@ -3346,7 +4621,9 @@ evhttp_handle_request(struct evhttp_request *req, void *arg)
 	/* we have a new request on which the user needs to take action */
 	req->userdone = 0;
 
-	bufferevent_disable(req->evcon->bufev, EV_READ);
+	/* unless the next pipelined request is being read already */
+	if (TAILQ_LAST(&req->evcon->requests, evcon_requestq) == req)
+		bufferevent_disable(req->evcon->bufev, EV_READ);
 
 	if (req->type == 0 || req->uri == NULL) {
 		evhttp_send_error(req, req->response_code, NULL);
@@ -3366,7 +4643,7 @@ evhttp_handle_request(struct evhttp_request *req, void *arg)
 		evhttp_find_vhost(http, &http, hostname);
 	}
 
-	if ((cb = evhttp_dispatch_callback(&http->callbacks, req)) != NULL) {
+	if ((cb = evhttp_dispatch_callback(http, req)) != NULL) {
 		(*cb->cb)(req, cb->cbarg);
 		return;
 	}
@@ -3627,9 +4904,10 @@ evhttp_free(struct evhttp* http)
 
 	while ((http_cb = TAILQ_FIRST(&http->callbacks)) != NULL) {
 		TAILQ_REMOVE(&http->callbacks, http_cb, next);
-		mm_free(http_cb->what);
-		mm_free(http_cb);
+		evhttp_cb_free(http_cb);
 	}
+	evhttp_route_free(http->routes);
+	http->routes = NULL;
 
 	while ((vhost = TAILQ_FIRST(&http->virtualhosts)) != NULL) {
 		TAILQ_REMOVE(&http->virtualhosts, vhost, next_vhost);
@@ -3640,6 +4918,9 @@ evhttp_free(struct evhttp* http)
 	if (http->vhost_pattern != NULL)
 		mm_free(http->vhost_pattern);
 
+	if (http->static_headers != NULL)
+		evhttp_static_headers_decref(http->static_headers);
+
 	while ((alias = TAILQ_FIRST(&http->aliases)) != NULL) {
 		TAILQ_REMOVE(&http->aliases, alias, next);
 		mm_free(alias->alias);
@@ -3745,6 +5026,7 @@ int evhttp_set_flags(struct evhttp *http, int flags)
 {
 	int avail_flags = 0;
 	avail_flags |= EVHTTP_SERVER_LINGERING_CLOSE;
+	avail_flags |= EVHTTP_SERVER_H2C;
 
 	if (flags & ~avail_flags)
 		return 1;
@@ -3773,28 +5055,82 @@ evhttp_set_max_body_size(struct evhttp* http, ssize_t max_body_size)
 		http->default_max_body_size = max_body_size;
 }
 
+void
+evhttp_set_max_pipeline(struct evhttp *http, int depth)
+{
+	http->default_pipeline_max = depth;
+}
+
 void
 evhttp_set_default_content_type(struct evhttp *http,
 	const char *content_type) {
 	http->default_content_type = content_type;
 }
 
+int
+evhttp_set_static_headers(struct evhttp *http,
+    const struct evkeyvalq *headers)
+{
+	struct evhttp_static_headers *sh = NULL;
+	const struct evkeyval *header;
+	size_t len = 0, n;
+	char *p;
+
+	if (headers != NULL && TAILQ_FIRST(headers) != NULL) {
+		TAILQ_FOREACH(header, headers, next)
+			len += strlen(header->key) + strlen(header->value) + 4;
+
+		sh = mm_malloc(offsetof(struct evhttp_static_headers, data) +
+		    len);
+		if (sh == NULL) {
+			event_warn("%s: malloc", __func__);
+			return (-1);
+		}
+		sh->refcnt = 1;
+		sh->len = len;
+		TAILQ_INIT(&sh->headers);
+
+		p = sh->data;
+		TAILQ_FOREACH(header, headers, next) {
+			if (evhttp_add_header(&sh->headers,
+				header->key, header->value) < 0) {
+				evhttp_static_headers_decref(sh);
+				return (-1);
+			}
+			n = strlen(header->key);
+			memcpy(p, header->key, n);
+			p += n;
+			*p++ = ':';
+			*p++ = ' ';
+			n = strlen(header->value);
+			memcpy(p, header->value, n);
+			p += n;
+			*p++ = '\r';
+			*p++ = '\n';
+		}
+		sh->has_content_type =
+		    evhttp_find_header(&sh->headers, "Content-Type") != NULL;
+	}
+
+	if (http->static_headers != NULL)
+		evhttp_static_headers_decref(http->static_headers);
+	http->static_headers = sh;
+
+	return (0);
+}
+
 void
 evhttp_set_allowed_methods(struct evhttp* http, uint16_t methods)
 {
 	http->allowed_methods = methods;
 }
 
-int
-evhttp_set_cb(struct evhttp *http, const char *uri,
+static int
+evhttp_add_cb_(struct evhttp *http, const char *uri, int is_route,
     void (*cb)(struct evhttp_request *, void *), void *cbarg)
 {
 	struct evhttp_cb *http_cb;
-
-	TAILQ_FOREACH(http_cb, &http->callbacks, next) {
-		if (strcmp(http_cb->what, uri) == 0)
-			return (-1);
-	}
+	int r;
 
 	if ((http_cb = mm_calloc(1, sizeof(struct evhttp_cb))) == NULL) {
 		event_warn("%s: calloc", __func__);
@@ -3807,14 +5143,37 @@ evhttp_set_cb(struct evhttp *http, const char *uri,
 		mm_free(http_cb);
 		return (-3);
 	}
+	http_cb->is_route = is_route;
 	http_cb->cb = cb;
 	http_cb->cbarg = cbarg;
 
+	if ((r = evhttp_route_insert(&http->routes, http_cb)) < 0) {
+		mm_free(http_cb->what);
+		mm_free(http_cb);
+		/* drop whatever the pattern added before it failed */
+		evhttp_route_rebuild(http);
+		return (r);
+	}
+
 	TAILQ_INSERT_TAIL(&http->callbacks, http_cb, next);
 
 	return (0);
 }
 
+int
+evhttp_set_cb(struct evhttp *http, const char *uri,
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	return evhttp_add_cb_(http, uri, 0, cb, cbarg);
+}
+
+int
+evhttp_set_route(struct evhttp *http, const char *pattern,
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	return evhttp_add_cb_(http, pattern, 1, cb, cbarg);
+}
+
 int
 evhttp_del_cb(struct evhttp *http, const char *uri)
 {
@@ -3828,8 +5187,9 @@ evhttp_del_cb(struct evhttp *http, const char *uri)
 		return (-1);
 
 	TAILQ_REMOVE(&http->callbacks, http_cb, next);
-	mm_free(http_cb->what);
-	mm_free(http_cb);
+	evhttp_cb_free(http_cb);
+
+	evhttp_route_rebuild(http);
 
 	return (0);
 }
@@ -3850,6 +5210,408 @@ evhttp_set_bevcb(struct evhttp *http,
 	http->bevcbarg = cbarg;
 }
 
+/*
+ * Static files
+ */
+
+struct evhttp_static {
+	/* the directory, without a trailing '/' */
+	char *root;
+	/* the length of the prefix, without a trailing '/' */
+	size_t prefixlen;
+	int flags;
+};
+
+static const struct {
+	const char *extension;
+	const char *content_type;
+} evhttp_static_types[] = {
+	{ "html", "text/html; charset=utf-8" },
+	{ "htm", "text/html; charset=utf-8" },
+	{ "css", "text/css; charset=utf-8" },
+	{ "js", "text/javascript; charset=utf-8" },
+	{ "mjs", "text/javascript; charset=utf-8" },
+	{ "json", "application/json" },
+	{ "txt", "text/plain; charset=utf-8" },
+	{ "xml", "application/xml" },
+	{ "svg", "image/svg+xml" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "webp", "image/webp" },
+	{ "avif", "image/avif" },
+	{ "ico", "image/vnd.microsoft.icon" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf", "font/ttf" },
+	{ "wasm", "application/wasm" },
+	{ "pdf", "application/pdf" },
+	{ "mp4", "video/mp4" },
+	{ "webm", "video/webm" },
+	{ "mp3", "audio/mpeg" },
+	{ "gz", "application/gzip" },
+	{ "zip", "application/zip" },
+	{ NULL, NULL },
+};
+
+static const char *
+evhttp_static_content_type(const char *path)
+{
+	const char *dot = strrchr(path, '.'), *slash = strrchr(path, '/');
+	int i;
+
+	if (dot != NULL && (slash == NULL || dot > slash)) {
+		for (i = 0; evhttp_static_types[i].extension; ++i) {
+			if (!evutil_ascii_strcasecmp(dot + 1,
+				evhttp_static_types[i].extension))
+				return (evhttp_static_types[i].content_type);
+		}
+	}
+	return ("application/octet-stream");
+}
+
+/* Parse an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT".  Returns -1
+ * if it isn't one. */
+static time_t
+evhttp_static_parse_date(const char *date)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	const char *m;
+	char mon[4];
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+		&tm.tm_mday, mon, &tm.tm_year,
+		&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+	    strlen(mon) != 3 ||
+	    (m = strstr(months, mon)) == NULL || (m - months) % 3)
+		return (-1);
+	tm.tm_mon = (int)(m - months) / 3;
+	tm.tm_year -= 1900;
+	return (timegm(&tm));
+}
+
+/* Whether the entity tags listed in an If-None-Match header include etag,
+ * compared weakly. */
+static int
+evhttp_static_etag_match(const char *header, const char *etag)
+{
+	size_t len = strlen(etag);
+	const char *p = header;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		if (*p == '*')
+			return (1);
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		if (!strncmp(p, etag, len) &&
+		    (p[len] == '\0' || strchr(" \t,", p[len]) != NULL))
+			return (1);
+		p += strcspn(p, ",");
+	}
+	return (0);
+}
+
+/* Parse a Range header for a file of size bytes into *offp and *lenp.
+ * Returns 1 for a range we can send, 0 to ignore the header and send the
+ * whole file, and -1 if the range lies past the end of the file.  A list
+ * of several ranges is ignored rather than sent as multipart. */
+static int
+evhttp_static_range(const char *range, off_t size, off_t *offp, off_t *lenp)
+{
+	uint64_t first, last, n = (uint64_t)size;
+	char *end;
+
+	if (evutil_ascii_strncasecmp(range, "bytes=", 6) ||
+	    strchr(range, ',') != NULL)
+		return (0);
+	range += 6;
+
+	if (*range == '-') {
+		/* the last so many bytes */
+		if (!EVUTIL_ISDIGIT_(range[1]))
+			return (0);
+		last = evutil_strtoll(range + 1, &end, 10);
+		if (*end != '\0')
+			return (0);
+		if (last == 0 || n == 0)
+			return (-1);
+		if (last > n)
+			last = n;
+		*offp = (off_t)(n - last);
+		*lenp = (off_t)last;
+		return (1);
+	}
+
+	if (!EVUTIL_ISDIGIT_(*range))
+		return (0);
+	first = evutil_strtoll(range, &end, 10);
+	if (*end++ != '-')
+		return (0);
+	if (*end == '\0') {
+		last = n - 1;
+	} else {
+		if (!EVUTIL_ISDIGIT_(*end))
+			return (0);
+		last = evutil_strtoll(end, &end, 10);
+		if (*end != '\0' || last < first)
+			return (0);
+	}
+	if (first >= n)
+		return (-1);
+	if (last >= n)
+		last = n - 1;
+	*offp = (off_t)first;
+	*lenp = (off_t)(last - first + 1);
+	return (1);
+}
+
+/* The response has been written: let the last partial packet go. */
+static void
+evhttp_static_complete(struct evhttp_request *req, void *arg)
+{
+	int fd = bufferevent_getfd(req->evcon->bufev), off = 0;
+
+	evbuffer_clear_flags(req->output_buffer, EVBUFFER_FLAG_DRAINS_TO_FD);
+	if (fd >= 0)
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+}
+
+static void
+evhttp_static_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_static *st = arg;
+	struct evhttp_connection *evcon = req->evcon;
+	struct evkeyvalq *headers = req->output_headers;
+	struct evbuffer_file_segment *seg = NULL;
+	char *decoded = NULL, *path = NULL;
+	const char *rel, *p, *value;
+	char etag[64], date[32], buf[80];
+	struct stat sb;
+	struct tm tm;
+	time_t since;
+	size_t len;
+	off_t off = 0, length;
+	int code = HTTP_OK, is_index, not_modified = 0, on = 1, fd;
+
+	if (req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD) {
+		evhttp_add_header(headers, "Allow", "GET, HEAD");
+		evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+		return;
+	}
+
+	/* The route matched the decoded path, so it starts with our prefix
+	 * and a '/'. */
+	decoded = evhttp_uridecode(evhttp_uri_get_path(req->uri_elems), 0,
+	    &len);
+	if (decoded == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+	if (strlen(decoded) != len)
+		goto notfound;
+	rel = decoded + st->prefixlen + 1;
+
+	/* Stay inside the root, and out of hidden files unless asked. */
+	for (p = rel; ; ++p) {
+		len = strcspn(p, "/");
+		if (p[0] == '.' && ((len == 2 && p[1] == '.') ||
+			!(st->flags & EVHTTP_STATIC_HIDDEN)))
+			goto notfound;
+		p += len;
+		if (*p == '\0')
+			break;
+	}
+
+	is_index = *rel == '\0' || rel[strlen(rel) - 1] == '/';
+	if (is_index && !(st->flags & EVHTTP_STATIC_INDEX))
+		goto notfound;
+	len = strlen(st->root) + strlen(rel) + sizeof("/index.html");
+	if ((path = mm_malloc(len)) == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		goto done;
+	}
+	evutil_snprintf(path, len, "%s/%s%s", st->root, rel,
+	    is_index ? "index.html" : "");
+
+	seg = evbuffer_file_segment_cache_get_(path, 0, -1, 0, &sb);
+	if (seg == NULL) {
+		if (errno != EISDIR || !(st->flags & EVHTTP_STATIC_INDEX))
+			goto notfound;
+		/* Send the client on to the directory's index, keeping the
+		 * query. */
+		value = evhttp_uri_get_path(req->uri_elems);
+		p = evhttp_uri_get_query(req->uri_elems);
+		len = strlen(value) + 2 + (p ? strlen(p) + 1 : 0);
+		mm_free(path);
+		if ((path = mm_malloc(len)) == NULL) {
+			evhttp_send_error(req, HTTP_INTERNAL, NULL);
+			goto done;
+		}
+		evutil_snprintf(path, len, "%s/%s%s", value, p ? "?" : "",
+		    p ? p : "");
+		evhttp_add_header(headers, "Location", path);
+		evhttp_send_reply(req, HTTP_MOVEPERM, NULL, NULL);
+		goto done;
+	}
+
+	evutil_snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+	    (unsigned long long)sb.st_ino, (unsigned long long)sb.st_size,
+	    (unsigned long long)sb.st_mtim.tv_sec * 1000000000ULL +
+	    (unsigned long long)sb.st_mtim.tv_nsec);
+	gmtime_r(&sb.st_mtime, &tm);
+	evutil_date_rfc1123(date, sizeof(date), &tm);
+	evhttp_add_header(headers, "ETag", etag);
+	evhttp_add_header(headers, "Last-Modified", date);
+	evhttp_add_header(headers, "Accept-Ranges", "bytes");
+
+	/* If-None-Match takes the place of If-Modified-Since when both are
+	 * given. */
+	if ((value = evhttp_find_header(req->input_headers,
+		    "If-None-Match")) != NULL)
+		not_modified = evhttp_static_etag_match(value, etag);
+	else if ((value = evhttp_find_header(req->input_headers,
+		    "If-Modified-Since")) != NULL &&
+	    (since = evhttp_static_parse_date(value)) != -1)
+		not_modified = sb.st_mtime <= since;
+	if (not_modified) {
+		evhttp_send_reply(req, HTTP_NOTMODIFIED, NULL, NULL);
+		goto done;
+	}
+
+	length = sb.st_size;
+	if ((value = evhttp_find_header(req->input_headers, "Range")) != NULL) {
+		const char *if_range = evhttp_find_header(req->input_headers,
+		    "If-Range");
+		int r = 0;
+
+		/* A stale If-Range asks for the whole of the new file. */
+		if (if_range == NULL || !strcmp(if_range, etag) ||
+		    !strcmp(if_range, date))
+			r = evhttp_static_range(value, sb.st_size, &off,
+			    &length);
+		if (r < 0) {
+			evutil_snprintf(buf, sizeof(buf), "bytes */%llu",
+			    (unsigned long long)sb.st_size);
+			evhttp_add_header(headers, "Content-Range", buf);
+			evhttp_send_reply(req, HTTP_BADRANGE, NULL, NULL);
+			goto done;
+		}
+		if (r > 0) {
+			evutil_snprintf(buf, sizeof(buf), "bytes %llu-%llu/%llu",
+			    (unsigned long long)off,
+			    (unsigned long long)(off + length - 1),
+			    (unsigned long long)sb.st_size);
+			evhttp_add_header(headers, "Content-Range", buf);
+			code = HTTP_PARTIALCONTENT;
+		}
+	}
+
+	evhttp_add_header(headers, "Content-Type",
+	    evhttp_static_content_type(path));
+	evutil_snprintf(buf, sizeof(buf), "%llu", (unsigned long long)length);
+	evhttp_add_header(headers, "Content-Length", buf);
+
+	if (req->type != EVHTTP_REQ_HEAD && length > 0) {
+		/* Only a plain socket can take the file by sendfile(); HTTP/2
+		 * and filtering bufferevents get it mapped instead. */
+		int use_sendfile = evcon->h2 == NULL &&
+		    (bufferevent_get_output(evcon->bufev)->flags &
+			EVBUFFER_FLAG_DRAINS_TO_FD);
+
+		if (use_sendfile)
+			evbuffer_set_flags(req->output_buffer,
+			    EVBUFFER_FLAG_DRAINS_TO_FD);
+		if (evbuffer_add_file_segment(req->output_buffer, seg, off,
+			length) < 0) {
+			evbuffer_clear_flags(req->output_buffer,
+			    EVBUFFER_FLAG_DRAINS_TO_FD);
+			evhttp_clear_headers(headers);
+			evhttp_send_error(req, HTTP_INTERNAL, NULL);
+			goto done;
+		}
+		if (use_sendfile) {
+			/* Hold the headers back until the start of the body
+			 * can go with them. */
+			fd = bufferevent_getfd(evcon->bufev);
+			if (fd >= 0)
+				(void)setsockopt(fd, IPPROTO_TCP, TCP_CORK,
+				    &on, sizeof(on));
+			evhttp_request_set_on_complete_cb(req,
+			    evhttp_static_complete, NULL);
+		}
+	}
+
+	evhttp_send_reply(req, code, NULL, NULL);
+	goto done;
+
+notfound:
+	evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+done:
+	if (seg != NULL)
+		evbuffer_file_segment_free(seg);
+	if (path != NULL)
+		mm_free(path);
+	mm_free(decoded);
+}
+
+static void
+evhttp_static_free(void *arg)
+{
+	struct evhttp_static *st = arg;
+
+	mm_free(st->root);
+	mm_free(st);
+}
+
+int
+evhttp_serve_static(struct evhttp *http, const char *url_prefix,
+    const char *root_dir, int flags)
+{
+	struct evhttp_static *st;
+	char *pattern;
+	size_t prefixlen = strlen(url_prefix), rootlen = strlen(root_dir);
+	int r = -2;
+
+	if (prefixlen && *url_prefix != '/')
+		return (-1);
+	while (prefixlen && url_prefix[prefixlen - 1] == '/')
+		--prefixlen;
+	while (rootlen > 1 && root_dir[rootlen - 1] == '/')
+		--rootlen;
+
+	if ((st = mm_calloc(1, sizeof(*st))) == NULL ||
+	    (st->root = mm_malloc(rootlen + 1)) == NULL ||
+	    (pattern = mm_malloc(prefixlen + 3)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		goto err;
+	}
+	memcpy(st->root, root_dir, rootlen);
+	st->root[rootlen] = '\0';
+	st->prefixlen = prefixlen;
+	st->flags = flags;
+
+	memcpy(pattern, url_prefix, prefixlen);
+	memcpy(pattern + prefixlen, "/*", 3);
+	r = evhttp_add_cb_(http, pattern, 1, evhttp_static_cb, st);
+	mm_free(pattern);
+	if (r < 0)
+		goto err;
+	TAILQ_LAST(&http->callbacks, httpcbq)->cbarg_free = evhttp_static_free;
+	return (0);
+
+err:
+	if (st != NULL) {
+		if (st->root != NULL)
+			mm_free(st->root);
+		mm_free(st);
+	}
+	return (r < -2 ? -2 : r);
+}
+
 /*
  * Request related functions
  */
@@ -3922,9 +5684,14 @@ evhttp_request_free(struct evhttp_request *req)
 		mm_free(req->response_code_line);
 	if (req->host_cache != NULL)
 		mm_free(req->host_cache);
+	if (req->route_params != NULL)
+		mm_free(req->route_params);
+	if (req->held != NULL)
+		evhttp_held_response_free(req->held);
 
 	evhttp_clear_headers(req->input_headers);
 	mm_free(req->input_headers);
+	evhttp_arena_free(req->header_arena);
 
 	evhttp_clear_headers(req->output_headers);
 	mm_free(req->output_headers);
@@ -3950,6 +5717,22 @@ evhttp_request_is_owned(struct evhttp_request *req)
 	return (req->flags & EVHTTP_USER_OWNED) != 0;
 }
 
+const char *
+evhttp_request_get_route_param(const struct evhttp_request *req,
+    const char *name)
+{
+	const struct evhttp_route_params *params = req->route_params;
+	int i;
+
+	if (params == NULL)
+		return (NULL);
+	for (i = 0; i < params->n; ++i) {
+		if (!strcmp(params->names[i], name))
+			return (params->values[i]);
+	}
+	return (NULL);
+}
+
 struct evhttp_connection *
 evhttp_request_get_connection(struct evhttp_request *req)
 {
@@ -4132,8 +5915,11 @@ evhttp_get_request_connection(
 
 	evcon->max_headers_size = http->default_max_headers_size;
 	evcon->max_body_size = http->default_max_body_size;
+	evcon->pipeline_max = http->default_pipeline_max;
 	if (http->flags & EVHTTP_SERVER_LINGERING_CLOSE)
 		evcon->flags |= EVHTTP_CON_LINGERING_CLOSE;
+	if (http->flags & EVHTTP_SERVER_H2C)
+		evcon->flags |= EVHTTP_CON_H2C_PREFACE;
 
 	evcon->flags |= EVHTTP_CON_INCOMING;
 	evcon->state = EVCON_READING_FIRSTLINE;
@@ -4155,18 +5941,25 @@ err:
 	return (NULL);
 }
 
-static int
-evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
+/* Creates a request to be read from the incoming connection evcon, and
+ * handed to the server's callbacks once it has been. */
+struct evhttp_request *
+evhttp_request_new_incoming_(struct evhttp_connection *evcon)
 {
 	struct evhttp *http = evcon->http_server;
 	struct evhttp_request *req;
-	if ((req = evhttp_request_new(evhttp_handle_request, http)) == NULL)
-		return (-1);
+	if ((req = evcon->spare_req) != NULL) {
+		evcon->spare_req = NULL;
+		req->cb = evhttp_handle_request;
+		req->cb_arg = http;
+	} else if ((req = evhttp_request_new(evhttp_handle_request, http)) == NULL)
+		return (NULL);
 
-	if ((req->remote_host = mm_strdup(evcon->address)) == NULL) {
+	if (req->remote_host == NULL &&
+	    (req->remote_host = mm_strdup(evcon->address)) == NULL) {
 		event_warn("%s: strdup", __func__);
 		evhttp_request_free(req);
-		return (-1);
+		return (NULL);
 	}
 	req->remote_port = evcon->port;
 
@@ -4180,10 +5973,20 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 	 */
 	req->userdone = 1;
 
-	TAILQ_INSERT_TAIL(&evcon->requests, req, next);
-
 	req->kind = EVHTTP_REQUEST;
 
+	return (req);
+}
+
+static int
+evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req;
+
+	if ((req = evhttp_request_new_incoming_(evcon)) == NULL)
+		return (-1);
+
+	TAILQ_INSERT_TAIL(&evcon->requests, req, next);
 
 	evhttp_start_read_(evcon);
 
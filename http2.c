@@ -0,0 +1,2252 @@
+/*
+ * Copyright (c) 2002-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HTTP/2 over cleartext TCP (RFC 9113, RFC 7541) for the evhttp server.
+ *
+ * A connection switches to HTTP/2 either because the client opened it with
+ * the HTTP/2 connection preface ("prior knowledge"), or because it asked
+ * to upgrade its first HTTP/1.1 request.  From then on every stream carries
+ * one request, which is handed to the server's callbacks like any other
+ * once it has been read in full; the evhttp_send_reply*() functions turn
+ * the response into HEADERS and DATA frames for that stream.
+ *
+ * Requests on streams are not kept in evcon->requests: each stream owns its
+ * request, and the connection owns the streams.  Responses are sent as the
+ * peer's flow control windows allow, taking one frame from each stream with
+ * data in turn.  Server push and priorities are not supported.
+ */
+
+#include "event2/event-config.h"
+#include "evconfig-private.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event2/http.h"
+#include "event2/event.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/http_struct.h"
+#include "event2/util.h"
+#include "log-internal.h"
+#include "util-internal.h"
+#include "http-internal.h"
+#include "mm-internal.h"
+#include "defer-internal.h"
+
+#ifndef MIN
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN		24
+#define H2_FRAME_HEADER_LEN	9
+
+/* frame types */
+#define H2_DATA			0x0
+#define H2_HEADERS		0x1
+#define H2_PRIORITY		0x2
+#define H2_RST_STREAM		0x3
+#define H2_SETTINGS		0x4
+#define H2_PUSH_PROMISE		0x5
+#define H2_PING			0x6
+#define H2_GOAWAY		0x7
+#define H2_WINDOW_UPDATE	0x8
+#define H2_CONTINUATION		0x9
+
+/* frame flags */
+#define H2_FLAG_END_STREAM	0x01
+#define H2_FLAG_ACK		0x01
+#define H2_FLAG_END_HEADERS	0x04
+#define H2_FLAG_PADDED		0x08
+#define H2_FLAG_PRIORITY	0x20
+
+/* error codes */
+#define H2_NO_ERROR		0x0
+#define H2_PROTOCOL_ERROR	0x1
+#define H2_INTERNAL_ERROR	0x2
+#define H2_FLOW_CONTROL_ERROR	0x3
+#define H2_STREAM_CLOSED	0x5
+#define H2_FRAME_SIZE_ERROR	0x6
+#define H2_REFUSED_STREAM	0x7
+#define H2_COMPRESSION_ERROR	0x9
+#define H2_ENHANCE_YOUR_CALM	0xb
+
+/* settings */
+#define H2_SETTINGS_HEADER_TABLE_SIZE		0x1
+#define H2_SETTINGS_ENABLE_PUSH			0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS	0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE		0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE		0x5
+
+#define H2_DEFAULT_WINDOW	65535
+#define H2_MAX_WINDOW		0x7fffffff
+#define H2_DEFAULT_FRAME_SIZE	16384
+#define H2_MAX_FRAME_SIZE	0xffffff
+
+/* what we allow the client */
+#define H2_MAX_STREAMS		128
+#define H2_STREAM_WINDOW	(1 << 20)
+#define H2_CONN_WINDOW		(1 << 24)
+/* how much request body a connection may hold before flow control credit
+ * for more waits on the application draining it */
+#define H2_MAX_BUFFERED		(16 * 1024 * 1024)
+#define H2_MAX_HEADER_BLOCK	(256 * 1024)
+/* how many open streams the client may reset each H2_RESET_INTERVAL
+ * seconds before we take it for an attack and close the connection */
+#define H2_MAX_RESETS		100
+#define H2_RESET_INTERVAL	1
+
+/* the size of both HPACK tables; every entry takes at least 32 octets */
+#define H2_HPACK_TABLE_SIZE	4096
+#define H2_HPACK_SLOTS		(H2_HPACK_TABLE_SIZE / 32)
+
+/* how much of the response data to queue on the bufferevent at a time */
+#define H2_OUTPUT_HIGH		(64 * 1024)
+
+/* A growable scratch buffer. */
+struct evhttp_h2_buf {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+};
+
+/* An entry of an HPACK dynamic table, name and value NUL terminated. */
+struct evhttp_hpack_entry {
+	size_t name_len;
+	size_t value_len;
+	char *value;
+	char name[1];
+};
+
+/* An HPACK dynamic table, kept as a ring of its newest entries. */
+struct evhttp_hpack {
+	struct evhttp_hpack_entry *ents[H2_HPACK_SLOTS];
+	unsigned head;			/* the slot the next entry goes to */
+	unsigned n;			/* the number of entries */
+	size_t size;			/* their size, as RFC 7541 counts it */
+	size_t max_size;
+};
+
+struct evhttp_h2_stream {
+	TAILQ_ENTRY(evhttp_h2_stream) next;
+
+	uint32_t id;
+	struct evhttp_request *req;
+
+	int64_t send_window;
+	int64_t recv_window;		/* DATA the client may still send */
+	uint32_t recv_unacked;		/* DATA read and not yet credited */
+	/* request body in req->input_buffer that the application has not
+	 * drained, and how much of that we have not credited yet */
+	size_t buffered;
+	size_t held;
+	struct evbuffer_cb_entry *body_cb;
+	/* the request's content-length, or -1 if it has none */
+	int64_t content_length;
+
+	/* response body that flow control has held back */
+	struct evbuffer *pending;
+	/* called once pending has gone out, @see evhttp_send_reply_chunk_with_cb */
+	void (*cb)(struct evhttp_connection *, void *);
+	void *cb_arg;
+
+	unsigned remote_closed:1,	/* the request has been read in full */
+	    dispatched:1,		/* the request went to the callbacks */
+	    headers_sent:1,
+	    end_queued:1,		/* the user has sent all data */
+	    finished:1;			/* END_STREAM went out */
+};
+
+TAILQ_HEAD(evhttp_h2_streamq, evhttp_h2_stream);
+
+struct evhttp_h2 {
+	struct evhttp_connection *evcon;
+
+	struct evhttp_h2_streamq streams;
+	int nstreams;
+	uint32_t last_stream_id;
+
+	/* a header block being collected from HEADERS and CONTINUATION
+	 * frames, for hblock_stream if that is not 0 */
+	struct evhttp_h2_buf hblock;
+	uint32_t hblock_stream;
+	unsigned hblock_end_stream:1;
+
+	/* scratch space for decoded strings and encoded header blocks */
+	struct evhttp_h2_buf str;
+	struct evhttp_h2_buf out;
+
+	struct evhttp_hpack dec;
+	struct evhttp_hpack enc;
+	/* the encoder table was resized, and the peer has to be told the
+	 * smallest size it had since */
+	unsigned enc_resized:1;
+	size_t enc_resize_min;
+
+	unsigned need_preface:1,
+	    got_settings:1,
+	    peer_goaway:1,
+	    closing:1;			/* GOAWAY went out; close once flushed */
+
+	/* the peer's settings, and flow control for the connection */
+	uint32_t peer_max_frame;
+	int64_t peer_initial_window;
+	int64_t send_window;
+	int64_t recv_window;		/* DATA the client may still send */
+	uint32_t recv_unacked;		/* DATA read and not yet credited */
+	/* the sum of the streams' buffered and held */
+	size_t buffered;
+	size_t held;
+
+	/* streams the client has reset since resets_since */
+	unsigned n_resets;
+	time_t resets_since;
+};
+
+/* RFC 7541, appendix A */
+static const struct evhttp_hpack_static {
+	const char *name;
+	const char *value;
+} evhttp_hpack_static[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/* RFC 7541, appendix B: the code for each symbol, EOS last */
+static const uint32_t evhttp_hpack_huff_code[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+	0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+	0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+	0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+	0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+	0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+	0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+	0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+	0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+	0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+	0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+	0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+	0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+	0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+	0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+	0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+	0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+	0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+	0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+	0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+	0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+	0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+	0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+	0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+	0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+	0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+	0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+	0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+	0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+	0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+	0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+	0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const uint8_t evhttp_hpack_huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+/* The code is canonical: the symbols in code order, and for each code
+ * length the first code of that length and where its symbols start. */
+static const uint16_t evhttp_hpack_huff_sym[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+	45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+	95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+	58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+	106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+	88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+	0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+	167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+	132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+	173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+	151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+	183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+	171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+	255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+	246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+	6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+	249, 10, 13, 22, 256,
+};
+static const struct evhttp_hpack_huff_range {
+	uint32_t first;
+	uint16_t count;
+	uint16_t index;
+} evhttp_hpack_huff_dec[31] = {
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0x0, 10, 0 },	/* 5 bits */
+	{ 0x14, 26, 10 },	/* 6 bits */
+	{ 0x5c, 32, 36 },	/* 7 bits */
+	{ 0xf8, 6, 68 },	/* 8 bits */
+	{ 0, 0, 0 },
+	{ 0x3f8, 5, 74 },	/* 10 bits */
+	{ 0x7fa, 3, 79 },	/* 11 bits */
+	{ 0xffa, 2, 82 },	/* 12 bits */
+	{ 0x1ff8, 6, 84 },	/* 13 bits */
+	{ 0x3ffc, 2, 90 },	/* 14 bits */
+	{ 0x7ffc, 3, 92 },	/* 15 bits */
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0, 0, 0 },
+	{ 0x7fff0, 3, 95 },	/* 19 bits */
+	{ 0xfffe6, 8, 98 },	/* 20 bits */
+	{ 0x1fffdc, 13, 106 },	/* 21 bits */
+	{ 0x3fffd2, 26, 119 },	/* 22 bits */
+	{ 0x7fffd8, 29, 145 },	/* 23 bits */
+	{ 0xffffea, 12, 174 },	/* 24 bits */
+	{ 0x1ffffec, 4, 186 },	/* 25 bits */
+	{ 0x3ffffe0, 15, 190 },	/* 26 bits */
+	{ 0x7ffffde, 19, 205 },	/* 27 bits */
+	{ 0xfffffe2, 29, 224 },	/* 28 bits */
+	{ 0, 0, 0 },
+	{ 0x3ffffffc, 4, 253 },	/* 30 bits */
+};
+
+#define H2_HPACK_STATIC_LEN \
+	(sizeof(evhttp_hpack_static) / sizeof(evhttp_hpack_static[0]))
+
+static void
+evhttp_hpack_evict(struct evhttp_hpack *t)
+{
+	struct evhttp_hpack_entry **e =
+	    &t->ents[(t->head - t->n) % H2_HPACK_SLOTS];
+
+	t->size -= (*e)->name_len + (*e)->value_len + 32;
+	mm_free(*e);
+	*e = NULL;
+	--t->n;
+}
+
+static void
+evhttp_hpack_resize(struct evhttp_hpack *t, size_t max_size)
+{
+	t->max_size = max_size;
+	while (t->n && t->size > t->max_size)
+		evhttp_hpack_evict(t);
+}
+
+static void
+evhttp_hpack_clear(struct evhttp_hpack *t)
+{
+	while (t->n)
+		evhttp_hpack_evict(t);
+}
+
+/* Adds an entry to t.  name and value may belong to an entry this evicts,
+ * so the new one is made first. */
+static int
+evhttp_hpack_add(struct evhttp_hpack *t, const char *name, size_t name_len,
+    const char *value, size_t value_len)
+{
+	struct evhttp_hpack_entry *e;
+	size_t size = name_len + value_len + 32;
+
+	if (size > t->max_size) {
+		evhttp_hpack_clear(t);
+		return (0);
+	}
+
+	e = mm_malloc(offsetof(struct evhttp_hpack_entry, name) +
+	    name_len + value_len + 2);
+	if (e == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	e->name_len = name_len;
+	e->value_len = value_len;
+	memcpy(e->name, name, name_len);
+	e->name[name_len] = '\0';
+	e->value = e->name + name_len + 1;
+	memcpy(e->value, value, value_len);
+	e->value[value_len] = '\0';
+
+	while (t->n && t->size + size > t->max_size)
+		evhttp_hpack_evict(t);
+	t->ents[t->head++ % H2_HPACK_SLOTS] = e;
+	++t->n;
+	t->size += size;
+	return (0);
+}
+
+/* Looks up the entry at index (1-based, static table first) of t. */
+static int
+evhttp_hpack_get(struct evhttp_hpack *t, uint32_t index,
+    const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+	const struct evhttp_hpack_entry *e;
+
+	if (index == 0)
+		return (-1);
+	if (index <= H2_HPACK_STATIC_LEN) {
+		*name = evhttp_hpack_static[index - 1].name;
+		*name_len = strlen(*name);
+		*value = evhttp_hpack_static[index - 1].value;
+		*value_len = strlen(*value);
+		return (0);
+	}
+	index -= H2_HPACK_STATIC_LEN;
+	if (index > t->n)
+		return (-1);
+	e = t->ents[(t->head - index) % H2_HPACK_SLOTS];
+	*name = e->name;
+	*name_len = e->name_len;
+	*value = e->value;
+	*value_len = e->value_len;
+	return (0);
+}
+
+/* Finds the index of name (lower case) and value in t; sets *full if the
+ * value matched, too.  Returns 0 if not even the name did. */
+static uint32_t
+evhttp_hpack_find(struct evhttp_hpack *t, const char *name, size_t name_len,
+    const char *value, size_t value_len, int *full)
+{
+	const struct evhttp_hpack_entry *e;
+	uint32_t found = 0;
+	unsigned i;
+
+	*full = 0;
+	for (i = 0; i < H2_HPACK_STATIC_LEN; ++i) {
+		if (strncmp(evhttp_hpack_static[i].name, name, name_len) ||
+		    evhttp_hpack_static[i].name[name_len] != '\0')
+			continue;
+		if (!strncmp(evhttp_hpack_static[i].value, value, value_len) &&
+		    evhttp_hpack_static[i].value[value_len] == '\0') {
+			*full = 1;
+			return (i + 1);
+		}
+		if (found == 0)
+			found = i + 1;
+	}
+	for (i = 1; i <= t->n; ++i) {
+		e = t->ents[(t->head - i) % H2_HPACK_SLOTS];
+		if (e->name_len != name_len || memcmp(e->name, name, name_len))
+			continue;
+		if (e->value_len == value_len &&
+		    !memcmp(e->value, value, value_len)) {
+			*full = 1;
+			return (H2_HPACK_STATIC_LEN + i);
+		}
+		if (found == 0)
+			found = H2_HPACK_STATIC_LEN + i;
+	}
+	return (found);
+}
+
+static int
+evhttp_hpack_get_int(const unsigned char **pp, const unsigned char *end,
+    int prefix, uint32_t *out)
+{
+	const unsigned char *p = *pp;
+	uint32_t mask = (1u << prefix) - 1;
+	uint32_t v;
+	int shift = 0;
+
+	if (p == end)
+		return (-1);
+	v = *p++ & mask;
+	if (v == mask) {
+		unsigned char b;
+		do {
+			/* nothing we accept needs more than 28 bits */
+			if (p == end || shift > 21)
+				return (-1);
+			b = *p++;
+			v += (uint32_t)(b & 0x7f) << shift;
+			shift += 7;
+		} while (b & 0x80);
+	}
+	*pp = p;
+	*out = v;
+	return (0);
+}
+
+static unsigned char *
+evhttp_hpack_put_int(unsigned char *p, unsigned char first, int prefix,
+    size_t v)
+{
+	size_t mask = ((size_t)1 << prefix) - 1;
+
+	if (v < mask) {
+		*p++ = first | v;
+		return (p);
+	}
+	*p++ = first | mask;
+	v -= mask;
+	while (v >= 0x80) {
+		*p++ = 0x80 | (v & 0x7f);
+		v >>= 7;
+	}
+	*p++ = v;
+	return (p);
+}
+
+/* Decodes len octets of Huffman coded data at in into out, which must have
+ * room for len * 8 / 5 octets.  Returns the decoded length or -1. */
+static ssize_t
+evhttp_hpack_huff_decode(const unsigned char *in, size_t len, char *out)
+{
+	const unsigned char *end = in + len;
+	const struct evhttp_hpack_huff_range *r;
+	uint64_t acc = 0;
+	uint32_t code;
+	char *o = out;
+	int bits = 0;
+	int n;
+
+	while (in < end || bits > 0) {
+		/* keep the pending bits at the top of acc */
+		while (bits <= 56 && in < end) {
+			acc |= (uint64_t)*in++ << (56 - bits);
+			bits += 8;
+		}
+		for (n = 5; n <= 30; ++n) {
+			if (n > bits) {
+				/* only padding, a prefix of EOS, may be left */
+				if (bits > 7 ||
+				    (acc >> (64 - bits)) != (1u << bits) - 1)
+					return (-1);
+				return (o - out);
+			}
+			code = acc >> (64 - n);
+			r = &evhttp_hpack_huff_dec[n];
+			if (code - r->first < r->count)
+				break;
+		}
+		if (n > 30)
+			return (-1);
+		code = evhttp_hpack_huff_sym[r->index + code - r->first];
+		if (code == 256)
+			return (-1);
+		*o++ = (char)code;
+		acc <<= n;
+		bits -= n;
+	}
+	return (o - out);
+}
+
+static size_t
+evhttp_hpack_huff_size(const char *s, size_t len)
+{
+	size_t bits = 0;
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		bits += evhttp_hpack_huff_len[(unsigned char)s[i]];
+	return ((bits + 7) / 8);
+}
+
+static unsigned char *
+evhttp_hpack_huff_encode(unsigned char *p, const char *s, size_t len)
+{
+	uint64_t acc = 0;
+	int bits = 0;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+		acc = (acc << evhttp_hpack_huff_len[c]) |
+		    evhttp_hpack_huff_code[c];
+		bits += evhttp_hpack_huff_len[c];
+		while (bits >= 8) {
+			bits -= 8;
+			*p++ = (unsigned char)(acc >> bits);
+		}
+	}
+	if (bits > 0)
+		*p++ = (unsigned char)((acc << (8 - bits)) | (0xff >> bits));
+	return (p);
+}
+
+/* Writes a string literal, Huffman coded if that is shorter. */
+static unsigned char *
+evhttp_hpack_put_str(unsigned char *p, const char *s, size_t len)
+{
+	size_t hlen = evhttp_hpack_huff_size(s, len);
+
+	if (hlen < len) {
+		p = evhttp_hpack_put_int(p, 0x80, 7, hlen);
+		return (evhttp_hpack_huff_encode(p, s, len));
+	}
+	p = evhttp_hpack_put_int(p, 0x00, 7, len);
+	memcpy(p, s, len);
+	return (p + len);
+}
+
+static int
+evhttp_h2_reserve(struct evhttp_h2_buf *buf, size_t size)
+{
+	unsigned char *p;
+	size_t n = buf->size ? buf->size : 256;
+
+	if (size <= buf->size)
+		return (0);
+	while (n < size)
+		n <<= 1;
+	if ((p = mm_realloc(buf->data, n)) == NULL) {
+		event_warn("%s: realloc", __func__);
+		return (-1);
+	}
+	buf->data = p;
+	buf->size = n;
+	return (0);
+}
+
+static uint32_t
+evhttp_h2_get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]);
+}
+
+static void
+evhttp_h2_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static struct evbuffer *
+evhttp_h2_output(struct evhttp_h2 *h2)
+{
+	return (bufferevent_get_output(h2->evcon->bufev));
+}
+
+/* Queues a frame header; the caller adds the len octets of payload. */
+static void
+evhttp_h2_frame(struct evhttp_h2 *h2, size_t len, unsigned char type,
+    unsigned char flags, uint32_t stream_id)
+{
+	unsigned char hdr[H2_FRAME_HEADER_LEN];
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	evhttp_h2_put32(hdr + 5, stream_id);
+	evbuffer_add(evhttp_h2_output(h2), hdr, sizeof(hdr));
+}
+
+static void
+evhttp_h2_rst_stream(struct evhttp_h2 *h2, uint32_t stream_id,
+    uint32_t error)
+{
+	unsigned char payload[4];
+
+	evhttp_h2_put32(payload, error);
+	evhttp_h2_frame(h2, sizeof(payload), H2_RST_STREAM, 0, stream_id);
+	evbuffer_add(evhttp_h2_output(h2), payload, sizeof(payload));
+}
+
+static void
+evhttp_h2_window_update(struct evhttp_h2 *h2, uint32_t stream_id,
+    uint32_t increment)
+{
+	unsigned char payload[4];
+
+	evhttp_h2_put32(payload, increment);
+	evhttp_h2_frame(h2, sizeof(payload), H2_WINDOW_UPDATE, 0, stream_id);
+	evbuffer_add(evhttp_h2_output(h2), payload, sizeof(payload));
+}
+
+/* Tells the peer we are going away, and closes the connection once all
+ * that is queued has been written. */
+static void
+evhttp_h2_goaway(struct evhttp_h2 *h2, uint32_t error)
+{
+	struct bufferevent *bev = h2->evcon->bufev;
+	unsigned char payload[8];
+
+	if (h2->closing)
+		return;
+	h2->closing = 1;
+
+	event_debug(("%s: closing with error %u on "EV_SOCK_FMT"\n",
+		__func__, (unsigned)error, EV_SOCK_ARG(h2->evcon->fd)));
+
+	evhttp_h2_put32(payload, h2->last_stream_id);
+	evhttp_h2_put32(payload + 4, error);
+	evhttp_h2_frame(h2, sizeof(payload), H2_GOAWAY, 0, 0);
+	evbuffer_add(evhttp_h2_output(h2), payload, sizeof(payload));
+
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_enable(bev, EV_WRITE);
+}
+
+/* Gives the client back n octets of flow control window, on the
+ * connection and, if s is not NULL, on s.  Updates are batched until half
+ * a window is due. */
+static void
+evhttp_h2_credit(struct evhttp_h2 *h2, struct evhttp_h2_stream *s, size_t n)
+{
+	if (h2->closing || n == 0)
+		return;
+
+	h2->recv_unacked += n;
+	if (h2->recv_unacked >= H2_CONN_WINDOW / 2) {
+		evhttp_h2_window_update(h2, 0, h2->recv_unacked);
+		h2->recv_window += h2->recv_unacked;
+		h2->recv_unacked = 0;
+	}
+
+	/* nothing more can come on a stream the client has closed */
+	if (s == NULL || s->remote_closed)
+		return;
+	s->recv_unacked += n;
+	if (s->recv_unacked >= H2_STREAM_WINDOW / 2) {
+		evhttp_h2_window_update(h2, s->id, s->recv_unacked);
+		s->recv_window += s->recv_unacked;
+		s->recv_unacked = 0;
+	}
+}
+
+/* Credits held request body for as long as the connection holds less
+ * than H2_MAX_BUFFERED octets that have been credited and not drained. */
+static void
+evhttp_h2_release(struct evhttp_h2 *h2)
+{
+	struct evhttp_h2_stream *s;
+	size_t n;
+
+	TAILQ_FOREACH(s, &h2->streams, next) {
+		if (h2->held == 0 ||
+		    h2->buffered - h2->held >= H2_MAX_BUFFERED)
+			return;
+		n = MIN(s->held, H2_MAX_BUFFERED - (h2->buffered - h2->held));
+		s->held -= n;
+		h2->held -= n;
+		evhttp_h2_credit(h2, s, n);
+	}
+}
+
+/* Called as the request body on s changes; credits what the application
+ * drains from it. */
+static void
+evhttp_h2_body_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+    void *arg)
+{
+	struct evhttp_h2_stream *s = arg;
+	struct evhttp_h2 *h2 = s->req->evcon->h2;
+	size_t n = MIN(info->n_deleted, s->buffered);
+
+	if (n == 0)
+		return;
+	s->buffered -= n;
+	h2->buffered -= n;
+	/* what was drained had not all been credited */
+	if (s->held > s->buffered) {
+		n = s->held - s->buffered;
+		s->held -= n;
+		h2->held -= n;
+		evhttp_h2_credit(h2, s, n);
+	}
+	evhttp_h2_release(h2);
+}
+
+static struct evhttp_h2_stream *
+evhttp_h2_stream_find(struct evhttp_h2 *h2, uint32_t stream_id)
+{
+	struct evhttp_h2_stream *s;
+
+	TAILQ_FOREACH(s, &h2->streams, next) {
+		if (s->id == stream_id)
+			return (s);
+	}
+	return (NULL);
+}
+
+/* Opens a stream, for req or else for a new request. */
+static struct evhttp_h2_stream *
+evhttp_h2_stream_new(struct evhttp_h2 *h2, uint32_t stream_id,
+    struct evhttp_request *req)
+{
+	struct evhttp_h2_stream *s;
+	struct evhttp_request *new_req = NULL;
+
+	if ((s = mm_calloc(1, sizeof(*s))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if (req == NULL &&
+	    (req = new_req = evhttp_request_new_incoming_(h2->evcon)) == NULL) {
+		mm_free(s);
+		return (NULL);
+	}
+	s->body_cb = evbuffer_add_cb(req->input_buffer, evhttp_h2_body_cb, s);
+	if (s->body_cb == NULL) {
+		if (new_req != NULL)
+			evhttp_request_free(new_req);
+		mm_free(s);
+		return (NULL);
+	}
+	req->h2_stream = s;
+	req->major = 2;
+	req->minor = 0;
+
+	s->id = stream_id;
+	s->req = req;
+	s->send_window = h2->peer_initial_window;
+	s->recv_window = H2_STREAM_WINDOW;
+	s->content_length = -1;
+	TAILQ_INSERT_TAIL(&h2->streams, s, next);
+	++h2->nstreams;
+	return (s);
+}
+
+static void
+evhttp_h2_stream_free(struct evhttp_h2 *h2, struct evhttp_h2_stream *s)
+{
+	struct evhttp_request *req = s->req;
+
+	TAILQ_REMOVE(&h2->streams, s, next);
+	--h2->nstreams;
+	if (s->pending != NULL)
+		evbuffer_free(s->pending);
+	evbuffer_remove_cb_entry(req->input_buffer, s->body_cb);
+	/* the body is no longer the connection's to hold */
+	h2->buffered -= s->buffered;
+	h2->held -= s->held;
+	evhttp_h2_credit(h2, NULL, s->held);
+	evhttp_h2_release(h2);
+	mm_free(s);
+
+	/* a request the user is still working on is left to them, as
+	 * evhttp_connection_detach_pending() does */
+	req->h2_stream = NULL;
+	if (!req->userdone || (req->flags & EVHTTP_USER_OWNED))
+		req->evcon = NULL;
+	else
+		evhttp_request_free(req);
+}
+
+/* The response on s has gone out in full. */
+static void
+evhttp_h2_stream_done(struct evhttp_h2 *h2, struct evhttp_h2_stream *s)
+{
+	struct evhttp_request *req = s->req;
+
+	/* whatever is left of the request is of no more use */
+	if (!s->remote_closed)
+		evhttp_h2_rst_stream(h2, s->id, H2_NO_ERROR);
+
+	if (req->on_complete_cb != NULL)
+		req->on_complete_cb(req, req->on_complete_cb_arg);
+
+	evhttp_h2_stream_free(h2, s);
+}
+
+/* Resets s, whose request is malformed (RFC 9113, 8.1.1). */
+static void
+evhttp_h2_stream_malformed(struct evhttp_h2 *h2, struct evhttp_h2_stream *s)
+{
+	s->remote_closed = 1;
+	evhttp_h2_rst_stream(h2, s->id, H2_PROTOCOL_ERROR);
+	evhttp_h2_stream_free(h2, s);
+}
+
+/* Hands the request on s to the server's callbacks. */
+static void
+evhttp_h2_dispatch(struct evhttp_h2 *h2, struct evhttp_h2_stream *s)
+{
+	struct evhttp_request *req = s->req;
+
+	s->dispatched = 1;
+
+	/* there is no tunneling over a stream */
+	if (req->type == EVHTTP_REQ_CONNECT) {
+		evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+		return;
+	}
+
+	(*req->cb)(req, req->cb_arg);
+}
+
+/* Sends response data from each stream in turn, as far as flow control
+ * and the output buffer allow, then retires the streams that are done. */
+static void
+evhttp_h2_flush(struct evhttp_h2 *h2)
+{
+	struct evbuffer *output = evhttp_h2_output(h2);
+	struct evhttp_h2_stream *s;
+	unsigned char flags;
+	size_t len, n;
+	int progress;
+
+	do {
+		progress = 0;
+		TAILQ_FOREACH(s, &h2->streams, next) {
+			if (h2->closing ||
+			    evbuffer_get_length(output) >= H2_OUTPUT_HIGH)
+				goto done;
+			if (!s->headers_sent || s->finished)
+				continue;
+
+			len = s->pending ? evbuffer_get_length(s->pending) : 0;
+			n = MIN(len, h2->peer_max_frame);
+			if (n > 0) {
+				if (s->send_window <= 0 || h2->send_window <= 0)
+					continue;
+				n = MIN(n, (size_t)s->send_window);
+				n = MIN(n, (size_t)h2->send_window);
+			} else if (!s->end_queued) {
+				continue;
+			}
+
+			flags = 0;
+			if (n == len && s->end_queued) {
+				flags = H2_FLAG_END_STREAM;
+				s->finished = 1;
+			}
+			evhttp_h2_frame(h2, n, H2_DATA, flags, s->id);
+			if (n > 0)
+				evbuffer_remove_buffer(s->pending, output, n);
+			s->send_window -= n;
+			h2->send_window -= n;
+			progress = 1;
+		}
+	} while (progress);
+
+done:
+	/* completion callbacks may send, and retire streams themselves */
+	for (;;) {
+		TAILQ_FOREACH(s, &h2->streams, next) {
+			if (s->finished)
+				break;
+		}
+		if (s == NULL)
+			break;
+		evhttp_h2_stream_done(h2, s);
+	}
+
+	if (h2->peer_goaway && TAILQ_EMPTY(&h2->streams))
+		evhttp_h2_goaway(h2, H2_NO_ERROR);
+}
+
+/* Headers that only mean something to a single HTTP/1.x connection. */
+static int
+evhttp_h2_is_connection_header(const char *key)
+{
+	return (!evutil_ascii_strcasecmp(key, "Connection") ||
+	    !evutil_ascii_strcasecmp(key, "Keep-Alive") ||
+	    !evutil_ascii_strcasecmp(key, "Proxy-Connection") ||
+	    !evutil_ascii_strcasecmp(key, "Transfer-Encoding") ||
+	    !evutil_ascii_strcasecmp(key, "Upgrade"));
+}
+
+/* Adds a response header to the header block being built in h2->out. */
+static int
+evhttp_h2_encode_header(struct evhttp_h2 *h2, const char *key,
+    const char *value)
+{
+	size_t name_len = strlen(key), value_len = strlen(value);
+	unsigned char *p;
+	char *name;
+	uint32_t index;
+	int full, indexing;
+	size_t i;
+
+	if (evhttp_h2_reserve(&h2->str, name_len + 1) < 0 ||
+	    evhttp_h2_reserve(&h2->out,
+		h2->out.len + name_len + value_len + 16) < 0)
+		return (-1);
+
+	name = (char *)h2->str.data;
+	for (i = 0; i < name_len; ++i)
+		name[i] = EVUTIL_TOLOWER_(key[i]);
+	name[name_len] = '\0';
+
+	p = h2->out.data + h2->out.len;
+	index = evhttp_hpack_find(&h2->enc, name, name_len, value, value_len,
+	    &full);
+	if (full) {
+		p = evhttp_hpack_put_int(p, 0x80, 7, index);
+	} else {
+		/* keep values that change with every response, or that are
+		 * better not kept, out of the table */
+		indexing = strcmp(name, "content-length") &&
+		    strcmp(name, "set-cookie") && strcmp(name, "etag") &&
+		    strcmp(name, "last-modified");
+		p = evhttp_hpack_put_int(p, indexing ? 0x40 : 0x00,
+		    indexing ? 6 : 4, index);
+		if (index == 0)
+			p = evhttp_hpack_put_str(p, name, name_len);
+		p = evhttp_hpack_put_str(p, value, value_len);
+		if (indexing && evhttp_hpack_add(&h2->enc, name, name_len,
+			value, value_len) < 0)
+			return (-1);
+	}
+	h2->out.len = p - h2->out.data;
+	return (0);
+}
+
+/* Completes the response headers of req the way evhttp_make_header()
+ * would, and sends them on s; end is set if body_len octets are all there
+ * is to the response. */
+static int
+evhttp_h2_send_headers(struct evhttp_h2 *h2, struct evhttp_h2_stream *s,
+    int end, size_t body_len)
+{
+	struct evhttp_request *req = s->req;
+	struct evhttp *http = h2->evcon->http_server;
+	const struct evkeyvalq *sh = evhttp_static_headers_(http);
+	struct evkeyval *header;
+	char buf[32];
+	size_t off, len;
+	unsigned char flags;
+
+	evhttp_maybe_add_date_header_(http, req->output_headers);
+	if (evhttp_response_needs_body_(req)) {
+		if (evhttp_find_header(req->output_headers,
+			"Content-Type") == NULL &&
+		    !(sh && evhttp_find_header(sh, "Content-Type")) &&
+		    http->default_content_type)
+			evhttp_add_header(req->output_headers, "Content-Type",
+			    http->default_content_type);
+		if (end && evhttp_find_header(req->output_headers,
+			"Content-Length") == NULL) {
+			evutil_snprintf(buf, sizeof(buf), EV_SIZE_FMT,
+			    EV_SIZE_ARG(body_len));
+			evhttp_add_header(req->output_headers,
+			    "Content-Length", buf);
+		}
+	}
+
+	h2->out.len = 0;
+	if (h2->enc_resized) {
+		if (evhttp_h2_reserve(&h2->out, 16) < 0)
+			return (-1);
+		h2->out.len = evhttp_hpack_put_int(h2->out.data, 0x20, 5,
+		    h2->enc_resize_min) - h2->out.data;
+		if (h2->enc.max_size != h2->enc_resize_min)
+			h2->out.len = evhttp_hpack_put_int(
+				h2->out.data + h2->out.len, 0x20, 5,
+				h2->enc.max_size) - h2->out.data;
+		h2->enc_resized = 0;
+	}
+
+	evutil_snprintf(buf, sizeof(buf), "%d", req->response_code);
+	if (evhttp_h2_encode_header(h2, ":status", buf) < 0)
+		return (-1);
+	TAILQ_FOREACH(header, req->output_headers, next) {
+		if (evhttp_h2_is_connection_header(header->key))
+			continue;
+		if (evhttp_h2_encode_header(h2, header->key,
+			header->value) < 0)
+			return (-1);
+	}
+	if (sh != NULL) {
+		TAILQ_FOREACH(header, sh, next) {
+			if (evhttp_find_header(req->output_headers,
+				header->key) != NULL)
+				continue;
+			if (evhttp_h2_encode_header(h2, header->key,
+				header->value) < 0)
+				return (-1);
+		}
+	}
+
+	/* HEADERS, then as many CONTINUATION frames as it takes */
+	end = end && body_len == 0;
+	flags = end ? H2_FLAG_END_STREAM : 0;
+	off = 0;
+	do {
+		len = MIN(h2->out.len - off, h2->peer_max_frame);
+		if (off + len == h2->out.len)
+			flags |= H2_FLAG_END_HEADERS;
+		evhttp_h2_frame(h2, len, off ? H2_CONTINUATION : H2_HEADERS,
+		    flags, s->id);
+		evbuffer_add(evhttp_h2_output(h2), h2->out.data + off, len);
+		off += len;
+		flags = 0;
+	} while (off < h2->out.len);
+
+	s->headers_sent = 1;
+	if (end) {
+		s->end_queued = 1;
+		s->finished = 1;
+	}
+	return (0);
+}
+
+void
+evhttp_h2_send_(struct evhttp_request *req, struct evbuffer *body, int end,
+    void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+	struct evhttp_h2 *h2 = req->evcon->h2;
+	struct evhttp_h2_stream *s = req->h2_stream;
+	size_t len = body ? evbuffer_get_length(body) : 0;
+
+	if (len > 0 && !evhttp_response_needs_body_(req)) {
+		evbuffer_drain(body, len);
+		len = 0;
+	}
+
+	if (h2->closing)
+		goto drop;
+
+	if (!s->headers_sent &&
+	    evhttp_h2_send_headers(h2, s, end, len) < 0)
+		goto fail;
+
+	if (len > 0) {
+		if (s->pending == NULL &&
+		    (s->pending = evbuffer_new()) == NULL)
+			goto fail;
+		evbuffer_add_buffer(s->pending, body);
+	}
+	if (cb != NULL) {
+		s->cb = cb;
+		s->cb_arg = arg;
+	}
+	if (end)
+		s->end_queued = 1;
+
+	evhttp_h2_flush(h2);
+	return;
+
+fail:
+	/* the encoder table may be out of step with the peer's now */
+	evhttp_h2_goaway(h2, H2_INTERNAL_ERROR);
+drop:
+	if (body != NULL)
+		evbuffer_drain(body, evbuffer_get_length(body));
+	if (end)
+		evhttp_h2_stream_free(h2, s);
+}
+
+#define H2_SEEN_METHOD		0x01
+#define H2_SEEN_SCHEME		0x02
+#define H2_SEEN_PATH		0x04
+#define H2_SEEN_AUTHORITY	0x08
+#define H2_SEEN_REGULAR		0x10
+
+static int
+evhttp_h2_add_cookie(struct evkeyvalq *headers, const char *value)
+{
+	const char *prev = evhttp_find_header(headers, "Cookie");
+	char *joined;
+	size_t len;
+	int res;
+
+	if (prev == NULL)
+		return (evhttp_add_header(headers, "Cookie", value));
+
+	/* the crumbs of a cookie go back together, RFC 7540 8.1.2.5 */
+	len = strlen(prev) + strlen(value) + 3;
+	if ((joined = mm_malloc(len)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	evutil_snprintf(joined, len, "%s; %s", prev, value);
+	evhttp_remove_header(headers, "Cookie");
+	res = evhttp_add_header(headers, "Cookie", joined);
+	mm_free(joined);
+	return (res);
+}
+
+/* Takes one decoded header field into req; -1 if that makes it
+ * malformed. */
+static int
+evhttp_h2_request_header(struct evhttp_request *req, const char *name,
+    size_t name_len, const char *value, size_t value_len, unsigned *seen)
+{
+	size_t i;
+
+	if (strlen(name) != name_len || memchr(value, '\0', value_len))
+		return (-1);
+	/* field names are lowercase, RFC 9113 8.2.1 */
+	for (i = 0; i < name_len; ++i) {
+		if (EVUTIL_ISUPPER_(name[i]))
+			return (-1);
+	}
+
+	if (name[0] == ':') {
+		unsigned bit;
+
+		if (*seen & H2_SEEN_REGULAR)
+			return (-1);
+		if (!strcmp(name, ":method")) {
+			bit = H2_SEEN_METHOD;
+			req->type = evhttp_parse_method_(value, value_len);
+		} else if (!strcmp(name, ":scheme")) {
+			bit = H2_SEEN_SCHEME;
+		} else if (!strcmp(name, ":path")) {
+			bit = H2_SEEN_PATH;
+			if (value_len == 0 || *seen & bit)
+				return (-1);
+			if ((req->uri = mm_strdup(value)) == NULL) {
+				event_warn("%s: strdup", __func__);
+				return (-1);
+			}
+		} else if (!strcmp(name, ":authority")) {
+			bit = H2_SEEN_AUTHORITY;
+			if (!(*seen & bit) && evhttp_add_header(
+				req->input_headers, "Host", value) < 0)
+				return (-1);
+		} else {
+			return (-1);
+		}
+		if (*seen & bit)
+			return (-1);
+		*seen |= bit;
+		return (0);
+	}
+
+	*seen |= H2_SEEN_REGULAR;
+	if (evhttp_h2_is_connection_header(name))
+		return (-1);
+	/* :authority stands in for Host */
+	if ((*seen & H2_SEEN_AUTHORITY) && !strcmp(name, "host"))
+		return (0);
+	if (!strcmp(name, "cookie"))
+		return (evhttp_h2_add_cookie(req->input_headers, value));
+	return (evhttp_add_header(req->input_headers, name, value));
+}
+
+/* Reads a string literal into h2->str at off, NUL terminated. */
+static int
+evhttp_h2_read_str(struct evhttp_h2 *h2, const unsigned char **pp,
+    const unsigned char *end, size_t off, size_t *lenp)
+{
+	const unsigned char *p = *pp;
+	uint32_t len;
+	ssize_t n;
+	int huffman;
+
+	if (p == end)
+		return (-1);
+	huffman = *p & 0x80;
+	if (evhttp_hpack_get_int(&p, end, 7, &len) < 0 ||
+	    len > (size_t)(end - p))
+		return (-1);
+	/* Huffman codes are at least 5 bits long */
+	if (evhttp_h2_reserve(&h2->str,
+		off + (huffman ? len * 8 / 5 : len) + 1) < 0)
+		return (-1);
+	if (huffman) {
+		n = evhttp_hpack_huff_decode(p, len,
+		    (char *)h2->str.data + off);
+		if (n < 0)
+			return (-1);
+	} else {
+		memcpy(h2->str.data + off, p, len);
+		n = len;
+	}
+	h2->str.data[off + n] = '\0';
+	*pp = p + len;
+	*lenp = n;
+	return (0);
+}
+
+/*
+ * Decodes a header block into the headers of req, or just to keep the
+ * decoder table in step if req is NULL.  Returns -1 if the connection
+ * has to go, and -2 if the request is malformed.
+ */
+static int
+evhttp_h2_decode_block(struct evhttp_h2 *h2, struct evhttp_request *req,
+    const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len;
+	const char *name, *value;
+	size_t name_len, value_len, off, total = 0;
+	const char *cl;
+	char *endp;
+	uint32_t index;
+	unsigned seen = 0;
+	int indexing, malformed = 0, too_large = 0, fields = 0;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			/* indexed header field */
+			indexing = 0;
+			if (evhttp_hpack_get_int(&p, end, 7, &index) < 0 ||
+			    evhttp_hpack_get(&h2->dec, index, &name, &name_len,
+				&value, &value_len) < 0)
+				goto compression;
+		} else if ((*p & 0xe0) == 0x20) {
+			/* dynamic table size update, which may only come
+			 * first, RFC 7541 4.2 */
+			if (fields ||
+			    evhttp_hpack_get_int(&p, end, 5, &index) < 0 ||
+			    index > H2_HPACK_TABLE_SIZE)
+				goto compression;
+			evhttp_hpack_resize(&h2->dec, index);
+			continue;
+		} else {
+			/* literal, with incremental indexing or not */
+			indexing = (*p & 0x40) != 0;
+			if (evhttp_hpack_get_int(&p, end, indexing ? 6 : 4,
+				&index) < 0)
+				goto compression;
+			off = 0;
+			if (index != 0) {
+				if (evhttp_hpack_get(&h2->dec, index, &name,
+					&name_len, &value, &value_len) < 0)
+					goto compression;
+			} else {
+				if (evhttp_h2_read_str(h2, &p, end, 0,
+					&name_len) < 0)
+					goto compression;
+				off = name_len + 1;
+			}
+			if (evhttp_h2_read_str(h2, &p, end, off,
+				&value_len) < 0)
+				goto compression;
+			if (index == 0)
+				name = (const char *)h2->str.data;
+			value = (const char *)h2->str.data + off;
+		}
+
+		fields = 1;
+		if (req != NULL && !malformed && !too_large) {
+			total += name_len + value_len + 32;
+			if (total > h2->evcon->max_headers_size)
+				too_large = 1;
+			else if (evhttp_h2_request_header(req, name, name_len,
+				value, value_len, &seen) < 0)
+				malformed = 1;
+		}
+
+		/* last, since this may evict what name points to */
+		if (indexing && evhttp_hpack_add(&h2->dec, name, name_len,
+			value, value_len) < 0) {
+			evhttp_h2_goaway(h2, H2_INTERNAL_ERROR);
+			return (-1);
+		}
+	}
+
+	if (req == NULL)
+		return (0);
+	if (malformed)
+		return (-2);
+	if (too_large) {
+		/* answered like an HTTP/1.x request with too many headers */
+		if (req->uri != NULL) {
+			mm_free(req->uri);
+			req->uri = NULL;
+		}
+		req->response_code = HTTP_BADREQUEST;
+		return (0);
+	}
+	if (!(seen & H2_SEEN_METHOD))
+		return (-2);
+	/* kept to check against the DATA that follows */
+	if ((cl = evhttp_find_header(req->input_headers,
+		    "Content-Length")) != NULL) {
+		if (!EVUTIL_ISDIGIT_(*cl))
+			return (-2);
+		req->h2_stream->content_length = evutil_strtoll(cl, &endp, 10);
+		if (*endp != '\0' || req->h2_stream->content_length < 0)
+			return (-2);
+	}
+	if (req->type == EVHTTP_REQ_CONNECT)
+		return (0);
+	if ((seen & (H2_SEEN_SCHEME|H2_SEEN_PATH)) !=
+	    (H2_SEEN_SCHEME|H2_SEEN_PATH))
+		return (-2);
+
+	if ((req->uri_elems = evhttp_uri_parse_with_flags(req->uri,
+		    EVHTTP_URI_NONCONFORMANT)) == NULL) {
+		mm_free(req->uri);
+		req->uri = NULL;
+		req->response_code = HTTP_BADREQUEST;
+	}
+	return (0);
+
+compression:
+	evhttp_h2_goaway(h2, H2_COMPRESSION_ERROR);
+	return (-1);
+}
+
+/* The request on stream_id has its headers; starts or ends the stream. */
+static void
+evhttp_h2_header_block(struct evhttp_h2 *h2, uint32_t stream_id,
+    int end_stream, const unsigned char *p, size_t len)
+{
+	struct evhttp_h2_stream *s = evhttp_h2_stream_find(h2, stream_id);
+	int res;
+
+	if (s != NULL) {
+		/* trailers, which end the request and are dropped */
+		if (s->remote_closed || !end_stream) {
+			evhttp_h2_goaway(h2, s->remote_closed ?
+			    H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+			return;
+		}
+		if (evhttp_h2_decode_block(h2, NULL, p, len) < 0)
+			return;
+		if (!s->dispatched && s->content_length >= 0 &&
+		    (uint64_t)s->content_length != s->req->body_size) {
+			evhttp_h2_stream_malformed(h2, s);
+			return;
+		}
+		s->remote_closed = 1;
+		if (!s->dispatched)
+			evhttp_h2_dispatch(h2, s);
+		return;
+	}
+
+	if (!(stream_id & 1) || stream_id <= h2->last_stream_id) {
+		evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+		return;
+	}
+	h2->last_stream_id = stream_id;
+
+	if (h2->nstreams >= H2_MAX_STREAMS || h2->peer_goaway ||
+	    (s = evhttp_h2_stream_new(h2, stream_id, NULL)) == NULL) {
+		if (evhttp_h2_decode_block(h2, NULL, p, len) == 0)
+			evhttp_h2_rst_stream(h2, stream_id, H2_REFUSED_STREAM);
+		return;
+	}
+
+	res = evhttp_h2_decode_block(h2, s->req, p, len);
+	if (res == -1)
+		return;
+	if (res == -2 || (end_stream && s->content_length > 0)) {
+		evhttp_h2_stream_malformed(h2, s);
+		return;
+	}
+
+	if (end_stream) {
+		s->remote_closed = 1;
+		evhttp_h2_dispatch(h2, s);
+	}
+}
+
+static void
+evhttp_h2_headers(struct evhttp_h2 *h2, unsigned char flags,
+    uint32_t stream_id, const unsigned char *p, size_t len)
+{
+	size_t pad = 0;
+
+	if (stream_id == 0)
+		goto protocol;
+	if (flags & H2_FLAG_PADDED) {
+		if (len < 1)
+			goto protocol;
+		pad = *p++;
+		--len;
+	}
+	if (flags & H2_FLAG_PRIORITY) {
+		if (len < 5)
+			goto protocol;
+		p += 5;
+		len -= 5;
+	}
+	if (pad > len)
+		goto protocol;
+	len -= pad;
+
+	if (flags & H2_FLAG_END_HEADERS) {
+		evhttp_h2_header_block(h2, stream_id,
+		    flags & H2_FLAG_END_STREAM, p, len);
+		return;
+	}
+
+	/* the rest of the block follows in CONTINUATION frames */
+	if (evhttp_h2_reserve(&h2->hblock, len) < 0) {
+		evhttp_h2_goaway(h2, H2_INTERNAL_ERROR);
+		return;
+	}
+	memcpy(h2->hblock.data, p, len);
+	h2->hblock.len = len;
+	h2->hblock_stream = stream_id;
+	h2->hblock_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+	return;
+
+protocol:
+	evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+}
+
+static void
+evhttp_h2_continuation(struct evhttp_h2 *h2, unsigned char flags,
+    const unsigned char *p, size_t len)
+{
+	struct evhttp_h2_buf *b = &h2->hblock;
+	uint32_t stream_id = h2->hblock_stream;
+
+	if (b->len + len > H2_MAX_HEADER_BLOCK) {
+		evhttp_h2_goaway(h2, H2_ENHANCE_YOUR_CALM);
+		return;
+	}
+	if (evhttp_h2_reserve(b, b->len + len) < 0) {
+		evhttp_h2_goaway(h2, H2_INTERNAL_ERROR);
+		return;
+	}
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+
+	if (flags & H2_FLAG_END_HEADERS) {
+		h2->hblock_stream = 0;
+		evhttp_h2_header_block(h2, stream_id, h2->hblock_end_stream,
+		    b->data, b->len);
+	}
+}
+
+/* Takes the len octets of payload of a DATA frame from input. */
+static void
+evhttp_h2_data(struct evhttp_h2 *h2, struct evbuffer *input,
+    unsigned char flags, uint32_t stream_id, size_t len)
+{
+	struct evhttp_h2_stream *s;
+	struct evhttp_request *req;
+	unsigned char pad = 0;
+	/* flow control counts the whole frame, padding included */
+	size_t frame = len;
+
+	if ((int64_t)frame > h2->recv_window) {
+		evbuffer_drain(input, frame);
+		evhttp_h2_goaway(h2, H2_FLOW_CONTROL_ERROR);
+		return;
+	}
+	h2->recv_window -= frame;
+
+	if (flags & H2_FLAG_PADDED) {
+		if (len < 1)
+			goto protocol;
+		evbuffer_remove(input, &pad, 1);
+		if (pad > --len)
+			goto protocol;
+		len -= pad;
+	}
+
+	s = evhttp_h2_stream_find(h2, stream_id);
+	if (s == NULL) {
+		if (stream_id == 0 || stream_id > h2->last_stream_id)
+			goto protocol;
+		/* on a stream since reset; it no longer matters */
+		evbuffer_drain(input, len + pad);
+		evhttp_h2_credit(h2, NULL, frame);
+		return;
+	}
+	if (s->remote_closed) {
+		evbuffer_drain(input, len + pad);
+		evhttp_h2_goaway(h2, H2_STREAM_CLOSED);
+		return;
+	}
+	if ((int64_t)frame > s->recv_window) {
+		evbuffer_drain(input, len + pad);
+		s->remote_closed = 1;
+		evhttp_h2_rst_stream(h2, s->id, H2_FLOW_CONTROL_ERROR);
+		evhttp_h2_stream_free(h2, s);
+		evhttp_h2_credit(h2, NULL, frame);
+		return;
+	}
+	s->recv_window -= frame;
+	if (s->dispatched) {
+		/* the request has been answered already */
+		evbuffer_drain(input, len + pad);
+		evhttp_h2_credit(h2, s, frame);
+		return;
+	}
+
+	req = s->req;
+	req->body_size += len;
+	if (s->content_length >= 0 &&
+	    (req->body_size > (uint64_t)s->content_length ||
+		((flags & H2_FLAG_END_STREAM) &&
+		    req->body_size != (uint64_t)s->content_length))) {
+		evbuffer_drain(input, len + pad);
+		evhttp_h2_stream_malformed(h2, s);
+		evhttp_h2_credit(h2, NULL, frame);
+		return;
+	}
+	if (req->body_size > h2->evcon->max_body_size ||
+	    req->body_size > H2_MAX_BUFFERED) {
+		evbuffer_drain(input, len + pad);
+		s->dispatched = 1;
+		evhttp_h2_credit(h2, s, frame);
+		evhttp_send_error(req, HTTP_ENTITYTOOLARGE, NULL);
+		return;
+	}
+	evbuffer_remove_buffer(input, req->input_buffer, len);
+	evbuffer_drain(input, pad);
+	if (flags & H2_FLAG_END_STREAM)
+		s->remote_closed = 1;
+
+	/* the padding is credited at once; the body once there is room
+	 * for it, or the application drains it */
+	evhttp_h2_credit(h2, s, frame - len);
+	s->buffered += len;
+	s->held += len;
+	h2->buffered += len;
+	h2->held += len;
+	evhttp_h2_release(h2);
+
+	if (s->remote_closed)
+		evhttp_h2_dispatch(h2, s);
+	return;
+
+protocol:
+	evbuffer_drain(input, len);
+	evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+}
+
+/* Applies the settings in p; returns 0, or the error code to close the
+ * connection with. */
+static uint32_t
+evhttp_h2_apply_settings(struct evhttp_h2 *h2, const unsigned char *p,
+    size_t len)
+{
+	struct evhttp_h2_stream *s;
+	uint32_t value;
+	size_t size;
+
+	if (len % 6)
+		return (H2_FRAME_SIZE_ERROR);
+
+	for (; len > 0; p += 6, len -= 6) {
+		value = evhttp_h2_get32(p + 2);
+		switch (p[0] << 8 | p[1]) {
+		case H2_SETTINGS_HEADER_TABLE_SIZE:
+			size = MIN(value, H2_HPACK_TABLE_SIZE);
+			if (size == h2->enc.max_size)
+				break;
+			if (!h2->enc_resized || size < h2->enc_resize_min)
+				h2->enc_resize_min = size;
+			h2->enc_resized = 1;
+			evhttp_hpack_resize(&h2->enc, size);
+			break;
+		case H2_SETTINGS_ENABLE_PUSH:
+			if (value > 1)
+				return (H2_PROTOCOL_ERROR);
+			break;
+		case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > H2_MAX_WINDOW)
+				return (H2_FLOW_CONTROL_ERROR);
+			/* no stream window may grow past the limit either,
+			 * RFC 9113 6.9.2 */
+			TAILQ_FOREACH(s, &h2->streams, next) {
+				if (s->send_window + (int64_t)value -
+				    h2->peer_initial_window > H2_MAX_WINDOW)
+					return (H2_FLOW_CONTROL_ERROR);
+			}
+			TAILQ_FOREACH(s, &h2->streams, next) {
+				s->send_window += (int64_t)value -
+				    h2->peer_initial_window;
+			}
+			h2->peer_initial_window = value;
+			break;
+		case H2_SETTINGS_MAX_FRAME_SIZE:
+			if (value < H2_DEFAULT_FRAME_SIZE ||
+			    value > H2_MAX_FRAME_SIZE)
+				return (H2_PROTOCOL_ERROR);
+			h2->peer_max_frame = value;
+			break;
+		default:
+			/* nothing we act on */
+			break;
+		}
+	}
+	return (0);
+}
+
+static void
+evhttp_h2_settings(struct evhttp_h2 *h2, unsigned char flags,
+    uint32_t stream_id, const unsigned char *p, size_t len)
+{
+	uint32_t error;
+
+	if (stream_id != 0) {
+		evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (flags & H2_FLAG_ACK) {
+		if (len != 0)
+			evhttp_h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+	if ((error = evhttp_h2_apply_settings(h2, p, len)) != 0) {
+		evhttp_h2_goaway(h2, error);
+		return;
+	}
+	h2->got_settings = 1;
+	evhttp_h2_frame(h2, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+
+	/* the windows may have grown */
+	evhttp_h2_flush(h2);
+}
+
+static void
+evhttp_h2_window_update_frame(struct evhttp_h2 *h2, uint32_t stream_id,
+    const unsigned char *p, size_t len)
+{
+	struct evhttp_h2_stream *s;
+	uint32_t increment;
+
+	if (len != 4) {
+		evhttp_h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+	increment = evhttp_h2_get32(p) & 0x7fffffff;
+
+	if (stream_id == 0) {
+		if (increment == 0) {
+			evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+			return;
+		}
+		if (h2->send_window + increment > H2_MAX_WINDOW) {
+			evhttp_h2_goaway(h2, H2_FLOW_CONTROL_ERROR);
+			return;
+		}
+		h2->send_window += increment;
+	} else {
+		if ((s = evhttp_h2_stream_find(h2, stream_id)) == NULL) {
+			if (stream_id > h2->last_stream_id)
+				evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+			return;
+		}
+		if (increment == 0 ||
+		    s->send_window + increment > H2_MAX_WINDOW) {
+			evhttp_h2_rst_stream(h2, stream_id, increment ?
+			    H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+			s->remote_closed = 1;
+			evhttp_h2_stream_free(h2, s);
+			return;
+		}
+		s->send_window += increment;
+	}
+
+	evhttp_h2_flush(h2);
+}
+
+/* Counts a stream the client has reset, and returns how many it has reset
+ * lately.  Opening streams and resetting them at once costs the client
+ * next to nothing and us a request each (CVE-2023-44487). */
+static unsigned
+evhttp_h2_count_reset(struct evhttp_h2 *h2)
+{
+	struct timeval now;
+
+	event_base_gettimeofday_cached(h2->evcon->base, &now);
+	if (now.tv_sec - h2->resets_since >= H2_RESET_INTERVAL) {
+		h2->resets_since = now.tv_sec;
+		h2->n_resets = 0;
+	}
+	return (++h2->n_resets);
+}
+
+static void
+evhttp_h2_process_frame(struct evhttp_h2 *h2, unsigned char type,
+    unsigned char flags, uint32_t stream_id, const unsigned char *p,
+    size_t len)
+{
+	struct evhttp_h2_stream *s;
+
+	switch (type) {
+	case H2_HEADERS:
+		evhttp_h2_headers(h2, flags, stream_id, p, len);
+		break;
+	case H2_CONTINUATION:
+		evhttp_h2_continuation(h2, flags, p, len);
+		break;
+	case H2_SETTINGS:
+		evhttp_h2_settings(h2, flags, stream_id, p, len);
+		break;
+	case H2_WINDOW_UPDATE:
+		evhttp_h2_window_update_frame(h2, stream_id, p, len);
+		break;
+	case H2_PING:
+		if (stream_id != 0 || len != 8) {
+			evhttp_h2_goaway(h2, stream_id ?
+			    H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (!(flags & H2_FLAG_ACK)) {
+			evhttp_h2_frame(h2, len, H2_PING, H2_FLAG_ACK, 0);
+			evbuffer_add(evhttp_h2_output(h2), p, len);
+		}
+		break;
+	case H2_RST_STREAM:
+		if (stream_id == 0 || len != 4) {
+			evhttp_h2_goaway(h2, stream_id ?
+			    H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+			break;
+		}
+		if ((s = evhttp_h2_stream_find(h2, stream_id)) != NULL) {
+			s->remote_closed = 1;
+			evhttp_h2_stream_free(h2, s);
+			if (evhttp_h2_count_reset(h2) > H2_MAX_RESETS)
+				evhttp_h2_goaway(h2, H2_ENHANCE_YOUR_CALM);
+		} else if (stream_id > h2->last_stream_id) {
+			evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+		}
+		break;
+	case H2_PRIORITY:
+		/* all streams are served alike */
+		if (stream_id == 0 || len != 5)
+			evhttp_h2_goaway(h2, stream_id ?
+			    H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+		break;
+	case H2_GOAWAY:
+		if (stream_id != 0 || len < 8) {
+			evhttp_h2_goaway(h2, stream_id ?
+			    H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		/* finish what has been started, then close */
+		h2->peer_goaway = 1;
+		if (TAILQ_EMPTY(&h2->streams))
+			evhttp_h2_goaway(h2, H2_NO_ERROR);
+		break;
+	case H2_PUSH_PROMISE:
+		/* clients cannot push */
+		evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+		break;
+	default:
+		/* unknown frame types are ignored */
+		break;
+	}
+}
+
+static void
+evhttp_h2_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	struct evhttp_h2 *h2 = evcon->h2;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	unsigned char *hdr, type, flags;
+	uint32_t stream_id;
+	size_t len;
+
+	/* Cancel if it's pending. */
+	event_deferred_cb_cancel_(evcon->base, &evcon->read_more_deferred_cb);
+
+	if (h2->need_preface) {
+		switch (evhttp_h2_preface_(input)) {
+		case MORE_DATA_EXPECTED:
+			return;
+		case ALL_DATA_READ:
+			evbuffer_drain(input, H2_PREFACE_LEN);
+			h2->need_preface = 0;
+			break;
+		default:
+			evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+			return;
+		}
+	}
+
+	while (!h2->closing &&
+	    evbuffer_get_length(input) >= H2_FRAME_HEADER_LEN) {
+		hdr = evbuffer_pullup(input, H2_FRAME_HEADER_LEN);
+		len = (size_t)hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+		type = hdr[3];
+		flags = hdr[4];
+		stream_id = evhttp_h2_get32(hdr + 5) & 0x7fffffff;
+
+		if (len > H2_DEFAULT_FRAME_SIZE) {
+			evhttp_h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (evbuffer_get_length(input) < H2_FRAME_HEADER_LEN + len)
+			break;
+
+		/* the client preface ends in SETTINGS, and nothing may come
+		 * between the frames of a header block */
+		if ((!h2->got_settings && type != H2_SETTINGS) ||
+		    (h2->hblock_stream != 0 && (type != H2_CONTINUATION ||
+			stream_id != h2->hblock_stream)) ||
+		    (h2->hblock_stream == 0 && type == H2_CONTINUATION)) {
+			evhttp_h2_goaway(h2, H2_PROTOCOL_ERROR);
+			break;
+		}
+
+		if (type == H2_DATA) {
+			evbuffer_drain(input, H2_FRAME_HEADER_LEN);
+			evhttp_h2_data(h2, input, flags, stream_id, len);
+			continue;
+		}
+		hdr = evbuffer_pullup(input, H2_FRAME_HEADER_LEN + len);
+		evhttp_h2_process_frame(h2, type, flags, stream_id,
+		    hdr + H2_FRAME_HEADER_LEN, len);
+		evbuffer_drain(input, H2_FRAME_HEADER_LEN + len);
+	}
+}
+
+static void
+evhttp_h2_write_cb(struct bufferevent *bev, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	struct evhttp_h2 *h2 = evcon->h2;
+	struct evhttp_h2_stream *s;
+	void (*cb)(struct evhttp_connection *, void *);
+
+	if (h2->closing) {
+		if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+			evhttp_connection_free(evcon);
+		return;
+	}
+
+	evhttp_h2_flush(h2);
+
+	/* let those whose data has gone out send more; the callbacks may
+	 * retire any stream */
+restart:
+	TAILQ_FOREACH(s, &h2->streams, next) {
+		if (s->cb == NULL ||
+		    (s->pending && evbuffer_get_length(s->pending)))
+			continue;
+		cb = s->cb;
+		s->cb = NULL;
+		(*cb)(evcon, s->cb_arg);
+		if (h2->closing)
+			return;
+		goto restart;
+	}
+}
+
+static void
+evhttp_h2_error_cb(struct bufferevent *bev, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	struct evhttp_h2 *h2 = evcon->h2;
+	struct evhttp_h2_stream *s;
+
+	if (evcon->fd == -1)
+		evcon->fd = bufferevent_getfd(bev);
+
+	if ((what & BEV_EVENT_TIMEOUT) && (what & BEV_EVENT_READING) &&
+	    !h2->closing) {
+		/* a client waiting for its responses is not idle */
+		TAILQ_FOREACH(s, &h2->streams, next) {
+			if (s->dispatched)
+				break;
+		}
+		if (s != NULL)
+			bufferevent_enable(bev, EV_READ);
+		else
+			evhttp_h2_goaway(h2, H2_NO_ERROR);
+		return;
+	}
+
+	evhttp_connection_free(evcon);
+}
+
+enum message_read_status
+evhttp_h2_preface_(struct evbuffer *buf)
+{
+	size_t len = MIN(evbuffer_get_length(buf), H2_PREFACE_LEN);
+
+	if (len == 0)
+		return (MORE_DATA_EXPECTED);
+	if (memcmp(evbuffer_pullup(buf, len), H2_PREFACE, len))
+		return (DATA_CORRUPTED);
+	return (len == H2_PREFACE_LEN ? ALL_DATA_READ : MORE_DATA_EXPECTED);
+}
+
+/* Returns 1 if the comma separated list s has token in it. */
+static int
+evhttp_h2_has_token(const char *s, const char *token)
+{
+	size_t len = strlen(token), n;
+
+	while (*s != '\0') {
+		s += strspn(s, " \t,");
+		n = strcspn(s, " \t,");
+		if (n == len && !evutil_ascii_strncasecmp(s, token, len))
+			return (1);
+		s += n;
+	}
+	return (0);
+}
+
+int
+evhttp_h2_wants_upgrade_(struct evhttp_request *req)
+{
+	const char *upgrade, *connection;
+
+	if (req->major != 1 || req->minor != 1 ||
+	    evhttp_find_header(req->input_headers, "HTTP2-Settings") == NULL)
+		return (0);
+	upgrade = evhttp_find_header(req->input_headers, "Upgrade");
+	connection = evhttp_find_header(req->input_headers, "Connection");
+	return (upgrade != NULL && connection != NULL &&
+	    evhttp_h2_has_token(upgrade, "h2c") &&
+	    evhttp_h2_has_token(connection, "Upgrade") &&
+	    evhttp_h2_has_token(connection, "HTTP2-Settings"));
+}
+
+static int
+evhttp_h2_base64url_value(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return (c - 'A');
+	if (c >= 'a' && c <= 'z')
+		return (c - 'a' + 26);
+	if (c >= '0' && c <= '9')
+		return (c - '0' + 52);
+	if (c == '-' || c == '+')
+		return (62);
+	if (c == '_' || c == '/')
+		return (63);
+	return (-1);
+}
+
+/* Applies the settings an upgrade request carries in HTTP2-Settings; the
+ * 101 response acknowledges them. */
+static int
+evhttp_h2_upgrade_settings(struct evhttp_h2 *h2, const char *s)
+{
+	unsigned char buf[6 * 16];
+	uint32_t acc = 0;
+	size_t len = 0;
+	int bits = 0, v;
+
+	for (; *s != '\0' && *s != '='; ++s) {
+		if ((v = evhttp_h2_base64url_value(*s)) < 0)
+			return (-1);
+		acc = acc << 6 | v;
+		bits += 6;
+		if (bits >= 8) {
+			if (len == sizeof(buf))
+				return (-1);
+			bits -= 8;
+			buf[len++] = acc >> bits;
+		}
+	}
+	return (evhttp_h2_apply_settings(h2, buf, len) ? -1 : 0);
+}
+
+int
+evhttp_h2_start_(struct evhttp_connection *evcon,
+    struct evhttp_request *upgraded)
+{
+	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
+	struct evhttp_h2 *h2;
+	struct evhttp_h2_stream *s = NULL;
+	struct evhttp_request *req;
+	unsigned char settings[12];
+	int fd, on = 1;
+
+	if ((h2 = mm_calloc(1, sizeof(*h2))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	TAILQ_INIT(&h2->streams);
+	h2->evcon = evcon;
+	h2->need_preface = 1;
+	h2->dec.max_size = h2->enc.max_size = H2_HPACK_TABLE_SIZE;
+	h2->peer_max_frame = H2_DEFAULT_FRAME_SIZE;
+	h2->peer_initial_window = h2->send_window = H2_DEFAULT_WINDOW;
+	h2->recv_window = H2_CONN_WINDOW;
+
+	if (upgraded != NULL) {
+		if (evhttp_h2_upgrade_settings(h2, evhttp_find_header(
+			    upgraded->input_headers, "HTTP2-Settings")) < 0 ||
+		    (s = evhttp_h2_stream_new(h2, 1, upgraded)) == NULL) {
+			evhttp_hpack_clear(&h2->enc);
+			mm_free(h2);
+			return (-1);
+		}
+		/* the request has been read, and is answered on stream 1 */
+		TAILQ_REMOVE(&evcon->requests, upgraded, next);
+		s->remote_closed = 1;
+		h2->last_stream_id = 1;
+		evbuffer_add_printf(output,
+		    "HTTP/1.1 101 Switching Protocols\r\n"
+		    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	} else {
+		/* the preface came instead of a first request */
+		while ((req = TAILQ_FIRST(&evcon->requests)) != NULL) {
+			TAILQ_REMOVE(&evcon->requests, req, next);
+			evhttp_request_free(req);
+		}
+	}
+
+	evcon->h2 = h2;
+	evcon->cb = NULL;
+
+	/* a window's worth of DATA often ends in a short frame, which Nagle
+	 * would hold back until the previous one is acknowledged */
+	fd = bufferevent_getfd(evcon->bufev);
+	if (fd != -1 &&
+	    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+		event_sock_warn(fd, "%s: setsockopt(TCP_NODELAY)", __func__);
+
+	/* our settings, and room for more than a window of request data */
+	settings[0] = 0;
+	settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	evhttp_h2_put32(settings + 2, H2_MAX_STREAMS);
+	settings[6] = 0;
+	settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+	evhttp_h2_put32(settings + 8, H2_STREAM_WINDOW);
+	evhttp_h2_frame(h2, sizeof(settings), H2_SETTINGS, 0, 0);
+	evbuffer_add(output, settings, sizeof(settings));
+	evhttp_h2_window_update(h2, 0, H2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+
+	bufferevent_setcb(evcon->bufev,
+	    evhttp_h2_read_cb, evhttp_h2_write_cb, evhttp_h2_error_cb,
+	    evcon);
+	bufferevent_enable(evcon->bufev, EV_READ|EV_WRITE);
+
+	/* the client may have sent more than has been read so far */
+	if (evbuffer_get_length(bufferevent_get_input(evcon->bufev)) > 0)
+		event_deferred_cb_schedule_(evcon->base,
+		    &evcon->read_more_deferred_cb);
+
+	if (s != NULL)
+		evhttp_h2_dispatch(h2, s);
+	return (0);
+}
+
+void
+evhttp_h2_free_(struct evhttp_connection *evcon)
+{
+	struct evhttp_h2 *h2 = evcon->h2;
+	struct evhttp_h2_stream *s;
+
+	/* there is no one left to give credit to */
+	h2->closing = 1;
+	while ((s = TAILQ_FIRST(&h2->streams)) != NULL)
+		evhttp_h2_stream_free(h2, s);
+
+	evhttp_hpack_clear(&h2->dec);
+	evhttp_hpack_clear(&h2->enc);
+	if (h2->hblock.data != NULL)
+		mm_free(h2->hblock.data);
+	if (h2->str.data != NULL)
+		mm_free(h2->str.data);
+	if (h2->out.data != NULL)
+		mm_free(h2->out.data);
+	mm_free(h2);
+	evcon->h2 = NULL;
+}
@@ -222,6 +222,35 @@ size_t evbuffer_get_length(const struct evbuffer *buf);
 EVENT2_EXPORT_SYMBOL
 size_t evbuffer_get_contiguous_space(const struct evbuffer *buf);
 
+/**
+   Statistics about the layout of an evbuffer in memory.
+
+   @see evbuffer_get_stats()
+*/
+struct evbuffer_stats {
+	/** The number of chains the buffer is made of right now. */
+	size_t n_chains;
+	/** How many times small chains were coalesced before a write. */
+	size_t n_compactions;
+	/** How many bytes those compactions copied. */
+	size_t n_bytes_compacted;
+};
+
+/**
+   Report how an evbuffer is laid out in memory.
+
+   Before writing to a file descriptor, an evbuffer whose data is spread
+   over more chains than a single writev() can take copies runs of small
+   chains into larger ones.  This function tells how many chains the buffer
+   has, and how much copying that has cost so far.
+
+   @param buf pointer to the evbuffer
+   @param stats the structure to fill in
+*/
+EVENT2_EXPORT_SYMBOL
+void evbuffer_get_stats(const struct evbuffer *buf,
+    struct evbuffer_stats *stats);
+
 /**
   Expands the available space in an evbuffer.
 
@@ -235,6 +264,63 @@ size_t evbuffer_get_contiguous_space(const struct evbuffer *buf);
 EVENT2_EXPORT_SYMBOL
 int evbuffer_expand(struct evbuffer *buf, size_t datlen);
 
+/**
+   Back an evbuffer with a fixed-size ring of memory.
+
+   The ring is mapped twice, back to back, so every range of bytes in it
+   can be addressed as a single contiguous block.  evbuffer_pullup() on a
+   ring never copies, and evbuffer_read() and evbuffer_write() only ever
+   need one iovec.
+
+   A ring never grows.  Adding more than the free space left in it fails,
+   as does anything that would add memory by reference
+   (evbuffer_add_reference(), evbuffer_add_buffer_reference(),
+   evbuffer_add_file_segment()) or prepend another buffer.
+   evbuffer_add_buffer() and evbuffer_remove_buffer() copy data into or out
+   of a ring rather than moving chains.  When a ring is used as the input of
+   a bufferevent, set a read high-watermark no larger than its capacity.
+
+   @param buf the evbuffer to convert; it must be empty
+   @param capacity the size of the ring, rounded up to a whole number of
+     pages
+   @return 0 if successful, or -1 if the buffer was not empty, was already a
+     ring, or the ring could not be mapped
+*/
+EVENT2_EXPORT_SYMBOL
+int evbuffer_enable_ring(struct evbuffer *buf, size_t capacity);
+
+/**
+   Keep only about the first 'threshold' bytes of an evbuffer in memory,
+   and move data added beyond that to an unlinked temporary file.
+
+   Data is moved out in batches of a few hundred kilobytes, and comes back
+   as file-segment chains, just as if it had been added with
+   evbuffer_add_file().  If the buffer has EVBUFFER_FLAG_DRAINS_TO_FD set,
+   those chains are sent with sendfile() and can only be written out, not
+   read; otherwise each one is mapped into memory as soon as it has been
+   written.  The file is created the first time it is needed, and replaced
+   by a new one whenever no spilled data is left in it.  Disk space for
+   mapped data is released as the data is drained; data sent with
+   sendfile() keeps its space until the file is replaced.
+
+   The data is written with ordinary blocking I/O, from whichever thread
+   adds to the buffer, at the point where the buffer's callbacks are
+   invoked.  For a bufferevent that is normally the event loop thread, so
+   each batch costs the loop a synchronous write to disk; keep the spill
+   directory on fast local storage (or tmpfs) if that matters.
+
+   @param buf the evbuffer to configure
+   @param threshold how many bytes to keep in memory, or 0 to stop spilling
+     (data that has already been spilled stays in the file)
+   @param dir the directory to create the file in, or NULL to use $TMPDIR
+     or /tmp
+   @return 0 if successful, or -1 if the buffer is a ring or we are out of
+     memory
+*/
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_spill(struct evbuffer *buf, size_t threshold,
+    const char *dir);
+
 /**
    Reserves space in the last chain or chains of an evbuffer.
 
@@ -444,6 +530,35 @@ EVENT2_EXPORT_SYMBOL
 int evbuffer_add_buffer_reference(struct evbuffer *outbuf,
     struct evbuffer *inbuf);
 
+/**
+  Move all data from one evbuffer onto the end of many others, sharing it.
+
+  The data is taken out of src into a read-only snapshot, and every
+  destination gets chains that refer to the snapshot's memory rather than a
+  copy of it.  The snapshot is freed once the last destination has drained
+  it.  Each destination is locked only once, and its callbacks run as they
+  would for evbuffer_add_buffer().  This is meant for sending one message to
+  many bufferevents: pass the buffers from bufferevent_get_output().
+
+  src is left empty and may be reused at once.  Data in src that refers to
+  other buffers or to file segments is copied into one chain first; data
+  that would be sent with sendfile() cannot be broadcast.
+
+  Destinations that are frozen at the end, backed by a ring, or the same
+  as src are skipped.
+
+  @param src the buffer holding the data to send
+  @param dsts the buffers to add the data to
+  @param n_dsts the number of buffers in dsts
+  @return the number of destinations the data was added to, or -1 if src
+    could not be broadcast, in which case it is left as it was
+
+  @see evbuffer_add_buffer_reference()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_broadcast(struct evbuffer *src, struct evbuffer **dsts,
+    int n_dsts);
+
 /**
    A cleanup function for a piece of memory added to an evbuffer by
    reference.
@@ -594,6 +709,61 @@ EVENT2_EXPORT_SYMBOL
 void evbuffer_file_segment_add_cleanup_cb(struct evbuffer_file_segment *seg,
 	evbuffer_file_segment_cleanup_cb cb, void* arg);
 
+struct event_base;
+/**
+   Turn on, resize, or turn off the process-wide file segment cache.
+
+   While the cache is on, evbuffer_file_segment_cache_get() hands out
+   shared segments instead of opening and mapping the file again each time.
+   The cache keeps at most max_entries segments, and drops the least
+   recently used one when it needs room.
+
+   If base is given, the cache watches its files with inotify from that
+   base, and drops a segment as soon as its file changes; lookups then make
+   no system calls at all.  Otherwise every lookup stat()s the file, and
+   the segment is replaced if the file's device, inode, size or
+   modification time have changed.  In the first case, turn the cache off
+   before freeing the base.
+
+   The inotify watch is on the file itself, so it sees the file being
+   written, renamed, removed or replaced by a rename over it, but not a
+   change to the rest of the path: if a parent directory is renamed or
+   replaced, or a symbolic link on the path is pointed elsewhere, the cache
+   keeps handing out the old file until it changes or is evicted.  Use the
+   stat() mode (base NULL) if paths can be switched that way.
+
+   Changing the settings empties the cache.  Segments that are still in
+   use stay valid until they are freed.
+
+   @param base the event_base to watch files from, or NULL
+   @param max_entries the most segments to keep, or 0 to turn the cache off
+   @return 0 on success, -1 on failure
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_file_segment_cache_enable(struct event_base *base,
+    size_t max_entries);
+
+/**
+   Return a segment for part of the file at path, from the file segment
+   cache if possible.
+
+   This works like opening the file and calling evbuffer_file_segment_new()
+   with EVBUF_FS_CLOSE_ON_FREE, except that the segment may be shared with
+   other callers.  Free it with evbuffer_file_segment_free() as usual, and
+   do not give it a cleanup callback.  EVBUF_FS_DISABLE_LOCKING is ignored.
+   If the cache is off, this always makes a new segment.  Only regular
+   files are opened; for a directory this fails with errno set to EISDIR.
+
+   @param path the file to read
+   @param offset where in the file the segment starts
+   @param length the length of the segment, or -1 for the rest of the file
+   @param flags any number of the EVBUF_FS_* flags
+   @return a new reference to a segment, or NULL on failure
+ */
+EVENT2_EXPORT_SYMBOL
+struct evbuffer_file_segment *evbuffer_file_segment_cache_get(
+    const char *path, off_t offset, off_t length, unsigned flags);
+
 /**
    Insert some or all of an evbuffer_file_segment at the end of an evbuffer
 
@@ -708,6 +878,74 @@ int evbuffer_write_atmost(struct evbuffer *buffer, int fd,
 EVENT2_EXPORT_SYMBOL
 int evbuffer_read(struct evbuffer *buffer, int fd, int howmuch);
 
+/**
+  Read from a file descriptor straight into memory the caller provides.
+
+  The regions in vec are filled in order with a single readv().  The ones
+  that receive data are appended to the buffer as if by
+  evbuffer_add_reference(), without copying.  Later appends never write
+  into the unused rest of a partly filled region.
+
+  Every region goes back to cleanupfn exactly once, with the pointer and
+  length it was given with.  A region that received nothing goes back
+  before this function returns, and so does every region on error.  A
+  region that received data goes back when the buffer no longer needs it.
+
+  @param buffer the evbuffer to store the result
+  @param fd the file descriptor to read from
+  @param vec the memory to read into
+  @param n_vec the number of regions in vec
+  @param cleanupfn the function that gets the memory back, or NULL
+  @param cleanup_arg the last argument for cleanupfn
+  @return the number of bytes read, 0 on end of file, or -1 on error.
+    errno is EINVAL if the end of the buffer is frozen or the buffer is
+    backed by a ring.
+  @see evbuffer_set_read_mem()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_read_into(struct evbuffer *buffer, int fd,
+    const struct iovec *vec, int n_vec,
+    evbuffer_ref_cleanup_cb cleanupfn, void *cleanup_arg);
+
+/**
+   A function that lends an evbuffer memory to read into.
+
+   @param buffer the evbuffer about to read
+   @param howmuch how many bytes the read is expected to return
+   @param vec where to put the regions of memory to lend
+   @param n_vec the most regions vec can hold
+   @param arg the argument passed to evbuffer_set_read_mem()
+   @return the number of regions put in vec, 0 to let the buffer allocate
+     memory itself this time, or -1 to fail the read
+   @see evbuffer_set_read_mem()
+ */
+typedef int (*evbuffer_read_mem_cb)(struct evbuffer *buffer, size_t howmuch,
+    struct iovec *vec, int n_vec, void *arg);
+
+/**
+  Have evbuffer_read() read into memory the application provides.
+
+  Before each read, getfn is asked for memory, and the read goes through
+  evbuffer_read_into() with cleanupfn.  This lets a bufferevent read
+  straight into message slabs or shared memory: a socket bufferevent
+  reads with evbuffer_read() on bufferevent_get_input(), and one opened
+  with BEV_OPT_FRUGAL skips its shared scratch area while getfn is set.
+
+  getfn runs with the buffer locked.  It cannot be used with a buffer
+  backed by a ring.
+
+  @param buffer the evbuffer to configure
+  @param getfn the function that provides memory, or NULL to go back to
+    allocating memory as usual
+  @param cleanupfn the function that gets the memory back, or NULL
+  @param arg the last argument for getfn and cleanupfn
+  @return 0 on success, or -1 with errno set to EINVAL if the buffer is
+    backed by a ring
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_read_mem(struct evbuffer *buffer, evbuffer_read_mem_cb getfn,
+    evbuffer_ref_cleanup_cb cleanupfn, void *arg);
+
 /**
    Search for a string within an evbuffer.
 
@@ -829,6 +1067,27 @@ int evbuffer_peek(struct evbuffer *buffer, ssize_t len,
     struct evbuffer_ptr *start_at,
     struct iovec *vec_out, int n_vec);
 
+/**
+   Compute the CRC-32C (Castagnoli) checksum of a range of an evbuffer.
+
+   The data is read in place, chain by chain, without evbuffer_pullup().
+   The CPU's CRC32 instruction is used where there is one (SSE4.2 on x86-64,
+   the CRC extension on ARMv8).
+
+   To checksum data in several pieces, start with *crc set to 0 and pass
+   the result of each call into the next.
+
+   @param buf the evbuffer to read
+   @param start where to start, or NULL for the start of the buffer
+   @param len how many bytes to read, or -1 for everything after start
+   @param crc on input, the checksum so far; on output, the new checksum
+   @return 0 on success, or -1 if the range runs past the end of the buffer
+     or includes data that is not in memory (see evbuffer_add_file())
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_crc32c(struct evbuffer *buf, const struct evbuffer_ptr *start,
+    ssize_t len, uint32_t *crc);
+
 
 /** Structure passed to an evbuffer_cb_func evbuffer callback
 
@@ -1020,6 +1279,81 @@ int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 EVENT2_EXPORT_SYMBOL
 size_t evbuffer_add_iovec(struct evbuffer * buffer, struct iovec * vec, int n_vec);
 
+/**
+   @name Memory accounting
+
+   Libevent keeps count of the bytes held in the input and output buffers
+   of every bufferevent, both for each event_base and for the process as a
+   whole.  Limits can be set on the count for an event_base, to learn about
+   (and optionally push back against) connections whose buffers grow out of
+   hand.
+
+   Only memory that the buffers allocated for their data counts.  File
+   segments (including data sent with sendfile() and data spilled with
+   evbuffer_set_spill()), references added with evbuffer_add_reference()
+   and the like, and data shared with evbuffer_add_buffer_reference() are
+   left out.
+
+   @{
+*/
+
+/** Memory levels reported to an event_base_memory_cb */
+#define EVBUFFER_MEM_OK		0 /**< below the soft limit */
+#define EVBUFFER_MEM_SOFT	1 /**< at or above the soft limit */
+#define EVBUFFER_MEM_HARD	2 /**< at or above the hard limit */
+
+/** Flag for event_base_set_memory_limits(): when the hard limit is reached,
+    suspend reading on every bufferevent that holds at least its share of
+    the buffered bytes, until usage drops below the soft limit again. */
+#define EVBUFFER_MEM_SUSPEND_READS 0x01
+
+/**
+   Type of a callback invoked when the memory level of an event_base
+   changes.
+
+   @param base the event_base whose level changed
+   @param usage the number of bytes buffered when the level changed
+   @param level the new level: one of EVBUFFER_MEM_OK, EVBUFFER_MEM_SOFT or
+     EVBUFFER_MEM_HARD
+   @param arg the argument passed to event_base_set_memory_limits()
+ */
+typedef void (*event_base_memory_cb)(struct event_base *base, size_t usage,
+    int level, void *arg);
+
+/**
+   Set limits on the bytes buffered by the bufferevents of an event_base.
+
+   Each time the usage crosses one of the limits, cb is invoked from the
+   event loop with the new level.
+
+   @param base the event_base to limit
+   @param soft_limit the soft limit in bytes, or 0 for none
+   @param hard_limit the hard limit in bytes, or 0 for none
+   @param flags 0 or EVBUFFER_MEM_SUSPEND_READS
+   @param cb the callback to invoke when the level changes, or NULL
+   @param arg an argument to pass to cb
+   @return 0 on success, -1 on failure
+ */
+EVENT2_EXPORT_SYMBOL
+int event_base_set_memory_limits(struct event_base *base, size_t soft_limit,
+    size_t hard_limit, int flags, event_base_memory_cb cb, void *arg);
+
+/**
+   Return the number of bytes held in the buffers of the bufferevents of an
+   event_base.
+ */
+EVENT2_EXPORT_SYMBOL
+size_t event_base_memory_usage(struct event_base *base);
+
+/**
+   Return the number of bytes held in the buffers of all bufferevents in
+   this process.
+ */
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_get_total_memory_usage(void);
+
+/**@}*/
+
 #ifdef __cplusplus
 }
 #endif
@@ -113,7 +113,9 @@ struct bufferevent
 ;
 struct event_base;
 struct evbuffer;
+struct evbuffer_ptr;
 struct sockaddr;
+struct iovec;
 
 /**
    A read or write callback for a bufferevent.
@@ -166,7 +168,37 @@ enum bufferevent_options {
 	* bufferevent.  This option currently requires that
 	* BEV_OPT_DEFER_CALLBACKS also be set; a future version of Libevent
 	* might remove the requirement.*/
-	BEV_OPT_UNLOCK_CALLBACKS = (1<<3)
+	BEV_OPT_UNLOCK_CALLBACKS = (1<<3),
+
+	/** If set, bufferevent_write() and bufferevent_write_buffer() on a
+	 * socket bufferevent try to write the data to the socket right away,
+	 * from the caller's context, when the output buffer is empty and the
+	 * socket was writable the last time we wrote to it.  Only whatever
+	 * the kernel does not accept is queued in the output buffer.  This
+	 * saves a trip through the event loop for each reply in
+	 * request/response protocols.  Ignored by other bufferevent types. */
+	BEV_OPT_WRITE_THROUGH = (1<<4),
+
+	/** If set, data added to the output buffer of a socket bufferevent is
+	 * not written as soon as the socket becomes writable.  Instead, the
+	 * bufferevent is flushed once, with a single write, after the event
+	 * loop has run all the callbacks that were active in the current
+	 * iteration.  Several small writes from the same callbacks (headers,
+	 * then body, for example) thus go out in one system call, and a write
+	 * that stops short of the rest of the data (at a file segment, say)
+	 * asks the kernel with MSG_MORE not to push a short segment.  Ignored
+	 * by other bufferevent types. */
+	BEV_OPT_COALESCE_WRITES = (1<<5),
+
+	/** If set, a socket bufferevent tries to hold as little memory as it
+	 * can while idle.  Reads into an empty input buffer go through a
+	 * per-base scratch area and are copied into a chain sized to the
+	 * data, unless evbuffer_set_read_mem() lends the input buffer memory
+	 * of its own. Whatever is left in the buffers after the callbacks have
+	 * run is moved into a chain sized to fit it. Meant for servers with
+	 * very many mostly idle connections; costs an extra copy per read.
+	 * Ignored by other bufferevent types. */
+	BEV_OPT_FRUGAL = (1<<6)
 };
 
 /**
@@ -185,6 +217,28 @@ enum bufferevent_options {
 EVENT2_EXPORT_SYMBOL
 struct bufferevent *bufferevent_socket_new(struct event_base *base, int fd, int options);
 
+/**
+  Keep up to n_max freed socket bufferevents on a base for reuse.
+
+  When a socket bufferevent is finally freed, its memory, its evbuffers and
+  their chain of callbacks are kept on the base's pool, if there is room,
+  instead of being released.  bufferevent_socket_new() then reinitialises a
+  pooled bufferevent for the new fd instead of allocating one.  This saves a
+  handful of allocations per connection on servers that accept and close
+  connections at a high rate.
+
+  Locks are not pooled: a BEV_OPT_THREADSAFE bufferevent gets a fresh lock
+  each time.  The pool is empty by default, and is emptied when the base is
+  freed.
+
+  @param base the event_base whose pool to resize
+  @param n_max the largest number of bufferevents to keep; 0 disables
+	 pooling and frees everything in the pool
+  @return 0 on success, -1 if n_max is negative
+  */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_socket_set_pool_size(struct event_base *base, int n_max);
+
 /**
    Launch a connect() attempt with a socket-based bufferevent.
 
@@ -547,6 +601,91 @@ EVENT2_EXPORT_SYMBOL
 int bufferevent_getwatermark(struct bufferevent *bufev, short events,
     size_t *lowmark, size_t *highmark);
 
+/**
+   Formats of the length prefix in front of each frame.
+
+   @see bufferevent_set_framing()
+ */
+enum bufferevent_frame_header {
+	/** One byte. */
+	BEV_FRAME_U8,
+	/** Two bytes, most significant first. */
+	BEV_FRAME_BE16,
+	/** Four bytes, most significant first. */
+	BEV_FRAME_BE32,
+	/** Two bytes, least significant first. */
+	BEV_FRAME_LE16,
+	/** Four bytes, least significant first. */
+	BEV_FRAME_LE32,
+	/** A varint: seven bits per byte, least significant first, with the
+	 * top bit set on every byte but the last.  At most ten bytes. */
+	BEV_FRAME_VARINT
+};
+
+/**
+   A callback for each frame read by a bufferevent with framing.
+
+   The payload is left in place in the input buffer, and is described both
+   as a position in that buffer and as the iovecs evbuffer_peek() would give
+   for it.  Neither stays valid after the callback returns, when the frame
+   is drained from the input.  The callback must not remove data from the
+   input buffer itself.
+
+   @param bev the bufferevent that read the frame
+   @param pos where the payload starts in bufferevent_get_input(bev)
+   @param len the length of the payload, which may be 0
+   @param vec the payload, in place
+   @param n_vec the number of elements in vec
+   @param ctx the argument passed to bufferevent_set_framing()
+ */
+typedef void (*bufferevent_frame_cb)(struct bufferevent *bev,
+    const struct evbuffer_ptr *pos, size_t len,
+    const struct iovec *vec, int n_vec, void *ctx);
+
+/**
+   Split what a bufferevent reads into length-prefixed frames.
+
+   While framing is on, the bufferevent calls cb once for every complete
+   frame instead of calling its read callback.  It keeps the read low
+   watermark at the size of the next frame, so nothing runs until a whole
+   frame has arrived, and raises the read high watermark for as long as
+   the next frame would not fit under it.  Read watermarks set while
+   framing is on take effect when it is turned off; until then only their
+   high watermark is used.  A frame longer than max_frame is an error:
+   reading is disabled, and the event callback runs with
+   BEV_EVENT_READING|BEV_EVENT_ERROR and errno set to EMSGSIZE, also when
+   the callback is deferred.
+
+   @param bufev the bufferevent to configure
+   @param header the format of the length prefix
+   @param max_frame the longest payload to accept, or 0 for no limit
+   @param cb the callback for each frame, or NULL to turn framing off and
+     go back to the read callback
+   @param cbarg the argument for cb
+   @return 0 on success, or -1 on failure
+   @see bufferevent_write_frame()
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_set_framing(struct bufferevent *bufev,
+    enum bufferevent_frame_header header, size_t max_frame,
+    bufferevent_frame_cb cb, void *cbarg);
+
+/**
+   Write one frame to a bufferevent.
+
+   The payload is added to the output buffer after a length prefix in the
+   format set with bufferevent_set_framing().
+
+   @param bufev the bufferevent to write to
+   @param data the payload
+   @param size the length of the payload
+   @return 0 on success, or -1 if framing is off, size does not fit in
+     the length prefix, or the data could not be added
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_write_frame(struct bufferevent *bufev,
+    const void *data, size_t size);
+
 /**
    Acquire the lock on a bufferevent.  Has no effect if locking was not
    enabled with BEV_OPT_THREADSAFE.
@@ -55,6 +55,7 @@ struct evhttp_connection;
 /* Response codes */
 #define HTTP_OK			200	/**< request completed ok */
 #define HTTP_NOCONTENT		204	/**< request does not have content */
+#define HTTP_PARTIALCONTENT	206	/**< part of the content was sent */
 #define HTTP_MOVEPERM		301	/**< the uri moved permanently */
 #define HTTP_MOVETEMP		302	/**< the uri moved temporarily */
 #define HTTP_NOTMODIFIED	304	/**< page was not modified from last */
@@ -62,6 +63,7 @@ struct evhttp_connection;
 #define HTTP_NOTFOUND		404	/**< could not find content for uri */
 #define HTTP_BADMETHOD		405 	/**< method not allowed for this uri */
 #define HTTP_ENTITYTOOLARGE	413	/**<  */
+#define HTTP_BADRANGE		416	/**< no part of the range can be sent */
 #define HTTP_EXPECTATIONFAILED	417	/**< we can't handle this expectation */
 #define HTTP_INTERNAL           500     /**< internal error */
 #define HTTP_NOTIMPLEMENTED     501     /**< not implemented */
@@ -222,6 +224,27 @@ void evhttp_set_max_headers_size(struct evhttp* http, ssize_t max_headers_size);
 EVENT2_EXPORT_SYMBOL
 void evhttp_set_max_body_size(struct evhttp* http, ssize_t max_body_size);
 
+/**
+  Read and dispatch up to depth pipelined requests on a connection before
+  the first of them has been answered.
+
+  Requests are passed to their callbacks as soon as they have been read,
+  and may be answered in any order; responses are still sent in the order
+  the requests arrived, each held back until those before it are out.
+  Nothing is read behind a request that closes the connection, and a
+  client that drops the connection while requests are outstanding causes
+  evhttp_request_get_connection() to return NULL for those the user has
+  not answered yet.
+
+  @param http the http server on which to set the pipeline depth
+  @param depth the most requests to have outstanding on each connection;
+    1 or less, the default, reads each request only after the previous
+    response has been sent
+  @see evhttp_connection_set_max_pipeline()
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_set_max_pipeline(struct evhttp *http, int depth);
+
 /**
   Set the value to use for the Content-Type header when none was provided. If
   the content type string is NULL, the Content-Type header will not be
@@ -234,6 +257,25 @@ EVENT2_EXPORT_SYMBOL
 void evhttp_set_default_content_type(struct evhttp *http,
 	const char *content_type);
 
+/**
+  Set headers to send with every response from this server, such as
+  Server or security headers.
+
+  The headers are copied and serialised once, and the serialised block is
+  appended to each response by reference rather than formatted again.  A
+  response that sets one of these headers itself keeps its own value, and
+  a Content-Type given here takes the place of the default content type.
+  Replacing or clearing the set does not affect responses already queued.
+
+  @param http the http server on which to set the headers
+  @param headers the headers to send, or NULL to stop sending any
+  @return 0 on success, -1 if a header is invalid or memory runs out
+  @see evhttp_set_default_content_type()
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_set_static_headers(struct evhttp *http,
+    const struct evkeyvalq *headers);
+
 /**
   Sets the what HTTP methods are supported in requests accepted by this
   server, and passed to user callbacks.
@@ -261,7 +303,72 @@ EVENT2_EXPORT_SYMBOL
 int evhttp_set_cb(struct evhttp *http, const char *path,
     void (*cb)(struct evhttp_request *, void *), void *cb_arg);
 
-/** Removes the callback for a specified URI */
+/**
+   Set a callback for the paths that match a pattern.
+
+   A pattern is a path split on '/' like any other.  A segment of the form
+   ':name' matches any one non-empty segment, and its decoded value can be
+   had from evhttp_request_get_route_param() with that name.  A last segment
+   of '*' matches one or more remaining segments, available as the
+   parameter "*"; so "/static/" followed by '*' matches "/static/" and
+   "/static/a/b", but not "/static".  Any other segment must match exactly.
+
+   Routes and the paths given to evhttp_set_cb() are looked up together,
+   one segment at a time, so dispatch does not slow down with the number of
+   callbacks.  Where more than one could match, an exact segment is
+   preferred to a ':name', and a ':name' to a '*'.
+
+   @param http the http server on which to set the callback
+   @param pattern the pattern of paths for which to invoke the callback
+   @param cb the callback function that gets invoked on a matching path
+   @param cb_arg an additional context argument for the callback
+   @return 0 on success, -1 if the pattern is taken, has more than seven
+     ':name' segments, or gives a different name to a parameter at the
+     same place as another pattern, -2 on failure
+   @see evhttp_del_cb()
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_set_route(struct evhttp *http, const char *pattern,
+    void (*cb)(struct evhttp_request *, void *), void *cb_arg);
+
+/** Serve the index.html of a directory asked for with a trailing '/'. */
+#define EVHTTP_STATIC_INDEX	0x01
+/** Serve files and directories whose names begin with '.'. */
+#define EVHTTP_STATIC_HIDDEN	0x02
+
+/**
+   Serve the files under a directory at the paths under a prefix.
+
+   A GET or HEAD of url_prefix followed by "/path" sends the file
+   root_dir/path, with Content-Type guessed from its extension and with
+   ETag and Last-Modified validators.  If-None-Match and If-Modified-Since
+   are answered with 304, and a single byte range in a Range header
+   (subject to If-Range) with 206, or with 416 if it lies past the end of
+   the file.  A path that tries to leave root_dir with "..", that names
+   something other than a regular file, or that cannot be opened gets 404;
+   directories are never listed.  Symbolic links are followed.
+
+   Files are opened with evbuffer_file_segment_cache_get(), so enabling
+   that cache with evbuffer_file_segment_cache_enable() keeps their fds
+   and stat results between requests.  On a plain socket, the file is
+   sent with sendfile() and the connection is corked with TCP_CORK
+   until the response has been written, so that the headers go out in
+   the same packet as the start of the body.
+
+   @param http the http server on which to serve the files
+   @param url_prefix the path under which to serve them, such as
+     "/static", or "" for the whole server
+   @param root_dir the directory that holds them
+   @param flags any of EVHTTP_STATIC_INDEX and EVHTTP_STATIC_HIDDEN
+   @return 0 on success, -1 if the prefix is taken by another route or
+     does not start with '/', -2 on failure
+   @see evhttp_del_cb(), which takes url_prefix followed by "/" and '*'
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_serve_static(struct evhttp *http, const char *url_prefix,
+    const char *root_dir, int flags);
+
+/** Removes the callback for a specified URI or route pattern */
 EVENT2_EXPORT_SYMBOL
 int evhttp_del_cb(struct evhttp *, const char *);
 
@@ -377,6 +484,11 @@ void evhttp_set_timeout_tv(struct evhttp *http, const struct timeval* tv);
 /* Read all the clients body, and only after this respond with an error if the
  * clients body exceed max_body_size */
 #define EVHTTP_SERVER_LINGERING_CLOSE	0x0001
+/* Accept HTTP/2 over cleartext TCP (h2c), from clients that either start
+ * the connection with the HTTP/2 preface or ask for an Upgrade: h2c.
+ * Requests arriving over HTTP/2 have major version 2, and are answered with
+ * the usual evhttp_send_reply*() functions. */
+#define EVHTTP_SERVER_H2C		0x0002
 /**
  * Set connection flags for HTTP server.
  *
@@ -755,6 +867,25 @@ EVENT2_EXPORT_SYMBOL
 void evhttp_connection_set_retries(struct evhttp_connection *evcon,
     int retry_max);
 
+/**
+  Allow up to depth requests on this connection to be sent before their
+  responses arrive (HTTP/1.1 pipelining).  Responses are matched to
+  requests in order.
+
+  Only idempotent requests (GET, HEAD, PUT, DELETE, OPTIONS and TRACE,
+  without an Expect header) are sent ahead, and nothing is sent behind
+  any other request.  If the connection fails or is closed while requests
+  are outstanding, the first of them fails as usual and the rest are sent
+  again on a new connection.
+
+  @param evcon the client connection
+  @param depth the most requests to have outstanding; 1 or less, the
+    default, sends each request only after the previous response
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_connection_set_max_pipeline(struct evhttp_connection *evcon,
+    int depth);
+
 /** Set a callback for connection close. */
 EVENT2_EXPORT_SYMBOL
 void evhttp_connection_set_closecb(struct evhttp_connection *evcon,
@@ -829,10 +960,13 @@ int evhttp_request_get_response_code(const struct evhttp_request *req);
 EVENT2_EXPORT_SYMBOL
 const char * evhttp_request_get_response_code_line(const struct evhttp_request *req);
 
-/** Returns the input headers */
+/** Returns the input headers.  They belong to the request; see the notes
+    on header nodes above evhttp_find_header(). */
 EVENT2_EXPORT_SYMBOL
 struct evkeyvalq *evhttp_request_get_input_headers(struct evhttp_request *req);
-/** Returns the output headers */
+/** Returns the output headers.  Change them with evhttp_add_header() and
+    evhttp_remove_header(); see the notes on header nodes above
+    evhttp_find_header(). */
 EVENT2_EXPORT_SYMBOL
 struct evkeyvalq *evhttp_request_get_output_headers(struct evhttp_request *req);
 /** Returns the input buffer */
@@ -848,8 +982,41 @@ struct evbuffer *evhttp_request_get_output_buffer(struct evhttp_request *req);
 EVENT2_EXPORT_SYMBOL
 const char *evhttp_request_get_host(struct evhttp_request *req);
 
+/**
+   Returns a parameter captured by the route that matched the request.
+
+   @param req the request
+   @param name the name of a ':name' segment in the route's pattern, or "*"
+     for the part of the path matched by a trailing '*'
+   @return the decoded value, or NULL if the route captured no such
+     parameter
+   @see evhttp_set_route()
+*/
+EVENT2_EXPORT_SYMBOL
+const char *evhttp_request_get_route_param(const struct evhttp_request *req,
+    const char *name);
+
 /* Interfaces for dealing with HTTP headers */
 
+/*
+ * The header nodes that libevent puts in an evkeyvalq -- parsed headers,
+ * and those added with evhttp_add_header() or evhttp_parse_query() -- are
+ * each allocated as a single block holding the struct evkeyval, its key
+ * and its value.  The nodes of a request's input headers live in memory
+ * that belongs to the request, and go away with it.  So:
+ *
+ *  - read the key and value of these nodes, but do not free them or
+ *    assign a new key;
+ *  - to change a header, remove it with evhttp_remove_header() and add
+ *    it again with evhttp_add_header();
+ *  - do not unlink nodes with TAILQ_REMOVE() or free them yourself; use
+ *    evhttp_remove_header() or evhttp_clear_headers(), and copy any key
+ *    or value you want to keep past the request.
+ *
+ * A value may still be replaced by one allocated with the same allocator
+ * as libevent (see event_set_mem_functions()); do not free the old one.
+ */
+
 /**
    Finds the value belonging to a header.
 
@@ -877,6 +1044,10 @@ int evhttp_remove_header(struct evkeyvalq *headers, const char *key);
 /**
    Adds a header to a list of existing headers.
 
+   The new node holds copies of key and value in a single allocation.  Do
+   not free or reassign its key, and free it only through
+   evhttp_remove_header() or evhttp_clear_headers().
+
    @param headers the evkeyvalq object to which to add a header
    @param key the name of the header
    @param value the value belonging to the header
@@ -889,6 +1060,9 @@ int evhttp_add_header(struct evkeyvalq *headers, const char *key, const char *va
 /**
    Removes all headers from the header list.
 
+   This frees nodes made by libevent as well as nodes the application
+   allocated itself with libevent's allocator.
+
    @param headers the evkeyvalq object from which to remove all headers
 */
 EVENT2_EXPORT_SYMBOL
@@ -138,6 +138,30 @@ struct {
 	 */
 	void (*on_complete_cb)(struct evhttp_request *, void *);
 	void *on_complete_cb_arg;
+
+	/*
+	 * Parameters captured by the route that matched this request.
+	 *
+	 * @see evhttp_request_get_route_param()
+	 */
+	struct evhttp_route_params *route_params;
+
+	/*
+	 * Memory for the headers parsed into input_headers.  Those headers
+	 * must not be moved to another list that outlives the request.
+	 */
+	struct evhttp_header_arena *header_arena;
+
+	/*
+	 * The response to a pipelined request, written while responses to
+	 * earlier requests on the connection are still outstanding.
+	 */
+	struct evhttp_held_response *held;
+
+	/*
+	 * The HTTP/2 stream this request came in on, if any.
+	 */
+	struct evhttp_h2_stream *h2_stream;
 };
 
 #ifdef __cplusplus
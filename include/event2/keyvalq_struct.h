@@ -54,6 +54,18 @@ struct name {					\
 /*
  * Key-Value pairs.  Can be used for HTTP headers but also for
  * query argument parsing.
+ *
+ * Nodes that libevent creates keep the key and value in the same
+ * allocation as the node, and a request's parsed headers live in memory
+ * owned by the request.  libevent tells its own nodes apart by where
+ * their key points.  On such a node, never free key, value or the node
+ * itself, never point key elsewhere, and never unlink the node with
+ * TAILQ_REMOVE(); use evhttp_remove_header(), evhttp_add_header() and
+ * evhttp_clear_headers() instead.  See <event2/http.h> for the details.
+ *
+ * Nodes that the application allocates itself must have key, value and
+ * the node each allocated separately, with libevent's allocator, if
+ * libevent is to free them.
  */
 struct evkeyval {
 	TAILQ_ENTRY(evkeyval) next;
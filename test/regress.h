@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2000-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef REGRESS_H_INCLUDED_
+#define REGRESS_H_INCLUDED_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "tinytest.h"
+#include "tinytest_macros.h"
+
+#include <event2/util.h>
+
+struct event_base;
+struct event;
+struct evbuffer;
+
+extern struct testcase_t buffer_testcases[];
+extern struct testcase_t bufferevent_testcases[];
+extern struct testcase_t http_testcases[];
+extern struct testcase_t http2_testcases[];
+
+/* A set of common setup functions for tests */
+struct basic_test_data {
+	struct event_base *base;
+	int pair[2];
+	void *setup_data;
+};
+extern const struct testcase_setup_t basic_setup;
+
+#define TT_NEED_SOCKETPAIR	TT_FIRST_USER_FLAG
+#define TT_NEED_BASE		(TT_FIRST_USER_FLAG<<1)
+#define TT_NEED_THREADS		(TT_FIRST_USER_FLAG<<2)
+
+/* Run the loop of base until msec milliseconds have passed or someone
+ * calls event_base_loopbreak() on it. */
+void regress_run_for(struct event_base *base, long msec);
+
+/* A raw TCP client for talking to servers on the loop under test.  While
+ * the loop runs, everything the server sends is appended to input; eof is
+ * set when it closes, and the loop breaks as soon as eof is set or done()
+ * returns true. */
+struct regress_peer {
+	int fd;
+	struct event *ev;
+	struct evbuffer *input;
+	int eof;
+	int (*done)(struct regress_peer *);
+	void *arg;
+};
+
+/* Connect peer to port on 127.0.0.1.  Returns 0 on success, -1 on failure. */
+int regress_peer_connect(struct regress_peer *peer,
+    struct event_base *base, uint16_t port);
+/* Write len bytes of data to the peer's socket; returns 0 on success. */
+int regress_peer_send(struct regress_peer *peer, const void *data,
+    size_t len);
+/* Close the peer's socket and release everything it holds. */
+void regress_peer_close(struct regress_peer *peer);
+
+/* Return the port a listening socket is bound to. */
+uint16_t regress_get_socket_port(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REGRESS_H_INCLUDED_ */
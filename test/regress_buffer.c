@@ -0,0 +1,1000 @@
+/*
+ * Copyright (c) 2003-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/buffer_compat.h>
+#include <event2/util.h>
+
+#include "evbuffer-internal.h"
+#include "regress.h"
+
+static void
+test_evbuffer_ring(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	char data[1000], out[1000];
+	unsigned char *p;
+	int i;
+
+	tt_assert(buf);
+	tt_int_op(evbuffer_enable_ring(buf, 100), ==, 0);
+	/* only once, and only while empty */
+	tt_int_op(evbuffer_enable_ring(buf, 100), ==, -1);
+
+	/* fill and drain enough times to wrap the ring around */
+	for (i = 0; i < 100; ++i) {
+		memset(data, 'a' + i % 26, sizeof(data));
+		tt_int_op(evbuffer_add(buf, data, sizeof(data)), ==, 0);
+		tt_int_op(evbuffer_get_length(buf), ==, sizeof(data));
+		/* the mirror mapping makes any range contiguous */
+		p = evbuffer_pullup(buf, -1);
+		tt_assert(p);
+		tt_int_op(p[0], ==, 'a' + i % 26);
+		tt_int_op(p[sizeof(data) - 1], ==, 'a' + i % 26);
+		tt_int_op(evbuffer_drain(buf, 700), ==, 0);
+		tt_int_op(evbuffer_remove(buf, out, 300), ==, 300);
+		tt_int_op(out[299], ==, 'a' + i % 26);
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
+static void
+test_evbuffer_ring_full(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *other = evbuffer_new();
+	char data[4096];
+
+	tt_assert(buf && other);
+	tt_int_op(evbuffer_enable_ring(buf, 100), ==, 0);
+	memset(data, 'x', sizeof(data));
+
+	/* the capacity is rounded up to a page and never grows */
+	tt_int_op(evbuffer_add(buf, data, sizeof(data)), ==, 0);
+	tt_int_op(evbuffer_add(buf, "y", 1), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, sizeof(data));
+
+	/* room freed at the front can be prepended into */
+	tt_int_op(evbuffer_drain(buf, 96), ==, 0);
+	tt_int_op(evbuffer_prepend(buf, "hello", 5), ==, 0);
+	tt_mem_op(evbuffer_pullup(buf, 5), ==, "hello", 5);
+	tt_int_op(evbuffer_drain(buf, 4005), ==, 0);
+
+	tt_int_op(evbuffer_add_printf(buf, "num=%d", 42), ==, 6);
+
+	/* buffers are copied in and out rather than moving chains */
+	evbuffer_add(other, "0123456789", 10);
+	tt_int_op(evbuffer_add_buffer(buf, other), ==, 0);
+	tt_int_op(evbuffer_get_length(other), ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, 16);
+	tt_int_op(evbuffer_remove_buffer(buf, other, 3), ==, 3);
+	tt_mem_op(evbuffer_pullup(other, -1), ==, "num", 3);
+
+	/* nothing may be added by reference */
+	tt_int_op(evbuffer_add_reference(buf, "zz", 2, NULL, NULL), ==, -1);
+	tt_mem_op(evbuffer_pullup(buf, -1), ==, "=420123456789", 13);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (other)
+		evbuffer_free(other);
+}
+
+static void
+test_evbuffer_ring_io(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = evbuffer_new();
+	char chunk[3000];
+	int i, n;
+
+	tt_assert(buf);
+	tt_int_op(evbuffer_enable_ring(buf, 4096), ==, 0);
+
+	/* each pass leaves the data straddling the end of the ring, so the
+	 * write and the read both have to go through the mirror */
+	for (i = 0; i < 8; ++i) {
+		memset(chunk, '0' + i, sizeof(chunk));
+		tt_int_op(evbuffer_add(buf, chunk, sizeof(chunk)), ==, 0);
+		n = evbuffer_write(buf, data->pair[0]);
+		tt_int_op(n, ==, sizeof(chunk));
+		tt_int_op(evbuffer_get_length(buf), ==, 0);
+		n = evbuffer_read(buf, data->pair[1], -1);
+		tt_int_op(n, ==, sizeof(chunk));
+		tt_mem_op(evbuffer_pullup(buf, -1), ==, chunk, sizeof(chunk));
+		tt_int_op(evbuffer_drain(buf, sizeof(chunk)), ==, 0);
+	}
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
+static unsigned char
+spill_pattern(size_t i)
+{
+	return (unsigned char)(i * 7 + i / 251);
+}
+
+static int
+count_open_fds(void)
+{
+	int fd, n = 0;
+
+	for (fd = 0; fd < 1024; ++fd) {
+		if (fcntl(fd, F_GETFD) != -1)
+			++n;
+	}
+	return n;
+}
+
+/* Add len bytes of spill_pattern() to buf in 4000-byte pieces. */
+static void
+spill_fill(struct evbuffer *buf, size_t len)
+{
+	unsigned char piece[4000];
+	size_t i, j;
+
+	for (i = 0; i < len; i += sizeof(piece)) {
+		for (j = 0; j < sizeof(piece); ++j)
+			piece[j] = spill_pattern(i + j);
+		evbuffer_add(buf, piece, sizeof(piece));
+	}
+}
+
+/* Remove everything in buf and count the bytes that differ from the
+ * pattern, starting at offset *off. */
+static size_t
+spill_check(struct evbuffer *buf, size_t *off)
+{
+	unsigned char out[8192];
+	size_t bad = 0;
+	int n, k;
+
+	while ((n = evbuffer_remove(buf, out, sizeof(out))) > 0) {
+		for (k = 0; k < n; ++k)
+			bad += out[k] != spill_pattern(*off + k);
+		*off += n;
+	}
+	return bad;
+}
+
+static void
+test_evbuffer_spill(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *half = evbuffer_new();
+	size_t len = 3 * 1024 * 1024, off = 0;
+	int fds_before = count_open_fds();
+
+	tt_assert(buf && half);
+	tt_int_op(evbuffer_set_spill(buf, 64 * 1024, NULL), ==, 0);
+	spill_fill(buf, len);
+	len = evbuffer_get_length(buf);
+	/* the spill file stays open while it holds data */
+	tt_int_op(count_open_fds(), >, fds_before);
+
+	/* spilled chains move to another buffer like any other */
+	tt_int_op(evbuffer_remove_buffer(buf, half, len / 2), ==, len / 2);
+	tt_int_op(spill_check(half, &off), ==, 0);
+	tt_int_op(spill_check(buf, &off), ==, 0);
+	tt_int_op(off, ==, len);
+
+	evbuffer_free(buf);
+	evbuffer_free(half);
+	buf = half = NULL;
+	tt_int_op(count_open_fds(), ==, fds_before);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (half)
+		evbuffer_free(half);
+}
+
+static void
+test_evbuffer_spill_sendfile(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *in = evbuffer_new();
+	size_t len = 1024 * 1024, off = 0, bad = 0;
+	int fds_before = count_open_fds();
+	int n;
+
+	tt_assert(buf && in);
+	evbuffer_set_flags(buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+	tt_int_op(evbuffer_set_spill(buf, 100000, NULL), ==, 0);
+	spill_fill(buf, len);
+	len = evbuffer_get_length(buf);
+
+	while (off < len) {
+		n = evbuffer_write(buf, data->pair[0]);
+		tt_assert(n >= 0 || errno == EAGAIN);
+		while (evbuffer_read(in, data->pair[1], -1) > 0)
+			bad += spill_check(in, &off);
+	}
+	tt_int_op(bad, ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(count_open_fds(), ==, fds_before);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (in)
+		evbuffer_free(in);
+}
+
+static char segment_dir[64];
+
+/* Replace the file name in the test's scratch directory with contents,
+ * and store its path in path. */
+static int
+segment_write(char *path, size_t pathlen, const char *name,
+    const char *contents)
+{
+	FILE *f;
+
+	if (!segment_dir[0]) {
+		strcpy(segment_dir, "/tmp/regress-XXXXXX");
+		if (!mkdtemp(segment_dir))
+			return -1;
+	}
+	evutil_snprintf(path, pathlen, "%s/%s", segment_dir, name);
+	if (!(f = fopen(path, "w")))
+		return -1;
+	fputs(contents, f);
+	fclose(f);
+	return 0;
+}
+
+static void
+segment_dir_remove(void)
+{
+	char path[128];
+
+	if (!segment_dir[0])
+		return;
+	evutil_snprintf(path, sizeof(path), "%s/one", segment_dir);
+	unlink(path);
+	evutil_snprintf(path, sizeof(path), "%s/two", segment_dir);
+	unlink(path);
+	rmdir(segment_dir);
+	segment_dir[0] = '\0';
+}
+
+/* Compare the whole of seg with expect. */
+static int
+segment_is(struct evbuffer_file_segment *seg, const char *expect)
+{
+	struct evbuffer *buf = evbuffer_new();
+	size_t len = strlen(expect);
+	int r;
+
+	evbuffer_add_file_segment(buf, seg, 0, -1);
+	r = evbuffer_get_length(buf) == len &&
+	    !memcmp(evbuffer_pullup(buf, -1), expect, len);
+	evbuffer_free(buf);
+	return r;
+}
+
+static void
+test_evbuffer_segment_cache(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer_file_segment *a = NULL, *b = NULL, *r = NULL;
+	char path[128], other[128];
+
+	tt_int_op(segment_write(other, sizeof(other), "two", "other"), ==, 0);
+	tt_int_op(segment_write(path, sizeof(path), "one", "version one"), ==, 0);
+	tt_int_op(evbuffer_file_segment_cache_enable(data->base, 2), ==, 0);
+
+	/* the same range of the same file is shared */
+	a = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	b = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	tt_assert(a);
+	tt_ptr_op(a, ==, b);
+	tt_assert(segment_is(a, "version one"));
+	evbuffer_file_segment_free(b);
+	b = NULL;
+
+	r = evbuffer_file_segment_cache_get(path, 8, 3, 0);
+	tt_assert(r);
+	tt_ptr_op(r, !=, a);
+	tt_assert(segment_is(r, "one"));
+	evbuffer_file_segment_free(r);
+	r = NULL;
+
+	/* once inotify has reported a change, the old segment is dropped */
+	tt_int_op(segment_write(path, sizeof(path), "one", "version two!"),
+	    ==, 0);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	b = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	tt_assert(b);
+	tt_ptr_op(b, !=, a);
+	tt_assert(segment_is(b, "version two!"));
+	evbuffer_file_segment_free(a);
+	a = b;
+	b = NULL;
+
+	/* with room for two, a third entry evicts the least recently used */
+	r = evbuffer_file_segment_cache_get(other, 0, -1, 0);
+	tt_assert(r);
+	evbuffer_file_segment_free(r);
+	r = evbuffer_file_segment_cache_get(path, 1, 2, 0);
+	tt_assert(r);
+	b = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	tt_assert(b);
+	tt_ptr_op(b, !=, a);
+
+	/* directories are refused */
+	evbuffer_file_segment_free(b);
+	b = evbuffer_file_segment_cache_get(segment_dir, 0, -1, 0);
+	tt_ptr_op(b, ==, NULL);
+	tt_int_op(errno, ==, EISDIR);
+
+end:
+	if (a)
+		evbuffer_file_segment_free(a);
+	if (b)
+		evbuffer_file_segment_free(b);
+	if (r)
+		evbuffer_file_segment_free(r);
+	evbuffer_file_segment_cache_enable(NULL, 0);
+	segment_dir_remove();
+}
+
+static void
+test_evbuffer_segment_cache_stat(void *ptr)
+{
+	struct evbuffer_file_segment *a = NULL, *b = NULL;
+	char path[128];
+
+	tt_int_op(segment_write(path, sizeof(path), "one", "version one"), ==, 0);
+	tt_int_op(evbuffer_file_segment_cache_enable(NULL, 16), ==, 0);
+
+	a = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	b = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	tt_assert(a);
+	tt_ptr_op(a, ==, b);
+	evbuffer_file_segment_free(b);
+	b = NULL;
+
+	/* without a base, the next lookup notices the new size */
+	tt_int_op(segment_write(path, sizeof(path), "one",
+		"version three, longer"), ==, 0);
+	b = evbuffer_file_segment_cache_get(path, 0, -1, 0);
+	tt_assert(b);
+	tt_ptr_op(b, !=, a);
+	tt_assert(segment_is(b, "version three, longer"));
+
+end:
+	if (a)
+		evbuffer_file_segment_free(a);
+	if (b)
+		evbuffer_file_segment_free(b);
+	evbuffer_file_segment_cache_enable(NULL, 0);
+	segment_dir_remove();
+}
+
+static void
+test_evbuffer_spare_chain(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new(), *dst = evbuffer_new();
+	struct evbuffer_chain *spare;
+	char out[16];
+
+	tt_assert(buf && dst);
+	tt_ptr_op(buf->spare_chain, ==, NULL);
+
+	/* a short message goes into the spare chain ... */
+	tt_int_op(evbuffer_add(buf, "hello", 5), ==, 0);
+	spare = buf->spare_chain;
+	tt_assert(spare);
+	tt_ptr_op(buf->first, ==, spare);
+	tt_assert(spare->flags & EVBUFFER_SPARE);
+
+	/* ... which is kept, and reused, once drained */
+	tt_int_op(evbuffer_drain(buf, 5), ==, 0);
+	tt_ptr_op(buf->spare_chain, ==, spare);
+	tt_int_op(evbuffer_add(buf, "world", 5), ==, 0);
+	tt_ptr_op(buf->first, ==, spare);
+	tt_ptr_op(buf->first->next, ==, NULL);
+
+	evbuffer_drain(buf, 5);
+
+	/* moving the data out copies it off the spare chain, which stays
+	 * with its buffer */
+	tt_int_op(evbuffer_add(buf, "moved", 5), ==, 0);
+	tt_ptr_op(buf->first, ==, spare);
+	tt_int_op(evbuffer_add_buffer(dst, buf), ==, 0);
+	tt_ptr_op(dst->first, !=, spare);
+	tt_ptr_op(buf->spare_chain, ==, spare);
+	tt_int_op(spare->refcnt, ==, 0);
+	tt_int_op(evbuffer_remove(dst, out, sizeof(out)), ==, 5);
+	tt_assert(!memcmp(out, "moved", 5));
+	tt_int_op(evbuffer_add(buf, "again", 5), ==, 0);
+	tt_ptr_op(buf->first, ==, spare);
+
+	/* a reference to it outlives evbuffer_free() of its buffer */
+	tt_int_op(evbuffer_add_buffer_reference(dst, buf), ==, 0);
+	evbuffer_free(buf);
+	buf = NULL;
+	tt_int_op(evbuffer_remove(dst, out, sizeof(out)), ==, 5);
+	tt_assert(!memcmp(out, "again", 5));
+
+	/* an idle buffer gives its spare chain back when trimmed */
+	buf = evbuffer_new();
+	tt_assert(buf);
+	tt_int_op(evbuffer_add(buf, "trim", 4), ==, 0);
+	evbuffer_drain(buf, 4);
+	tt_assert(buf->spare_chain);
+	evbuffer_trim_(buf);
+	tt_ptr_op(buf->spare_chain, ==, NULL);
+	tt_int_op(evbuffer_add(buf, "back", 4), ==, 0);
+	tt_assert(buf->spare_chain);
+	tt_int_op(evbuffer_remove(buf, out, sizeof(out)), ==, 4);
+	tt_assert(!memcmp(out, "back", 4));
+
+	/* room for more than it holds comes from a chain of its own */
+	tt_int_op(evbuffer_expand(buf, EVBUFFER_SPARE_SIZE * 2), ==, 0);
+	tt_assert(buf->first);
+	tt_ptr_op(buf->first, !=, buf->spare_chain);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (dst)
+		evbuffer_free(dst);
+}
+
+static char lend_mem[4][4];
+static int n_returned;
+static size_t returned_len;
+
+static void
+lend_cleanup(const void *data, size_t len, void *arg)
+{
+	++n_returned;
+	returned_len += len;
+}
+
+static int
+lend_getfn(struct evbuffer *buf, size_t howmuch, struct iovec *vec,
+    int n_vec, void *arg)
+{
+	int i;
+
+	for (i = 0; i < 4 && i < n_vec; ++i) {
+		vec[i].iov_base = lend_mem[i];
+		vec[i].iov_len = sizeof(lend_mem[i]);
+	}
+	return i;
+}
+
+static void
+lend_reset(struct iovec *vec)
+{
+	int i;
+
+	memset(lend_mem, 0, sizeof(lend_mem));
+	n_returned = 0;
+	returned_len = 0;
+	for (i = 0; i < 4; ++i) {
+		vec[i].iov_base = lend_mem[i];
+		vec[i].iov_len = sizeof(lend_mem[i]);
+	}
+}
+
+static void
+test_evbuffer_read_into(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = evbuffer_new(), *ring = evbuffer_new();
+	struct iovec v[4];
+	struct iovec vec[4];
+	char out[16];
+
+	tt_assert(buf && ring);
+	lend_reset(vec);
+
+	/* a short read spreads over the first regions and hands the
+	 * unused one back at once */
+	tt_int_op(write(data->pair[0], "hello, wor", 10), ==, 10);
+	tt_int_op(evbuffer_read_into(buf, data->pair[1], vec, 4,
+		lend_cleanup, NULL), ==, 10);
+	tt_int_op(n_returned, ==, 1);
+	tt_int_op(evbuffer_get_length(buf), ==, 10);
+	tt_int_op(evbuffer_peek(buf, -1, NULL, v, 4), ==, 3);
+	tt_ptr_op(v[0].iov_base, ==, lend_mem[0]);
+	tt_ptr_op(v[1].iov_base, ==, lend_mem[1]);
+	tt_ptr_op(v[2].iov_base, ==, lend_mem[2]);
+	tt_int_op(v[2].iov_len, ==, 2);
+
+	/* appends never write into the rest of a lent region */
+	tt_int_op(evbuffer_add(buf, "ld", 2), ==, 0);
+	tt_int_op(lend_mem[2][2], ==, 0);
+
+	/* each region goes back as the data in it is drained */
+	tt_int_op(evbuffer_drain(buf, 5), ==, 0);
+	tt_int_op(n_returned, ==, 2);
+	tt_int_op(evbuffer_remove(buf, out, sizeof(out)), ==, 7);
+	tt_mem_op(out, ==, ", world", 7);
+	tt_int_op(n_returned, ==, 4);
+	tt_int_op(returned_len, ==, sizeof(lend_mem));
+
+	/* a frozen end refuses the read, and every region goes back */
+	lend_reset(vec);
+	tt_int_op(write(data->pair[0], "x", 1), ==, 1);
+	evbuffer_freeze(buf, 0);
+	errno = 0;
+	tt_int_op(evbuffer_read_into(buf, data->pair[1], vec, 4,
+		lend_cleanup, NULL), ==, -1);
+	tt_int_op(errno, ==, EINVAL);
+	tt_int_op(n_returned, ==, 4);
+	evbuffer_unfreeze(buf, 0);
+
+	/* so does a ring, which can't take lent memory at all */
+	lend_reset(vec);
+	tt_int_op(evbuffer_enable_ring(ring, 4096), ==, 0);
+	errno = 0;
+	tt_int_op(evbuffer_read_into(ring, data->pair[1], vec, 4,
+		lend_cleanup, NULL), ==, -1);
+	tt_int_op(errno, ==, EINVAL);
+	tt_int_op(n_returned, ==, 4);
+	errno = 0;
+	tt_int_op(evbuffer_set_read_mem(ring, lend_getfn, lend_cleanup,
+		NULL), ==, -1);
+	tt_int_op(errno, ==, EINVAL);
+	tt_int_op(evbuffer_set_read_mem(ring, NULL, NULL, NULL), ==, 0);
+
+	/* end of file hands everything back too */
+	lend_reset(vec);
+	tt_int_op(evbuffer_read_into(buf, data->pair[1], vec, 4,
+		lend_cleanup, NULL), ==, 1);
+	tt_int_op(evbuffer_drain(buf, 1), ==, 0);
+	tt_int_op(n_returned, ==, 4);
+	evutil_closesocket(data->pair[0]);
+	data->pair[0] = -1;
+	lend_reset(vec);
+	tt_int_op(evbuffer_read_into(buf, data->pair[1], vec, 4,
+		lend_cleanup, NULL), ==, 0);
+	tt_int_op(n_returned, ==, 4);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (ring)
+		evbuffer_free(ring);
+}
+
+static void
+test_evbuffer_read_mem(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = evbuffer_new();
+	struct iovec v[4];
+	struct iovec vec[4];
+
+	tt_assert(buf);
+	lend_reset(vec);
+	tt_int_op(evbuffer_set_read_mem(buf, lend_getfn, lend_cleanup,
+		NULL), ==, 0);
+
+	/* evbuffer_read() fills the lent regions ... */
+	tt_int_op(write(data->pair[0], "abcdef", 6), ==, 6);
+	tt_int_op(evbuffer_read(buf, data->pair[1], -1), ==, 6);
+	tt_int_op(n_returned, ==, 2);
+	tt_int_op(evbuffer_peek(buf, -1, NULL, v, 4), ==, 2);
+	tt_ptr_op(v[0].iov_base, ==, lend_mem[0]);
+	tt_ptr_op(v[1].iov_base, ==, lend_mem[1]);
+	tt_mem_op(evbuffer_pullup(buf, -1), ==, "abcdef", 6);
+	tt_int_op(n_returned, ==, 4);
+	evbuffer_drain(buf, 6);
+
+	/* ... until it is told to allocate for itself again */
+	lend_reset(vec);
+	tt_int_op(evbuffer_set_read_mem(buf, NULL, NULL, NULL), ==, 0);
+	tt_int_op(write(data->pair[0], "ghi", 3), ==, 3);
+	tt_int_op(evbuffer_read(buf, data->pair[1], -1), ==, 3);
+	tt_int_op(evbuffer_peek(buf, -1, NULL, v, 4), ==, 1);
+	tt_ptr_op(v[0].iov_base, !=, lend_mem[0]);
+	tt_int_op(n_returned, ==, 0);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
+/* Wait up to msec for fd to become readable, then read what is there. */
+static int
+recv_within(int fd, char *out, size_t len, int msec)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, msec) != 1)
+		return 0;
+	return (int)recv(fd, out, len, MSG_DONTWAIT);
+}
+
+static void
+test_evbuffer_write_more(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	char path[] = "/tmp/regress-moreXXXXXX";
+	int lfd = -1, cfd = -1, sfd = -1, file = -1, i, n, got;
+	char in[16];
+
+	tt_assert(buf);
+	evbuffer_set_flags(buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+	tt_int_op((file = mkstemp(path)), >=, 0);
+	unlink(path);
+	tt_int_op(write(file, "tail", 4), ==, 4);
+
+	/* MSG_MORE only does anything on TCP */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	tt_int_op((lfd = socket(AF_INET, SOCK_STREAM, 0)), >=, 0);
+	tt_int_op(bind(lfd, (struct sockaddr *)&sin, sizeof(sin)), ==, 0);
+	tt_int_op(listen(lfd, 1), ==, 0);
+	tt_int_op(getsockname(lfd, (struct sockaddr *)&sin, &slen), ==, 0);
+	tt_int_op((cfd = socket(AF_INET, SOCK_STREAM, 0)), >=, 0);
+	tt_int_op(connect(cfd, (struct sockaddr *)&sin, sizeof(sin)), ==, 0);
+	tt_int_op((sfd = accept(lfd, NULL, NULL)), >=, 0);
+
+	for (i = 0; i < 2; ++i) {
+		/* the write stops at the sendfile chain, with more to come */
+		tt_int_op(evbuffer_add(buf, "head", 4), ==, 0);
+		tt_int_op(evbuffer_add_file(buf, dup(file), 0, 4), ==, 0);
+		tt_int_op(evbuffer_write_atmost_(buf, cfd, -1, i), ==, 4);
+		if (i == 0) {
+			/* a plain write pushes the head out at once ... */
+			tt_int_op(recv_within(sfd, in, sizeof(in), 1000), ==, 4);
+			tt_mem_op(in, ==, "head", 4);
+		} else {
+			/* ... one asked to wait for more holds it back */
+			tt_int_op(recv_within(sfd, in, sizeof(in), 50), ==, 0);
+		}
+		tt_int_op(evbuffer_write(buf, cfd), ==, 4);
+		tt_int_op(evbuffer_get_length(buf), ==, 0);
+		if (i == 0) {
+			tt_int_op(recv_within(sfd, in, sizeof(in), 1000),
+			    ==, 4);
+			tt_mem_op(in, ==, "tail", 4);
+		}
+	}
+	/* the rest of the write lets it go */
+	for (got = 0; got < 8; got += n) {
+		n = recv_within(sfd, in + got, sizeof(in) - got, 1000);
+		tt_int_op(n, >, 0);
+	}
+	tt_int_op(got, ==, 8);
+	tt_mem_op(in, ==, "headtail", 8);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (file >= 0)
+		close(file);
+	if (lfd >= 0)
+		close(lfd);
+	if (cfd >= 0)
+		close(cfd);
+	if (sfd >= 0)
+		close(sfd);
+}
+
+static void
+test_evbuffer_read_hint(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = evbuffer_new();
+	static char big[100000];
+	size_t hint, sent, total;
+	int n;
+
+	tt_assert(buf);
+	tt_int_op(buf->read_hint, ==, 0);
+
+	/* short reads halve the guess, down to a floor */
+	for (hint = 2048; hint >= 128; hint /= 2) {
+		tt_int_op(write(data->pair[0], big, 100), ==, 100);
+		tt_int_op(evbuffer_read(buf, data->pair[1], -1), ==, 100);
+		tt_int_op(buf->read_hint, ==, hint < 256 ? 256 : hint);
+	}
+
+	/* nothing to read says nothing about the next burst */
+	errno = 0;
+	tt_int_op(evbuffer_read(buf, data->pair[1], -1), ==, -1);
+	tt_int_op(errno, ==, EAGAIN);
+	tt_int_op(buf->read_hint, ==, 256);
+
+	/* reads that fill the guess double it, up to a ceiling */
+	for (sent = 0; sent < sizeof(big); sent += n) {
+		n = write(data->pair[0], big + sent, sizeof(big) - sent);
+		tt_int_op(n, >, 0);
+	}
+	for (total = 0, hint = 256; total < sizeof(big); total += n) {
+		n = evbuffer_read(buf, data->pair[1], -1);
+		tt_int_op(n, >, 0);
+		if ((size_t)n == hint && hint < 65536)
+			hint *= 2;
+		tt_int_op(buf->read_hint, ==, hint);
+	}
+	tt_int_op(hint, ==, 65536);
+	tt_int_op(evbuffer_get_length(buf), ==, 500 + sizeof(big));
+
+	/* so does end of file */
+	evutil_closesocket(data->pair[0]);
+	data->pair[0] = -1;
+	tt_int_op(evbuffer_read(buf, data->pair[1], -1), ==, 0);
+	tt_int_op(buf->read_hint, ==, 65536);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
+static int n_compact_cleanups;
+
+static void
+compact_cleanup(const void *data, size_t len, void *arg)
+{
+	++n_compact_cleanups;
+}
+
+static void
+test_evbuffer_compaction(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = evbuffer_new(), *in = evbuffer_new();
+	struct evbuffer_stats stats;
+	static char pieces[2000][10];
+	int i, n;
+
+	tt_assert(buf && in);
+	for (i = 0; i < 2000; ++i)
+		memset(pieces[i], 'a' + i % 26, sizeof(pieces[i]));
+
+	/* a few chains go out as they are */
+	for (i = 0; i < 10; ++i)
+		tt_int_op(evbuffer_add_reference(buf, pieces[i],
+			sizeof(pieces[i]), compact_cleanup, NULL), ==, 0);
+	tt_int_op(evbuffer_write(buf, data->pair[0]), ==, 100);
+	evbuffer_get_stats(buf, &stats);
+	tt_int_op(stats.n_compactions, ==, 0);
+	tt_int_op(n_compact_cleanups, ==, 10);
+	tt_int_op(evbuffer_read(in, data->pair[1], -1), ==, 100);
+	tt_mem_op(evbuffer_pullup(in, -1), ==, pieces, 100);
+	evbuffer_drain(in, 100);
+
+	/* more small chains than one writev() takes are copied together,
+	 * so a single write still sends them all */
+	for (i = 0; i < 2000; ++i)
+		tt_int_op(evbuffer_add_reference(buf, pieces[i],
+			sizeof(pieces[i]), compact_cleanup, NULL), ==, 0);
+	evbuffer_get_stats(buf, &stats);
+	tt_int_op(stats.n_chains, ==, 2000);
+	tt_int_op(evbuffer_write(buf, data->pair[0]), ==, sizeof(pieces));
+	evbuffer_get_stats(buf, &stats);
+	tt_int_op(stats.n_chains, ==, 0);
+	tt_int_op(stats.n_compactions, ==, 1);
+	tt_int_op(stats.n_bytes_compacted, ==, sizeof(pieces));
+	tt_int_op(n_compact_cleanups, ==, 2010);
+
+	while ((n = evbuffer_read(in, data->pair[1], -1)) > 0)
+		;
+	tt_int_op(evbuffer_get_length(in), ==, sizeof(pieces));
+	tt_mem_op(evbuffer_pullup(in, -1), ==, pieces, sizeof(pieces));
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (in)
+		evbuffer_free(in);
+}
+
+static int n_broadcast_cbs;
+
+static void
+broadcast_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+    void *arg)
+{
+	if (info->n_added)
+		++n_broadcast_cbs;
+}
+
+static void
+test_evbuffer_broadcast(void *ptr)
+{
+	struct evbuffer *src = evbuffer_new(), *dsts[6] = { NULL };
+	struct iovec v[2], w[2];
+	char path[] = "/tmp/regress-bcastXXXXXX";
+	int i, fd = -1;
+
+	tt_assert(src);
+	for (i = 0; i < 5; ++i) {
+		tt_assert((dsts[i] = evbuffer_new()) != NULL);
+		evbuffer_add_cb(dsts[i], broadcast_cb, NULL);
+	}
+	dsts[5] = src;
+	tt_int_op(evbuffer_add(dsts[2], "pre:", 4), ==, 0);
+	evbuffer_freeze(dsts[3], 0);
+	tt_int_op(evbuffer_enable_ring(dsts[4], 4096), ==, 0);
+	n_broadcast_cbs = 0;
+
+	/* three buffers get the data; the frozen one, the ring and src
+	 * itself are skipped */
+	tt_int_op(evbuffer_add(src, "hello ", 6), ==, 0);
+	tt_int_op(evbuffer_add_reference(src, "world", 5, NULL, NULL), ==, 0);
+	tt_int_op(evbuffer_broadcast(src, dsts, 6), ==, 3);
+	tt_int_op(evbuffer_get_length(src), ==, 0);
+	tt_int_op(n_broadcast_cbs, ==, 3);
+	tt_int_op(evbuffer_get_length(dsts[3]), ==, 0);
+	tt_int_op(evbuffer_get_length(dsts[4]), ==, 0);
+
+	/* all three share one copy */
+	tt_int_op(evbuffer_peek(dsts[0], -1, NULL, v, 2), ==, 2);
+	tt_int_op(evbuffer_peek(dsts[1], -1, NULL, w, 2), ==, 2);
+	tt_ptr_op(v[0].iov_base, ==, w[0].iov_base);
+	tt_ptr_op(v[1].iov_base, ==, w[1].iov_base);
+	tt_mem_op(evbuffer_pullup(dsts[0], -1), ==, "hello world", 11);
+	tt_mem_op(evbuffer_pullup(dsts[2], -1), ==, "pre:hello world", 15);
+
+	/* draining one leaves the others intact, and src can be reused */
+	evbuffer_drain(dsts[1], 11);
+	tt_int_op(evbuffer_add(src, "again", 5), ==, 0);
+	tt_mem_op(evbuffer_pullup(dsts[0], -1), ==, "hello world", 11);
+	evbuffer_drain(src, 5);
+
+	/* data to be sent with sendfile() can't be shared */
+	tt_int_op((fd = mkstemp(path)), >=, 0);
+	unlink(path);
+	tt_int_op(write(fd, "file", 4), ==, 4);
+	evbuffer_set_flags(src, EVBUFFER_FLAG_DRAINS_TO_FD);
+	tt_int_op(evbuffer_add_file(src, fd, 0, 4), ==, 0);
+	fd = -1;
+	tt_int_op(evbuffer_broadcast(src, dsts, 2), ==, -1);
+	tt_int_op(evbuffer_get_length(src), ==, 4);
+	tt_int_op(evbuffer_get_length(dsts[0]), ==, 11);
+
+end:
+	if (fd >= 0)
+		close(fd);
+	for (i = 0; i < 5; ++i)
+		if (dsts[i])
+			evbuffer_free(dsts[i]);
+	if (src)
+		evbuffer_free(src);
+}
+
+static void
+test_evbuffer_crc32c(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer_ptr pos;
+	char block[32];
+	uint32_t crc;
+
+	tt_assert(buf);
+
+	/* the standard check value */
+	tt_int_op(evbuffer_add(buf, "123456789", 9), ==, 0);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(crc, ==, 0xE3069283);
+	evbuffer_drain(buf, 9);
+
+	/* the same over two chains, and in two calls */
+	tt_int_op(evbuffer_add(buf, "1234", 4), ==, 0);
+	tt_int_op(evbuffer_add_reference(buf, "56789", 5, NULL, NULL), ==, 0);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(crc, ==, 0xE3069283);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, 3, &crc), ==, 0);
+	tt_int_op(evbuffer_ptr_set(buf, &pos, 3, EVBUFFER_PTR_SET), ==, 0);
+	tt_int_op(evbuffer_crc32c(buf, &pos, 6, &crc), ==, 0);
+	tt_int_op(crc, ==, 0xE3069283);
+
+	/* a range past the end is refused */
+	tt_int_op(evbuffer_crc32c(buf, &pos, 7, &crc), ==, -1);
+	evbuffer_drain(buf, 9);
+
+	/* long enough for the word-at-a-time path (RFC 3720, B.4) */
+	memset(block, 0, sizeof(block));
+	tt_int_op(evbuffer_add(buf, block, sizeof(block)), ==, 0);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(crc, ==, 0x8A9136AA);
+	evbuffer_drain(buf, sizeof(block));
+	memset(block, 0xff, sizeof(block));
+	tt_int_op(evbuffer_add(buf, block, sizeof(block)), ==, 0);
+	crc = 0;
+	tt_int_op(evbuffer_crc32c(buf, NULL, -1, &crc), ==, 0);
+	tt_int_op(crc, ==, 0x62A8AB43);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
+struct testcase_t buffer_testcases[] = {
+	{ "ring", test_evbuffer_ring, 0, NULL, NULL },
+	{ "ring_full", test_evbuffer_ring_full, 0, NULL, NULL },
+	{ "ring_io", test_evbuffer_ring_io, TT_FORK|TT_NEED_SOCKETPAIR,
+	  &basic_setup, NULL },
+	{ "spill", test_evbuffer_spill, TT_FORK, NULL, NULL },
+	{ "spill_sendfile", test_evbuffer_spill_sendfile,
+	  TT_FORK|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "segment_cache", test_evbuffer_segment_cache,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "segment_cache_stat", test_evbuffer_segment_cache_stat, TT_FORK,
+	  NULL, NULL },
+	{ "spare_chain", test_evbuffer_spare_chain, 0, NULL, NULL },
+	{ "read_into", test_evbuffer_read_into, TT_FORK|TT_NEED_SOCKETPAIR,
+	  &basic_setup, NULL },
+	{ "read_mem", test_evbuffer_read_mem, TT_FORK|TT_NEED_SOCKETPAIR,
+	  &basic_setup, NULL },
+	{ "write_more", test_evbuffer_write_more, TT_FORK, NULL, NULL },
+	{ "read_hint", test_evbuffer_read_hint, TT_FORK|TT_NEED_SOCKETPAIR,
+	  &basic_setup, NULL },
+	{ "compaction", test_evbuffer_compaction, TT_FORK|TT_NEED_SOCKETPAIR,
+	  &basic_setup, NULL },
+	{ "broadcast", test_evbuffer_broadcast, TT_FORK, NULL, NULL },
+	{ "crc32c", test_evbuffer_crc32c, 0, NULL, NULL },
+
+	END_OF_TESTCASES
+};
@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2003-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/buffer_compat.h>
+#include <event2/bufferevent.h>
+
+#include "evbuffer-internal.h"
+#include "regress.h"
+
+static int mem_levels[8];
+static int n_mem_levels;
+
+static void
+mem_level_cb(struct event_base *base, size_t usage, int level, void *arg)
+{
+	if (n_mem_levels < 8)
+		mem_levels[n_mem_levels++] = level;
+}
+
+static void
+test_bufferevent_memory_limits(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct bufferevent *bev1 = NULL, *bev2 = NULL;
+	int pair2[2] = { -1, -1 };
+	char big[2000];
+	int i;
+
+	memset(big, 'q', sizeof(big));
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair2), ==, 0);
+	evutil_make_socket_nonblocking(pair2[0]);
+
+	bev1 = bufferevent_socket_new(base, data->pair[0], 0);
+	bev2 = bufferevent_socket_new(base, pair2[0], 0);
+	tt_assert(bev1 && bev2);
+	bufferevent_enable(bev1, EV_READ);
+	bufferevent_enable(bev2, EV_READ);
+	tt_int_op(event_base_set_memory_limits(base, 1000, 5000,
+		EVBUFFER_MEM_SUSPEND_READS, mem_level_cb, NULL), ==, 0);
+
+	tt_int_op(write(pair2[1], "hi", 2), ==, 2);
+	for (i = 0; i < 3; ++i) {
+		tt_int_op(write(data->pair[1], big, sizeof(big)), ==, sizeof(big));
+		event_base_loop(base, EVLOOP_NONBLOCK);
+	}
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev1)), ==, 6000);
+	tt_int_op(event_base_memory_usage(base), ==, 6002);
+	tt_int_op(evbuffer_get_total_memory_usage(), ==, 6002);
+	tt_int_op(n_mem_levels, ==, 2);
+	tt_int_op(mem_levels[0], ==, EVBUFFER_MEM_SOFT);
+	tt_int_op(mem_levels[1], ==, EVBUFFER_MEM_HARD);
+
+	/* past the hard limit, the bufferevent holding the bulk of the
+	 * memory stops reading; the one holding two bytes does not */
+	tt_int_op(write(data->pair[1], big, sizeof(big)), ==, sizeof(big));
+	tt_int_op(write(pair2[1], "hi", 2), ==, 2);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev1)), ==, 6000);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev2)), ==, 4);
+
+	/* draining below the soft limit resumes it */
+	tt_int_op(n_mem_levels, ==, 2);
+	evbuffer_drain(bufferevent_get_input(bev1), 6000);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(n_mem_levels, >=, 3);
+	tt_int_op(mem_levels[2], ==, EVBUFFER_MEM_OK);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(bev1)), ==, 2000);
+
+	/* borrowed memory is not counted against the base */
+	evbuffer_drain(bufferevent_get_input(bev1), 2000);
+	evbuffer_drain(bufferevent_get_input(bev2), 4);
+	tt_int_op(event_base_memory_usage(base), ==, 0);
+	tt_int_op(evbuffer_add_reference(bufferevent_get_output(bev2),
+		big, sizeof(big), NULL, NULL), ==, 0);
+	tt_int_op(event_base_memory_usage(base), ==, 0);
+	tt_int_op(evbuffer_add(bufferevent_get_output(bev2), "abc", 3), ==, 0);
+	tt_int_op(event_base_memory_usage(base), ==, 3);
+
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+	bev1 = bev2 = NULL;
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(event_base_memory_usage(base), ==, 0);
+	tt_int_op(evbuffer_get_total_memory_usage(), ==, 0);
+
+end:
+	if (bev1)
+		bufferevent_free(bev1);
+	if (bev2)
+		bufferevent_free(bev2);
+	if (pair2[0] >= 0)
+		evutil_closesocket(pair2[0]);
+	if (pair2[1] >= 0)
+		evutil_closesocket(pair2[1]);
+}
+
+static int n_frames, n_frame_errors, frame_errno;
+static size_t frame_lens[16];
+
+static void
+frame_cb(struct bufferevent *bev, const struct evbuffer_ptr *pos, size_t len,
+    const struct iovec *vec, int n_vec, void *arg)
+{
+	size_t total = 0, j;
+	int i;
+
+	/* every payload is 0, 1, 2, ... mod 256 */
+	for (i = 0; i < n_vec; ++i) {
+		const unsigned char *p = vec[i].iov_base;
+		for (j = 0; j < vec[i].iov_len; ++j) {
+			if (p[j] != (unsigned char)(total + j))
+				++n_frame_errors;
+		}
+		total += vec[i].iov_len;
+	}
+	if (total != len || pos->pos < 1)
+		++n_frame_errors;
+	if (n_frames < 16)
+		frame_lens[n_frames] = len;
+	++n_frames;
+}
+
+static void
+frame_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & BEV_EVENT_ERROR)
+		frame_errno = errno;
+}
+
+static void
+test_bufferevent_framing(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *r = NULL, *w = NULL;
+	static unsigned char payload[70000];
+	static const size_t sizes[] = { 0, 1, 200, 255, 3000, 65535, 60000 };
+	int hdr, pair[2];
+	size_t i, low, high;
+	int expect;
+
+	for (i = 0; i < sizeof(payload); ++i)
+		payload[i] = (unsigned char)i;
+
+	for (hdr = BEV_FRAME_U8; hdr <= BEV_FRAME_VARINT; ++hdr) {
+		tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair), ==, 0);
+		r = bufferevent_socket_new(data->base, pair[0],
+		    BEV_OPT_CLOSE_ON_FREE);
+		w = bufferevent_socket_new(data->base, pair[1],
+		    BEV_OPT_CLOSE_ON_FREE);
+		tt_assert(r && w);
+		bufferevent_setcb(r, NULL, NULL, frame_eventcb, NULL);
+		tt_int_op(bufferevent_set_framing(r, hdr, 0, frame_cb, NULL),
+		    ==, 0);
+		tt_int_op(bufferevent_set_framing(w, hdr, 0, frame_cb, NULL),
+		    ==, 0);
+		bufferevent_enable(r, EV_READ);
+
+		n_frames = n_frame_errors = 0;
+		frame_errno = 0;
+		expect = 0;
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			if (hdr == BEV_FRAME_U8 && sizes[i] > 255) {
+				tt_int_op(bufferevent_write_frame(w, payload,
+					sizes[i]), ==, -1);
+				continue;
+			}
+			tt_int_op(bufferevent_write_frame(w, payload,
+				sizes[i]), ==, 0);
+			++expect;
+		}
+		regress_run_for(data->base, 200);
+		tt_int_op(n_frames, ==, expect);
+		tt_int_op(n_frame_errors, ==, 0);
+
+		/* a frame over the limit is an error, with errno EMSGSIZE */
+		tt_int_op(bufferevent_set_framing(r, hdr, 100, frame_cb, NULL),
+		    ==, 0);
+		tt_int_op(bufferevent_write_frame(w, payload, 200), ==, 0);
+		regress_run_for(data->base, 200);
+		tt_int_op(n_frames, ==, expect);
+		tt_int_op(frame_errno, ==, EMSGSIZE);
+
+		/* turning framing off gives back the unset watermarks */
+		tt_int_op(bufferevent_set_framing(r, hdr, 0, NULL, NULL), ==, 0);
+		bufferevent_getwatermark(r, EV_READ, &low, &high);
+		tt_int_op(low, ==, 0);
+		tt_int_op(high, ==, 0);
+
+		bufferevent_free(r);
+		bufferevent_free(w);
+		r = w = NULL;
+	}
+
+end:
+	if (r)
+		bufferevent_free(r);
+	if (w)
+		bufferevent_free(w);
+}
+
+static void
+test_bufferevent_framing_dribble(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *r = NULL;
+	unsigned char msg[2 + 300];
+	int i, n;
+
+	/* 300 as a varint is 0xac 0x02 */
+	msg[0] = 0xac;
+	msg[1] = 0x02;
+	for (i = 0; i < 300; ++i)
+		msg[2 + i] = (unsigned char)i;
+
+	r = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(r);
+	bufferevent_setwatermark(r, EV_READ, 0, 100);
+	tt_int_op(bufferevent_set_framing(r, BEV_FRAME_VARINT, 0, frame_cb,
+		NULL), ==, 0);
+	bufferevent_enable(r, EV_READ);
+
+	/* seven bytes at a time splits the header between reads, and the
+	 * frame is larger than the high watermark */
+	n_frames = n_frame_errors = 0;
+	for (i = 0; i < (int)sizeof(msg); i += 7) {
+		n = (int)sizeof(msg) - i < 7 ? (int)sizeof(msg) - i : 7;
+		tt_int_op(write(data->pair[1], msg + i, n), ==, n);
+		regress_run_for(data->base, 1);
+	}
+	tt_int_op(n_frames, ==, 1);
+	tt_int_op(frame_lens[0], ==, 300);
+	tt_int_op(n_frame_errors, ==, 0);
+
+end:
+	if (r)
+		bufferevent_free(r);
+}
+
+static void
+test_bufferevent_framing_watermarks(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *r = NULL, *w = NULL;
+	static char payload[1000];
+	size_t low, high;
+
+	r = bufferevent_socket_new(data->base, data->pair[0],
+	    BEV_OPT_DEFER_CALLBACKS);
+	w = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_assert(r && w);
+	bufferevent_setcb(r, NULL, NULL, frame_eventcb, NULL);
+	bufferevent_setwatermark(r, EV_READ, 5, 100);
+	tt_int_op(bufferevent_set_framing(r, BEV_FRAME_BE16, 500, frame_cb,
+		NULL), ==, 0);
+	tt_int_op(bufferevent_set_framing(w, BEV_FRAME_BE16, 0, frame_cb,
+		NULL), ==, 0);
+	bufferevent_enable(r, EV_READ);
+
+	/* a frame larger than the user's high watermark raises it only
+	 * while that frame is read */
+	n_frames = 0;
+	frame_errno = 0;
+	tt_int_op(bufferevent_write_frame(w, payload, 300), ==, 0);
+	regress_run_for(data->base, 50);
+	tt_int_op(n_frames, ==, 1);
+	bufferevent_getwatermark(r, EV_READ, &low, &high);
+	tt_int_op(low, ==, 2);
+	tt_int_op(high, ==, 100);
+
+	/* new watermarks set while framing are kept for later */
+	bufferevent_setwatermark(r, EV_READ, 7, 50);
+	bufferevent_getwatermark(r, EV_READ, &low, &high);
+	tt_int_op(low, ==, 2);
+	tt_int_op(high, ==, 50);
+	tt_int_op(bufferevent_write_frame(w, payload, 60), ==, 0);
+	regress_run_for(data->base, 50);
+	tt_int_op(n_frames, ==, 2);
+	bufferevent_getwatermark(r, EV_READ, &low, &high);
+	tt_int_op(high, ==, 50);
+
+	/* an oversized frame followed by EOF still reports EMSGSIZE */
+	tt_int_op(bufferevent_write_frame(w, payload, 600), ==, 0);
+	regress_run_for(data->base, 50);
+	shutdown(data->pair[1], SHUT_WR);
+	bufferevent_trigger_event(r, BEV_EVENT_EOF|BEV_EVENT_READING,
+	    BEV_TRIG_DEFER_CALLBACKS);
+	regress_run_for(data->base, 50);
+	tt_int_op(frame_errno, ==, EMSGSIZE);
+
+	tt_int_op(bufferevent_set_framing(r, BEV_FRAME_BE16, 0, NULL, NULL),
+	    ==, 0);
+	bufferevent_getwatermark(r, EV_READ, &low, &high);
+	tt_int_op(low, ==, 7);
+	tt_int_op(high, ==, 50);
+
+end:
+	if (r)
+		bufferevent_free(r);
+	if (w)
+		bufferevent_free(w);
+}
+
+static void
+test_bufferevent_write_through(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *buf = evbuffer_new(), *in = evbuffer_new();
+	static char big[1024 * 1024];
+	char out[8];
+	size_t i;
+	int n;
+
+	tt_assert(buf && in);
+	bev = bufferevent_socket_new(data->base, data->pair[0],
+	    BEV_OPT_WRITE_THROUGH);
+	tt_assert(bev);
+	bufferevent_enable(bev, EV_WRITE);
+
+	/* with the socket writable, both calls write before returning,
+	 * without running the loop */
+	tt_int_op(bufferevent_write(bev, "ping", 4), ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_int_op(read(data->pair[1], out, sizeof(out)), ==, 4);
+	tt_mem_op(out, ==, "ping", 4);
+	tt_int_op(evbuffer_add(buf, "pong", 4), ==, 0);
+	tt_int_op(bufferevent_write_buffer(bev, buf), ==, 0);
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_int_op(read(data->pair[1], out, sizeof(out)), ==, 4);
+	tt_mem_op(out, ==, "pong", 4);
+
+	/* what the kernel does not take is queued, and later writes go
+	 * behind it rather than through */
+	for (i = 0; i < sizeof(big); ++i)
+		big[i] = (char)(i % 251);
+	tt_int_op(bufferevent_write(bev, big, sizeof(big)), ==, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), >, 0);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), <,
+	    sizeof(big));
+	tt_int_op(bufferevent_write(bev, "tail", 4), ==, 0);
+
+	for (i = 0; i < 1000 &&
+	    evbuffer_get_length(in) < sizeof(big) + 4; ++i) {
+		event_base_loop(data->base, EVLOOP_NONBLOCK);
+		while ((n = evbuffer_read(in, data->pair[1], -1)) > 0)
+			;
+	}
+	tt_int_op(evbuffer_get_length(in), ==, sizeof(big) + 4);
+	tt_mem_op(evbuffer_pullup(in, -1), ==, big, sizeof(big));
+	tt_mem_op(evbuffer_pullup(in, -1) + sizeof(big), ==, "tail", 4);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (buf)
+		evbuffer_free(buf);
+	if (in)
+		evbuffer_free(in);
+}
+
+static char pool_got[16];
+
+static void
+pool_readcb(struct bufferevent *bev, void *arg)
+{
+	size_t n = bufferevent_read(bev, pool_got, sizeof(pool_got) - 1);
+	pool_got[n] = '\0';
+}
+
+static void
+pool_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+}
+
+static void
+test_bufferevent_pool(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL, *old;
+	struct evbuffer *input, *output;
+	bufferevent_data_cb readcb, writecb;
+	bufferevent_event_cb eventcb;
+	void *cbarg;
+	size_t low, high;
+
+	tt_int_op(bufferevent_socket_set_pool_size(data->base, -1), ==, -1);
+	tt_int_op(bufferevent_socket_set_pool_size(data->base, 1), ==, 0);
+
+	/* leave some state behind in a bufferevent, then free it */
+	old = bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	input = bufferevent_get_input(bev);
+	output = bufferevent_get_output(bev);
+	bufferevent_setcb(bev, pool_readcb, NULL, pool_eventcb, data);
+	bufferevent_setwatermark(bev, EV_READ, 10, 100);
+	bufferevent_enable(bev, EV_READ);
+	tt_int_op(write(data->pair[1], "stale", 5), ==, 5);
+	regress_run_for(data->base, 50);
+	tt_int_op(evbuffer_get_length(input), ==, 5);
+	tt_int_op(evbuffer_add(output, "stale", 5), ==, 0);
+	bufferevent_free(bev);
+	bev = NULL;
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+
+	/* the next one reuses its memory and buffers, and none of that
+	 * state */
+	bev = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_ptr_op(bev, ==, old);
+	tt_ptr_op(bufferevent_get_input(bev), ==, input);
+	tt_ptr_op(bufferevent_get_output(bev), ==, output);
+	tt_int_op(evbuffer_get_length(input), ==, 0);
+	tt_int_op(evbuffer_get_length(output), ==, 0);
+	tt_int_op(bufferevent_getfd(bev), ==, data->pair[1]);
+	bufferevent_getcb(bev, &readcb, &writecb, &eventcb, &cbarg);
+	tt_assert(readcb == NULL && writecb == NULL && eventcb == NULL);
+	tt_ptr_op(cbarg, ==, NULL);
+	tt_int_op(bufferevent_getwatermark(bev, EV_READ, &low, &high), ==, 0);
+	tt_int_op(low, ==, 0);
+	tt_int_op(high, ==, 0);
+	tt_int_op(bufferevent_get_enabled(bev), ==, EV_WRITE);
+
+	/* and works like a new one */
+	bufferevent_setcb(bev, pool_readcb, NULL, NULL, NULL);
+	bufferevent_enable(bev, EV_READ);
+	tt_int_op(write(data->pair[0], "fresh", 5), ==, 5);
+	regress_run_for(data->base, 50);
+	tt_str_op(pool_got, ==, "fresh");
+
+	/* with pooling off, freed bufferevents are released */
+	tt_int_op(bufferevent_socket_set_pool_size(data->base, 0), ==, 0);
+	bufferevent_free(bev);
+	bev = NULL;
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+}
+
+static char frugal_lines[64];
+
+static void
+frugal_readcb(struct bufferevent *bev, void *arg)
+{
+	char *line;
+
+	while ((line = evbuffer_readln(bufferevent_get_input(bev), NULL,
+		    EVBUFFER_EOL_LF)) != NULL) {
+		strncat(frugal_lines, line,
+		    sizeof(frugal_lines) - strlen(frugal_lines) - 1);
+		free(line);
+	}
+}
+
+static void
+test_bufferevent_frugal(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *input;
+
+	bev = bufferevent_socket_new(data->base, data->pair[0],
+	    BEV_OPT_FRUGAL);
+	tt_assert(bev);
+	input = bufferevent_get_input(bev);
+	bufferevent_setcb(bev, frugal_readcb, NULL, NULL, NULL);
+	bufferevent_enable(bev, EV_READ);
+
+	/* a partial line is kept in a chain just big enough for it */
+	tt_int_op(write(data->pair[1], "one\ntw", 6), ==, 6);
+	regress_run_for(data->base, 50);
+	tt_str_op(frugal_lines, ==, "one");
+	tt_int_op(evbuffer_get_length(input), ==, 2);
+	tt_assert(input->first);
+	tt_ptr_op(input->first->next, ==, NULL);
+	tt_int_op(input->first->buffer_len, <, 1024);
+
+	/* the rest joins it, and once consumed nothing is left behind */
+	tt_int_op(write(data->pair[1], "o\nthree\n", 8), ==, 8);
+	regress_run_for(data->base, 50);
+	tt_str_op(frugal_lines, ==, "onetwothree");
+	tt_int_op(evbuffer_get_length(input), ==, 0);
+	tt_ptr_op(input->first, ==, NULL);
+	tt_ptr_op(input->spare_chain, ==, NULL);
+
+	/* and an idle one still reads what comes next */
+	tt_int_op(write(data->pair[1], "four\n", 5), ==, 5);
+	regress_run_for(data->base, 50);
+	tt_str_op(frugal_lines, ==, "onetwothreefour");
+	tt_ptr_op(input->first, ==, NULL);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+}
+
+static char frugal_mem[64];
+static int n_frugal_lent, n_frugal_returned;
+
+static int
+frugal_getfn(struct evbuffer *buf, size_t howmuch, struct iovec *vec,
+    int n_vec, void *arg)
+{
+	if (n_frugal_lent > n_frugal_returned)
+		return 0;
+	++n_frugal_lent;
+	vec[0].iov_base = frugal_mem;
+	vec[0].iov_len = sizeof(frugal_mem);
+	return 1;
+}
+
+static void
+frugal_cleanup(const void *data, size_t len, void *arg)
+{
+	++n_frugal_returned;
+}
+
+static void
+test_bufferevent_frugal_read_mem(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *input;
+	struct iovec v[2];
+
+	bev = bufferevent_socket_new(data->base, data->pair[0],
+	    BEV_OPT_FRUGAL);
+	tt_assert(bev);
+	input = bufferevent_get_input(bev);
+	tt_int_op(evbuffer_set_read_mem(input, frugal_getfn, frugal_cleanup,
+		NULL), ==, 0);
+	bufferevent_enable(bev, EV_READ);
+
+	/* the read lands in the lent memory, not the scratch area */
+	tt_int_op(write(data->pair[1], "hello", 5), ==, 5);
+	regress_run_for(data->base, 50);
+	tt_int_op(n_frugal_lent, ==, 1);
+	tt_int_op(evbuffer_peek(input, -1, NULL, v, 2), ==, 1);
+	tt_ptr_op(v[0].iov_base, ==, frugal_mem);
+	tt_int_op(v[0].iov_len, ==, 5);
+	tt_mem_op(v[0].iov_base, ==, "hello", 5);
+	evbuffer_drain(input, 5);
+	tt_int_op(n_frugal_returned, ==, 1);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+}
+
+struct testcase_t bufferevent_testcases[] = {
+	{ "memory_limits", test_bufferevent_memory_limits,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "framing", test_bufferevent_framing, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "framing_dribble", test_bufferevent_framing_dribble,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "framing_watermarks", test_bufferevent_framing_watermarks,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "pool", test_bufferevent_pool,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "write_through", test_bufferevent_write_through,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "frugal", test_bufferevent_frugal,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "frugal_read_mem", test_bufferevent_frugal_read_mem,
+	  TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+
+	END_OF_TESTCASES
+};
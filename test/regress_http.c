@@ -0,0 +1,1609 @@
+/*
+ * Copyright (c) 2003-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/http_struct.h>
+#include <event2/keyvalq_struct.h>
+
+#include "http-internal.h"
+#include "regress.h"
+
+static int test_ok;
+
+/* Start an HTTP server on an ephemeral port of 127.0.0.1. */
+static struct evhttp *
+http_setup(uint16_t *pport, struct event_base *base)
+{
+	struct evhttp *myhttp;
+	struct evhttp_bound_socket *sock;
+
+	myhttp = evhttp_new(base);
+	if (!myhttp)
+		return NULL;
+	sock = evhttp_bind_socket_with_handle(myhttp, "127.0.0.1", 0);
+	if (!sock) {
+		evhttp_free(myhttp);
+		return NULL;
+	}
+	*pport = regress_get_socket_port(evhttp_bound_socket_get_fd(sock));
+	return myhttp;
+}
+
+/* Send request on a new connection to port, and collect everything the
+ * server sends until it closes the connection or msec have passed. */
+static int
+http_exchange(struct event_base *base, uint16_t port, const void *request,
+    size_t len, struct evbuffer *reply, long msec)
+{
+	struct regress_peer peer;
+
+	if (regress_peer_connect(&peer, base, port) < 0)
+		return -1;
+	if (regress_peer_send(&peer, request, len) < 0) {
+		regress_peer_close(&peer);
+		return -1;
+	}
+	regress_run_for(base, msec);
+	evbuffer_add_buffer(reply, peer.input);
+	regress_peer_close(&peer);
+	return 0;
+}
+
+/* Return the reply as a NUL-terminated string. */
+static const char *
+http_reply_str(struct evbuffer *reply)
+{
+	evbuffer_add(reply, "", 1);
+	return (const char *)evbuffer_pullup(reply, -1);
+}
+
+static void
+http_header_storage_cb(struct evhttp_request *req, void *arg)
+{
+	struct evkeyvalq *in = evhttp_request_get_input_headers(req);
+	struct evkeyvalq query;
+	struct evkeyval *kv;
+	int n = 0;
+
+	TAILQ_INIT(&query);
+
+	/* lookups ignore case, and values are trimmed and unfolded */
+	tt_str_op(evhttp_find_header(in, "host"), ==, "example");
+	tt_str_op(evhttp_find_header(in, "CONTENT-TYPE"), ==, "text/plain");
+	tt_str_op(evhttp_find_header(in, "x-custom"), ==, "a b");
+	tt_str_op(evhttp_find_header(in, "X-Long"), ==, "one two three");
+	tt_ptr_op(evhttp_find_header(in, "Hos"), ==, NULL);
+	tt_ptr_op(evhttp_find_header(in, "Date"), ==, NULL);
+
+	/* parsed headers can be removed and added to like any others */
+	tt_int_op(evhttp_remove_header(in, "x-custom"), ==, 0);
+	tt_ptr_op(evhttp_find_header(in, "X-Custom"), ==, NULL);
+	tt_int_op(evhttp_add_header(in, "Date", "now"), ==, 0);
+	tt_str_op(evhttp_find_header(in, "date"), ==, "now");
+
+	/* a node the application built with malloc() and strdup() is freed
+	 * along with the parsed ones */
+	kv = malloc(sizeof(*kv));
+	tt_assert(kv);
+	kv->key = strdup("User-Made");
+	kv->value = strdup("v");
+	TAILQ_INSERT_TAIL(in, kv, next);
+	tt_str_op(evhttp_find_header(in, "user-made"), ==, "v");
+	TAILQ_FOREACH(kv, in, next)
+		++n;
+	tt_int_op(n, ==, 6);
+
+	tt_int_op(evhttp_parse_query("/x?a=1&b=2&Host=h", &query), ==, 0);
+	tt_str_op(evhttp_find_header(&query, "host"), ==, "h");
+
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Content-Type", "x/y");
+	test_ok = 1;
+end:
+	evhttp_clear_headers(&query);
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static const char http_header_request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: example\r\n"
+    "content-type: text/plain\r\n"
+    "X-Custom:   a b  \r\n"
+    "X-Long: one\r\n"
+    " two\r\n"
+    "\tthree\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static void
+http_header_storage_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	uint16_t port = 0;
+
+	http = http_setup(&port, data->base);
+	tt_assert(http && reply);
+	evhttp_set_cb(http, "/", http_header_storage_cb, NULL);
+
+	test_ok = 0;
+	tt_int_op(http_exchange(data->base, port, http_header_request,
+		strlen(http_header_request), reply, 1000), ==, 0);
+	tt_int_op(test_ok, ==, 1);
+	tt_assert(strstr(http_reply_str(reply), "Content-Type: x/y"));
+
+end:
+	if (reply)
+		evbuffer_free(reply);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_header_dribble_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	size_t i, len = strlen(http_header_request), n;
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	evhttp_set_cb(http, "/", http_header_storage_cb, NULL);
+
+	/* lines split across reads are parsed once they are complete */
+	test_ok = 0;
+	tt_int_op(regress_peer_connect(&peer, data->base, port), ==, 0);
+	for (i = 0; i < len; i += n) {
+		n = len - i < 3 ? len - i : 3;
+		tt_int_op(regress_peer_send(&peer, http_header_request + i, n),
+		    ==, 0);
+		regress_run_for(data->base, 1);
+	}
+	regress_run_for(data->base, 1000);
+	tt_int_op(test_ok, ==, 1);
+	tt_assert(peer.eof);
+	tt_assert(strstr(http_reply_str(peer.input), "Content-Type: x/y"));
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+}
+
+static size_t http_uri_len;
+
+static void
+http_uri_len_cb(struct evhttp_request *req, void *arg)
+{
+	http_uri_len = strlen(evhttp_request_get_uri(req));
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void
+http_parse_errors_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	char request[2000];
+	uint16_t port = 0;
+
+	http = http_setup(&port, data->base);
+	tt_assert(http && reply);
+	evhttp_set_gencb(http, http_uri_len_cb, NULL);
+
+	/* a request line too long for the stack copy is parsed from the
+	 * heap */
+	strcpy(request, "GET /");
+	memset(request + 5, 'a', 900);
+	strcpy(request + 905, " HTTP/1.1\r\nConnection: close\r\n\r\n");
+	tt_int_op(http_exchange(data->base, port, request, strlen(request),
+		reply, 1000), ==, 0);
+	tt_int_op(http_uri_len, ==, 901);
+	tt_assert(!strncmp(http_reply_str(reply), "HTTP/1.1 200", 12));
+
+	/* a control byte in a header name is a bad request */
+	http_uri_len = 0;
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	strcpy(request, "GET /x HTTP/1.1\r\nX-\x01A: a\r\n\r\n");
+	tt_int_op(http_exchange(data->base, port, request, strlen(request),
+		reply, 1000), ==, 0);
+	tt_int_op(http_uri_len, ==, 0);
+	tt_assert(!strncmp(http_reply_str(reply), "HTTP/1.1 400", 12));
+
+	/* a header line without a colon is a bad request */
+	http_uri_len = 0;
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	strcpy(request, "GET /x HTTP/1.1\r\nNoColon\r\n\r\n");
+	tt_int_op(http_exchange(data->base, port, request, strlen(request),
+		reply, 1000), ==, 0);
+	tt_int_op(http_uri_len, ==, 0);
+	tt_assert(!strncmp(http_reply_str(reply), "HTTP/1.1 400", 12));
+
+end:
+	if (reply)
+		evbuffer_free(reply);
+	if (http)
+		evhttp_free(http);
+}
+
+/* The byte-range sets the header tokenizer uses, plus ones that test the
+ * unsigned comparisons and the most ranges a set may have. */
+static const struct {
+	char ranges[EVHTTP_SCAN_RANGES_MAX];
+	int len;
+} http_scan_sets[] = {
+	{ "\0\x1f\x7f\x7f::", 6 },
+	{ "\0\0\n\n\r\r", 6 },
+	{ "\n\n\r\r", 4 },
+	{ "\x80\xff", 2 },
+	{ "\x7f\x80", 2 },
+	{ "AZ09az\x01\x08\xf0\xff--__~~", 16 },
+};
+
+static size_t
+http_scan_reference(const unsigned char *p, size_t len, const char *ranges,
+    int ranges_len)
+{
+	size_t i;
+	int r;
+
+	for (i = 0; i < len; ++i) {
+		for (r = 0; r < ranges_len; r += 2) {
+			if (p[i] >= (unsigned char)ranges[r] &&
+			    p[i] <= (unsigned char)ranges[r + 1])
+				return i;
+		}
+	}
+	return len;
+}
+
+static void
+http_scan_test(void *arg)
+{
+	unsigned char buf[256 + 32];
+	const int impls[] = { EVHTTP_SCAN_IMPL_SW, EVHTTP_SCAN_IMPL_SSE42,
+			      EVHTTP_SCAN_IMPL_AVX2 };
+	size_t len, align, hit, off, expect;
+	unsigned seed = 1;
+	int set, impl, have[3] = { 0, 0, 0 };
+
+	for (set = 0; set < (int)(sizeof(http_scan_sets) /
+		    sizeof(http_scan_sets[0])); ++set) {
+		const char *ranges = http_scan_sets[set].ranges;
+		int ranges_len = http_scan_sets[set].len;
+		unsigned char filler;
+
+		/* a byte outside every range of the set */
+		for (filler = ' '; http_scan_reference(&filler, 1, ranges,
+			ranges_len) == 0; ++filler)
+			;
+
+		/* every length up to eight AVX2 blocks, at every alignment,
+		 * with the hit anywhere -- in a full block, in the tail past
+		 * the last full block, or nowhere */
+		for (len = 0; len <= 256; ++len) {
+			for (align = 0; align < 32; align += (len < 80 ? 1 : 7)) {
+				unsigned char *p = buf + align;
+				for (hit = 0; hit <= len; ++hit) {
+					size_t i;
+					for (i = 0; i < len; ++i) {
+						seed = seed * 1103515245 + 12345;
+						p[i] = (seed >> 16) & 1 ?
+						    filler : (unsigned char)(seed >> 8);
+						if (i < hit && http_scan_reference(
+							p + i, 1, ranges, ranges_len) == 0)
+							p[i] = filler;
+					}
+					if (hit < len)
+						p[hit] = (unsigned char)ranges[
+						    (seed >> 4) % ranges_len];
+					expect = http_scan_reference(p, len,
+					    ranges, ranges_len);
+					tt_int_op(expect, ==, hit);
+					for (impl = 0; impl < 3; ++impl) {
+						if (evhttp_scan_impl_(impls[impl],
+							(const char *)p, len, ranges,
+							ranges_len, &off) < 0)
+							continue;
+						have[impl] = 1;
+						if (off != expect) {
+							TT_DIE(("scanner %d, set %d: "
+							    "%lu of %lu at %lu, "
+							    "expected %lu", impls[impl],
+							    set, (unsigned long)off,
+							    (unsigned long)len,
+							    (unsigned long)align,
+							    (unsigned long)expect));
+						}
+					}
+				}
+			}
+		}
+	}
+	/* a header name ends at its colon, or at any control byte */
+	for (len = 0; len < 256; ++len) {
+		memcpy(buf, "Na?e: v", 7);
+		buf[2] = (unsigned char)len;
+		expect = len < 0x20 || len == 0x7f || len == ':' ? 2 : 4;
+		for (impl = 0; impl < 3; ++impl) {
+			if (evhttp_scan_impl_(impls[impl], (const char *)buf,
+				7, http_scan_sets[0].ranges,
+				http_scan_sets[0].len, &off) < 0)
+				continue;
+			tt_int_op(off, ==, expect);
+		}
+	}
+
+	tt_assert(have[0]);
+	if (!have[1] || !have[2])
+		TT_BLATHER(("SIMD scanners missing: sse4.2 %d, avx2 %d",
+		    have[1], have[2]));
+
+end:
+	;
+}
+
+static char http_nul_value[16];
+
+static void
+http_header_nul_cb(struct evhttp_request *req, void *arg)
+{
+	const char *v = evhttp_find_header(
+		evhttp_request_get_input_headers(req), "X-A");
+
+	evutil_snprintf(http_nul_value, sizeof(http_nul_value), "%s",
+	    v ? v : "(none)");
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void
+http_header_nul_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	static const char request[] =
+	    "GET /x HTTP/1.1\r\n\0Host: x\r\nConnection: close\r\n\r\n";
+	static const char request2[] =
+	    "GET /x HTTP/1.1\r\nHost: x\r\nX-A: a\0b\r\n"
+	    "Connection: close\r\n\r\n";
+	uint16_t port = 0;
+
+	http = http_setup(&port, data->base);
+	tt_assert(http && reply);
+	evhttp_set_gencb(http, http_uri_len_cb, NULL);
+
+	/* a header line that starts with NUL has no name, and must not be
+	 * taken for the blank line that ends the headers */
+	http_uri_len = 0;
+	tt_int_op(http_exchange(data->base, port, request,
+		sizeof(request) - 1, reply, 1000), ==, 0);
+	tt_int_op(http_uri_len, ==, 0);
+	tt_assert(!strncmp(http_reply_str(reply), "HTTP/1.1 400", 12));
+
+	/* within a value, a NUL ends it, as it always has */
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	evhttp_set_gencb(http, http_header_nul_cb, NULL);
+	tt_int_op(http_exchange(data->base, port, request2,
+		sizeof(request2) - 1, reply, 1000), ==, 0);
+	tt_str_op(http_nul_value, ==, "a");
+	tt_assert(!strncmp(http_reply_str(reply), "HTTP/1.1 200", 12));
+
+end:
+	if (reply)
+		evbuffer_free(reply);
+	if (http)
+		evhttp_free(http);
+}
+
+static struct evhttp_request *http_recycle_seen[6];
+static int http_recycle_n;
+
+static void
+http_recycle_cb(struct evhttp_request *req, void *arg)
+{
+	struct evkeyvalq *in = evhttp_request_get_input_headers(req);
+	struct evbuffer *body = evbuffer_new();
+	struct evkeyval *kv;
+	char want[32];
+	int n = http_recycle_n, count = 0;
+
+	/* nothing is left over from the request that used the object
+	 * before */
+	evutil_snprintf(want, sizeof(want), "/r%d", n);
+	tt_str_op(evhttp_request_get_uri(req), ==, want);
+	tt_str_op(evhttp_request_get_host(req), ==, "h");
+	TAILQ_FOREACH(kv, in, next)
+		++count;
+	tt_int_op(count, ==, n == 1 ? 3 : 2);
+	if (n == 2) {
+		tt_ptr_op(evhttp_find_header(in, "X-N"), ==, NULL);
+		tt_int_op(evbuffer_get_length(
+			evhttp_request_get_input_buffer(req)), ==, 5);
+	} else {
+		evutil_snprintf(want, sizeof(want), "%d", n);
+		tt_str_op(evhttp_find_header(in, "X-N"), ==, want);
+		tt_int_op(evbuffer_get_length(
+			evhttp_request_get_input_buffer(req)), ==, 0);
+	}
+	tt_ptr_op(TAILQ_FIRST(evhttp_request_get_output_headers(req)), ==,
+	    NULL);
+
+	http_recycle_seen[http_recycle_n++] = req;
+	/* an owned request is not recycled, but freed as usual */
+	if (n == 3)
+		evhttp_request_own(req);
+end:
+	evbuffer_add_printf(body, "body%d", n);
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+static void
+http_request_recycle_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	char request[256];
+	const char *reply, *p;
+	uint16_t port = 0;
+	int i, n;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_recycle_cb, NULL);
+	tt_int_op(regress_peer_connect(&peer, data->base, port), ==, 0);
+
+	http_recycle_n = 0;
+	for (i = 0; i < 6; ++i) {
+		if (i == 1)
+			evutil_snprintf(request, sizeof(request),
+			    "GET /r%d HTTP/1.1\r\nHost: h\r\nX-N: %d\r\n"
+			    "X-Extra: y\r\n\r\n", i, i);
+		else if (i == 2)
+			evutil_snprintf(request, sizeof(request),
+			    "POST /r%d HTTP/1.1\r\nHost: h\r\n"
+			    "Content-Length: 5\r\n\r\nhello", i);
+		else
+			evutil_snprintf(request, sizeof(request),
+			    "GET /r%d HTTP/1.1\r\nHost: h\r\nX-N: %d\r\n\r\n",
+			    i, i);
+		tt_int_op(regress_peer_send(&peer, request, strlen(request)),
+		    ==, 0);
+		regress_run_for(data->base, 50);
+	}
+	tt_int_op(http_recycle_n, ==, 6);
+
+	reply = http_reply_str(peer.input);
+	for (n = 0, p = reply; (p = strstr(p, "200 OK")) != NULL; ++p)
+		++n;
+	tt_int_op(n, ==, 6);
+	tt_assert(strstr(reply, "body5"));
+
+	/* one object serves the connection, and after the owned one was
+	 * freed, its replacement is reused in turn */
+	tt_ptr_op(http_recycle_seen[1], ==, http_recycle_seen[0]);
+	tt_ptr_op(http_recycle_seen[3], ==, http_recycle_seen[0]);
+	tt_ptr_op(http_recycle_seen[5], ==, http_recycle_seen[4]);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+}
+
+/* A raw HTTP/1.1 server on the loop, for watching what a client puts on
+ * the wire.  It waits a little after bytes arrive so that pipelined
+ * requests pile up, then answers every complete request it holds with
+ * the request's URI as the body. */
+struct http_raw_server {
+	int lfd;
+	struct event *lev;
+	int fd;
+	struct event *ev;
+	struct event *timer;
+	struct evbuffer *input;
+	int nconn;
+	int served;
+	int close_after;	/* close after this many replies, or -1 */
+	int maxbatch;
+	int body_batch;		/* size of the last batch carrying a body */
+};
+
+static void
+http_raw_drop(struct http_raw_server *srv)
+{
+	if (srv->fd >= 0) {
+		event_free(srv->ev);
+		evutil_closesocket(srv->fd);
+	}
+	srv->ev = NULL;
+	srv->fd = -1;
+	evbuffer_drain(srv->input, evbuffer_get_length(srv->input));
+}
+
+static void
+http_raw_timercb(int fd, short what, void *arg)
+{
+	struct http_raw_server *srv = arg;
+	struct evbuffer_ptr end;
+	char head[1024], uri[64], reply[256];
+	const char *cl;
+	size_t len, bodylen;
+	int batch = 0, body = 0, last;
+
+	while (srv->fd >= 0) {
+		end = evbuffer_search(srv->input, "\r\n\r\n", 4, NULL);
+		if (end.pos < 0)
+			break;
+		len = end.pos + 4;
+		if (len >= sizeof(head))
+			len = sizeof(head) - 1;
+		evbuffer_copyout(srv->input, head, len);
+		head[len] = '\0';
+		bodylen = 0;
+		if ((cl = strstr(head, "Content-Length: ")) != NULL)
+			bodylen = atoi(cl + 16);
+		if (evbuffer_get_length(srv->input) < end.pos + 4 + bodylen)
+			break;
+		evbuffer_drain(srv->input, end.pos + 4 + bodylen);
+		if (sscanf(head, "%*s %63s", uri) != 1)
+			break;
+
+		++batch;
+		body |= bodylen != 0;
+		last = ++srv->served == srv->close_after;
+		evutil_snprintf(reply, sizeof(reply),
+		    "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n%s\r\n%s",
+		    (int)strlen(uri), last ? "Connection: close\r\n" : "", uri);
+		if (send(srv->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0 ||
+		    last)
+			http_raw_drop(srv);
+	}
+	if (batch > srv->maxbatch)
+		srv->maxbatch = batch;
+	if (body)
+		srv->body_batch = batch;
+}
+
+static void
+http_raw_readcb(int fd, short what, void *arg)
+{
+	struct http_raw_server *srv = arg;
+	struct timeval tv = { 0, 20 * 1000 };
+	int n;
+
+	n = evbuffer_read(srv->input, fd, -1);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		http_raw_drop(srv);
+		return;
+	}
+	if (!evtimer_pending(srv->timer, NULL))
+		evtimer_add(srv->timer, &tv);
+}
+
+static void
+http_raw_acceptcb(int lfd, short what, void *arg)
+{
+	struct http_raw_server *srv = arg;
+	int fd;
+
+	if ((fd = accept(lfd, NULL, NULL)) < 0)
+		return;
+	/* the client under test keeps one connection at a time */
+	http_raw_drop(srv);
+	evutil_make_socket_nonblocking(fd);
+	srv->fd = fd;
+	srv->ev = event_new(event_get_base(srv->lev), fd, EV_READ|EV_PERSIST,
+	    http_raw_readcb, srv);
+	event_add(srv->ev, NULL);
+	++srv->nconn;
+}
+
+static int
+http_raw_start(struct http_raw_server *srv, struct event_base *base,
+    uint16_t *pport)
+{
+	struct sockaddr_in sin;
+
+	memset(srv, 0, sizeof(*srv));
+	srv->fd = -1;
+	srv->close_after = -1;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+
+	if ((srv->lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (bind(srv->lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(srv->lfd, 8) < 0 ||
+	    evutil_make_socket_nonblocking(srv->lfd) < 0)
+		return -1;
+	*pport = regress_get_socket_port(srv->lfd);
+	srv->input = evbuffer_new();
+	srv->timer = evtimer_new(base, http_raw_timercb, srv);
+	srv->lev = event_new(base, srv->lfd, EV_READ|EV_PERSIST,
+	    http_raw_acceptcb, srv);
+	if (!srv->input || !srv->timer || !srv->lev ||
+	    event_add(srv->lev, NULL) < 0)
+		return -1;
+	return 0;
+}
+
+static void
+http_raw_stop(struct http_raw_server *srv)
+{
+	if (srv->input)
+		http_raw_drop(srv);
+	if (srv->lev)
+		event_free(srv->lev);
+	if (srv->timer)
+		event_free(srv->timer);
+	if (srv->input)
+		evbuffer_free(srv->input);
+	if (srv->lfd >= 0)
+		evutil_closesocket(srv->lfd);
+}
+
+static int http_pipeline_done;
+static char http_pipeline_got[256];
+
+static void
+http_pipeline_cb(struct evhttp_request *req, void *arg)
+{
+	const char *want = arg;
+	struct evbuffer *buf;
+	char body[64];
+	size_t len;
+
+	++http_pipeline_done;
+	if (!req || evhttp_request_get_response_code(req) != HTTP_OK) {
+		strcat(http_pipeline_got, "ERR ");
+		return;
+	}
+	/* every reply lands on the request it answers */
+	buf = evhttp_request_get_input_buffer(req);
+	len = evbuffer_copyout(buf, body, sizeof(body) - 1);
+	body[len] = '\0';
+	if (strcmp(body, want))
+		strcat(http_pipeline_got, "MISMATCH ");
+	strcat(http_pipeline_got, body);
+	strcat(http_pipeline_got, " ");
+}
+
+static struct evhttp_request *
+http_pipeline_make(struct evhttp_connection *evcon,
+    enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_request *req;
+
+	req = evhttp_request_new(http_pipeline_cb, (void *)uri);
+	if (!req)
+		return NULL;
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "h");
+	if (type != EVHTTP_REQ_GET)
+		evbuffer_add(evhttp_request_get_output_buffer(req), "xyz", 3);
+	if (evhttp_make_request(evcon, req, type, uri) < 0)
+		return NULL;
+	return req;
+}
+
+static void
+http_pipeline_wait(struct event_base *base, int n)
+{
+	int i;
+
+	for (i = 0; i < 400 && http_pipeline_done < n; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+}
+
+static void
+http_client_pipeline_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct http_raw_server srv;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *reqs[5];
+	static const char *uris[] = {
+		"/g0", "/g1", "/g2", "/g3", "/g4", "/g5", "/g6", "/g7",
+		"/g8", "/g9"
+	};
+	static const char *mixed[] = {
+		"/a", "/b", "/post", "/c", "/d", "/e"
+	};
+	static const char *kept[] = {
+		"/k0", "/k1", "/k2", "/k3", "/k4", "/k5", "/k6", "/k7"
+	};
+	uint16_t port = 0;
+	int i, nconn;
+
+	srv.lfd = -1;
+	srv.lev = srv.timer = NULL;
+	srv.input = NULL;
+	tt_int_op(http_raw_start(&srv, data->base, &port), ==, 0);
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1",
+	    port);
+	tt_assert(evcon);
+	evhttp_connection_set_max_pipeline(evcon, 4);
+
+	/* up to four requests go out before the first reply comes back */
+	http_pipeline_done = 0;
+	http_pipeline_got[0] = '\0';
+	for (i = 0; i < 10; ++i)
+		tt_assert(http_pipeline_make(evcon, EVHTTP_REQ_GET, uris[i]));
+	http_pipeline_wait(data->base, 10);
+	tt_int_op(http_pipeline_done, ==, 10);
+	tt_str_op(http_pipeline_got, ==,
+	    "/g0 /g1 /g2 /g3 /g4 /g5 /g6 /g7 /g8 /g9 ");
+	tt_int_op(srv.maxbatch, ==, 4);
+	tt_int_op(srv.nconn, ==, 1);
+
+	/* a request with a body is never pipelined with others */
+	http_pipeline_done = 0;
+	http_pipeline_got[0] = '\0';
+	for (i = 0; i < 6; ++i)
+		tt_assert(http_pipeline_make(evcon,
+			i == 2 ? EVHTTP_REQ_POST : EVHTTP_REQ_GET, mixed[i]));
+	http_pipeline_wait(data->base, 6);
+	tt_str_op(http_pipeline_got, ==, "/a /b /post /c /d /e ");
+	tt_int_op(srv.body_batch, ==, 1);
+
+	/* the server closes after the second reply: whatever was sent
+	 * ahead goes out again on a new connection */
+	http_pipeline_done = 0;
+	http_pipeline_got[0] = '\0';
+	srv.close_after = srv.served + 2;
+	nconn = srv.nconn;
+	for (i = 0; i < 8; ++i)
+		tt_assert(http_pipeline_make(evcon,
+			i == 5 ? EVHTTP_REQ_PUT : EVHTTP_REQ_GET, kept[i]));
+	http_pipeline_wait(data->base, 8);
+	tt_str_op(http_pipeline_got, ==,
+	    "/k0 /k1 /k2 /k3 /k4 /k5 /k6 /k7 ");
+	tt_int_op(srv.nconn, ==, nconn + 1);
+
+	/* cancelling a request that was sent ahead leaves the others
+	 * matched to their replies */
+	http_pipeline_done = 0;
+	http_pipeline_got[0] = '\0';
+	srv.close_after = -1;
+	for (i = 0; i < 5; ++i) {
+		reqs[i] = http_pipeline_make(evcon, EVHTTP_REQ_GET, uris[i]);
+		tt_assert(reqs[i]);
+	}
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	evhttp_cancel_request(reqs[2]);
+	http_pipeline_wait(data->base, 4);
+	regress_run_for(data->base, 50);
+	tt_int_op(http_pipeline_done, ==, 4);
+	tt_str_op(http_pipeline_got, ==, "/g0 /g1 /g3 /g4 ");
+
+end:
+	if (evcon)
+		evhttp_connection_free(evcon);
+	http_raw_stop(&srv);
+}
+
+struct http_pipeline_job {
+	struct evhttp_request *req;
+	struct event *ev;
+	int n;
+};
+
+static int http_pipeline_active, http_pipeline_maxactive;
+static int http_pipeline_dispatched;
+
+static void
+http_pipeline_job_cb(int fd, short what, void *arg)
+{
+	struct http_pipeline_job *job = arg;
+	struct evhttp_request *req = job->req;
+	struct evbuffer *body = evbuffer_new();
+
+	--http_pipeline_active;
+	if (job->n == 3) {
+		evhttp_send_reply_start(req, HTTP_OK, "OK");
+		evbuffer_add_printf(body, "b%d", job->n);
+		evhttp_send_reply_chunk(req, body);
+		evhttp_send_reply_end(req);
+	} else if (job->n == 5) {
+		evbuffer_add_buffer(body, evhttp_request_get_input_buffer(req));
+		evhttp_send_reply(req, HTTP_OK, "OK", body);
+	} else {
+		evbuffer_add_printf(body, "b%d", job->n);
+		evhttp_send_reply(req, HTTP_OK, "OK", body);
+	}
+	evbuffer_free(body);
+	event_free(job->ev);
+	free(job);
+}
+
+/* Answer /<n> after a delay that shrinks as n grows, so that requests
+ * pipelined behind one another finish out of order. */
+static void
+http_pipeline_server_cb(struct evhttp_request *req, void *arg)
+{
+	struct event_base *base = arg;
+	struct http_pipeline_job *job;
+	struct timeval tv;
+
+	++http_pipeline_dispatched;
+	if (++http_pipeline_active > http_pipeline_maxactive)
+		http_pipeline_maxactive = http_pipeline_active;
+	job = calloc(1, sizeof(*job));
+	job->req = req;
+	job->n = atoi(evhttp_request_get_uri(req) + 1);
+	job->ev = evtimer_new(base, http_pipeline_job_cb, job);
+	tv.tv_sec = 0;
+	tv.tv_usec = (10 - job->n) * 10 * 1000;
+	evtimer_add(job->ev, &tv);
+}
+
+static int
+http_count(const char *s, const char *what)
+{
+	int n = 0;
+
+	for (; (s = strstr(s, what)) != NULL; ++s)
+		++n;
+	return n;
+}
+
+static void
+http_server_pipeline_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new(), *request = evbuffer_new();
+	const char *p, *q;
+	char want[8];
+	uint16_t port = 0;
+	int i;
+
+	tt_assert(reply && request);
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_pipeline_server_cb, data->base);
+	evhttp_set_max_pipeline(http, 4);
+
+	/* eight pipelined requests: at most four handlers run at once, and
+	 * the replies go out in request order even though they complete
+	 * in reverse */
+	for (i = 0; i < 8; ++i) {
+		if (i == 5)
+			evbuffer_add_printf(request, "POST /%d HTTP/1.1\r\n"
+			    "Host: h\r\nContent-Length: 2\r\n\r\nb5", i);
+		else
+			evbuffer_add_printf(request,
+			    "GET /%d HTTP/1.1\r\nHost: h\r\n\r\n", i);
+	}
+	tt_int_op(http_exchange(data->base, port,
+		evbuffer_pullup(request, -1), evbuffer_get_length(request),
+		reply, 800), ==, 0);
+	p = http_reply_str(reply);
+	tt_int_op(http_count(p, "HTTP/1.1 200"), ==, 8);
+	tt_int_op(http_pipeline_dispatched, ==, 8);
+	tt_int_op(http_pipeline_maxactive, ==, 4);
+	for (i = 0; i < 8; ++i) {
+		q = strstr(p, "\r\n\r\n");
+		tt_assert(q);
+		q += 4;
+		if (i == 3) {
+			tt_assert(!strncmp(q, "2\r\nb3\r\n0\r\n\r\n", 12));
+			p = q + 12;
+		} else {
+			evutil_snprintf(want, sizeof(want), "b%d", i);
+			tt_assert(!strncmp(q, want, 2));
+			p = q + 2;
+		}
+	}
+	tt_str_op(p, ==, "");
+
+	/* nothing behind a Connection: close request is read */
+	http_pipeline_dispatched = 0;
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	evbuffer_drain(request, evbuffer_get_length(request));
+	evbuffer_add_printf(request,
+	    "GET /1 HTTP/1.1\r\nHost: h\r\n\r\n"
+	    "GET /2 HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n"
+	    "GET /3 HTTP/1.1\r\nHost: h\r\n\r\n");
+	tt_int_op(http_exchange(data->base, port,
+		evbuffer_pullup(request, -1), evbuffer_get_length(request),
+		reply, 600), ==, 0);
+	p = http_reply_str(reply);
+	tt_int_op(http_count(p, "HTTP/1.1 200"), ==, 2);
+	tt_int_op(http_pipeline_dispatched, ==, 2);
+
+	/* a bad request behind an outstanding one is answered after it */
+	http_pipeline_dispatched = 0;
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	evbuffer_drain(request, evbuffer_get_length(request));
+	evbuffer_add_printf(request,
+	    "GET /1 HTTP/1.1\r\nHost: h\r\n\r\n"
+	    "BLAH\r\n\r\n"
+	    "GET /2 HTTP/1.1\r\nHost: h\r\n\r\n");
+	tt_int_op(http_exchange(data->base, port,
+		evbuffer_pullup(request, -1), evbuffer_get_length(request),
+		reply, 600), ==, 0);
+	p = http_reply_str(reply);
+	tt_int_op(http_count(p, "HTTP/1.1 200"), ==, 1);
+	tt_int_op(http_count(p, " 400 "), ==, 1);
+	tt_int_op(http_pipeline_dispatched, ==, 1);
+	tt_assert(strstr(p, "b1") < strstr(p, " 400 "));
+
+	/* with a depth of one, requests are handled one at a time */
+	evhttp_set_max_pipeline(http, 1);
+	http_pipeline_maxactive = 0;
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	evbuffer_drain(request, evbuffer_get_length(request));
+	evbuffer_add_printf(request,
+	    "GET /1 HTTP/1.1\r\nHost: h\r\n\r\n"
+	    "GET /2 HTTP/1.1\r\nHost: h\r\n\r\n");
+	tt_int_op(http_exchange(data->base, port,
+		evbuffer_pullup(request, -1), evbuffer_get_length(request),
+		reply, 600), ==, 0);
+	tt_int_op(http_count(http_reply_str(reply), "HTTP/1.1 200"), ==, 2);
+	tt_int_op(http_pipeline_maxactive, ==, 1);
+
+end:
+	if (http)
+		evhttp_free(http);
+	if (reply)
+		evbuffer_free(reply);
+	if (request)
+		evbuffer_free(request);
+}
+
+static void
+http_slow_reply_cb(int fd, short what, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evbuffer *body = evbuffer_new();
+
+	evbuffer_add_printf(body, "slow %s\n", evhttp_request_get_uri(req));
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+static void
+http_slow_cb(struct evhttp_request *req, void *arg)
+{
+	struct timeval tv = { 0, 500 * 1000 };
+
+	event_base_once(arg, -1, EV_TIMEOUT, http_slow_reply_cb, req, &tv);
+}
+
+static void
+http_server_pipeline_timeout_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct timeval tv = { 0, 200 * 1000 }, start, now;
+	static const char request[] =
+	    "GET /a HTTP/1.1\r\nHost: h\r\n\r\n"
+	    "GET /b HTTP/1.1\r\nHost: h\r\n\r\n";
+	const char *reply;
+	uint16_t port = 0;
+	long msec;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_slow_cb, data->base);
+	evhttp_set_max_pipeline(http, 4);
+	evhttp_set_timeout_tv(http, &tv);
+
+	/* handlers slower than the timeout do not cost the pipelined
+	 * request behind them its reply; the connection times out only once
+	 * it is idle */
+	tt_int_op(regress_peer_connect(&peer, data->base, port), ==, 0);
+	tt_int_op(regress_peer_send(&peer, request, sizeof(request) - 1),
+	    ==, 0);
+	gettimeofday(&start, NULL);
+	regress_run_for(data->base, 3000);
+	gettimeofday(&now, NULL);
+	tt_assert(peer.eof);
+	reply = http_reply_str(peer.input);
+	tt_int_op(http_count(reply, "HTTP/1.1 200"), ==, 2);
+	tt_assert(strstr(reply, "slow /a\n"));
+	tt_assert(strstr(reply, "slow /a\n") < strstr(reply, "slow /b\n"));
+	msec = (now.tv_sec - start.tv_sec) * 1000 +
+	    (now.tv_usec - start.tv_usec) / 1000;
+	tt_int_op(msec, >=, 600);
+	tt_int_op(msec, <, 1500);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+}
+
+static char http_static_dir[64];
+
+/* Write contents to name under the test's scratch directory. */
+static int
+http_static_write(const char *name, const char *contents)
+{
+	char path[128];
+	FILE *f;
+
+	evutil_snprintf(path, sizeof(path), "%s/%s", http_static_dir, name);
+	if (!(f = fopen(path, "w")))
+		return -1;
+	fputs(contents, f);
+	fclose(f);
+	return 0;
+}
+
+static void
+http_static_remove(void)
+{
+	static const char *names[] = {
+		"www/a.txt", "www/index.html", "www/.hidden", "secret"
+	};
+	char path[128];
+	size_t i;
+
+	if (!http_static_dir[0])
+		return;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		evutil_snprintf(path, sizeof(path), "%s/%s", http_static_dir,
+		    names[i]);
+		unlink(path);
+	}
+	evutil_snprintf(path, sizeof(path), "%s/www/sub", http_static_dir);
+	rmdir(path);
+	evutil_snprintf(path, sizeof(path), "%s/www", http_static_dir);
+	rmdir(path);
+	rmdir(http_static_dir);
+	http_static_dir[0] = '\0';
+}
+
+/* GET path with the extra header lines in headers, and return the reply as
+ * a string. */
+static const char *
+http_static_get(struct event_base *base, uint16_t port, const char *path,
+    const char *headers, struct evbuffer *reply)
+{
+	char request[512];
+
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	evutil_snprintf(request, sizeof(request),
+	    "GET %s HTTP/1.1\r\nHost: h\r\nConnection: close\r\n%s\r\n",
+	    path, headers);
+	if (http_exchange(base, port, request, strlen(request), reply,
+		1000) < 0)
+		return "";
+	return http_reply_str(reply);
+}
+
+/* Copy the value of the header name in reply to out. */
+static int
+http_reply_header(const char *reply, const char *name, char *out,
+    size_t outlen)
+{
+	const char *p = strstr(reply, name);
+	size_t len;
+
+	if (!p || p[strlen(name)] != ':')
+		return -1;
+	p += strlen(name) + 2;
+	len = strcspn(p, "\r");
+	if (len >= outlen)
+		return -1;
+	memcpy(out, p, len);
+	out[len] = '\0';
+	return 0;
+}
+
+static void
+http_serve_static_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	char root[128], etag[64], date[64], headers[128];
+	const char *r;
+	uint16_t port = 0;
+
+	tt_assert(reply);
+	strcpy(http_static_dir, "/tmp/regress-XXXXXX");
+	tt_assert(mkdtemp(http_static_dir));
+	evutil_snprintf(root, sizeof(root), "%s/www", http_static_dir);
+	tt_int_op(mkdir(root, 0700), ==, 0);
+	evutil_snprintf(root, sizeof(root), "%s/www/sub", http_static_dir);
+	tt_int_op(mkdir(root, 0700), ==, 0);
+	tt_int_op(http_static_write("www/a.txt", "0123456789"), ==, 0);
+	tt_int_op(http_static_write("www/index.html", "<p>index</p>"), ==, 0);
+	tt_int_op(http_static_write("www/.hidden", "hidden"), ==, 0);
+	tt_int_op(http_static_write("secret", "secret"), ==, 0);
+	evutil_snprintf(root, sizeof(root), "%s/www", http_static_dir);
+
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	tt_int_op(evhttp_serve_static(http, "/static", root,
+		EVHTTP_STATIC_INDEX), ==, 0);
+	tt_int_op(evhttp_serve_static(http, "/static", root, 0), ==, -1);
+	tt_int_op(evhttp_serve_static(http, "nope", root, 0), ==, -1);
+
+	r = http_static_get(data->base, port, "/static/a.txt", "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 ", 13));
+	tt_assert(strstr(r, "\r\nContent-Length: 10\r\n"));
+	tt_assert(strstr(r, "\r\n\r\n0123456789"));
+	tt_int_op(http_reply_header(r, "ETag", etag, sizeof(etag)), ==, 0);
+	tt_int_op(http_reply_header(r, "Last-Modified", date, sizeof(date)),
+	    ==, 0);
+
+	/* nothing outside the root, or hidden, is served */
+	r = http_static_get(data->base, port, "/static/../secret", "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 404 ", 13));
+	r = http_static_get(data->base, port, "/static/%2e%2e/secret", "",
+	    reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 404 ", 13));
+	r = http_static_get(data->base, port, "/static/sub/%2E%2E/../secret",
+	    "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 404 ", 13));
+	tt_assert(!strstr(r, "secret"));
+	r = http_static_get(data->base, port, "/static/.hidden", "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 404 ", 13));
+	r = http_static_get(data->base, port, "/static/a.txt%00.html", "",
+	    reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 404 ", 13));
+
+	/* directories get their index, or are sent on to it */
+	r = http_static_get(data->base, port, "/static/", "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 ", 13));
+	tt_assert(strstr(r, "\r\n\r\n<p>index</p>"));
+	r = http_static_get(data->base, port, "/static/sub", "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 301 ", 13));
+	tt_assert(strstr(r, "\r\nLocation: /static/sub/\r\n"));
+	r = http_static_get(data->base, port, "/static/sub?a=1&b=%2F", "",
+	    reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 301 ", 13));
+	tt_assert(strstr(r, "\r\nLocation: /static/sub/?a=1&b=%2F\r\n"));
+	r = http_static_get(data->base, port, "/static/sub/", "", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 404 ", 13));
+
+	/* single byte ranges */
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "Range: bytes=2-5\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 206 ", 13));
+	tt_assert(strstr(r, "\r\nContent-Range: bytes 2-5/10\r\n"));
+	tt_assert(strstr(r, "\r\nContent-Length: 4\r\n"));
+	tt_assert(!strcmp(strstr(r, "\r\n\r\n"), "\r\n\r\n2345"));
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "Range: bytes=-3\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 206 ", 13));
+	tt_assert(!strcmp(strstr(r, "\r\n\r\n"), "\r\n\r\n789"));
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "Range: bytes=8-100\r\n", reply);
+	tt_assert(strstr(r, "\r\nContent-Range: bytes 8-9/10\r\n"));
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "Range: bytes=10-\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 416 ", 13));
+	tt_assert(strstr(r, "\r\nContent-Range: bytes */10\r\n"));
+	/* several ranges, or a stale If-Range, get the whole file */
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "Range: bytes=0-1,4-5\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 ", 13));
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "Range: bytes=2-5\r\nIf-Range: \"stale\"\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 ", 13));
+	evutil_snprintf(headers, sizeof(headers),
+	    "Range: bytes=2-5\r\nIf-Range: %s\r\n", etag);
+	r = http_static_get(data->base, port, "/static/a.txt", headers,
+	    reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 206 ", 13));
+
+	/* conditional requests */
+	evutil_snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n",
+	    etag);
+	r = http_static_get(data->base, port, "/static/a.txt", headers,
+	    reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 304 ", 13));
+	tt_assert(!strstr(r, "0123456789"));
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "If-None-Match: \"other\", W/\"x\"\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 ", 13));
+	evutil_snprintf(headers, sizeof(headers),
+	    "If-Modified-Since: %s\r\n", date);
+	r = http_static_get(data->base, port, "/static/a.txt", headers,
+	    reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 304 ", 13));
+	r = http_static_get(data->base, port, "/static/a.txt",
+	    "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r\n", reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 ", 13));
+
+end:
+	if (http)
+		evhttp_free(http);
+	if (reply)
+		evbuffer_free(reply);
+	http_static_remove();
+}
+
+static void
+http_date_cb(struct evhttp_request *req, void *arg)
+{
+	/* a Date the handler sets itself is left alone */
+	if (!strcmp(evhttp_request_get_uri(req), "/own"))
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Date", "Thu, 01 Jan 1970 00:00:00 GMT");
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void
+http_date_header_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	static const char request[] =
+	    "GET / HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n";
+	static const char own[] =
+	    "GET /own HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n";
+	char first[64], second[64];
+	const char *r;
+	uint16_t port = 0;
+
+	tt_assert(reply);
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_date_cb, NULL);
+
+	tt_int_op(http_exchange(data->base, port, request,
+		sizeof(request) - 1, reply, 1000), ==, 0);
+	r = http_reply_str(reply);
+	tt_int_op(http_count(r, "\r\nDate: "), ==, 1);
+	tt_int_op(http_reply_header(r, "Date", first, sizeof(first)), ==, 0);
+	tt_int_op(strlen(first), ==, 29);
+	tt_str_op(first + 25, ==, " GMT");
+
+	/* the cached string follows the clock */
+	regress_run_for(data->base, 1100);
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	tt_int_op(http_exchange(data->base, port, request,
+		sizeof(request) - 1, reply, 1000), ==, 0);
+	r = http_reply_str(reply);
+	tt_int_op(http_reply_header(r, "Date", second, sizeof(second)), ==,
+	    0);
+	tt_str_op(first, !=, second);
+
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	tt_int_op(http_exchange(data->base, port, own, sizeof(own) - 1, reply,
+		1000), ==, 0);
+	r = http_reply_str(reply);
+	tt_int_op(http_count(r, "\r\nDate: "), ==, 1);
+	tt_assert(strstr(r, "\r\nDate: Thu, 01 Jan 1970 00:00:00 GMT\r\n"));
+
+end:
+	if (http)
+		evhttp_free(http);
+	if (reply)
+		evbuffer_free(reply);
+}
+
+#define HTTP_STATIC_BIG		(4 * 1024 * 1024)
+
+static void
+http_static_headers_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp *http = arg;
+	struct evkeyvalq headers;
+	struct evbuffer *body = evbuffer_new();
+	const char *uri = evhttp_request_get_uri(req);
+
+	if (!strcmp(uri, "/override")) {
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "X-Frame-Options", "SAMEORIGIN");
+	} else if (!strcmp(uri, "/big")) {
+		/* queue a reply too big to go out at once, then replace and
+		 * drop the set it was built with */
+		evbuffer_expand(body, HTTP_STATIC_BIG);
+		while (evbuffer_get_length(body) < HTTP_STATIC_BIG)
+			evbuffer_add(body, "0123456789abcdef", 16);
+		evhttp_send_reply(req, HTTP_OK, "OK", body);
+		evbuffer_free(body);
+
+		TAILQ_INIT(&headers);
+		evhttp_add_header(&headers, "Server", "other");
+		evhttp_set_static_headers(http, &headers);
+		evhttp_clear_headers(&headers);
+		evhttp_set_static_headers(http, NULL);
+		return;
+	}
+	evbuffer_add_printf(body, "body %s", uri);
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+static void
+http_static_headers_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evkeyvalq headers;
+	struct evbuffer *reply = evbuffer_new();
+	static const char requests[] =
+	    "GET /a HTTP/1.1\r\nHost: h\r\n\r\n"
+	    "GET /override HTTP/1.1\r\nHost: h\r\n\r\n"
+	    "GET /b HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n";
+	static const char big[] =
+	    "GET /big HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n";
+	static const char plain[] =
+	    "GET /c HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n";
+	const char *r, *body;
+	uint16_t port = 0;
+
+	TAILQ_INIT(&headers);
+	tt_assert(reply);
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_static_headers_cb, http);
+
+	evhttp_add_header(&headers, "Server", "regress");
+	evhttp_add_header(&headers, "X-Frame-Options", "DENY");
+	tt_int_op(evhttp_set_static_headers(http, &headers), ==, 0);
+	/* the set was copied */
+	evhttp_clear_headers(&headers);
+
+	/* every response carries the set, unless it sets a header itself */
+	tt_int_op(http_exchange(data->base, port, requests,
+		sizeof(requests) - 1, reply, 1000), ==, 0);
+	r = http_reply_str(reply);
+	tt_int_op(http_count(r, "HTTP/1.1 200 OK\r\n"), ==, 3);
+	tt_int_op(http_count(r, "\r\nServer: regress\r\n"), ==, 3);
+	tt_int_op(http_count(r, "\r\nX-Frame-Options: DENY\r\n"), ==, 2);
+	tt_int_op(http_count(r, "\r\nX-Frame-Options: SAMEORIGIN\r\n"), ==,
+	    1);
+	tt_assert(strstr(r, "body /b"));
+
+	/* a response queued before the set is replaced keeps the block it
+	 * was built with */
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	tt_int_op(http_exchange(data->base, port, big, sizeof(big) - 1,
+		reply, 3000), ==, 0);
+	r = http_reply_str(reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 OK\r\n", 17));
+	body = strstr(r, "\r\n\r\n");
+	tt_assert(body);
+	tt_int_op(http_count(r, "\r\nServer: regress\r\n"), ==, 1);
+	tt_assert(strstr(r, "\r\nX-Frame-Options: DENY\r\n") < body);
+	tt_assert(!strstr(r, "Server: other"));
+	tt_int_op(evbuffer_get_length(reply) - 1 - (body + 4 - r), ==,
+	    HTTP_STATIC_BIG);
+
+	/* and later responses go without */
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	tt_int_op(http_exchange(data->base, port, plain, sizeof(plain) - 1,
+		reply, 1000), ==, 0);
+	r = http_reply_str(reply);
+	tt_assert(!strncmp(r, "HTTP/1.1 200 OK\r\n", 17));
+	tt_assert(!strstr(r, "Server:"));
+	tt_assert(!strstr(r, "X-Frame-Options:"));
+
+end:
+	evhttp_clear_headers(&headers);
+	if (http)
+		evhttp_free(http);
+	if (reply)
+		evbuffer_free(reply);
+}
+
+static void
+http_route_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *body = evbuffer_new();
+	const char *a = evhttp_request_get_route_param(req, "a");
+	const char *b = evhttp_request_get_route_param(req, "b");
+	const char *rest = evhttp_request_get_route_param(req, "*");
+
+	evbuffer_add_printf(body, "%s a=%s b=%s *=%s", (const char *)arg,
+	    a ? a : "-", b ? b : "-", rest ? rest : "-");
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+/* GET path on a connection of its own.  Returns the body of a 200 reply,
+ * or else the whole reply. */
+static const char *
+http_route_get(struct event_base *base, uint16_t port, const char *path,
+    struct evbuffer *reply)
+{
+	struct evbuffer *request = evbuffer_new();
+	const char *r, *body;
+
+	evbuffer_drain(reply, evbuffer_get_length(reply));
+	evbuffer_add_printf(request,
+	    "GET %s HTTP/1.1\r\nHost: h\r\nConnection: close\r\n\r\n", path);
+	http_exchange(base, port, evbuffer_pullup(request, -1),
+	    evbuffer_get_length(request), reply, 1000);
+	evbuffer_free(request);
+	r = http_reply_str(reply);
+	if (strncmp(r, "HTTP/1.1 200 ", 13) || !(body = strstr(r, "\r\n\r\n")))
+		return r;
+	return body + 4;
+}
+
+static void
+http_route_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evbuffer *reply = evbuffer_new();
+	char path[700], expect[700];
+	uint16_t port = 0;
+
+	tt_assert(reply);
+	http = http_setup(&port, data->base);
+	tt_assert(http);
+
+	tt_int_op(evhttp_set_cb(http, "/users/me", http_route_cb,
+		(void *)"me"), ==, 0);
+	tt_int_op(evhttp_set_route(http, "/users/:a", http_route_cb,
+		(void *)"user"), ==, 0);
+	tt_int_op(evhttp_set_route(http, "/users/:a/posts/:b", http_route_cb,
+		(void *)"post"), ==, 0);
+	tt_int_op(evhttp_set_route(http, "/users/*", http_route_cb,
+		(void *)"star"), ==, 0);
+	tt_int_op(evhttp_set_route(http, "/files/*", http_route_cb,
+		(void *)"files"), ==, 0);
+
+	/* a literal segment beats a parameter, which beats '*' */
+	tt_str_op(http_route_get(data->base, port, "/users/me", reply), ==,
+	    "me a=- b=- *=-");
+	tt_str_op(http_route_get(data->base, port, "/users/42", reply), ==,
+	    "user a=42 b=- *=-");
+	tt_str_op(http_route_get(data->base, port, "/users/42/posts/7", reply),
+	    ==, "post a=42 b=7 *=-");
+	tt_str_op(http_route_get(data->base, port, "/users/42/posts", reply),
+	    ==, "star a=- b=- *=42/posts");
+	tt_str_op(http_route_get(data->base, port, "/users/me/posts/7?x=1",
+		reply), ==, "post a=me b=7 *=-");
+
+	/* parameters come decoded; '*' needs at least one segment */
+	tt_str_op(http_route_get(data->base, port, "/users/a%20b", reply), ==,
+	    "user a=a b b=- *=-");
+	tt_str_op(http_route_get(data->base, port, "/files/x/y%2fz", reply),
+	    ==, "files a=- b=- *=x/y/z");
+	tt_assert(!strncmp(http_route_get(data->base, port, "/files", reply),
+		"HTTP/1.1 404 ", 13));
+
+	/* a path longer than the stack buffer dispatch decodes into */
+	memcpy(path, "/files/", 7);
+	memset(path + 7, 'p', 600);
+	path[607] = '\0';
+	evutil_snprintf(expect, sizeof(expect), "files a=- b=- *=%s", path + 7);
+	tt_str_op(http_route_get(data->base, port, path, reply), ==, expect);
+	memcpy(path, "/users/", 7);
+	evutil_snprintf(expect, sizeof(expect), "user a=%s b=- *=-", path + 7);
+	tt_str_op(http_route_get(data->base, port, path, reply), ==, expect);
+
+	/* patterns that clash, or capture too much, are refused, and leave
+	 * nothing behind */
+	tt_int_op(evhttp_set_route(http, "/users/:other", http_route_cb,
+		(void *)"x"), ==, -1);
+	tt_int_op(evhttp_set_cb(http, "/users/me", http_route_cb,
+		(void *)"x"), ==, -1);
+	tt_int_op(evhttp_set_route(http, "/users/*", http_route_cb,
+		(void *)"x"), ==, -1);
+	tt_int_op(evhttp_set_route(http, "/p/:a/:b/:c/:d/:e/:f/:g/:h",
+		http_route_cb, (void *)"x"), ==, -1);
+	tt_int_op(evhttp_set_route(http, "/p/:z", http_route_cb,
+		(void *)"z"), ==, 0);
+	tt_str_op(http_route_get(data->base, port, "/p/1", reply), ==,
+	    "z a=- b=- *=-");
+	tt_int_op(evhttp_set_route(http, "/q/:a/:b/:c/:d/:e/:f/:g",
+		http_route_cb, (void *)"seven"), ==, 0);
+	tt_str_op(http_route_get(data->base, port, "/q/1/2/3/4/5/6/7", reply),
+	    ==, "seven a=1 b=2 *=-");
+
+	/* removing a callback rebuilds the trie without it */
+	tt_int_op(evhttp_del_cb(http, "/users/me"), ==, 0);
+	tt_str_op(http_route_get(data->base, port, "/users/me", reply), ==,
+	    "user a=me b=- *=-");
+	tt_int_op(evhttp_del_cb(http, "/users/:a"), ==, 0);
+	tt_str_op(http_route_get(data->base, port, "/users/42", reply), ==,
+	    "star a=- b=- *=42");
+	tt_str_op(http_route_get(data->base, port, "/users/42/posts/7", reply),
+	    ==, "post a=42 b=7 *=-");
+	tt_int_op(evhttp_del_cb(http, "/users/:a"), ==, -1);
+	tt_int_op(evhttp_set_route(http, "/users/:other", http_route_cb,
+		(void *)"other"), ==, -1);
+	tt_int_op(evhttp_del_cb(http, "/users/:a/posts/:b"), ==, 0);
+	tt_int_op(evhttp_set_route(http, "/users/:other", http_route_cb,
+		(void *)"other"), ==, 0);
+	tt_str_op(http_route_get(data->base, port, "/users/42", reply), ==,
+	    "other a=- b=- *=-");
+
+end:
+	if (http)
+		evhttp_free(http);
+	if (reply)
+		evbuffer_free(reply);
+}
+
+struct testcase_t http_testcases[] = {
+	{ "header_storage", http_header_storage_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "header_dribble", http_header_dribble_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "parse_errors", http_parse_errors_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "scan", http_scan_test, 0, NULL, NULL },
+	{ "header_nul", http_header_nul_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "request_recycle", http_request_recycle_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "client_pipeline", http_client_pipeline_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "server_pipeline", http_server_pipeline_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "server_pipeline_timeout", http_server_pipeline_timeout_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "serve_static", http_serve_static_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "date_header", http_date_header_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "static_headers", http_static_headers_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "route", http_route_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+
+	END_OF_TESTCASES
+};
@@ -0,0 +1,861 @@
+/*
+ * Copyright (c) 2003-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The h2c server, driven with raw frames.  Requests are sent as HPACK
+ * literals without indexing, so that no encoder is needed here; of the
+ * responses only the :status octet and the DATA frames are looked at.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "regress.h"
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define H2_DATA			0x0
+#define H2_HEADERS		0x1
+#define H2_RST_STREAM		0x3
+#define H2_SETTINGS		0x4
+#define H2_PING			0x6
+#define H2_GOAWAY		0x7
+#define H2_WINDOW_UPDATE	0x8
+#define H2_CONTINUATION		0x9
+
+#define H2_FLAG_END_STREAM	0x01
+#define H2_FLAG_ACK		0x01
+#define H2_FLAG_END_HEADERS	0x04
+
+#define H2_NO_ERROR		0x0
+#define H2_PROTOCOL_ERROR	0x1
+#define H2_FLOW_CONTROL_ERROR	0x3
+#define H2_CANCEL		0x8
+#define H2_ENHANCE_YOUR_CALM	0xb
+
+/* the length of the body /big answers with */
+#define HTTP2_BIG_LEN		100000
+/* the largest DATA frame the server takes */
+#define HTTP2_FRAME_LEN		16384
+
+static int http2_async_replies;
+
+static void
+http2_root_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *body = evbuffer_new();
+
+	evbuffer_add_printf(body, "hello %s", evhttp_request_get_uri(req));
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+static void
+http2_big_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *body = evbuffer_new();
+	char *p = malloc(HTTP2_BIG_LEN);
+	int i;
+
+	for (i = 0; i < HTTP2_BIG_LEN; ++i)
+		p[i] = 'a' + i % 26;
+	evbuffer_add(body, p, HTTP2_BIG_LEN);
+	free(p);
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+static void
+http2_async_reply_cb(int fd, short what, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evbuffer *body = evbuffer_new();
+
+	++http2_async_replies;
+	evbuffer_add_printf(body, "later %s", evhttp_request_get_uri(req));
+	evhttp_send_reply(req, HTTP_OK, "OK", body);
+	evbuffer_free(body);
+}
+
+static void
+http2_async_cb(struct evhttp_request *req, void *arg)
+{
+	struct timeval tv = { 0, 100 * 1000 };
+
+	event_base_once(arg, -1, EV_TIMEOUT, http2_async_reply_cb, req, &tv);
+}
+
+/* Start an h2c server on an ephemeral port of 127.0.0.1. */
+static struct evhttp *
+http2_setup(uint16_t *pport, struct event_base *base, int flags)
+{
+	struct evhttp *http;
+	struct evhttp_bound_socket *sock;
+
+	if ((http = evhttp_new(base)) == NULL)
+		return NULL;
+	if (evhttp_set_flags(http, flags) < 0 ||
+	    (sock = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0)) ==
+	    NULL) {
+		evhttp_free(http);
+		return NULL;
+	}
+	evhttp_set_cb(http, "/big", http2_big_cb, NULL);
+	evhttp_set_cb(http, "/async", http2_async_cb, base);
+	evhttp_set_gencb(http, http2_root_cb, NULL);
+	*pport = regress_get_socket_port(evhttp_bound_socket_get_fd(sock));
+	return http;
+}
+
+static void
+http2_frame(struct evbuffer *out, int type, int flags, uint32_t sid,
+    const void *payload, size_t len)
+{
+	unsigned char head[9];
+
+	head[0] = len >> 16;
+	head[1] = len >> 8;
+	head[2] = len;
+	head[3] = type;
+	head[4] = flags;
+	head[5] = sid >> 24;
+	head[6] = sid >> 16;
+	head[7] = sid >> 8;
+	head[8] = sid;
+	evbuffer_add(out, head, sizeof(head));
+	if (len)
+		evbuffer_add(out, payload, len);
+}
+
+static void
+http2_frame32(struct evbuffer *out, int type, uint32_t sid, uint32_t v)
+{
+	unsigned char p[4];
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	http2_frame(out, type, 0, sid, p, sizeof(p));
+}
+
+/* A literal header field without indexing, with a new name. */
+static void
+http2_literal(struct evbuffer *block, const char *name, const char *value)
+{
+	unsigned char len;
+
+	evbuffer_add(block, "", 1);
+	len = strlen(name);
+	evbuffer_add(block, &len, 1);
+	evbuffer_add(block, name, len);
+	len = strlen(value);
+	evbuffer_add(block, &len, 1);
+	evbuffer_add(block, value, len);
+}
+
+static void
+http2_request(struct evbuffer *block, const char *method, const char *path)
+{
+	http2_literal(block, ":method", method);
+	http2_literal(block, ":scheme", "http");
+	http2_literal(block, ":path", path);
+	http2_literal(block, ":authority", "h");
+}
+
+/* Send a request for path on stream sid in a single HEADERS frame. */
+static int
+http2_send_request(struct regress_peer *peer, uint32_t sid, int flags,
+    const char *method, const char *path)
+{
+	struct evbuffer *block = evbuffer_new(), *out = evbuffer_new();
+	int r;
+
+	http2_request(block, method, path);
+	http2_frame(out, H2_HEADERS, flags, sid, evbuffer_pullup(block, -1),
+	    evbuffer_get_length(block));
+	r = regress_peer_send(peer, evbuffer_pullup(out, -1),
+	    evbuffer_get_length(out));
+	evbuffer_free(block);
+	evbuffer_free(out);
+	return r;
+}
+
+static int
+http2_send(struct regress_peer *peer, struct evbuffer *out)
+{
+	int r;
+
+	r = regress_peer_send(peer, evbuffer_pullup(out, -1),
+	    evbuffer_get_length(out));
+	evbuffer_drain(out, evbuffer_get_length(out));
+	return r;
+}
+
+/* Send len octets of DATA on stream sid, paying no heed to flow control,
+ * and running the loop whenever the socket is full. */
+static int
+http2_send_body(struct regress_peer *peer, struct event_base *base,
+    uint32_t sid, size_t len)
+{
+	static unsigned char frame[9 + HTTP2_FRAME_LEN];
+	size_t n, off;
+	ssize_t r;
+
+	while (len) {
+		n = len < HTTP2_FRAME_LEN ? len : HTTP2_FRAME_LEN;
+		frame[0] = n >> 16;
+		frame[1] = n >> 8;
+		frame[2] = n;
+		frame[3] = H2_DATA;
+		frame[4] = 0;
+		frame[5] = sid >> 24;
+		frame[6] = sid >> 16;
+		frame[7] = sid >> 8;
+		frame[8] = sid;
+		for (off = 0; off < 9 + n; ) {
+			r = send(peer->fd, frame + off, 9 + n - off,
+			    MSG_NOSIGNAL);
+			if (r > 0)
+				off += r;
+			else if (r < 0 && errno == EAGAIN)
+				event_base_loop(base, EVLOOP_NONBLOCK);
+			else
+				return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* Connect and send the preface, followed by settings of len octets. */
+static int
+http2_connect(struct regress_peer *peer, struct event_base *base,
+    uint16_t port, const void *settings, size_t len)
+{
+	struct evbuffer *out;
+	int r;
+
+	if (regress_peer_connect(peer, base, port) < 0)
+		return -1;
+	out = evbuffer_new();
+	evbuffer_add(out, H2_PREFACE, strlen(H2_PREFACE));
+	http2_frame(out, H2_SETTINGS, 0, 0, settings, len);
+	r = http2_send(peer, out);
+	evbuffer_free(out);
+	return r;
+}
+
+struct http2_frame {
+	int type;
+	int flags;
+	uint32_t sid;
+	size_t len;
+	const unsigned char *payload;
+};
+
+/* Fill in f from the complete frame at *off in the frames the server sent,
+ * and step *off past it.  Returns 0 if there is no such frame. */
+static int
+http2_next_frame(struct evbuffer *in, size_t *off, struct http2_frame *f)
+{
+	size_t len = evbuffer_get_length(in);
+	const unsigned char *p;
+
+	if (len < *off + 9)
+		return 0;
+	p = evbuffer_pullup(in, -1) + *off;
+	f->len = (size_t)p[0] << 16 | p[1] << 8 | p[2];
+	if (len < *off + 9 + f->len)
+		return 0;
+	f->type = p[3];
+	f->flags = p[4];
+	f->sid = ((uint32_t)p[5] << 24 | p[6] << 16 | p[7] << 8 | p[8]) &
+	    0x7fffffff;
+	f->payload = p + 9;
+	*off += 9 + f->len;
+	return 1;
+}
+
+/* Count the frames of type on stream sid that have all of flags set. */
+static int
+http2_count(struct evbuffer *in, int type, uint32_t sid, int flags)
+{
+	struct http2_frame f;
+	size_t off = 0;
+	int n = 0;
+
+	while (http2_next_frame(in, &off, &f))
+		if (f.type == type && f.sid == sid &&
+		    (f.flags & flags) == flags)
+			++n;
+	return n;
+}
+
+/* Append the DATA sent on stream sid to body. */
+static void
+http2_data(struct evbuffer *in, uint32_t sid, struct evbuffer *body)
+{
+	struct http2_frame f;
+	size_t off = 0;
+
+	while (http2_next_frame(in, &off, &f))
+		if (f.type == H2_DATA && f.sid == sid)
+			evbuffer_add(body, f.payload, f.len);
+}
+
+/* Return the first octet of the header block sent on stream sid, which
+ * for the statuses used here is the indexed :status, or -1. */
+static int
+http2_status(struct evbuffer *in, uint32_t sid)
+{
+	struct http2_frame f;
+	size_t off = 0;
+
+	while (http2_next_frame(in, &off, &f))
+		if (f.type == H2_HEADERS && f.sid == sid && f.len)
+			return f.payload[0];
+	return -1;
+}
+
+/* Return the error code of the RST_STREAM the server sent on stream sid,
+ * or -1. */
+static long
+http2_rst_error(struct evbuffer *in, uint32_t sid)
+{
+	struct http2_frame f;
+	size_t off = 0;
+
+	while (http2_next_frame(in, &off, &f))
+		if (f.type == H2_RST_STREAM && f.sid == sid && f.len >= 4)
+			return (long)((uint32_t)f.payload[0] << 24 |
+			    f.payload[1] << 16 | f.payload[2] << 8 |
+			    f.payload[3]);
+	return -1;
+}
+
+/* Return the error code of the GOAWAY the server sent, or -1. */
+static long
+http2_goaway_error(struct evbuffer *in)
+{
+	struct http2_frame f;
+	size_t off = 0;
+
+	while (http2_next_frame(in, &off, &f))
+		if (f.type == H2_GOAWAY && f.len >= 8)
+			return (long)((uint32_t)f.payload[4] << 24 |
+			    f.payload[5] << 16 | f.payload[6] << 8 |
+			    f.payload[7]);
+	return -1;
+}
+
+static struct {
+	int type;
+	uint32_t sid;
+	int flags;
+} http2_want;
+
+static int
+http2_done(struct regress_peer *peer)
+{
+	return http2_count(peer->input, http2_want.type, http2_want.sid,
+	    http2_want.flags) > 0;
+}
+
+/* Run the loop until the server has sent a frame of type on stream sid
+ * with flags set, or closed the connection, or msec have passed. */
+static void
+http2_wait(struct regress_peer *peer, struct event_base *base, int type,
+    uint32_t sid, int flags, long msec)
+{
+	http2_want.type = type;
+	http2_want.sid = sid;
+	http2_want.flags = flags;
+	peer->done = http2_done;
+	if (!peer->eof && !http2_done(peer))
+		regress_run_for(base, msec);
+}
+
+static void
+http2_prior_knowledge_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *body = evbuffer_new(), *out = evbuffer_new();
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+
+	/* the connection starts with the preface instead of a request */
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	tt_int_op(http2_send_request(&peer, 1,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/a"), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 1, H2_FLAG_END_STREAM, 2000);
+	tt_assert(!peer.eof);
+	tt_int_op(http2_count(peer.input, H2_SETTINGS, 0, 0), ==, 2);
+	tt_int_op(http2_count(peer.input, H2_SETTINGS, 0, H2_FLAG_ACK), ==, 1);
+	tt_int_op(http2_status(peer.input, 1), ==, 0x88);	/* 200 */
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, 8);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /a", 8));
+
+	/* later streams share the connection, and a PING comes back */
+	evbuffer_drain(peer.input, evbuffer_get_length(peer.input));
+	evbuffer_drain(body, evbuffer_get_length(body));
+	http2_frame(out, H2_PING, 0, 0, "12345678", 8);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	tt_int_op(http2_send_request(&peer, 3,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/b"), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 3, H2_FLAG_END_STREAM, 2000);
+	tt_int_op(http2_count(peer.input, H2_PING, 0, H2_FLAG_ACK), ==, 1);
+	tt_int_op(http2_status(peer.input, 3), ==, 0x88);
+	http2_data(peer.input, 3, body);
+	tt_int_op(evbuffer_get_length(body), ==, 8);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /b", 8));
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(body);
+	evbuffer_free(out);
+}
+
+static const char http2_upgrade_request[] =
+    "GET /up HTTP/1.1\r\n"
+    "Host: h\r\n"
+    "Connection: Upgrade, HTTP2-Settings\r\n"
+    "Upgrade: h2c\r\n"
+    "HTTP2-Settings: AAMAAABk\r\n"	/* MAX_CONCURRENT_STREAMS 100 */
+    "\r\n";
+
+static int
+http2_head_done(struct regress_peer *peer)
+{
+	return evbuffer_search(peer->input, "\r\n\r\n", 4, NULL).pos >= 0;
+}
+
+static void
+http2_upgrade_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *body = evbuffer_new(), *out = evbuffer_new();
+	struct evbuffer_ptr end;
+	static const char switching[] =
+	    "HTTP/1.1 101 Switching Protocols\r\n";
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+
+	/* without h2c, the upgrade is not taken */
+	http = http2_setup(&port, data->base, 0);
+	tt_assert(http);
+	tt_int_op(regress_peer_connect(&peer, data->base, port), ==, 0);
+	peer.done = http2_head_done;
+	tt_int_op(regress_peer_send(&peer, http2_upgrade_request,
+		sizeof(http2_upgrade_request) - 1), ==, 0);
+	regress_run_for(data->base, 2000);
+	evbuffer_add(peer.input, "", 1);
+	tt_assert(!strncmp((char *)evbuffer_pullup(peer.input, -1),
+		"HTTP/1.1 200 OK\r\n", 17));
+	regress_peer_close(&peer);
+	evhttp_free(http);
+
+	/* with it, the request is answered on stream 1 */
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+	tt_int_op(regress_peer_connect(&peer, data->base, port), ==, 0);
+	peer.done = http2_head_done;
+	tt_int_op(regress_peer_send(&peer, http2_upgrade_request,
+		sizeof(http2_upgrade_request) - 1), ==, 0);
+	regress_run_for(data->base, 2000);
+	end = evbuffer_search(peer.input, "\r\n\r\n", 4, NULL);
+	tt_int_op(end.pos, >=, 0);
+	tt_assert(!strncmp((char *)evbuffer_pullup(peer.input, -1),
+		switching, strlen(switching)));
+	evbuffer_drain(peer.input, end.pos + 4);
+
+	evbuffer_add(out, H2_PREFACE, strlen(H2_PREFACE));
+	http2_frame(out, H2_SETTINGS, 0, 0, NULL, 0);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 1, H2_FLAG_END_STREAM, 2000);
+	tt_assert(!peer.eof);
+	tt_int_op(http2_status(peer.input, 1), ==, 0x88);
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, 9);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /up", 9));
+
+	/* and the connection goes on in HTTP/2 */
+	evbuffer_drain(body, evbuffer_get_length(body));
+	tt_int_op(http2_send_request(&peer, 3,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/next"), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 3, H2_FLAG_END_STREAM, 2000);
+	http2_data(peer.input, 3, body);
+	tt_int_op(evbuffer_get_length(body), ==, 11);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /next", 11));
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(body);
+	evbuffer_free(out);
+}
+
+static void
+http2_flow_control_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *body = evbuffer_new(), *out = evbuffer_new();
+	/* INITIAL_WINDOW_SIZE 0 */
+	static const unsigned char settings[] = { 0, 4, 0, 0, 0, 0 };
+	const unsigned char *p;
+	int i;
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+
+	/* with no window the response stalls after its headers */
+	tt_int_op(http2_connect(&peer, data->base, port, settings,
+		sizeof(settings)), ==, 0);
+	tt_int_op(http2_send_request(&peer, 1,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/big"), ==, 0);
+	http2_wait(&peer, data->base, H2_HEADERS, 1, 0, 2000);
+	peer.done = NULL;
+	regress_run_for(data->base, 100);
+	tt_int_op(http2_status(peer.input, 1), ==, 0x88);
+	tt_int_op(http2_count(peer.input, H2_DATA, 1, 0), ==, 0);
+
+	/* a window update on the stream lets exactly that much through */
+	http2_frame32(out, H2_WINDOW_UPDATE, 1, 1000);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 1, 0, 2000);
+	peer.done = NULL;
+	regress_run_for(data->base, 100);
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, 1000);
+	tt_int_op(http2_count(peer.input, H2_DATA, 1, H2_FLAG_END_STREAM),
+	    ==, 0);
+
+	/* the connection window is spent before the stream's is */
+	evbuffer_drain(body, evbuffer_get_length(body));
+	http2_frame32(out, H2_WINDOW_UPDATE, 1, HTTP2_BIG_LEN);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	peer.done = NULL;
+	regress_run_for(data->base, 200);
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, 65535);
+
+	/* and opening it completes the response */
+	evbuffer_drain(body, evbuffer_get_length(body));
+	http2_frame32(out, H2_WINDOW_UPDATE, 0, HTTP2_BIG_LEN);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 1, H2_FLAG_END_STREAM, 2000);
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, HTTP2_BIG_LEN);
+	p = evbuffer_pullup(body, -1);
+	for (i = 0; i < HTTP2_BIG_LEN; ++i)
+		if (p[i] != 'a' + i % 26)
+			break;
+	tt_int_op(i, ==, HTTP2_BIG_LEN);
+	tt_assert(!peer.eof);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(body);
+	evbuffer_free(out);
+}
+
+static void
+http2_recv_window_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *body = evbuffer_new();
+	const size_t mb = 1024 * 1024;
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+
+	/* The server keeps 16 MB of request body before it stops giving
+	 * credit.  The first 9 MB on stream 1 is all credited, in updates
+	 * of half a window. */
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	tt_int_op(http2_send_request(&peer, 1, H2_FLAG_END_HEADERS,
+		"POST", "/one"), ==, 0);
+	tt_int_op(http2_send_body(&peer, data->base, 1, 9 * mb), ==, 0);
+	peer.done = NULL;
+	regress_run_for(data->base, 200);
+	tt_int_op(http2_count(peer.input, H2_WINDOW_UPDATE, 1, 0), ==, 18);
+
+	/* Stream 3 gets credit for only 7 MB more, which makes its window
+	 * 8 MB; sending past that resets it. */
+	tt_int_op(http2_send_request(&peer, 3, H2_FLAG_END_HEADERS,
+		"POST", "/three"), ==, 0);
+	tt_int_op(http2_send_body(&peer, data->base, 3, 9 * mb), ==, 0);
+	http2_wait(&peer, data->base, H2_RST_STREAM, 3, 0, 2000);
+	tt_int_op(http2_count(peer.input, H2_WINDOW_UPDATE, 3, 0), ==, 14);
+	tt_int_op(http2_rst_error(peer.input, 3), ==, H2_FLOW_CONTROL_ERROR);
+	tt_assert(!peer.eof);
+
+	/* the connection lives on, and stream 1 can still finish */
+	evbuffer_drain(peer.input, evbuffer_get_length(peer.input));
+	http2_frame(body, H2_DATA, H2_FLAG_END_STREAM, 1, NULL, 0);
+	tt_int_op(http2_send(&peer, body), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 1, H2_FLAG_END_STREAM, 2000);
+	tt_int_op(http2_status(peer.input, 1), ==, 0x88);
+	tt_int_op(http2_send_request(&peer, 5,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/five"), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 5, H2_FLAG_END_STREAM, 2000);
+	http2_data(peer.input, 5, body);
+	tt_int_op(evbuffer_get_length(body), ==, 11);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /five", 11));
+	tt_assert(!peer.eof);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(body);
+}
+
+static void
+http2_continuation_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *block = evbuffer_new(), *out = evbuffer_new();
+	struct evbuffer *body = evbuffer_new();
+	const unsigned char *p;
+	size_t len;
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+
+	/* a header block split over HEADERS and two CONTINUATIONs */
+	http2_request(block, "GET", "/cont");
+	http2_literal(block, "x-long", "0123456789abcdef0123456789abcdef");
+	p = evbuffer_pullup(block, -1);
+	len = evbuffer_get_length(block);
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	http2_frame(out, H2_HEADERS, H2_FLAG_END_STREAM, 1, p, 5);
+	http2_frame(out, H2_CONTINUATION, 0, 1, p + 5, 20);
+	http2_frame(out, H2_CONTINUATION, H2_FLAG_END_HEADERS, 1, p + 25,
+	    len - 25);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 1, H2_FLAG_END_STREAM, 2000);
+	tt_int_op(http2_status(peer.input, 1), ==, 0x88);
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, 11);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /cont", 11));
+	regress_peer_close(&peer);
+
+	/* any other frame inside the block is a connection error */
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	http2_frame(out, H2_HEADERS, H2_FLAG_END_STREAM, 1, p, 5);
+	http2_frame(out, H2_PING, 0, 0, "12345678", 8);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, -1, 0, 0, 2000);
+	tt_assert(peer.eof);
+	tt_int_op(http2_goaway_error(peer.input), ==, H2_PROTOCOL_ERROR);
+	tt_int_op(http2_count(peer.input, H2_PING, 0, H2_FLAG_ACK), ==, 0);
+	tt_int_op(http2_count(peer.input, H2_HEADERS, 1, 0), ==, 0);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(block);
+	evbuffer_free(body);
+	evbuffer_free(out);
+}
+
+static void
+http2_rst_stream_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *body = evbuffer_new(), *out = evbuffer_new();
+	uint32_t sid;
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+
+	/* a stream reset while its handler is busy gets no reply, and
+	 * leaves the other streams alone */
+	http2_async_replies = 0;
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	tt_int_op(http2_send_request(&peer, 1,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/async"), ==, 0);
+	http2_frame32(out, H2_RST_STREAM, 1, H2_CANCEL);
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	tt_int_op(http2_send_request(&peer, 3,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/after"), ==, 0);
+	http2_wait(&peer, data->base, H2_DATA, 3, H2_FLAG_END_STREAM, 2000);
+	http2_data(peer.input, 3, body);
+	tt_int_op(evbuffer_get_length(body), ==, 12);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "hello /after", 12));
+
+	/* the handler finishes later, into the void */
+	peer.done = NULL;
+	regress_run_for(data->base, 300);
+	tt_int_op(http2_async_replies, ==, 1);
+	tt_int_op(http2_count(peer.input, H2_HEADERS, 1, 0), ==, 0);
+	tt_int_op(http2_count(peer.input, H2_DATA, 1, 0), ==, 0);
+	tt_assert(!peer.eof);
+	regress_peer_close(&peer);
+
+	/* opening and resetting streams as fast as possible is an attack */
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	for (sid = 1; sid < 500; sid += 2) {
+		evbuffer_drain(body, evbuffer_get_length(body));
+		http2_request(body, "POST", "/reset");
+		http2_frame(out, H2_HEADERS, H2_FLAG_END_HEADERS, sid,
+		    evbuffer_pullup(body, -1), evbuffer_get_length(body));
+		http2_frame32(out, H2_RST_STREAM, sid, H2_CANCEL);
+	}
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, -1, 0, 0, 2000);
+	tt_assert(peer.eof);
+	tt_int_op(http2_goaway_error(peer.input), ==, H2_ENHANCE_YOUR_CALM);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(body);
+	evbuffer_free(out);
+}
+
+static void
+http2_goaway_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct regress_peer peer;
+	struct evbuffer *body = evbuffer_new(), *out = evbuffer_new();
+	static const unsigned char goaway[8] = { 0 };
+	uint16_t port = 0;
+
+	peer.fd = -1;
+	peer.ev = NULL;
+	peer.input = NULL;
+	http = http2_setup(&port, data->base, EVHTTP_SERVER_H2C);
+	tt_assert(http);
+
+	/* after the peer's GOAWAY, the streams it opened are finished
+	 * before the server closes in turn */
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	tt_int_op(http2_send_request(&peer, 1,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/async"), ==, 0);
+	http2_frame(out, H2_GOAWAY, 0, 0, goaway, sizeof(goaway));
+	tt_int_op(http2_send(&peer, out), ==, 0);
+	http2_wait(&peer, data->base, -1, 0, 0, 2000);
+	tt_assert(peer.eof);
+	http2_data(peer.input, 1, body);
+	tt_int_op(evbuffer_get_length(body), ==, 12);
+	tt_assert(!memcmp(evbuffer_pullup(body, -1), "later /async", 12));
+	tt_int_op(http2_goaway_error(peer.input), ==, H2_NO_ERROR);
+	regress_peer_close(&peer);
+
+	/* a protocol error is answered with GOAWAY, and nothing more */
+	tt_int_op(http2_connect(&peer, data->base, port, NULL, 0), ==, 0);
+	tt_int_op(http2_send_request(&peer, 2,
+		H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM, "GET", "/even"), ==, 0);
+	http2_wait(&peer, data->base, -1, 0, 0, 2000);
+	tt_assert(peer.eof);
+	tt_int_op(http2_goaway_error(peer.input), ==, H2_PROTOCOL_ERROR);
+	tt_int_op(http2_count(peer.input, H2_HEADERS, 2, 0), ==, 0);
+
+end:
+	regress_peer_close(&peer);
+	if (http)
+		evhttp_free(http);
+	evbuffer_free(body);
+	evbuffer_free(out);
+}
+
+struct testcase_t http2_testcases[] = {
+	{ "prior_knowledge", http2_prior_knowledge_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "upgrade", http2_upgrade_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "flow_control", http2_flow_control_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "recv_window", http2_recv_window_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "continuation", http2_continuation_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "rst_stream", http2_rst_stream_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "goaway", http2_goaway_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+
+	END_OF_TESTCASES
+};
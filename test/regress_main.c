@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2003-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/thread.h>
+
+#include "regress.h"
+
+static void *
+basic_test_setup(const struct testcase_t *testcase)
+{
+	struct event_base *base = NULL;
+	int spair[2] = { -1, -1 };
+	struct basic_test_data *data = NULL;
+
+	if (testcase->flags & TT_NEED_THREADS) {
+#ifdef EVTHREAD_USE_PTHREADS_IMPLEMENTED
+		if (evthread_use_pthreads() < 0)
+			return NULL;
+#else
+		return (void *)TT_SKIP;
+#endif
+	}
+
+	if (testcase->flags & TT_NEED_SOCKETPAIR) {
+		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, spair) == -1) {
+			fprintf(stderr, "%s: socketpair\n", __func__);
+			exit(1);
+		}
+
+		if (evutil_make_socket_nonblocking(spair[0]) == -1) {
+			fprintf(stderr, "fcntl(O_NONBLOCK)");
+			exit(1);
+		}
+
+		if (evutil_make_socket_nonblocking(spair[1]) == -1) {
+			fprintf(stderr, "fcntl(O_NONBLOCK)");
+			exit(1);
+		}
+	}
+	if (testcase->flags & TT_NEED_BASE) {
+		base = event_base_new();
+		if (!base) {
+			fprintf(stderr, "%s: event_base_new\n", __func__);
+			exit(1);
+		}
+	}
+
+	data = calloc(1, sizeof(*data));
+	if (!data) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		exit(1);
+	}
+	data->base = base;
+	data->pair[0] = spair[0];
+	data->pair[1] = spair[1];
+	data->setup_data = testcase->setup_data;
+	return data;
+}
+
+static int
+basic_test_cleanup(const struct testcase_t *testcase, void *ptr)
+{
+	struct basic_test_data *data = ptr;
+
+	if (testcase->flags & TT_NEED_SOCKETPAIR) {
+		if (data->pair[0] != -1)
+			evutil_closesocket(data->pair[0]);
+		if (data->pair[1] != -1)
+			evutil_closesocket(data->pair[1]);
+	}
+
+	if (testcase->flags & TT_NEED_BASE) {
+		if (data->base)
+			event_base_free(data->base);
+	}
+
+	if (testcase->flags & TT_NEED_THREADS)
+		libevent_global_shutdown();
+
+	free(data);
+
+	return 1;
+}
+
+const struct testcase_setup_t basic_setup = {
+	basic_test_setup, basic_test_cleanup
+};
+
+void
+regress_run_for(struct event_base *base, long msec)
+{
+	struct timeval tv;
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+}
+
+static void
+regress_peer_readcb(int fd, short what, void *arg)
+{
+	struct regress_peer *peer = arg;
+	int n;
+
+	n = evbuffer_read(peer->input, fd, -1);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		peer->eof = 1;
+		event_del(peer->ev);
+	}
+	if (peer->eof || (peer->done && peer->done(peer)))
+		event_base_loopbreak(event_get_base(peer->ev));
+}
+
+int
+regress_peer_connect(struct regress_peer *peer, struct event_base *base,
+    uint16_t port)
+{
+	struct sockaddr_in sin;
+
+	memset(peer, 0, sizeof(*peer));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sin.sin_port = htons(port);
+
+	if ((peer->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(peer->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    evutil_make_socket_nonblocking(peer->fd) < 0)
+		goto err;
+	peer->input = evbuffer_new();
+	peer->ev = event_new(base, peer->fd, EV_READ|EV_PERSIST,
+	    regress_peer_readcb, peer);
+	if (!peer->input || !peer->ev || event_add(peer->ev, NULL) < 0)
+		goto err;
+	return 0;
+err:
+	regress_peer_close(peer);
+	return -1;
+}
+
+int
+regress_peer_send(struct regress_peer *peer, const void *data, size_t len)
+{
+	const char *p = data;
+
+	/* the socket buffer holds everything the tests send, but the server
+	 * only drains it while the loop runs, so don't wait for it */
+	while (len) {
+		ssize_t n = send(peer->fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void
+regress_peer_close(struct regress_peer *peer)
+{
+	if (peer->ev)
+		event_free(peer->ev);
+	if (peer->input)
+		evbuffer_free(peer->input);
+	if (peer->fd >= 0)
+		evutil_closesocket(peer->fd);
+	peer->ev = NULL;
+	peer->input = NULL;
+	peer->fd = -1;
+}
+
+uint16_t
+regress_get_socket_port(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t socklen = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *)&ss, &socklen) != 0)
+		return 0;
+	if (ss.ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in *)&ss)->sin_port);
+	else if (ss.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+	return 0;
+}
+
+struct testgroup_t testgroups[] = {
+	{ "buffer/", buffer_testcases },
+	{ "bufferevent/", bufferevent_testcases },
+	{ "http/", http_testcases },
+	{ "http2/", http2_testcases },
+	END_OF_GROUPS
+};
+
+int
+main(int argc, const char **argv)
+{
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	if (tinytest_main(argc, argv, testgroups))
+		return 1;
+
+	return 0;
+}
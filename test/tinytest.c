@@ -0,0 +1,336 @@
+/* tinytest.c -- Copyright 2009-2012 Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tinytest.h"
+#include "tinytest_macros.h"
+
+#define LONGEST_TEST_NAME 16384
+
+static int n_ok = 0; /**< Number of tests that have passed */
+static int n_bad = 0; /**< Number of tests that have failed. */
+static int n_skipped = 0; /**< Number of tests that have been skipped. */
+
+static int opt_nofork = 0; /**< Suppress calls to fork() for debugging. */
+static int opt_verbosity = 1; /**< -==quiet,0==terse,1==normal,2==verbose */
+
+static int cur_test_outcome = 0; /**< an enum outcome */
+static const char *cur_test_prefix = NULL; /**< prefix of the current test */
+static const char *cur_test_name = NULL; /**< name of the current test */
+
+/* Test outcomes, as reported from the child to the parent */
+enum outcome { SKIP = 2, OK = 1, FAIL = 0 };
+
+static enum outcome
+testcase_run_bare_(const struct testcase_t *testcase)
+{
+	void *env = NULL;
+	enum outcome outcome;
+
+	if (testcase->setup) {
+		env = testcase->setup->setup_fn(testcase);
+		if (!env)
+			return FAIL;
+		else if (env == (void *)TT_SKIP)
+			return SKIP;
+	}
+
+	cur_test_outcome = OK;
+	testcase->fn(env);
+	outcome = cur_test_outcome;
+
+	if (testcase->setup) {
+		if (testcase->setup->cleanup_fn(testcase, env) == 0)
+			outcome = FAIL;
+	}
+
+	return outcome;
+}
+
+static enum outcome
+testcase_run_forked_(const struct testgroup_t *group,
+    const struct testcase_t *testcase)
+{
+	int outcome_pipe[2];
+	pid_t pid;
+
+	if (pipe(outcome_pipe))
+		perror("opening pipe");
+
+	if (opt_verbosity > 0)
+		printf("[forking] ");
+	fflush(stdout);
+
+	pid = fork();
+	if (!pid) {
+		/* child. */
+		int test_r, write_r;
+		char b[1];
+		close(outcome_pipe[0]);
+		test_r = testcase_run_bare_(testcase);
+		b[0] = "NYS"[test_r];
+		write_r = (int)write(outcome_pipe[1], b, 1);
+		if (write_r != 1) {
+			perror("write outcome to pipe");
+			exit(1);
+		}
+		fflush(stdout);
+		exit(0);
+		return FAIL; /* unreachable */
+	} else {
+		/* parent */
+		int status, r;
+		char b[1];
+		/* Close this now, so that if the other side closes it,
+		 * our read fails. */
+		close(outcome_pipe[1]);
+		r = (int)read(outcome_pipe[0], b, 1);
+		if (r == 0) {
+			printf("[Lost connection!] ");
+			return FAIL;
+		} else if (r != 1) {
+			perror("read outcome from pipe");
+		}
+		waitpid(pid, &status, 0);
+		close(outcome_pipe[0]);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			/* the test passed but the child died on its way out,
+			 * e.g. because the leak checker found something */
+			printf("[child exited badly] ");
+			return FAIL;
+		}
+		return b[0] == 'Y' ? OK : (b[0] == 'S' ? SKIP : FAIL);
+	}
+}
+
+int
+testcase_run_one(const struct testgroup_t *group,
+    const struct testcase_t *testcase)
+{
+	enum outcome outcome;
+
+	if (testcase->flags & (TT_SKIP|TT_OFF_BY_DEFAULT)) {
+		if (opt_verbosity > 0)
+			printf("%s%s: %s\n",
+			    group->prefix, testcase->name,
+			    (testcase->flags & TT_SKIP) ? "SKIPPED" : "DISABLED");
+		++n_skipped;
+		return SKIP;
+	}
+
+	if (opt_verbosity > 0) {
+		printf("%s%s: ", group->prefix, testcase->name);
+	} else {
+		if (opt_verbosity == 0) printf(".");
+		cur_test_prefix = group->prefix;
+		cur_test_name = testcase->name;
+	}
+
+	if ((testcase->flags & TT_FORK) && !opt_nofork) {
+		outcome = testcase_run_forked_(group, testcase);
+	} else {
+		outcome = testcase_run_bare_(testcase);
+	}
+
+	if (outcome == OK) {
+		++n_ok;
+		if (opt_verbosity > 0)
+			puts(opt_verbosity == 1 ? "OK" : "");
+	} else if (outcome == SKIP) {
+		++n_skipped;
+		if (opt_verbosity > 0)
+			puts("SKIPPED");
+	} else {
+		++n_bad;
+		printf("\n  [%s FAILED]\n", testcase->name);
+	}
+	fflush(stdout);
+
+	return (int)outcome;
+}
+
+/* Mark every test whose full name matches selector; return the count.  A
+ * selector ending in ".." matches every name it is a prefix of. */
+static int
+tinytest_set_flag_(struct testgroup_t *groups, const char *arg,
+    int set, unsigned long flag)
+{
+	int i, j;
+	size_t length = LONGEST_TEST_NAME;
+	char fullname[LONGEST_TEST_NAME];
+	int found = 0;
+	size_t arglen = strlen(arg);
+	int prefix = 0;
+
+	if (arglen >= 2 && !strcmp(arg + arglen - 2, "..")) {
+		arglen -= 2;
+		prefix = 1;
+	}
+	for (i = 0; groups[i].prefix; ++i) {
+		for (j = 0; groups[i].cases[j].name; ++j) {
+			struct testcase_t *testcase = &groups[i].cases[j];
+			snprintf(fullname, length, "%s%s",
+			    groups[i].prefix, testcase->name);
+			if (prefix ? !strncmp(fullname, arg, arglen) :
+			    !strcmp(fullname, arg)) {
+				if (set)
+					testcase->flags |= flag;
+				else
+					testcase->flags &= ~flag;
+				++found;
+			}
+		}
+	}
+	return found;
+}
+
+static void
+usage(struct testgroup_t *groups, int list_groups)
+{
+	puts("Options are: [--verbose|--quiet|--terse] [--no-fork]");
+	puts("  Specify tests by name, or using a prefix ending with '..'");
+	puts("  To skip a test, prefix its name with a colon.");
+	puts("  Use --list-tests for a list of tests.");
+	if (list_groups) {
+		int i, j;
+		puts("Known tests are:");
+		for (i = 0; groups[i].prefix; ++i) {
+			for (j = 0; groups[i].cases[j].name; ++j)
+				printf("  %s%s\n", groups[i].prefix,
+				    groups[i].cases[j].name);
+		}
+	}
+	exit(0);
+}
+
+int
+tinytest_main(int c, const char **v, struct testgroup_t *groups)
+{
+	int i, j, n = 0;
+
+	for (i = 1; i < c; ++i) {
+		if (v[i][0] == '-') {
+			if (!strcmp(v[i], "--quiet")) {
+				opt_verbosity = -1;
+			} else if (!strcmp(v[i], "--verbose")) {
+				opt_verbosity = 2;
+			} else if (!strcmp(v[i], "--terse")) {
+				opt_verbosity = 0;
+			} else if (!strcmp(v[i], "--no-fork")) {
+				opt_nofork = 1;
+			} else if (!strcmp(v[i], "--help")) {
+				usage(groups, 0);
+			} else if (!strcmp(v[i], "--list-tests")) {
+				usage(groups, 1);
+			} else {
+				printf("Unknown option %s.  Try --help\n", v[i]);
+				return -1;
+			}
+		} else {
+			const char *test = v[i];
+			int flag = TT_ENABLED_;
+			if (test[0] == ':') {
+				++test;
+				flag = TT_SKIP;
+			} else {
+				++n;
+			}
+			if (!tinytest_set_flag_(groups, test, 1, flag)) {
+				printf("No such test as %s!\n", v[i]);
+				return -1;
+			}
+		}
+	}
+	if (!n)
+		tinytest_set_flag_(groups, "..", 1, TT_ENABLED_);
+
+	for (i = 0; groups[i].prefix; ++i)
+		for (j = 0; groups[i].cases[j].name; ++j)
+			if (groups[i].cases[j].flags & TT_ENABLED_)
+				testcase_run_one(&groups[i],
+				    &groups[i].cases[j]);
+
+	if (opt_verbosity == 0)
+		puts("");
+
+	if (n_bad)
+		printf("%d/%d TESTS FAILED. (%d skipped)\n", n_bad,
+		    n_bad + n_ok, n_skipped);
+	else if (opt_verbosity >= 1)
+		printf("%d tests ok.  (%d skipped)\n", n_ok, n_skipped);
+
+	return (n_bad == 0) ? 0 : 1;
+}
+
+int
+tinytest_get_verbosity_(void)
+{
+	return opt_verbosity;
+}
+
+void
+tinytest_set_test_failed_(void)
+{
+	if (opt_verbosity <= 0 && cur_test_name) {
+		if (opt_verbosity == 0) puts("");
+		printf("%s%s: ", cur_test_prefix, cur_test_name);
+		cur_test_name = NULL;
+	}
+	cur_test_outcome = FAIL;
+}
+
+void
+tinytest_set_test_skipped_(void)
+{
+	if (cur_test_outcome == OK)
+		cur_test_outcome = SKIP;
+}
+
+char *
+tinytest_format_hex_(const void *val_, unsigned long len)
+{
+	const unsigned char *val = val_;
+	char *result, *cp;
+	size_t i;
+
+	if (!val)
+		return strdup("null");
+	if (!(result = malloc(len * 2 + 1)))
+		return strdup("<allocation failure>");
+	cp = result;
+	for (i = 0; i < len; ++i) {
+		*cp++ = "0123456789ABCDEF"[val[i] >> 4];
+		*cp++ = "0123456789ABCDEF"[val[i] & 0x0f];
+	}
+	*cp = 0;
+	return result;
+}